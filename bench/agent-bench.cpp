@@ -0,0 +1,457 @@
+#include "agent.h"
+#include "callbacks.h"
+#include "chat.h"
+#include "error.h"
+#include "ggml.h"
+#include "llama.h"
+#include "model.h"
+#include "tool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using agent_cpp::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+double
+elapsed_ms(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Time spent executing tools, added to by calls running concurrently
+class ToolClock
+{
+  public:
+    void add(double ms)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_ms_ += ms;
+    }
+
+    // Time added since the last call
+    double take()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::exchange(busy_ms_, 0.0);
+    }
+
+  private:
+    std::mutex mutex_;
+    double busy_ms_ = 0;
+};
+
+// Tool from the bench script returning a canned response after a delay, so
+// the agent loop is measured without depending on real tools
+class MockTool : public agent_cpp::Tool
+{
+  public:
+    MockTool(const json& spec, ToolClock& clock)
+      : name_(spec.at("name").get<std::string>())
+      , description_(spec.value("description", ""))
+      , parameters_(spec.value("parameters",
+                               json{ { "type", "object" },
+                                     { "properties", json::object() } }))
+      , response_(spec.value("response", json{ { "result", "ok" } }))
+      , latency_(spec.value("latency_ms", 0))
+      , clock_(clock)
+    {
+    }
+
+    common_chat_tool get_definition() const override
+    {
+        return { name_, description_, parameters_.dump() };
+    }
+
+    std::string get_name() const override { return name_; }
+
+    // Timed here rather than between the agent's callbacks, which run
+    // before and after all calls of a message when they run concurrently
+    std::string execute(const json& /*arguments*/) override
+    {
+        const auto start = Clock::now();
+        if (latency_.count() > 0) {
+            std::this_thread::sleep_for(latency_);
+        }
+        std::string response = response_.dump();
+        clock_.add(elapsed_ms(start, Clock::now()));
+        return response;
+    }
+
+  private:
+    std::string name_;
+    std::string description_;
+    json parameters_;
+    json response_;
+    std::chrono::milliseconds latency_;
+    ToolClock& clock_;
+};
+
+// Measurements of one run_loop call
+struct TurnStats
+{
+    std::vector<agent_cpp::GenerationStats> calls;
+    size_t tool_calls = 0;
+    double tool_ms = 0; // Summed over the calls, concurrent ones overlap
+    double ttft_ms = 0; // From run_loop to the first generated token
+    double total_ms = 0;
+};
+
+// Collects the stats of model calls and counts tool executions of the agent
+// it is attached to
+class BenchCallback : public agent_cpp::Callback
+{
+  public:
+    explicit BenchCallback(TurnStats*& turn)
+      : turn_(turn)
+    {
+    }
+
+    // Marks the start of a turn, the first generated token ends its TTFT
+    void start_turn(Clock::time_point start) { turn_start_ = start; }
+
+    void before_llm_call(std::vector<common_chat_msg>& /*messages*/) override
+    {
+        call_start_ = Clock::now();
+    }
+
+    void on_generation_stats(const agent_cpp::GenerationStats& stats) override
+    {
+        if (turn_->calls.empty()) {
+            turn_->ttft_ms =
+              elapsed_ms(turn_start_, call_start_) + stats.ttft_ms;
+        }
+        turn_->calls.push_back(stats);
+    }
+
+    void after_tool_execution(std::string& /*tool_name*/,
+                              agent_cpp::ToolResult& /*result*/) override
+    {
+        turn_->tool_calls++;
+    }
+
+  private:
+    TurnStats*& turn_;
+    Clock::time_point turn_start_;
+    Clock::time_point call_start_;
+};
+
+// One point of the n_batch x n_threads x cache type sweep
+struct SweepPoint
+{
+    int n_batch;
+    int n_threads;
+    ggml_type cache_type_k;
+    ggml_type cache_type_v;
+};
+
+ggml_type
+parse_cache_type(const std::string& name)
+{
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const auto type = static_cast<ggml_type>(i);
+        const char* type_name = ggml_type_name(type);
+        if (type_name != nullptr && name == type_name) {
+            return type;
+        }
+    }
+    throw std::invalid_argument("unknown cache type '" + name + "'");
+}
+
+std::vector<std::string>
+split_list(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+std::vector<int>
+parse_int_list(const std::string& list)
+{
+    std::vector<int> values;
+    for (const auto& item : split_list(list)) {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+json
+summarize(const std::vector<TurnStats>& turns)
+{
+    size_t prompt_tokens = 0;
+    size_t reused_tokens = 0;
+    size_t prefilled_tokens = 0;
+    size_t decoded_tokens = 0;
+    size_t tool_calls = 0;
+    double render_ms = 0;
+    double tokenize_ms = 0;
+    double prefill_ms = 0;
+    double decode_ms = 0;
+    double ttft_ms = 0;
+    double total_ms = 0;
+    double tool_ms = 0;
+
+    for (const auto& turn : turns) {
+        for (const auto& call : turn.calls) {
+            prompt_tokens += call.prompt_tokens;
+            reused_tokens += call.reused_tokens;
+            prefilled_tokens += call.prefilled_tokens;
+            decoded_tokens += call.decoded_tokens;
+            render_ms += call.render_ms;
+            tokenize_ms += call.tokenize_ms;
+            prefill_ms += call.prefill_ms;
+            decode_ms += call.decode_ms;
+        }
+        tool_calls += turn.tool_calls;
+        tool_ms += turn.tool_ms;
+        ttft_ms += turn.ttft_ms;
+        total_ms += turn.total_ms;
+    }
+
+    const double n_turns =
+      turns.empty() ? 1.0 : static_cast<double>(turns.size());
+    return {
+        { "turns", turns.size() },
+        { "prompt_tokens", prompt_tokens },
+        { "prefilled_tokens", prefilled_tokens },
+        { "decoded_tokens", decoded_tokens },
+        { "tool_calls", tool_calls },
+        { "prefill_tokens_per_s",
+          prefill_ms > 0 ? prefilled_tokens * 1000.0 / prefill_ms : 0.0 },
+        { "decode_tokens_per_s",
+          decode_ms > 0 ? decoded_tokens * 1000.0 / decode_ms : 0.0 },
+        { "prefix_reuse_ratio",
+          prompt_tokens > 0
+            ? static_cast<double>(reused_tokens) / prompt_tokens
+            : 0.0 },
+        { "mean_render_ms", render_ms / n_turns },
+        { "mean_tokenize_ms", tokenize_ms / n_turns },
+        { "mean_ttft_ms", ttft_ms / n_turns },
+        { "mean_run_loop_ms", total_ms / n_turns },
+        { "mean_tool_ms", tool_ms / n_turns },
+    };
+}
+
+json
+run_conversation(const std::shared_ptr<agent_cpp::ModelWeights>& weights,
+                 const agent_cpp::ModelConfig& config,
+                 const json& script,
+                 const json& conversation)
+{
+    auto model = agent_cpp::Model::create_with_weights(weights, config);
+
+    ToolClock tool_clock;
+    std::vector<std::unique_ptr<agent_cpp::Tool>> tools;
+    for (const auto& spec : script.value("tools", json::array())) {
+        tools.push_back(std::make_unique<MockTool>(spec, tool_clock));
+    }
+
+    TurnStats* current = nullptr;
+    auto bench_callback = std::make_unique<BenchCallback>(current);
+    BenchCallback* bench = bench_callback.get();
+    std::vector<std::unique_ptr<agent_cpp::Callback>> callbacks;
+    callbacks.push_back(std::move(bench_callback));
+
+    agent_cpp::Agent agent(model,
+                           std::move(tools),
+                           std::move(callbacks),
+                           script.value("instructions", ""));
+
+    std::vector<common_chat_msg> messages;
+    std::vector<TurnStats> turns;
+    json turn_results = json::array();
+    for (const auto& content : conversation.at("turns")) {
+        common_chat_msg user_msg;
+        user_msg.role = "user";
+        user_msg.content = content.get<std::string>();
+        messages.push_back(user_msg);
+
+        TurnStats turn;
+        current = &turn;
+        const auto start = Clock::now();
+        bench->start_turn(start);
+        agent.run_loop(messages);
+        turn.total_ms = elapsed_ms(start, Clock::now());
+        turn.tool_ms = tool_clock.take();
+        current = nullptr;
+
+        turns.push_back(turn);
+        turn_results.push_back(summarize({ turn }));
+    }
+
+    return {
+        { "conversation", conversation.value("name", "") },
+        { "summary", summarize(turns) },
+        { "turns", turn_results },
+    };
+}
+
+void
+print_usage(int /*unused*/, char** argv)
+{
+    printf("\nexample usage:\n");
+    printf("\n    %s -m model.gguf -s bench/scripts/weather.json\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -m <path>          Path to the GGUF model file (required)\n");
+    printf("  -s <path>          Path to the bench script (required)\n");
+    printf("  -o <path>          Write the JSON report to a file (default: "
+           "stdout)\n");
+    printf("  -r <n>             Repetitions of each sweep point (default: "
+           "1)\n");
+    printf("  --n-batch <list>   Comma separated n_batch values\n");
+    printf("  --threads <list>   Comma separated n_threads values, also used "
+           "for n_threads_batch\n");
+    printf("  --cache-type <list> Comma separated K/V cache types, e.g. "
+           "f16,q8_0\n");
+    printf("\n");
+}
+
+} // namespace
+
+int
+main(int argc, char** argv)
+{
+    std::string model_path;
+    std::string script_path;
+    std::string output_path;
+    int repetitions = 1;
+
+    const agent_cpp::ModelConfig defaults;
+    std::vector<int> n_batch_values = { defaults.n_batch };
+    std::vector<int> n_threads_values = { defaults.n_threads };
+    std::vector<ggml_type> cache_types = { defaults.cache_type_k };
+
+    for (int i = 1; i < argc; i++) {
+        try {
+            const bool has_value = i + 1 < argc;
+            if (strcmp(argv[i], "-m") == 0 && has_value) {
+                model_path = argv[++i];
+            } else if (strcmp(argv[i], "-s") == 0 && has_value) {
+                script_path = argv[++i];
+            } else if (strcmp(argv[i], "-o") == 0 && has_value) {
+                output_path = argv[++i];
+            } else if (strcmp(argv[i], "-r") == 0 && has_value) {
+                repetitions = std::max(1, std::stoi(argv[++i]));
+            } else if (strcmp(argv[i], "--n-batch") == 0 && has_value) {
+                n_batch_values = parse_int_list(argv[++i]);
+            } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+                n_threads_values = parse_int_list(argv[++i]);
+            } else if (strcmp(argv[i], "--cache-type") == 0 && has_value) {
+                cache_types.clear();
+                for (const auto& name : split_list(argv[++i])) {
+                    cache_types.push_back(parse_cache_type(name));
+                }
+            } else {
+                print_usage(argc, argv);
+                return 1;
+            }
+        } catch (std::exception& e) {
+            fprintf(stderr, "error: %s\n", e.what());
+            print_usage(argc, argv);
+            return 1;
+        }
+    }
+
+    if (model_path.empty() || script_path.empty() || n_batch_values.empty() ||
+        n_threads_values.empty() || cache_types.empty()) {
+        print_usage(argc, argv);
+        return 1;
+    }
+
+    json script;
+    try {
+        std::ifstream file(script_path);
+        if (!file) {
+            fprintf(
+              stderr, "error: unable to open '%s'\n", script_path.c_str());
+            return 1;
+        }
+        script = json::parse(file);
+    } catch (const json::exception& e) {
+        fprintf(stderr, "error: invalid bench script: %s\n", e.what());
+        return 1;
+    }
+
+    std::vector<SweepPoint> sweep;
+    for (int n_batch : n_batch_values) {
+        for (int n_threads : n_threads_values) {
+            for (ggml_type cache_type : cache_types) {
+                sweep.push_back({ n_batch, n_threads, cache_type, cache_type });
+            }
+        }
+    }
+
+    json report;
+    try {
+        auto weights = agent_cpp::ModelWeights::create(model_path);
+
+        report["model"] = model_path;
+        report["script"] = script_path;
+        report["results"] = json::array();
+
+        for (const auto& point : sweep) {
+            agent_cpp::ModelConfig config;
+            config.n_batch = point.n_batch;
+            config.n_threads = point.n_threads;
+            config.n_threads_batch = point.n_threads;
+            config.cache_type_k = point.cache_type_k;
+            config.cache_type_v = point.cache_type_v;
+
+            fprintf(stderr,
+                    "n_batch=%d n_threads=%d cache_type=%s/%s\n",
+                    point.n_batch,
+                    point.n_threads,
+                    ggml_type_name(point.cache_type_k),
+                    ggml_type_name(point.cache_type_v));
+
+            json runs = json::array();
+            for (int r = 0; r < repetitions; r++) {
+                for (const auto& conversation : script.at("conversations")) {
+                    runs.push_back(
+                      run_conversation(weights, config, script, conversation));
+                }
+            }
+
+            report["results"].push_back({
+              { "n_batch", point.n_batch },
+              { "n_threads", point.n_threads },
+              { "cache_type_k", ggml_type_name(point.cache_type_k) },
+              { "cache_type_v", ggml_type_name(point.cache_type_v) },
+              { "runs", runs },
+            });
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+
+    if (output_path.empty()) {
+        std::cout << report.dump(2) << std::endl;
+    } else {
+        std::ofstream out(output_path);
+        out << report.dump(2) << std::endl;
+    }
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include "callbacks.h"
 #include "chat.h"
 #include "chat_loop.h"
+#include "context_compaction.h"
 #include "error.h"
 #include "error_recovery_callback.h"
 #include "llama.h"
@@ -126,6 +127,8 @@ print_usage(int /*unused*/, char** argv)
     printf(
       "  -n <number>     Maximum recent tool calls to keep (default: %zu)\n",
       DEFAULT_MAX_TOOL_CALLS);
+    printf("  -c <tokens>     Compact the context to a token budget instead, "
+           "keeping the KV cache prefix valid\n");
     printf("\n");
 }
 
@@ -134,6 +137,7 @@ main(int argc, char** argv)
 {
     std::string model_path;
     size_t max_tool_calls = DEFAULT_MAX_TOOL_CALLS;
+    int max_context_tokens = 0;
 
     for (int i = 1; i < argc; i++) {
         try {
@@ -155,6 +159,17 @@ main(int argc, char** argv)
                     print_usage(argc, argv);
                     return 1;
                 }
+            } else if (strcmp(argv[i], "-c") == 0) {
+                if (i + 1 < argc) {
+                    max_context_tokens = std::stoi(argv[++i]);
+                    if (max_context_tokens <= 0) {
+                        fprintf(stderr, "error: -c must be at least 1\n");
+                        return 1;
+                    }
+                } else {
+                    print_usage(argc, argv);
+                    return 1;
+                }
             } else {
                 print_usage(argc, argv);
                 return 1;
@@ -200,12 +215,31 @@ main(int argc, char** argv)
       "'3 + 5' using the tool, then use the result to calculate the final "
       "answer.";
 
-    printf("Context engineering: keeping %zu most recent tool calls\n",
-           max_tool_calls);
-
     std::vector<std::unique_ptr<agent_cpp::Callback>> callbacks;
-    callbacks.push_back(
-      std::make_unique<ContextTrimmerCallback>(max_tool_calls));
+    if (max_context_tokens > 0) {
+        printf("Context engineering: compacting above %d tokens\n",
+               max_context_tokens);
+        agent_cpp::ContextCompactionConfig compaction;
+        compaction.max_tokens = max_context_tokens;
+        compaction.on_compaction = [](const agent_cpp::CompactionReport& r) {
+            fprintf(stderr,
+                    "[CONTEXT] Removed %zu messages: %d -> %d tokens, %d "
+                    "reused, %d to prefill\n",
+                    r.applied.count,
+                    r.applied.tokens_before,
+                    r.applied.tokens_after,
+                    r.applied.reused_tokens,
+                    r.applied.prefill_tokens);
+        };
+        callbacks.push_back(
+          std::make_unique<agent_cpp::ContextCompactionCallback>(model,
+                                                                 compaction));
+    } else {
+        printf("Context engineering: keeping %zu most recent tool calls\n",
+               max_tool_calls);
+        callbacks.push_back(
+          std::make_unique<ContextTrimmerCallback>(max_tool_calls));
+    }
     callbacks.push_back(std::make_unique<LoggingCallback>());
     callbacks.push_back(std::make_unique<ErrorRecoveryCallback>());
 
@@ -97,9 +97,11 @@ class MathAgent
 
   public:
     MathAgent(std::shared_ptr<agent_cpp::ModelWeights> weights,
+              std::shared_ptr<agent_cpp::ComputeThreadpool> threadpool,
               const std::string& cache_path)
     {
         auto model_config = agent_cpp::ModelConfig{};
+        model_config.threadpool = std::move(threadpool);
         model_config.n_ctx = 10240;
         model_config.temp = 0.0F;
         auto model =
@@ -176,10 +178,12 @@ class MainAgent
 
   public:
     MainAgent(std::shared_ptr<agent_cpp::ModelWeights> weights,
+              std::shared_ptr<agent_cpp::ComputeThreadpool> threadpool,
               MathAgent* math_agent,
               const std::string& cache_path)
     {
         auto model_config = agent_cpp::ModelConfig{};
+        model_config.threadpool = std::move(threadpool);
         model_config.n_ctx = 10240;
         model_config.temp = 0.0F;
         auto model =
@@ -238,12 +242,16 @@ main(int argc, char** argv)
         fprintf(stderr, "(Weights are shared between all agents)\n\n");
 
         auto weights = agent_cpp::ModelWeights::create(model_path);
+        // Both contexts compute on one set of worker threads instead of
+        // each starting its own
+        auto threadpool = agent_cpp::ComputeThreadpool::create();
 
         fprintf(stderr, "Creating Math Agent (specialized sub-agent)...\n");
-        MathAgent math_agent(weights, "math_agent.cache");
+        MathAgent math_agent(weights, threadpool, "math_agent.cache");
 
         fprintf(stderr, "Creating Main Agent (orchestrator)...\n");
-        MainAgent main_agent(weights, &math_agent, "main_agent.cache");
+        MainAgent main_agent(
+          weights, threadpool, &math_agent, "main_agent.cache");
 
         fprintf(stderr, "\nMulti-Agent System Ready\n");
         fprintf(stderr, "\nTry asking math questions like:\n");
@@ -149,6 +149,25 @@ class OpenTelemetryCallback : public agent_cpp::Callback
         llm_span->SetAttribute("gen_ai.request.model", model_name);
     }
 
+    void on_generation_stats(const agent_cpp::GenerationStats& stats) override
+    {
+        if (llm_span) {
+            llm_span->SetAttribute("gen_ai.usage.input_tokens",
+                                   stats.prompt_tokens);
+            llm_span->SetAttribute("gen_ai.usage.output_tokens",
+                                   stats.decoded_tokens);
+            llm_span->SetAttribute("agent_cpp.prompt.reused_tokens",
+                                   stats.reused_tokens);
+            llm_span->SetAttribute("agent_cpp.prompt.prefilled_tokens",
+                                   stats.prefilled_tokens);
+            llm_span->SetAttribute("agent_cpp.render_ms", stats.render_ms);
+            llm_span->SetAttribute("agent_cpp.tokenize_ms", stats.tokenize_ms);
+            llm_span->SetAttribute("agent_cpp.prefill_ms", stats.prefill_ms);
+            llm_span->SetAttribute("agent_cpp.decode_ms", stats.decode_ms);
+            llm_span->SetAttribute("agent_cpp.ttft_ms", stats.ttft_ms);
+        }
+    }
+
     void after_llm_call(common_chat_msg& parsed_msg) override
     {
         if (llm_span) {
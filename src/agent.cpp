@@ -1,22 +1,168 @@
 #include "agent.h"
 #include "error.h"
 #include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <exception>
 #include <filesystem>
+#include <mutex>
+#include <thread>
 
 namespace agent_cpp {
 
 using json = nlohmann::json;
 
+namespace {
+
+// Prefills the next prompt on a thread of its own while tool calls run
+// Updates arriving while a prefill is in flight are coalesced into one
+class PrefillPipeline
+{
+  public:
+    // governor, when set, shortens tool outputs before they enter the
+    // conversation
+    PrefillPipeline(Model& model,
+                    const std::vector<common_chat_tool>& tools,
+                    const ToolOutputGovernor* governor)
+      : model(model)
+      , tools(tools)
+      , governor(governor)
+      , worker([this] { run(); })
+    {
+    }
+
+    ~PrefillPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    PrefillPipeline(const PrefillPipeline&) = delete;
+    PrefillPipeline& operator=(const PrefillPipeline&) = delete;
+
+    // Prefill messages followed by the start of the response to call
+    // max_tokens is the tool's own output budget, 0 uses the governor's
+    void begin(const std::vector<common_chat_msg>& messages,
+               const common_chat_tool_call& call,
+               int max_tokens)
+    {
+        common_chat_msg tool_msg;
+        tool_msg.role = "tool";
+        tool_msg.tool_call_id = call.id;
+        tool_msg.tool_name = call.name;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        conversation = messages;
+        conversation.push_back(std::move(tool_msg));
+        output.clear();
+        output_max_tokens = max_tokens;
+        shortened = false;
+        active = true;
+        pending = true;
+        wake.notify_all();
+    }
+
+    // Extend the response with output the tool just produced
+    void append(std::string_view chunk)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Once the governor shortened the output only its head is known,
+        // the rest of the response depends on output still to come
+        if (!active || shortened || chunk.empty()) {
+            return;
+        }
+        output.append(chunk);
+        common_chat_msg& tool_msg = conversation.back();
+        if (governor) {
+            tool_msg.content =
+              governor->head(tool_msg.tool_name, output, output_max_tokens);
+            shortened = tool_msg.content.size() < output.size();
+        } else {
+            tool_msg.content = output;
+        }
+        pending = true;
+        wake.notify_all();
+    }
+
+    // Wait for the prefill in flight and drop the rest, the model is free
+    // for the caller afterwards
+    void pause()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        active = false;
+        pending = false;
+        idle.wait(lock, [this] { return !busy; });
+    }
+
+  private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || pending; });
+            if (stopping) {
+                return;
+            }
+            pending = false;
+            busy = true;
+            const std::vector<common_chat_msg> snapshot = conversation;
+            lock.unlock();
+            try {
+                model.prefill_partial(snapshot, tools);
+            } catch (const std::exception&) {
+                // Only costs the overlap, generate() reports real errors
+            }
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    Model& model;
+    const std::vector<common_chat_tool>& tools;
+    const ToolOutputGovernor* governor;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<common_chat_msg> conversation;
+    std::string output; // Of the tool so far, before the governor
+    int output_max_tokens = 0;
+    bool shortened = false;
+    bool active = false;
+    bool pending = false;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker; // Last, it starts running in the constructor
+};
+
+} // anonymous namespace
+
 Agent::Agent(std::shared_ptr<Model> model,
              std::vector<std::unique_ptr<Tool>> tools,
              std::vector<std::unique_ptr<Callback>> callbacks,
-             const std::string& instructions)
+             const std::string& instructions,
+             const AgentConfig& config)
   : model(std::move(model))
   , tools(std::move(tools))
   , callbacks(std::move(callbacks))
   , instructions(instructions)
+  , config(config)
+  , tool_pool(config.tool_pool)
 {
+    if (!tool_pool && config.max_parallel_tools > 1) {
+        tool_pool = std::make_shared<ThreadPool>(config.max_parallel_tools);
+    }
+    if (config.tool_output.max_tokens > 0) {
+        output_governor = std::make_shared<ToolOutputGovernor>(
+          config.tool_output,
+          this->model ? this->model->get_vocab() : nullptr);
+        this->tools.add(std::make_unique<ReadToolOutputTool>(output_governor));
+    }
 }
 
 void
@@ -39,32 +185,66 @@ Agent::ensure_system_message(std::vector<common_chat_msg>& messages)
 std::vector<common_chat_tool>
 Agent::get_tool_definitions() const
 {
-    std::vector<common_chat_tool> tool_definitions;
-    tool_definitions.reserve(tools.size());
-    for (const auto& tool : tools) {
-        tool_definitions.push_back(tool->get_definition());
-    }
-    return tool_definitions;
+    return *tools.definitions();
 }
 
 std::string
 Agent::run_loop(std::vector<common_chat_msg>& messages,
-                const ResponseCallback& callback)
+                const ResponseCallback& callback,
+                const GenerationEventCallback& on_event,
+                const CancellationToken& cancel)
 {
+    const CancellationToken turn =
+      config.turn_timeout.count() > 0
+        ? cancel.with_deadline(CancellationToken::Clock::now() +
+                               config.turn_timeout)
+        : cancel;
+
     ensure_system_message(messages);
 
+    // A context shift should never discard the instructions and tools.
+    // Rendering them is as costly as a whole prompt, so they are counted
+    // once rather than on every turn.
+    if (model->get_n_keep() == 0) {
+        if (n_prompt_tokens < 0) {
+            n_prompt_tokens = static_cast<int>(build_prompt_tokens().size());
+        }
+        model->set_n_keep(n_prompt_tokens);
+    }
+
     for (const auto& cb : callbacks) {
         cb->before_agent_loop(messages);
     }
 
-    std::vector<common_chat_tool> tool_definitions = get_tool_definitions();
+    // Snapshot, an invalidation only takes effect from the next turn
+    const ToolRegistry::Definitions tool_definitions = tools.definitions();
+
+    GenerationEventCallback event_callback = on_event;
+    if (config.stop_at_tool_call) {
+        event_callback = [&on_event](const GenerationEvent& event) {
+            const bool keep_going = !on_event || on_event(event);
+            return keep_going &&
+                   event.type != GenerationEventType::ToolCallArgumentsComplete;
+        };
+    }
+
+    // Started on the first tool call when AgentConfig::overlap_prefill is set
+    std::unique_ptr<PrefillPipeline> pipeline;
 
     while (true) {
+        turn.throw_if_cancelled();
+
         for (const auto& cb : callbacks) {
             cb->before_llm_call(messages);
         }
 
-        auto parsed_msg = model->generate(messages, tool_definitions, callback);
+        auto parsed_msg = model->generate(
+          messages, *tool_definitions, callback, event_callback, turn);
+
+        const GenerationStats& stats = model->last_stats();
+        for (const auto& cb : callbacks) {
+            cb->on_generation_stats(stats);
+        }
 
         for (const auto& cb : callbacks) {
             cb->after_llm_call(parsed_msg);
@@ -80,69 +260,216 @@ Agent::run_loop(std::vector<common_chat_msg>& messages,
             return response;
         }
 
-        for (const auto& tool_call : parsed_msg.tool_calls) {
-            std::string tool_name = tool_call.name;
-            std::string tool_arguments = tool_call.arguments;
-
-            ToolResult result("");
-            bool tool_skipped = false;
+        const auto& tool_calls = parsed_msg.tool_calls;
 
-            try {
-                for (const auto& cb : callbacks) {
-                    cb->before_tool_execution(tool_name, tool_arguments);
+        if (config.overlap_prefill && !pipeline) {
+            pipeline = std::make_unique<PrefillPipeline>(
+              *model, *tool_definitions, output_governor.get());
+        }
+        // The response to call comes next in the prompt, prefill up to it
+        // and its output as it streams in
+        auto overlap = [&](const common_chat_tool_call& tool_call,
+                           PendingToolCall& call) {
+            if (pipeline && call.ready) {
+                // The same budget finish_tool_call governs the output with
+                pipeline->begin(
+                  messages, tool_call, call.tool->max_output_tokens());
+                PrefillPipeline* target = pipeline.get();
+                call.on_output = [target](std::string_view chunk) {
+                    target->append(chunk);
+                };
+            }
+        };
+
+        if (!tool_pool) {
+            for (const auto& tool_call : tool_calls) {
+                std::vector<PendingToolCall> calls(1);
+                prepare_tool_call(tool_call, calls[0]);
+                overlap(tool_call, calls[0]);
+                execute_tool_calls(calls, turn);
+                if (pipeline) {
+                    pipeline->pause();
                 }
-            } catch (const ToolExecutionSkipped& e) {
-                json response;
-                response["skipped"] = e.get_message();
-                result = response.dump();
-                tool_skipped = true;
+                finish_tool_call(tool_call, calls[0], messages);
             }
+            continue;
+        }
+
+        std::vector<PendingToolCall> calls(tool_calls.size());
+        for (size_t i = 0; i < tool_calls.size(); i++) {
+            prepare_tool_call(tool_calls[i], calls[i]);
+        }
+        overlap(tool_calls[0], calls[0]);
+        execute_tool_calls(calls, turn);
+        if (pipeline) {
+            pipeline->pause();
+        }
+        for (size_t i = 0; i < tool_calls.size(); i++) {
+            finish_tool_call(tool_calls[i], calls[i], messages);
+        }
+    }
+}
+
+std::future<std::string>
+Agent::run_loop_async(std::vector<common_chat_msg>& messages,
+                      ResponseCallback callback,
+                      GenerationEventCallback on_event,
+                      CancellationToken cancel)
+{
+    auto turn = [this,
+                 &messages,
+                 callback = std::move(callback),
+                 on_event = std::move(on_event),
+                 cancel = std::move(cancel)]() {
+        return run_loop(messages, callback, on_event, cancel);
+    };
+
+    if (config.executor) {
+        return config.executor->submit(std::move(turn));
+    }
+    return std::async(std::launch::async, std::move(turn));
+}
+
+void
+Agent::prepare_tool_call(const common_chat_tool_call& tool_call,
+                         PendingToolCall& call)
+{
+    call.name = tool_call.name;
+    call.arguments = tool_call.arguments;
+
+    try {
+        for (const auto& cb : callbacks) {
+            cb->before_tool_execution(call.name, call.arguments);
+        }
+    } catch (const ToolExecutionSkipped& e) {
+        json response;
+        response["skipped"] = e.get_message();
+        call.result = response.dump();
+        return;
+    }
+
+    try {
+        try {
+            call.args = json::parse(call.arguments);
+        } catch (const json::parse_error& e) {
+            throw ToolArgumentError(call.name, e.what());
+        }
+
+        call.tool = tools.find(call.name);
+        if (call.tool == nullptr) {
+            throw ToolNotFoundError(call.name);
+        }
+        call.ready = true;
+    } catch (const std::exception& e) {
+        call.result = ToolResult::from_exception(e);
+    }
+}
 
-            if (!tool_skipped) {
-                try {
-                    json args;
-                    try {
-                        args = json::parse(tool_arguments);
-                    } catch (const json::parse_error& e) {
-                        throw ToolArgumentError(tool_name, e.what());
-                    }
-
-                    auto tool_it = std::find_if(
-                      tools.begin(),
-                      tools.end(),
-                      [&tool_name](const std::unique_ptr<Tool>& t) {
-                          return t->get_name() == tool_name;
-                      });
-
-                    if (tool_it == tools.end()) {
-                        throw ToolNotFoundError(tool_name);
-                    }
-
-                    result = (*tool_it)->execute(args);
-                } catch (const std::exception& e) {
-                    result = ToolResult::from_exception(e);
+void
+Agent::execute_tool_calls(std::vector<PendingToolCall>& calls,
+                          const CancellationToken& cancel)
+{
+    ToolResultCache* cache = config.tool_result_cache.get();
+    auto execute = [cache](PendingToolCall& call) {
+        const auto ttl = cache ? call.tool->cache_ttl()
+                               : std::chrono::milliseconds(0);
+        try {
+            const std::string scope =
+              ttl.count() > 0 ? call.tool->cache_scope() : std::string();
+            if (ttl.count() > 0) {
+                if (auto cached = cache->get(call.name, call.args, scope)) {
+                    call.result = std::move(*cached);
+                    return;
                 }
             }
-
-            // Single callback invocation - callbacks can convert errors to
-            // results
-            for (const auto& cb : callbacks) {
-                cb->after_tool_execution(tool_name, result);
+            std::string output =
+              call.on_output
+                ? call.tool->execute_streaming(call.args, call.on_output)
+                : call.tool->execute(call.args);
+            if (ttl.count() > 0) {
+                cache->put(call.name, call.args, output, ttl, scope);
             }
+            call.result = std::move(output);
+        } catch (const std::exception& e) {
+            call.result = ToolResult::from_exception(e);
+        }
+    };
 
-            // If still an error after callbacks, re-throw
-            if (result.has_error()) {
-                throw ToolError(tool_name, result.error().message);
+    std::vector<std::future<void>> running;
+    // Waits for every running call before rethrowing, tasks reference calls
+    auto wait_running = [&running]() {
+        std::exception_ptr error;
+        for (auto& future : running) {
+            try {
+                future.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
             }
+        }
+        running.clear();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    };
+
+    for (auto& call : calls) {
+        if (!call.ready) {
+            continue;
+        }
+
+        if (cancel.is_cancelled()) {
+            json response;
+            response["cancelled"] = "turn was cancelled before the call ran";
+            call.result = response.dump();
+            continue;
+        }
 
-            common_chat_msg tool_msg;
-            tool_msg.role = "tool";
-            tool_msg.content = result.output();
-            tool_msg.tool_call_id = tool_call.id;
-            tool_msg.tool_name = tool_name;
-            messages.push_back(tool_msg);
+        // A turn running on the tool pool itself, e.g. when it is also the
+        // executor, would wait for workers that are all waiting as well
+        if (tool_pool && !tool_pool->is_worker() && calls.size() > 1 &&
+            call.tool->is_concurrency_safe()) {
+            PendingToolCall* target = &call;
+            running.push_back(
+              tool_pool->submit([&execute, target] { execute(*target); }));
+            continue;
         }
+
+        // Not safe to overlap with anything, wait for the calls before it
+        wait_running();
+        execute(call);
     }
+
+    wait_running();
+}
+
+void
+Agent::finish_tool_call(const common_chat_tool_call& tool_call,
+                        PendingToolCall& call,
+                        std::vector<common_chat_msg>& messages)
+{
+    // Single callback invocation - callbacks can convert errors to results
+    for (const auto& cb : callbacks) {
+        cb->after_tool_execution(call.name, call.result);
+    }
+
+    // If still an error after callbacks, re-throw
+    if (call.result.has_error()) {
+        throw ToolError(call.name, call.result.error().message);
+    }
+
+    common_chat_msg tool_msg;
+    tool_msg.role = "tool";
+    tool_msg.content = call.result.output();
+    if (output_governor) {
+        const int max_tokens = call.tool ? call.tool->max_output_tokens() : 0;
+        tool_msg.content = output_governor->govern(
+          call.name, std::move(tool_msg.content), max_tokens);
+    }
+    tool_msg.tool_call_id = tool_call.id;
+    tool_msg.tool_name = call.name;
+    messages.push_back(tool_msg);
 }
 
 std::vector<llama_token>
@@ -160,11 +487,9 @@ Agent::build_prompt_tokens()
         system_messages.push_back(system_msg);
     }
 
-    std::vector<common_chat_tool> tool_definitions = get_tool_definitions();
-
     common_chat_templates_inputs inputs;
     inputs.messages = system_messages;
-    inputs.tools = tool_definitions;
+    inputs.tools = *tools.definitions();
     inputs.tool_choice = COMMON_CHAT_TOOL_CHOICE_AUTO;
     inputs.add_generation_prompt = false;
     inputs.enable_thinking = false;
@@ -181,17 +506,28 @@ Agent::load_or_create_cache(const std::string& cache_path)
         return false;
     }
 
+    auto prompt_tokens = build_prompt_tokens();
+
     if (std::filesystem::exists(cache_path)) {
         auto cached_tokens = model->load_cache(cache_path);
-        if (!cached_tokens.empty()) {
+        // A cache saved for other instructions, tools or another model
+        // doesn't start with this agent's prompt
+        const bool matches =
+          cached_tokens.size() >= prompt_tokens.size() &&
+          std::equal(
+            prompt_tokens.begin(), prompt_tokens.end(), cached_tokens.begin());
+        if (!cached_tokens.empty() && matches) {
             printf("Loaded prompt cache from '%s' (%zu tokens)\n",
                    cache_path.c_str(),
                    cached_tokens.size());
             return true;
         }
+        if (!cached_tokens.empty()) {
+            printf("Prompt cache at '%s' is stale, recreating it\n",
+                   cache_path.c_str());
+        }
     }
 
-    auto prompt_tokens = build_prompt_tokens();
     if (prompt_tokens.empty()) {
         return true;
     }
@@ -201,9 +537,49 @@ Agent::load_or_create_cache(const std::string& cache_path)
            prompt_tokens.size());
 
     // warms the KV cache
-    model->generate_from_tokens(prompt_tokens);
+    model->prefill(prompt_tokens);
 
     return model->save_cache(cache_path);
 }
 
+bool
+Agent::load_or_create_cache(PromptCacheStore& store)
+{
+    if (!model) {
+        return false;
+    }
+
+    auto prompt_tokens = build_prompt_tokens();
+    if (prompt_tokens.empty()) {
+        return true;
+    }
+
+    const size_t n_reused = store.load(*model, prompt_tokens);
+    if (n_reused == prompt_tokens.size()) {
+        return true;
+    }
+
+    // Only the part after the longest cached prefix is decoded
+    model->prefill(prompt_tokens);
+    return store.save(*model);
+}
+
+bool
+Agent::share_prefix_from(const Model& source)
+{
+    if (!model) {
+        return false;
+    }
+
+    auto prompt_tokens = build_prompt_tokens();
+    const auto& cached_tokens = source.get_cached_tokens();
+    if (prompt_tokens.empty() || cached_tokens.size() < prompt_tokens.size() ||
+        !std::equal(
+          prompt_tokens.begin(), prompt_tokens.end(), cached_tokens.begin())) {
+        return false;
+    }
+
+    return model->copy_state_from(source);
+}
+
 } // namespace agent_cpp
@@ -1,45 +1,164 @@
 #pragma once
 
 #include "callbacks.h"
+#include "cancellation.h"
 #include "chat.h"
 #include "llama.h"
 #include "model.h"
+#include "prompt_cache_store.h"
+#include "thread_pool.h"
 #include "tool.h"
+#include "tool_output_governor.h"
+#include "tool_registry.h"
+#include "tool_result.h"
+#include "tool_result_cache.h"
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
 
 namespace agent_cpp {
 
+struct AgentConfig
+{
+    // Maximum number of tool calls from one assistant message executed at the
+    // same time. 1 executes them one after another.
+    size_t max_parallel_tools = 1;
+    // Pool to run concurrent tool calls on, e.g. shared between agents.
+    // When set it is used instead of creating one, and its size bounds the
+    // number of concurrent calls. Turns running on this pool, e.g. when it
+    // is also the executor, execute their tool calls one after another, so
+    // give executor a pool of its own.
+    std::shared_ptr<ThreadPool> tool_pool;
+    // Stop generating as soon as the model closes a tool call instead of
+    // decoding whatever it emits after it. Tool calls after the first one in
+    // a message are dropped.
+    bool stop_at_tool_call = false;
+    // Deadline for one run_loop call, 0 disables it. Once it passes the turn
+    // throws CancelledError at its next decode step or tool call.
+    std::chrono::milliseconds turn_timeout{ 0 };
+    // Pool run_loop_async runs turns on, e.g. shared by all sessions of a
+    // server. Each turn holds a thread while it runs. Without one every
+    // call starts its own thread.
+    std::shared_ptr<ThreadPool> executor;
+    // Outputs of tools with a cache_ttl() are reused from it for calls with
+    // the same arguments. May be shared between agents.
+    std::shared_ptr<ToolResultCache> tool_result_cache;
+    // Token budget of tool outputs. With max_tokens set, longer outputs are
+    // shortened to their head and tail before they enter the conversation,
+    // and a read_tool_output tool is registered to page through them.
+    ToolOutputGovernorConfig tool_output;
+    // Prefill the next prompt while tool calls run instead of after: the
+    // end of the assistant turn and the tool response header at once, and
+    // the output of tools overriding execute_streaming() as it arrives.
+    // The model is busy on another thread meanwhile, so tools must not use
+    // it.
+    bool overlap_prefill = false;
+};
+
 class Agent
 {
   private:
+    // A tool call between its before and after callbacks
+    struct PendingToolCall
+    {
+        std::string name;
+        std::string arguments;
+        json args;
+        Tool* tool = nullptr;
+        ToolResult result{ "" };
+        // Arguments parsed and tool found, execute() still has to run
+        bool ready = false;
+        // Set to run execute_streaming() with it instead of execute()
+        std::function<void(std::string_view)> on_output;
+    };
+
     std::vector<std::unique_ptr<Callback>> callbacks;
     std::string instructions;
     std::shared_ptr<Model> model;
-    std::vector<std::unique_ptr<Tool>> tools;
+    ToolRegistry tools;
+    AgentConfig config;
+    // Set when tool calls run concurrently
+    std::shared_ptr<ThreadPool> tool_pool;
+    // Set when AgentConfig::tool_output has a budget
+    std::shared_ptr<ToolOutputGovernor> output_governor;
+    // Size of build_prompt_tokens(), the n_keep of context shifts. -1 until
+    // counted, and again once the tool definitions are invalidated.
+    std::atomic<int> n_prompt_tokens{ -1 };
 
     // Helper to ensure system message with instructions is at the start
     void ensure_system_message(std::vector<common_chat_msg>& messages);
 
+    // Run the before_tool_execution callbacks, parse the arguments and look
+    // up the tool. Failures end up in call.result.
+    void prepare_tool_call(const common_chat_tool_call& tool_call,
+                           PendingToolCall& call);
+
+    // Execute prepared calls, concurrency-safe ones on the tool pool
+    // Calls not started before cancel is cancelled get a cancelled result
+    void execute_tool_calls(std::vector<PendingToolCall>& calls,
+                            const CancellationToken& cancel);
+
+    // Run the after_tool_execution callbacks and append the tool message
+    // Throws ToolError if the result is still an error
+    void finish_tool_call(const common_chat_tool_call& tool_call,
+                          PendingToolCall& call,
+                          std::vector<common_chat_msg>& messages);
+
   public:
     Agent(std::shared_ptr<Model> model,
           std::vector<std::unique_ptr<Tool>> tools,
           std::vector<std::unique_ptr<Callback>> callbacks = {},
-          const std::string& instructions = "");
+          const std::string& instructions = "",
+          const AgentConfig& config = AgentConfig{});
 
     // Run one turn of the agent loop
     // Assumes the latest user message is already in the messages vector
     // Executes tool calls as needed, and returns the final response
     // The callback is called for each token generated by the model
+    // on_event receives the same output as structured events, see
+    // GenerationEvent
+    //
+    // With max_parallel_tools > 1, the tool calls of one assistant message
+    // run concurrently when their tools are concurrency safe. Every
+    // before_tool_execution callback runs first, in order, on the calling
+    // thread; then the calls execute; then the after_tool_execution callbacks
+    // run and tool messages are appended in the original order.
+    //
+    // Throws CancelledError when cancel is cancelled or the turn_timeout
+    // passes. It is checked between decode steps and before each tool call;
+    // calls that didn't start still get a tool message, so messages can be
+    // passed to run_loop again.
     std::string run_loop(std::vector<common_chat_msg>& messages,
-                         const ResponseCallback& callback = nullptr);
+                         const ResponseCallback& callback = nullptr,
+                         const GenerationEventCallback& on_event = nullptr,
+                         const CancellationToken& cancel = {});
+
+    // Run one turn on AgentConfig::executor, see run_loop
+    // The agent and messages must outlive the returned future, and only one
+    // turn of an agent may run at a time. Errors are rethrown by get().
+    std::future<std::string> run_loop_async(
+      std::vector<common_chat_msg>& messages,
+      ResponseCallback callback = nullptr,
+      GenerationEventCallback on_event = nullptr,
+      CancellationToken cancel = {});
 
     // Get the tool definitions for all registered tools
     // Useful for building prompts for caching
     [[nodiscard]] std::vector<common_chat_tool> get_tool_definitions() const;
 
+    // Rebuild the tool definitions before the next turn, e.g. when an MCP
+    // server reports that its tools changed. Safe to call from any thread.
+    // Tools the server added or removed need an Agent with new tools.
+    void invalidate_tool_definitions()
+    {
+        tools.invalidate();
+        n_prompt_tokens = -1;
+    }
+
     // Get the instructions string
     [[nodiscard]] const std::string& get_instructions() const
     {
@@ -50,11 +169,24 @@ class Agent
     [[nodiscard]] Model* get_model() const { return model.get(); }
 
     // Load prompt cache from file, or create it if it doesn't exist
+    // A cache that doesn't start with this agent's prompt tokens is stale
+    // and gets recreated
     // Returns true on success, false on failure
     bool load_or_create_cache(const std::string& cache_path);
 
-  private:
+    // Start from the store entry sharing the longest prefix with this
+    // agent's prompt tokens, prefill the rest and save it unless it was
+    // already cached in full
+    // Returns true on success, false on failure
+    bool load_or_create_cache(PromptCacheStore& store);
+
+    // Start from the KV cache of a model that already holds this agent's
+    // prompt prefix, e.g. one prefilled once and shared by many sessions
+    // Returns false if source doesn't start with this agent's prompt tokens
+    bool share_prefix_from(const Model& source);
+
     // Build the agent's prompt tokens (system message + tool definitions)
+    // Prefill these into a model to create a prefix for share_prefix_from
     std::vector<llama_token> build_prompt_tokens();
 };
 
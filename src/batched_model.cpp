@@ -0,0 +1,599 @@
+#include "batched_model.h"
+#include "common.h"
+#include "error.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+std::shared_ptr<BatchedModel>
+BatchedModel::create(std::shared_ptr<ModelWeights> weights,
+                     const BatchedModelConfig& config)
+{
+    if (config.n_seq_max < 1) {
+        throw ModelError("n_seq_max must be at least 1");
+    }
+
+    std::shared_ptr<BatchedModel> batched(new BatchedModel());
+    batched->weights_ = std::move(weights);
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config.n_ctx;
+    ctx_params.n_batch = config.n_batch;
+    ctx_params.n_seq_max = config.n_seq_max;
+    ctx_params.n_threads = config.n_threads;
+    ctx_params.n_threads_batch = config.n_threads_batch;
+    if (config.threadpool) {
+        ctx_params.n_threads = config.threadpool->n_threads();
+        ctx_params.n_threads_batch = config.threadpool->n_threads_batch();
+    }
+    if (config.n_ubatch > 0) {
+        ctx_params.n_ubatch = config.n_ubatch;
+    }
+    ctx_params.type_k = config.cache_type_k;
+    ctx_params.type_v = config.cache_type_v;
+    ctx_params.flash_attn_type = config.flash_attn;
+    ctx_params.offload_kqv = config.offload_kqv;
+    // A unified cache lets all sequences draw from one pool of cells instead
+    // of splitting n_ctx evenly between them
+    ctx_params.kv_unified = true;
+
+    batched->ctx_ =
+      llama_init_from_model(batched->weights_->get_model(), ctx_params);
+    if (batched->ctx_ == nullptr) {
+        throw ModelError("failed to create llama context");
+    }
+    if (config.threadpool) {
+        batched->threadpool_ = config.threadpool;
+        llama_attach_threadpool(batched->ctx_,
+                                config.threadpool->get(),
+                                config.threadpool->get_batch());
+    }
+
+    batched->n_batch_ = static_cast<int>(llama_n_batch(batched->ctx_));
+    batched->n_cells_limit_ = batched->n_batch_;
+    batched->batch_ = llama_batch_init(batched->n_batch_, 0, 1);
+    batched->seq_in_use_.assign(config.n_seq_max, false);
+    batched->slots_.resize(config.n_seq_max);
+    batched->worker_ = std::thread(&BatchedModel::run, batched.get());
+
+    return batched;
+}
+
+BatchedModel::~BatchedModel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+
+    if (batch_.token != nullptr) {
+        llama_batch_free(batch_);
+    }
+    if (ctx_ != nullptr) {
+        llama_free(ctx_);
+    }
+}
+
+std::shared_ptr<Model>
+BatchedModel::create_session(const ModelConfig& model_config)
+{
+    llama_seq_id seq_id = -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < seq_in_use_.size(); i++) {
+            if (!seq_in_use_[i]) {
+                seq_in_use_[i] = true;
+                seq_id = static_cast<llama_seq_id>(i);
+                break;
+            }
+        }
+    }
+    if (seq_id < 0) {
+        throw ModelError("no free sequence for a new session");
+    }
+
+    std::shared_ptr<Model> session(new Model());
+    session->weights_ = weights_;
+    session->config_ = model_config;
+    session->prompt_builder_.set_enabled(model_config.incremental_prompt);
+    session->ctx_ = ctx_;
+    session->seq_id_ = seq_id;
+    session->scheduler_ = shared_from_this();
+    session->initialize_sampler(model_config);
+
+    std::lock_guard<std::mutex> lock(ctx_mutex_);
+    slots_[seq_id] = { session.get(), n_steps_ };
+    return session;
+}
+
+std::shared_ptr<Model>
+BatchedModel::create_session(const Model& prefix,
+                             const ModelConfig& model_config)
+{
+    if (prefix.scheduler_.get() != this) {
+        throw ModelError("prefix session belongs to another batched model");
+    }
+
+    auto session = create_session(model_config);
+    copy_session(prefix, *session);
+    return session;
+}
+
+void
+BatchedModel::copy_session(const Model& source, Model& destination)
+{
+    std::lock_guard<std::mutex> lock(ctx_mutex_);
+    llama_memory_t mem = llama_get_memory(ctx_);
+    llama_memory_seq_rm(mem, destination.seq_id_, -1, -1);
+    llama_memory_seq_cp(mem, source.seq_id_, destination.seq_id_, -1, -1);
+    destination.set_cache_state(source.processed_tokens_);
+}
+
+int
+BatchedModel::n_active_sessions() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<int>(
+      std::count(seq_in_use_.begin(), seq_in_use_.end(), true));
+}
+
+std::string
+BatchedModel::generate(Model& session,
+                       const std::vector<llama_token>& all_tokens,
+                       const ResponseCallback& callback,
+                       bool prefill_only)
+{
+    auto request = std::make_unique<Request>();
+    request->session = &session;
+    request->tokens = &all_tokens;
+    request->callback = &callback;
+    request->prefill_only = prefill_only;
+    request->response =
+      StopMatcher(session.stops_, session.config_.stream_chunk_tokens);
+    auto result = request->promise.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+            throw ModelError("batched model is shutting down");
+        }
+        incoming_.push_back(std::move(request));
+    }
+    cv_.notify_one();
+
+    // The caller blocks here, which keeps all_tokens and callback alive for
+    // as long as the scheduler references them
+    return result.get();
+}
+
+void
+BatchedModel::release_session(llama_seq_id seq_id)
+{
+    {
+        std::lock_guard<std::mutex> lock(ctx_mutex_);
+        llama_memory_seq_rm(llama_get_memory(ctx_), seq_id, -1, -1);
+        slots_[seq_id] = {};
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    seq_in_use_[seq_id] = false;
+}
+
+void
+BatchedModel::rebind_session(Model& session)
+{
+    std::lock_guard<std::mutex> lock(ctx_mutex_);
+    slots_[session.seq_id_].session = &session;
+}
+
+bool
+BatchedModel::save_session(const Model& session, const std::string& cache_path)
+{
+    std::lock_guard<std::mutex> lock(ctx_mutex_);
+    return llama_state_seq_save_file(ctx_,
+                                     cache_path.c_str(),
+                                     session.seq_id_,
+                                     session.processed_tokens_.data(),
+                                     session.processed_tokens_.size()) > 0;
+}
+
+std::vector<llama_token>
+BatchedModel::load_session(Model& session, const std::string& cache_path)
+{
+    std::vector<llama_token> tokens(llama_n_ctx(ctx_));
+    size_t n_token_count_out = 0;
+
+    std::lock_guard<std::mutex> lock(ctx_mutex_);
+    llama_memory_seq_rm(llama_get_memory(ctx_), session.seq_id_, -1, -1);
+    if (llama_state_seq_load_file(ctx_,
+                                  cache_path.c_str(),
+                                  session.seq_id_,
+                                  tokens.data(),
+                                  tokens.size(),
+                                  &n_token_count_out) == 0) {
+        session.set_cache_state({});
+        return {};
+    }
+
+    tokens.resize(n_token_count_out);
+    session.set_cache_state(tokens);
+    return tokens;
+}
+
+void
+BatchedModel::run()
+{
+    while (true) {
+        std::vector<std::unique_ptr<Request>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] {
+                return stop_ || !incoming_.empty() || !active_.empty();
+            });
+            if (stop_) {
+                break;
+            }
+            while (!incoming_.empty()) {
+                admitted.push_back(std::move(incoming_.front()));
+                incoming_.pop_front();
+            }
+        }
+
+        for (auto& request : admitted) {
+            try {
+                admit(*request);
+                active_.push_back(std::move(request));
+            } catch (...) {
+                request->promise.set_exception(std::current_exception());
+            }
+        }
+
+        step();
+    }
+
+    for (auto& request : active_) {
+        request->promise.set_exception(std::make_exception_ptr(
+          ModelError("batched model is shutting down")));
+    }
+    active_.clear();
+}
+
+void
+BatchedModel::admit(Request& request)
+{
+    Model& session = *request.session;
+    const auto& tokens = *request.tokens;
+
+    if (tokens.empty() && !request.prefill_only) {
+        throw ModelError("cannot generate from an empty prompt");
+    }
+
+    // Find common prefix length between processed tokens and new tokens
+    size_t common_prefix = 0;
+    while (common_prefix < session.processed_tokens_.size() &&
+           common_prefix < tokens.size() &&
+           session.processed_tokens_[common_prefix] == tokens[common_prefix]) {
+        common_prefix++;
+    }
+
+    // The last prompt token has to go through this step's batch, otherwise
+    // there are no logits to sample the session's first token from
+    if (common_prefix == tokens.size() && !request.prefill_only) {
+        common_prefix--;
+    }
+
+    if (common_prefix < session.processed_tokens_.size()) {
+        std::lock_guard<std::mutex> lock(ctx_mutex_);
+        llama_memory_seq_rm(
+          llama_get_memory(ctx_), session.seq_id_, common_prefix, -1);
+        session.processed_tokens_.resize(common_prefix);
+        session.n_past_ = static_cast<int>(common_prefix);
+    }
+
+    session.stats_.reused_tokens = static_cast<int>(common_prefix);
+    session.stats_.prefilled_tokens =
+      static_cast<int>(tokens.size() - common_prefix);
+    request.n_prefilled = common_prefix;
+    request.done = request.prefill_only && common_prefix == tokens.size();
+}
+
+void
+BatchedModel::pack_batch(int n_max)
+{
+    const int n_ctx = static_cast<int>(llama_n_ctx(ctx_));
+
+    common_batch_clear(batch_);
+
+    // Cancelled requests retire this step without contributing tokens
+    auto cancelled = [](Request& request) {
+        try {
+            request.session->cancel_.throw_if_cancelled();
+            return false;
+        } catch (...) {
+            request.error = std::current_exception();
+            return true;
+        }
+    };
+
+    // Sessions that are generating go first with one token each, so their
+    // inter-token latency stays flat while other prompts are being prefilled
+    for (auto& request : active_) {
+        request->i_batch = -1;
+        request->n_batch_tokens = 0;
+
+        if (!request->decoding || request->error || batch_.n_tokens >= n_max) {
+            continue;
+        }
+
+        Model& session = *request->session;
+        if (cancelled(*request)) {
+            continue;
+        }
+        if (session.n_past_ + 1 > std::min(session.config_.n_ctx, n_ctx)) {
+            request->error = std::make_exception_ptr(
+              ModelError("context size exceeded during generation"));
+            continue;
+        }
+
+        common_batch_add(batch_,
+                         request->last_token,
+                         session.n_past_,
+                         { session.seq_id_ },
+                         true);
+        request->i_batch = batch_.n_tokens - 1;
+        request->n_batch_tokens = 1;
+    }
+
+    // Remaining space is filled with prefill chunks in arrival order
+    for (auto& request : active_) {
+        if (request->decoding || request->done || request->error) {
+            continue;
+        }
+
+        const int budget = n_max - batch_.n_tokens;
+        if (budget <= 0) {
+            break;
+        }
+
+        Model& session = *request->session;
+        if (cancelled(*request)) {
+            continue;
+        }
+        const auto& tokens = *request->tokens;
+        const size_t n_tokens =
+          std::min(tokens.size() - request->n_prefilled, (size_t)budget);
+
+        if (session.n_past_ + static_cast<int>(n_tokens) >
+            std::min(session.config_.n_ctx, n_ctx)) {
+            request->error =
+              std::make_exception_ptr(ModelError("context size exceeded"));
+            continue;
+        }
+
+        for (size_t k = 0; k < n_tokens; k++) {
+            const size_t idx = request->n_prefilled + k;
+            common_batch_add(batch_,
+                             tokens[idx],
+                             session.n_past_ + static_cast<llama_pos>(k),
+                             { session.seq_id_ },
+                             idx + 1 == tokens.size() &&
+                               !request->prefill_only);
+        }
+        request->n_batch_tokens = n_tokens;
+        if (request->n_prefilled + n_tokens == tokens.size() &&
+            !request->prefill_only) {
+            request->i_batch = batch_.n_tokens - 1;
+        }
+    }
+}
+
+bool
+BatchedModel::preempt()
+{
+    llama_memory_t mem = llama_get_memory(ctx_);
+
+    // An idle session only has to prefill again on its next request, so the
+    // one used least recently gives up its cells first
+    auto is_active = [this](const Model* session) {
+        return std::any_of(
+          active_.begin(), active_.end(), [session](const auto& request) {
+              return request->session == session;
+          });
+    };
+    Slot* idle = nullptr;
+    for (auto& slot : slots_) {
+        if (slot.session == nullptr || slot.session->n_past_ == 0 ||
+            is_active(slot.session)) {
+            continue;
+        }
+        if (idle == nullptr || slot.last_used < idle->last_used) {
+            idle = &slot;
+        }
+    }
+    if (idle != nullptr) {
+        llama_memory_seq_rm(mem, idle->session->seq_id_, -1, -1);
+        idle->session->set_cache_state({});
+        return true;
+    }
+
+    // Otherwise the newest request holding cells gives them up
+    for (auto it = active_.rbegin(); it != active_.rend(); ++it) {
+        Request& request = **it;
+        Model& session = *request.session;
+        if (request.error || session.n_past_ == 0) {
+            continue;
+        }
+        llama_memory_seq_rm(mem, session.seq_id_, -1, -1);
+        session.set_cache_state({});
+        request.error = std::make_exception_ptr(
+          ModelError("KV cache is full, the session's cache was dropped"));
+        return true;
+    }
+    return false;
+}
+
+void
+BatchedModel::step()
+{
+    const llama_vocab* vocab = weights_->get_vocab();
+
+    // A full cache rejects the whole batch and changes nothing, so the step
+    // is packed again smaller, deferring prefill chunks, the way llama.cpp's
+    // server halves n_batch. When not even one token fits, a session is
+    // preempted, see preempt().
+    std::unique_lock<std::mutex> lock(ctx_mutex_, std::defer_lock);
+    std::unique_lock<std::mutex> compute;
+    common_batch_clear(batch_);
+    int ret = 0;
+    if (!active_.empty()) {
+        lock.lock();
+        if (threadpool_) {
+            compute = threadpool_->acquire();
+        }
+        n_steps_++;
+        for (auto& request : active_) {
+            slots_[request->session->seq_id_].last_used = n_steps_;
+        }
+
+        int n_max = n_cells_limit_;
+        while (true) {
+            pack_batch(n_max);
+            if (batch_.n_tokens == 0) {
+                break;
+            }
+            ret = llama_decode(ctx_, batch_);
+            if (ret != 1) {
+                break;
+            }
+            if (batch_.n_tokens > 1) {
+                n_max = batch_.n_tokens / 2;
+            } else if (!preempt()) {
+                break;
+            }
+        }
+
+        // Later steps start from what fit and grow back as cells free up
+        if (ret == 0 && batch_.n_tokens > 0) {
+            n_cells_limit_ = n_max < n_cells_limit_
+                               ? n_max
+                               : std::min(n_batch_, n_cells_limit_ * 2);
+        }
+    }
+
+    if (batch_.n_tokens > 0) {
+        if (ret != 0) {
+            for (auto& request : active_) {
+                if (request->n_batch_tokens > 0 && !request->error) {
+                    request->error = std::make_exception_ptr(
+                      ModelError(ret == 1 ? "KV cache is full"
+                                          : "failed to decode batch"));
+                }
+            }
+        } else {
+            for (auto& request : active_) {
+                if (request->n_batch_tokens == 0 || request->error) {
+                    continue;
+                }
+                Model& session = *request->session;
+                if (request->decoding) {
+                    session.processed_tokens_.push_back(request->last_token);
+                } else {
+                    const auto first = request->tokens->begin() +
+                                       static_cast<std::ptrdiff_t>(
+                                         request->n_prefilled);
+                    session.processed_tokens_.insert(
+                      session.processed_tokens_.end(),
+                      first,
+                      first +
+                        static_cast<std::ptrdiff_t>(request->n_batch_tokens));
+                    request->n_prefilled += request->n_batch_tokens;
+                }
+                session.n_past_ += static_cast<int>(request->n_batch_tokens);
+
+                if (request->prefill_only &&
+                    request->n_prefilled == request->tokens->size()) {
+                    request->done = true;
+                    continue;
+                }
+
+                if (request->i_batch < 0) {
+                    continue;
+                }
+
+                llama_token new_token_id = session.sample(request->i_batch);
+                if (llama_vocab_is_eog(vocab, new_token_id)) {
+                    request->done = true;
+                    continue;
+                }
+                session.record_token();
+
+                try {
+                    session.token_to_piece(new_token_id, request->piece);
+                    request->has_piece = true;
+                    request->last_token = new_token_id;
+                    request->decoding = true;
+                } catch (...) {
+                    request->error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if (compute.owns_lock()) {
+        compute.unlock();
+    }
+    if (lock.owns_lock()) {
+        lock.unlock();
+    }
+
+    // Stream outside the context lock so callbacks can't stall other sessions
+    // waiting to be released or saved
+    for (auto& request : active_) {
+        if (!request->has_piece) {
+            continue;
+        }
+        request->has_piece = false;
+        try {
+            std::string_view piece = request->response.push(request->piece);
+            if (*request->callback && !piece.empty()) {
+                (*request->callback)(piece);
+            }
+            // The token completing the stop sequence is never decoded
+            if (request->response.stopped() ||
+                request->session->stop_requested_) {
+                request->done = true;
+            }
+        } catch (...) {
+            request->error = std::current_exception();
+        }
+    }
+
+    auto retired =
+      std::stable_partition(active_.begin(), active_.end(), [](auto& r) {
+          return !r->done && !r->error;
+      });
+    for (auto it = retired; it != active_.end(); ++it) {
+        auto& request = *it;
+        if (!request->error) {
+            try {
+                std::string_view rest = request->response.flush();
+                if (*request->callback && !rest.empty()) {
+                    (*request->callback)(rest);
+                }
+            } catch (...) {
+                request->error = std::current_exception();
+            }
+        }
+        if (request->error) {
+            request->promise.set_exception(request->error);
+        } else {
+            request->promise.set_value(request->response.take_text());
+        }
+    }
+    active_.erase(retired, active_.end());
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "llama.h"
+#include "model.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace agent_cpp {
+
+// Configuration of the shared context owned by a BatchedModel
+struct BatchedModelConfig
+{
+    // Maximum number of concurrent sessions (one llama_seq_id each)
+    int n_seq_max = 8;
+    // Total KV cells shared by all sessions. The cache is unified, so a
+    // session only occupies the cells it actually uses.
+    int n_ctx = 32768;
+    // Maximum number of tokens packed into a single llama_decode call
+    int n_batch = 2048;
+    int n_threads =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    int n_threads_batch =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    // Shared workers to compute on, see ModelConfig::threadpool
+    std::shared_ptr<ComputeThreadpool> threadpool;
+    // Physical batch size, -1 keeps llama.cpp's default
+    int n_ubatch = -1;
+    ggml_type cache_type_k = GGML_TYPE_F16;
+    ggml_type cache_type_v = GGML_TYPE_F16;
+    llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
+    bool offload_kqv = true;
+};
+
+/// @brief Continuous-batching scheduler that lets many sessions share one
+/// llama_context.
+///
+/// Each session is a regular Model bound to its own llama_seq_id inside the
+/// shared context, so it can be handed to an Agent unchanged. A background
+/// thread packs the prefill chunks and decode steps of all sessions with
+/// pending work into a single llama_decode call per step.
+///
+/// Sessions may generate concurrently from different threads. Response
+/// callbacks of a session are invoked on the scheduler thread.
+class BatchedModel : public std::enable_shared_from_this<BatchedModel>
+{
+    friend class Model;
+
+  public:
+    /// @brief Create the shared context and start the scheduler thread
+    /// @param weights Shared pointer to ModelWeights
+    /// @param config Shape of the shared context
+    /// @return Shared pointer to the new BatchedModel
+    /// @throws agent_cpp::ModelError if context creation fails
+    static std::shared_ptr<BatchedModel> create(
+      std::shared_ptr<ModelWeights> weights,
+      const BatchedModelConfig& config = BatchedModelConfig{});
+
+    ~BatchedModel();
+
+    BatchedModel(const BatchedModel&) = delete;
+    BatchedModel& operator=(const BatchedModel&) = delete;
+    BatchedModel(BatchedModel&&) = delete;
+    BatchedModel& operator=(BatchedModel&&) = delete;
+
+    /// @brief Create a new session bound to a free sequence of the context
+    /// @param model_config Sampling configuration of the session. n_ctx caps
+    /// the number of KV cells the session may use.
+    /// @return Shared pointer to a Model that generates through this scheduler
+    /// @throws agent_cpp::ModelError if all sequences are in use
+    std::shared_ptr<Model> create_session(
+      const ModelConfig& model_config = ModelConfig{});
+
+    /// @brief Create a new session that starts from another session's cache
+    /// @param prefix Session of this BatchedModel holding a warm prefix, e.g.
+    /// the shared system prompt and tool definitions
+    /// @param model_config Sampling configuration of the session
+    /// @return Shared pointer to the new session
+    /// @throws agent_cpp::ModelError if all sequences are in use or prefix
+    /// belongs to another BatchedModel
+    ///
+    /// The KV cells of the prefix are shared with the new session, not
+    /// copied. Each session only pays for the tokens after the prefix.
+    std::shared_ptr<Model> create_session(
+      const Model& prefix,
+      const ModelConfig& model_config = ModelConfig{});
+
+    /// @brief Number of sessions currently holding a sequence
+    [[nodiscard]] int n_active_sessions() const;
+
+    /// @brief Get the shared weights
+    [[nodiscard]] std::shared_ptr<ModelWeights> get_weights() const
+    {
+        return weights_;
+    }
+
+  private:
+    // A generation request submitted by a session, owned by the scheduler.
+    // The submitting thread blocks until completion, so the referenced
+    // tokens and callback outlive the request.
+    struct Request
+    {
+        Model* session = nullptr;
+        const std::vector<llama_token>* tokens = nullptr;
+        const ResponseCallback* callback = nullptr;
+        bool prefill_only = false;
+        std::promise<std::string> promise;
+
+        size_t n_prefilled = 0;     // Prompt tokens already in the KV cache
+        bool decoding = false;      // Prompt done, generating tokens
+        llama_token last_token = 0; // Sampled token to decode next step
+        int32_t i_batch = -1;       // Batch index to sample from, if any
+        size_t n_batch_tokens = 0;  // Tokens contributed to this step
+
+        std::string piece;
+        bool has_piece = false;
+        StopMatcher response;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    BatchedModel() = default;
+
+    // Submit a request and block until it completes (called by Model)
+    // With prefill_only the request completes once all tokens are in the
+    // cache, without sampling
+    std::string generate(Model& session,
+                         const std::vector<llama_token>& all_tokens,
+                         const ResponseCallback& callback,
+                         bool prefill_only = false);
+
+    // Make destination share the cached cells of source (called by Model)
+    void copy_session(const Model& source, Model& destination);
+
+    // Free the sequence of a session (called by ~Model)
+    void release_session(llama_seq_id seq_id);
+
+    // Point the sequence of a moved session at its new object (called by
+    // Model's move operations)
+    void rebind_session(Model& session);
+
+    // Per-sequence cache persistence for sessions (called by Model)
+    bool save_session(const Model& session, const std::string& cache_path);
+    std::vector<llama_token> load_session(Model& session,
+                                          const std::string& cache_path);
+
+    void run();
+    void admit(Request& request);
+    // Fill batch_ with at most n_max tokens of the active requests
+    void pack_batch(int n_max);
+    // Drop the cache of the least recently used idle session holding cells,
+    // or else of the newest request's session and fail that request
+    // Returns false if no session holds any
+    bool preempt();
+    void step();
+
+    std::shared_ptr<ModelWeights> weights_;
+    llama_context* ctx_ = nullptr;
+    std::shared_ptr<ComputeThreadpool> threadpool_; // Outlives ctx_
+    llama_batch batch_{};
+    int n_batch_ = 0;
+    // Tokens a step packs, lowered when the shared cache runs out of cells
+    // and raised again as they free up. llama.cpp doesn't report the cells
+    // in use, and sessions share prefix cells, so it is learned from
+    // llama_decode rejecting batches.
+    int n_cells_limit_ = 0;
+
+    // Guards incoming_, seq_in_use_ and stop_
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<Request>> incoming_;
+    std::vector<bool> seq_in_use_;
+    bool stop_ = false;
+
+    // Serializes access to ctx_ between the scheduler and session management
+    std::mutex ctx_mutex_;
+
+    // Session holding a sequence, guarded by ctx_mutex_
+    struct Slot
+    {
+        Model* session = nullptr;
+        uint64_t last_used = 0; // Last step the session had a request in
+    };
+    std::vector<Slot> slots_; // Indexed by seq_id
+    uint64_t n_steps_ = 0;
+
+    // Requests being processed, only touched by the scheduler thread
+    std::vector<std::unique_ptr<Request>> active_;
+    std::thread worker_;
+};
+
+} // namespace agent_cpp
@@ -2,6 +2,7 @@
 
 #include "chat.h"
 #include "error.h"
+#include "generation_stats.h"
 #include "tool_result.h"
 #include <string>
 #include <vector>
@@ -37,6 +38,11 @@ class Callback
     // @param parsed_msg: The parsed message from the LLM (can be modified)
     virtual void after_llm_call(common_chat_msg& parsed_msg) {}
 
+    // Called after each LLM inference call, before after_llm_call
+    // @param stats: Render, tokenize, prefill and decode timings of the call,
+    // and how much of the prompt was reused from the KV cache
+    virtual void on_generation_stats(const GenerationStats& stats) {}
+
     // Called before executing a tool call
     // @param tool_name: Name of the tool to be executed (can be modified)
     // @param arguments: JSON string of the tool arguments (can be modified)
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "error.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+namespace agent_cpp {
+
+/// @brief Shared flag to stop a turn early, optionally with a deadline
+///
+/// Copies share their state, so one copy can be handed to run_loop while
+/// another is cancelled from a different thread. A default constructed
+/// token is never cancelled.
+///
+/// Usage:
+///   auto cancel = agent_cpp::CancellationToken::create();
+///   auto result = agent.run_loop_async(messages, nullptr, nullptr, cancel);
+///   ...
+///   cancel.cancel(); // result.get() throws agent_cpp::CancelledError
+class CancellationToken
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    CancellationToken() = default;
+
+    /// @brief Create a token that can be cancelled
+    static CancellationToken create() { return CancellationToken(nullptr); }
+
+    /// @brief Create a token that cancels itself after timeout
+    static CancellationToken with_timeout(Clock::duration timeout)
+    {
+        return create().with_deadline(Clock::now() + timeout);
+    }
+
+    /// @brief Derive a token cancelled with this one or at deadline,
+    /// whichever comes first
+    [[nodiscard]] CancellationToken with_deadline(
+      Clock::time_point deadline) const
+    {
+        CancellationToken child(state_);
+        child.state_->deadline = deadline;
+        child.state_->has_deadline = true;
+        return child;
+    }
+
+    /// @brief Request cancellation, no-op for a default constructed token
+    void cancel()
+    {
+        if (state_) {
+            state_->cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    [[nodiscard]] bool is_cancelled() const
+    {
+        for (const State* state = state_.get(); state != nullptr;
+             state = state->parent.get()) {
+            if (state->cancelled.load(std::memory_order_relaxed) ||
+                (state->has_deadline && Clock::now() >= state->deadline)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// @brief Throw CancelledError if the token was cancelled or its
+    /// deadline passed
+    void throw_if_cancelled() const
+    {
+        for (const State* state = state_.get(); state != nullptr;
+             state = state->parent.get()) {
+            if (state->cancelled.load(std::memory_order_relaxed)) {
+                throw CancelledError("turn was cancelled");
+            }
+            if (state->has_deadline && Clock::now() >= state->deadline) {
+                throw CancelledError("deadline exceeded");
+            }
+        }
+    }
+
+  private:
+    struct State
+    {
+        std::atomic<bool> cancelled{ false };
+        bool has_deadline = false;
+        Clock::time_point deadline;
+        std::shared_ptr<State> parent;
+    };
+
+    explicit CancellationToken(std::shared_ptr<State> parent)
+      : state_(std::make_shared<State>())
+    {
+        state_->parent = std::move(parent);
+    }
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace agent_cpp
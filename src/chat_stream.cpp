@@ -0,0 +1,99 @@
+#include "chat_stream.h"
+
+namespace agent_cpp {
+
+ChatStreamParser::ChatStreamParser(const common_chat_syntax& syntax)
+  : syntax_(syntax)
+{
+}
+
+void
+ChatStreamParser::complete(const common_chat_tool_call& tool_call,
+                           size_t index,
+                           std::vector<GenerationEvent>& events)
+{
+    GenerationEvent event{ GenerationEventType::ToolCallArgumentsComplete,
+                           tool_call.arguments };
+    event.tool_call_index = index;
+    event.tool_name = tool_call.name;
+    event.tool_call_id = tool_call.id;
+    events.push_back(std::move(event));
+    n_complete_ = index + 1;
+}
+
+void
+ChatStreamParser::push(std::string_view chunk,
+                       std::vector<GenerationEvent>& events)
+{
+    text_.append(chunk.data(), chunk.size());
+
+    common_chat_msg current;
+    try {
+        current = common_chat_parse(text_, true, syntax_);
+    } catch (const std::exception&) {
+        // Not parseable yet, try again with the next chunk
+        return;
+    }
+
+    for (const auto& diff :
+         common_chat_msg_diff::compute_diffs(previous_, current)) {
+        if (!diff.reasoning_content_delta.empty()) {
+            events.push_back({ GenerationEventType::ReasoningDelta,
+                               diff.reasoning_content_delta });
+        }
+        if (!diff.content_delta.empty()) {
+            events.push_back(
+              { GenerationEventType::ContentDelta, diff.content_delta });
+        }
+        if (diff.tool_call_index == std::string::npos) {
+            continue;
+        }
+
+        const size_t index = diff.tool_call_index;
+        const auto& tool_call = current.tool_calls[index];
+
+        // A new call closes every call before it
+        for (size_t i = n_complete_; i < index; i++) {
+            complete(current.tool_calls[i], i, events);
+        }
+
+        GenerationEvent event{ GenerationEventType::ToolCallStarted, "" };
+        event.tool_call_index = index;
+        event.tool_name = tool_call.name;
+        event.tool_call_id = tool_call.id;
+        if (!diff.tool_call_delta.name.empty()) {
+            events.push_back(event);
+        }
+        if (!diff.tool_call_delta.arguments.empty()) {
+            event.type = GenerationEventType::ToolCallArgumentsDelta;
+            event.text = diff.tool_call_delta.arguments;
+            events.push_back(std::move(event));
+        }
+    }
+
+    // Only text that can close a call is worth a strict parse
+    if (current.tool_calls.size() > n_complete_ &&
+        chunk.find_first_of("}]>") != std::string::npos) {
+        try {
+            auto strict = common_chat_parse(text_, false, syntax_);
+            for (size_t i = n_complete_; i < strict.tool_calls.size(); i++) {
+                complete(strict.tool_calls[i], i, events);
+            }
+        } catch (const std::exception&) {
+            // Still open
+        }
+    }
+
+    previous_ = std::move(current);
+}
+
+void
+ChatStreamParser::finish(const common_chat_msg& final_msg,
+                         std::vector<GenerationEvent>& events)
+{
+    for (size_t i = n_complete_; i < final_msg.tool_calls.size(); i++) {
+        complete(final_msg.tool_calls[i], i, events);
+    }
+}
+
+} // namespace agent_cpp
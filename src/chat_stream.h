@@ -0,0 +1,65 @@
+#pragma once
+
+#include "chat.h"
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace agent_cpp {
+
+enum class GenerationEventType
+{
+    ContentDelta,   // text holds new content
+    ReasoningDelta, // text holds new reasoning content
+    ToolCallStarted,
+    ToolCallArgumentsDelta,   // text holds new argument text
+    ToolCallArgumentsComplete // text holds the full arguments
+};
+
+// Structured view of a response while it streams
+struct GenerationEvent
+{
+    GenerationEventType type;
+    std::string text;
+    // Set for tool call events
+    size_t tool_call_index = 0;
+    std::string tool_name;
+    std::string tool_call_id;
+};
+
+// Callback for structured streaming events
+// Return false to stop generating; the response so far is parsed as usual
+using GenerationEventCallback = std::function<bool(const GenerationEvent&)>;
+
+/// @brief Turns streamed text into GenerationEvents
+///
+/// The text so far is parsed as a partial message after every chunk and
+/// compared with the previous parse. A tool call counts as complete once a
+/// strict parse of the text contains it, i.e. once the model closed it.
+class ChatStreamParser
+{
+  public:
+    explicit ChatStreamParser(const common_chat_syntax& syntax);
+
+    /// @brief Append a chunk of generated text
+    /// @param events Receives the events of this chunk
+    void push(std::string_view chunk, std::vector<GenerationEvent>& events);
+
+    /// @brief Complete the tool calls of the final message not reported yet
+    void finish(const common_chat_msg& final_msg,
+                std::vector<GenerationEvent>& events);
+
+  private:
+    void complete(const common_chat_tool_call& tool_call,
+                  size_t index,
+                  std::vector<GenerationEvent>& events);
+
+    common_chat_syntax syntax_;
+    std::string text_;
+    common_chat_msg previous_;
+    size_t n_complete_ = 0; // Tool calls reported complete
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,135 @@
+#include "compute_threadpool.h"
+#include "error.h"
+#include "ggml-cpu.h"
+#include <string>
+
+namespace agent_cpp {
+
+namespace {
+
+using ThreadpoolNew = decltype(ggml_threadpool_new);
+using ThreadpoolFree = decltype(ggml_threadpool_free);
+
+// The CPU backend may be a dynamically loaded module, so its threadpool
+// functions are looked up through the backend registry
+void*
+cpu_backend_proc(const char* name)
+{
+    ggml_backend_dev_t cpu =
+      ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (cpu == nullptr) {
+        ggml_backend_load_all();
+        cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    }
+    if (cpu == nullptr) {
+        throw ModelError("no CPU backend available for a threadpool");
+    }
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu);
+    void* proc = ggml_backend_reg_get_proc_address(reg, name);
+    if (proc == nullptr) {
+        throw ModelError(std::string("CPU backend lacks ") + name);
+    }
+    return proc;
+}
+
+ggml_threadpool_t
+new_threadpool(int n_threads,
+               const std::vector<int>& cpus,
+               const ComputeThreadpoolConfig& config)
+{
+    auto* threadpool_new =
+      reinterpret_cast<ThreadpoolNew*>(cpu_backend_proc("ggml_threadpool_new"));
+
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    if (!cpus.empty()) {
+        std::fill(std::begin(params.cpumask), std::end(params.cpumask), false);
+        for (int cpu : cpus) {
+            if (cpu < 0 || cpu >= GGML_MAX_N_THREADS) {
+                throw ModelError("cpu " + std::to_string(cpu) +
+                                 " is out of range");
+            }
+            params.cpumask[cpu] = true;
+        }
+    }
+    params.strict_cpu = config.strict_cpu;
+    params.poll = config.poll;
+    params.prio = config.priority;
+
+    ggml_threadpool_t threadpool = threadpool_new(&params);
+    if (threadpool == nullptr) {
+        throw ModelError("failed to create a threadpool of " +
+                         std::to_string(n_threads) + " threads");
+    }
+    return threadpool;
+}
+
+} // anonymous namespace
+
+std::shared_ptr<ComputeThreadpool>
+ComputeThreadpool::create(const ComputeThreadpoolConfig& config)
+{
+    std::shared_ptr<ComputeThreadpool> pool(new ComputeThreadpool());
+    pool->free_ = reinterpret_cast<ThreadpoolFree*>(
+      cpu_backend_proc("ggml_threadpool_free"));
+
+    pool->n_threads_ = std::max(1, config.n_threads);
+    pool->threadpool_ = new_threadpool(pool->n_threads_, config.cpus, config);
+
+    pool->n_threads_batch_ = pool->n_threads_;
+    if (config.n_threads_batch > 0) {
+        pool->n_threads_batch_ = config.n_threads_batch;
+        pool->threadpool_batch_ = new_threadpool(
+          pool->n_threads_batch_,
+          config.cpus_batch.empty() ? config.cpus : config.cpus_batch,
+          config);
+    }
+    return pool;
+}
+
+std::vector<std::shared_ptr<ComputeThreadpool>>
+ComputeThreadpool::split(const ComputeThreadpoolConfig& config, size_t n_parts)
+{
+    if (n_parts == 0) {
+        throw ModelError("a threadpool can't be split into 0 parts");
+    }
+
+    std::vector<int> cpus = config.cpus;
+    if (cpus.empty()) {
+        const int n_cpus =
+          static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    std::vector<std::shared_ptr<ComputeThreadpool>> pools;
+    pools.reserve(n_parts);
+    const size_t n_cpus = cpus.size();
+    for (size_t i = 0; i < n_parts; i++) {
+        const size_t begin = i * n_cpus / n_parts;
+        const size_t end = std::max(begin + 1, (i + 1) * n_cpus / n_parts);
+
+        ComputeThreadpoolConfig part = config;
+        part.cpus.assign(cpus.begin() + begin, cpus.begin() + end);
+        part.cpus_batch.clear();
+        part.n_threads = static_cast<int>(end - begin);
+        part.n_threads_batch = 0;
+        pools.push_back(create(part));
+    }
+    return pools;
+}
+
+ComputeThreadpool::~ComputeThreadpool()
+{
+    if (free_ == nullptr) {
+        return;
+    }
+    if (threadpool_batch_ != nullptr) {
+        free_(threadpool_batch_);
+    }
+    if (threadpool_ != nullptr) {
+        free_(threadpool_);
+    }
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "ggml.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace agent_cpp {
+
+struct ComputeThreadpoolConfig
+{
+    // Threads computing decode steps
+    int n_threads =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    // Threads processing prompt batches, 0 uses the decode threads for them
+    int n_threads_batch = 0;
+    // CPUs the decode threads may run on, empty allows any. Listing the CPUs
+    // of one NUMA node keeps the threads next to their memory.
+    std::vector<int> cpus;
+    // CPUs the prompt threads may run on, empty uses cpus
+    std::vector<int> cpus_batch;
+    // Pin each thread to its own CPU of the list instead of letting all of
+    // them run on any listed CPU
+    bool strict_cpu = false;
+    // How eagerly idle threads spin for the next graph, 0 to 100. Higher
+    // lowers decode latency at the cost of busy CPUs between steps.
+    uint32_t poll = 50;
+    ggml_sched_priority priority = GGML_SCHED_PRIO_NORMAL;
+};
+
+/// @brief ggml worker threads that several contexts compute on
+///
+/// By default every llama_context starts its own workers for all but one
+/// core, so a few models decoding at once oversubscribe the CPU. Contexts
+/// given the same pool through ModelConfig::threadpool share one set of
+/// workers instead and take turns computing. To let sessions compute at the
+/// same time without contending, give each a pool of its own from split().
+///
+/// Usage:
+///   auto pool = agent_cpp::ComputeThreadpool::create();
+///   agent_cpp::ModelConfig config;
+///   config.threadpool = pool;
+///   auto a = agent_cpp::Model::create_with_weights(weights, config);
+///   auto b = agent_cpp::Model::create_with_weights(weights, config);
+class ComputeThreadpool
+{
+  public:
+    /// @throws agent_cpp::ModelError if the CPU backend can't create the
+    /// threads
+    static std::shared_ptr<ComputeThreadpool> create(
+      const ComputeThreadpoolConfig& config = ComputeThreadpoolConfig{});
+
+    /// @brief Pools on disjoint CPUs, one per concurrent session
+    /// The CPUs of config (all of them if none are listed) are divided
+    /// evenly, each pool gets one thread per CPU. Parts share CPUs only when
+    /// there are more parts than CPUs.
+    /// @throws agent_cpp::ModelError if n_parts is 0 or a pool can't be
+    /// created
+    static std::vector<std::shared_ptr<ComputeThreadpool>> split(
+      const ComputeThreadpoolConfig& config,
+      size_t n_parts);
+
+    ~ComputeThreadpool();
+
+    ComputeThreadpool(const ComputeThreadpool&) = delete;
+    ComputeThreadpool& operator=(const ComputeThreadpool&) = delete;
+
+    [[nodiscard]] ggml_threadpool_t get() const { return threadpool_; }
+    [[nodiscard]] ggml_threadpool_t get_batch() const
+    {
+        return threadpool_batch_ != nullptr ? threadpool_batch_ : threadpool_;
+    }
+    [[nodiscard]] int n_threads() const { return n_threads_; }
+    [[nodiscard]] int n_threads_batch() const { return n_threads_batch_; }
+
+    /// @brief Held around each llama_decode of an attached context
+    /// A ggml threadpool computes one graph at a time
+    std::unique_lock<std::mutex> acquire()
+    {
+        return std::unique_lock<std::mutex>(mutex_);
+    }
+
+  private:
+    ComputeThreadpool() = default;
+
+    ggml_threadpool_t threadpool_ = nullptr;
+    ggml_threadpool_t threadpool_batch_ = nullptr;
+    int n_threads_ = 0;
+    int n_threads_batch_ = 0;
+    std::mutex mutex_;
+    void (*free_)(ggml_threadpool_t) = nullptr;
+};
+
+} // namespace agent_cpp
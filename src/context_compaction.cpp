@@ -0,0 +1,243 @@
+#include "context_compaction.h"
+#include <algorithm>
+#include <string>
+
+namespace agent_cpp {
+
+namespace {
+
+// Render messages without the generation prompt, throws if the template
+// rejects them
+std::string
+render(const common_chat_templates* templates,
+       const std::vector<common_chat_msg>& messages)
+{
+    common_chat_templates_inputs inputs;
+    inputs.messages = messages;
+    inputs.tool_choice = COMMON_CHAT_TOOL_CHOICE_AUTO;
+    inputs.add_generation_prompt = false;
+    inputs.enable_thinking = false;
+
+    return common_chat_templates_apply(templates, inputs).prompt;
+}
+
+int
+count(const llama_vocab* vocab, const std::string& text, bool add_special)
+{
+    // Without an output buffer llama_tokenize returns minus the count
+    return -llama_tokenize(
+      vocab, text.c_str(), text.size(), nullptr, 0, add_special, true);
+}
+
+bool
+is_turn_start(const common_chat_msg& msg)
+{
+    // Tool responses belong to the assistant message before them
+    return msg.role != "tool";
+}
+
+// Leading prompt size at a turn boundary
+struct Boundary
+{
+    size_t index = 0;
+    int tokens = 0;
+};
+
+} // anonymous namespace
+
+ContextCompactionCallback::ContextCompactionCallback(
+  std::shared_ptr<Model> model,
+  ContextCompactionConfig config)
+  : model_(std::move(model))
+  , config_(std::move(config))
+{
+    max_tokens_ = config_.max_tokens;
+    if (max_tokens_ <= 0) {
+        max_tokens_ =
+          static_cast<int>(llama_n_ctx(model_->get_context()) / 4 * 3);
+    }
+    target_tokens_ = config_.target_tokens;
+    if (target_tokens_ <= 0 || target_tokens_ > max_tokens_) {
+        target_tokens_ = max_tokens_ / 2;
+    }
+}
+
+int
+ContextCompactionCallback::count_tokens(
+  const std::vector<common_chat_msg>& messages)
+{
+    std::vector<llama_token> tokens;
+    prompt_builder_.build(model_->get_templates(),
+                          model_->get_vocab(),
+                          messages,
+                          {},
+                          true,
+                          tokens);
+    last_count_ = static_cast<int>(tokens.size());
+    return last_count_ + overhead_;
+}
+
+void
+ContextCompactionCallback::before_llm_call(
+  std::vector<common_chat_msg>& messages)
+{
+    compact(messages);
+}
+
+void
+ContextCompactionCallback::on_generation_stats(const GenerationStats& stats)
+{
+    if (stats.prompt_tokens > 0 && last_count_ > 0) {
+        overhead_ = std::max(0, stats.prompt_tokens - last_count_);
+    }
+}
+
+std::vector<CompactionPlan>
+ContextCompactionCallback::plan(const std::vector<common_chat_msg>& messages)
+{
+    return make_plans(messages, count_tokens(messages));
+}
+
+std::vector<CompactionPlan>
+ContextCompactionCallback::make_plans(
+  const std::vector<common_chat_msg>& messages,
+  int total)
+{
+    const int need = total - target_tokens_;
+    if (need <= 0) {
+        return {};
+    }
+
+    // Only whole turns between the protected head and tail can go
+    size_t head = std::min(config_.keep_first, messages.size());
+    while (head < messages.size() && !is_turn_start(messages[head])) {
+        head++;
+    }
+    size_t tail =
+      messages.size() - std::min(config_.keep_last, messages.size());
+    while (tail > head && !is_turn_start(messages[tail])) {
+        tail--;
+    }
+    if (head >= tail) {
+        return {};
+    }
+
+    // Prompt size up to each boundary. Each render extends the previous one,
+    // so only the new text is tokenized.
+    const common_chat_templates* templates = model_->get_templates();
+    const llama_vocab* vocab = model_->get_vocab();
+    std::vector<Boundary> boundaries;
+    std::string previous;
+    int previous_tokens = 0;
+    for (size_t i = head; i <= tail; i++) {
+        if (i < tail && !is_turn_start(messages[i])) {
+            continue;
+        }
+        if (i == 0) {
+            boundaries.push_back({ 0, overhead_ });
+            continue;
+        }
+
+        std::string text;
+        try {
+            text = render(templates,
+                          std::vector<common_chat_msg>(
+                            messages.begin(),
+                            messages.begin() + static_cast<std::ptrdiff_t>(i)));
+        } catch (const std::exception&) {
+            // Some templates reject a conversation ending here
+            continue;
+        }
+        int tokens = 0;
+        if (!previous.empty() && text.size() >= previous.size() &&
+            text.compare(0, previous.size(), previous) == 0) {
+            const std::string delta = text.substr(previous.size());
+            tokens = previous_tokens + count(vocab, delta, false);
+        } else {
+            tokens = count(vocab, text, true);
+        }
+        boundaries.push_back({ i, tokens + overhead_ });
+        previous = std::move(text);
+        previous_tokens = tokens;
+    }
+    if (boundaries.size() < 2) {
+        return {};
+    }
+
+    const int cached = static_cast<int>(model_->get_cached_tokens().size());
+    auto make_plan = [&](const Boundary& from, const Boundary& to) {
+        CompactionPlan plan;
+        plan.first = from.index;
+        plan.count = to.index - from.index;
+        plan.tokens_before = total;
+        plan.tokens_after = total - (to.tokens - from.tokens);
+        plan.reused_tokens = std::min(from.tokens, cached);
+        plan.prefill_tokens = plan.tokens_after - plan.reused_tokens;
+        return plan;
+    };
+
+    // For each start, the shortest span that frees enough. A later start
+    // frees less with the same end, so the end only moves forward.
+    std::vector<CompactionPlan> plans;
+    size_t end = 1;
+    for (size_t start = 0; start + 1 < boundaries.size(); start++) {
+        end = std::max(end, start + 1);
+        while (end < boundaries.size() &&
+               boundaries[end].tokens - boundaries[start].tokens < need) {
+            end++;
+        }
+        if (end == boundaries.size()) {
+            break;
+        }
+        plans.push_back(make_plan(boundaries[start], boundaries[end]));
+    }
+    if (plans.empty()) {
+        // Nothing gets down to the target, free as much as possible
+        plans.push_back(make_plan(boundaries.front(), boundaries.back()));
+    }
+
+    if (config_.minimize_prefill) {
+        std::stable_sort(plans.begin(),
+                         plans.end(),
+                         [](const CompactionPlan& a, const CompactionPlan& b) {
+                             return a.prefill_tokens < b.prefill_tokens;
+                         });
+    }
+    return plans;
+}
+
+bool
+ContextCompactionCallback::compact(std::vector<common_chat_msg>& messages)
+{
+    const int total = count_tokens(messages);
+    if (total <= max_tokens_) {
+        return false;
+    }
+    auto plans = make_plans(messages, total);
+    if (plans.empty()) {
+        return false;
+    }
+
+    CompactionReport report;
+    report.applied = plans.front();
+    const auto first =
+      messages.begin() + static_cast<std::ptrdiff_t>(report.applied.first);
+    const auto last = first + static_cast<std::ptrdiff_t>(report.applied.count);
+    std::vector<common_chat_msg> removed(first, last);
+    const auto position = messages.erase(first, last);
+    if (config_.summarize) {
+        messages.insert(position, config_.summarize(removed));
+        report.summarized = true;
+    }
+
+    report.applied.tokens_after = count_tokens(messages);
+    report.applied.prefill_tokens =
+      report.applied.tokens_after - report.applied.reused_tokens;
+    report.candidates = std::move(plans);
+    if (config_.on_compaction) {
+        config_.on_compaction(report);
+    }
+    return true;
+}
+
+} // namespace agent_cpp
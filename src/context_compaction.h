@@ -0,0 +1,133 @@
+#pragma once
+
+#include "callbacks.h"
+#include "chat.h"
+#include "model.h"
+#include "prompt_builder.h"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief One way of bringing the conversation back under budget
+///
+/// Token counts include the tool definitions and the generation prompt.
+struct CompactionPlan
+{
+    // Messages [first, first + count) are removed
+    size_t first = 0;
+    size_t count = 0;
+    int tokens_before = 0;
+    int tokens_after = 0;
+    // Leading prompt tokens still valid in the KV cache afterwards
+    int reused_tokens = 0;
+    // Tokens the next call has to prefill again, tokens_after - reused_tokens
+    int prefill_tokens = 0;
+};
+
+/// @brief What one compaction did
+struct CompactionReport
+{
+    // The plan applied, with the exact token counts of the result
+    CompactionPlan applied;
+    // Every plan that was considered, applied one included, with estimates
+    std::vector<CompactionPlan> candidates;
+    // Whether the removed messages were replaced by a summary
+    bool summarized = false;
+};
+
+struct ContextCompactionConfig
+{
+    // Prompt size in tokens that triggers compaction. 0 uses 3/4 of the
+    // model's context.
+    int max_tokens = 0;
+    // Size compaction brings the prompt down to. Keeping it well below
+    // max_tokens makes compactions, and the prefill each one costs, rare.
+    // 0 uses half of max_tokens.
+    int target_tokens = 0;
+    // Leading messages never removed, e.g. the system prompt and the task
+    size_t keep_first = 2;
+    // Trailing messages never removed, e.g. the latest exchanges
+    size_t keep_last = 6;
+    // Remove the span that keeps the longest prefix of the KV cache valid.
+    // When false the oldest messages are removed, which keeps recent context
+    // but prefills nearly the whole conversation again.
+    bool minimize_prefill = true;
+    // Replaces the removed messages with the message it returns, e.g. a
+    // summary written by another model. Without it they are dropped.
+    std::function<common_chat_msg(const std::vector<common_chat_msg>&)>
+      summarize;
+    // Called after every compaction
+    std::function<void(const CompactionReport&)> on_compaction;
+};
+
+/// @brief Keeps the conversation within a token budget while preserving
+/// prefix reuse
+///
+/// Removing messages invalidates the KV cache from the first removed one
+/// on, and whatever follows has to be prefilled again. Trimming a few of the
+/// oldest messages on every call therefore re-prefills almost the whole
+/// conversation each time. This callback instead lets the prompt grow to
+/// max_tokens, then removes one contiguous span of whole turns, large enough
+/// to get down to target_tokens, and placed where the fewest tokens have to
+/// be prefilled again. A tool response is never separated from the
+/// assistant message that called it.
+///
+/// Sizes are counted exactly by rendering the chat template and tokenizing,
+/// incrementally as the conversation grows. The size of the tool
+/// definitions, which a callback doesn't see, is taken from the prompt size
+/// the model reports after each call.
+///
+/// Usage:
+///   agent_cpp::ContextCompactionConfig config;
+///   config.max_tokens = 6144;
+///   callbacks.push_back(
+///     std::make_unique<agent_cpp::ContextCompactionCallback>(model, config));
+class ContextCompactionCallback : public Callback
+{
+  public:
+    explicit ContextCompactionCallback(
+      std::shared_ptr<Model> model,
+      ContextCompactionConfig config = ContextCompactionConfig{});
+
+    void before_llm_call(std::vector<common_chat_msg>& messages) override;
+    void on_generation_stats(const GenerationStats& stats) override;
+
+    /// @brief Prompt size of messages in tokens, tool definitions included
+    /// once a call was made
+    int count_tokens(const std::vector<common_chat_msg>& messages);
+
+    /// @brief Every way of compacting messages down to target_tokens, the
+    /// one compact() would apply first. Empty if they are within
+    /// target_tokens or nothing can be removed.
+    std::vector<CompactionPlan> plan(
+      const std::vector<common_chat_msg>& messages);
+
+    /// @brief Compact messages if they exceed max_tokens
+    /// @return false if they were within budget or nothing could be removed
+    bool compact(std::vector<common_chat_msg>& messages);
+
+    [[nodiscard]] int max_tokens() const { return max_tokens_; }
+    [[nodiscard]] int target_tokens() const { return target_tokens_; }
+
+  private:
+    // plan() for messages already counted at total tokens
+    std::vector<CompactionPlan> make_plans(
+      const std::vector<common_chat_msg>& messages,
+      int total);
+
+    std::shared_ptr<Model> model_;
+    ContextCompactionConfig config_;
+    int max_tokens_ = 0;
+    int target_tokens_ = 0;
+    PromptBuilder prompt_builder_;
+    // Tokens the model's prompt has beyond the rendered messages, learned
+    // from its stats
+    int overhead_ = 0;
+    // Size of the messages last counted, without overhead
+    int last_count_ = 0;
+};
+
+} // namespace agent_cpp
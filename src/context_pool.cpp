@@ -0,0 +1,112 @@
+#include "context_pool.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+std::shared_ptr<ContextPool>
+ContextPool::create(std::shared_ptr<ModelWeights> weights,
+                    ContextPoolConfig config)
+{
+    std::shared_ptr<ContextPool> pool(new ContextPool());
+    pool->weights_ = std::move(weights);
+    pool->config_ = std::move(config);
+
+    pool->idle_.reserve(std::max(pool->config_.n_initial,
+                                 pool->config_.max_idle));
+    for (size_t i = 0; i < pool->config_.n_initial; i++) {
+        auto model =
+          Model::create_with_weights(pool->weights_, pool->config_.model);
+        if (!pool->config_.prefix.empty()) {
+            model->prefill(pool->config_.prefix);
+        }
+        pool->idle_.push_back(std::move(model));
+    }
+    return pool;
+}
+
+std::shared_ptr<Model>
+ContextPool::lease()
+{
+    std::shared_ptr<Model> model;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            model = std::move(idle_.back());
+            idle_.pop_back();
+        }
+        n_leased_++;
+    }
+
+    try {
+        if (!model) {
+            model = Model::create_with_weights(weights_, config_.model);
+        }
+        // Only decodes what a context returned mid-prefix is missing
+        const auto& cached = model->get_cached_tokens();
+        if (cached.size() < config_.prefix.size()) {
+            model->prefill(config_.prefix);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        n_leased_--;
+        throw;
+    }
+
+    // The deleter holds the model, the pool may be gone by the time it runs
+    std::weak_ptr<ContextPool> pool = weak_from_this();
+    Model* raw = model.get();
+    return std::shared_ptr<Model>(raw, [pool, model](Model*) mutable {
+        if (auto locked = pool.lock()) {
+            locked->give_back(std::move(model));
+        }
+    });
+}
+
+void
+ContextPool::give_back(std::shared_ptr<Model> model)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        n_leased_--;
+        if (idle_.size() >= config_.max_idle) {
+            return;
+        }
+    }
+
+    // Keep the part of the prefix the cache still holds
+    const auto& cached = model->get_cached_tokens();
+    const auto& prefix = config_.prefix;
+    const size_t n = std::min(cached.size(), prefix.size());
+    const size_t n_match = static_cast<size_t>(
+      std::mismatch(prefix.begin(), prefix.begin() + n, cached.begin()).first -
+      prefix.begin());
+
+    try {
+        model->reset(n_match);
+    } catch (...) {
+        // A context that can't be reset is freed instead, this runs in a
+        // deleter
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.size() < config_.max_idle) {
+        idle_.push_back(std::move(model));
+    }
+}
+
+size_t
+ContextPool::idle() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+}
+
+size_t
+ContextPool::leased() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return n_leased_;
+}
+
+} // namespace agent_cpp
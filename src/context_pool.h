@@ -0,0 +1,73 @@
+#pragma once
+
+#include "llama.h"
+#include "model.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace agent_cpp {
+
+struct ContextPoolConfig
+{
+    // Configuration of every context in the pool
+    ModelConfig model;
+    // Contexts created up front by ContextPool::create
+    size_t n_initial = 0;
+    // Returned contexts kept for reuse, ones returned beyond it are freed
+    size_t max_idle = 8;
+    // Tokens every leased context starts with, e.g. the output of
+    // Agent::build_prompt_tokens(). A returned context only drops what
+    // follows them, so the next lease doesn't prefill them again.
+    std::vector<llama_token> prefix;
+};
+
+/// @brief Reuses llama_contexts between short-lived sessions
+///
+/// Creating a Model allocates a context and its KV buffer, which for
+/// thousands of short sessions costs latency and fragments device memory.
+/// lease() instead hands out a context from the pool, creating one only
+/// when none is idle. Dropping the last copy of a leased model resets it
+/// (KV cache, sampler, stats) and gives it back.
+///
+/// Usage:
+///   agent_cpp::ContextPoolConfig config;
+///   config.prefix = prompt_tokens;
+///   auto pool = agent_cpp::ContextPool::create(weights, config);
+///   agent_cpp::Agent agent(pool->lease(), std::move(tools));
+class ContextPool : public std::enable_shared_from_this<ContextPool>
+{
+  public:
+    /// @throws agent_cpp::ModelError if an initial context can't be created
+    static std::shared_ptr<ContextPool> create(
+      std::shared_ptr<ModelWeights> weights,
+      ContextPoolConfig config = ContextPoolConfig{});
+
+    ContextPool(const ContextPool&) = delete;
+    ContextPool& operator=(const ContextPool&) = delete;
+
+    /// @brief Take a context holding the prefix and nothing else
+    /// @throws agent_cpp::ModelError if a new context can't be created
+    std::shared_ptr<Model> lease();
+
+    /// @brief Contexts waiting to be leased
+    [[nodiscard]] size_t idle() const;
+
+    /// @brief Contexts currently leased
+    [[nodiscard]] size_t leased() const;
+
+  private:
+    ContextPool() = default;
+
+    // Reset a model dropped by its last user and keep it if there is room
+    void give_back(std::shared_ptr<Model> model);
+
+    std::shared_ptr<ModelWeights> weights_;
+    ContextPoolConfig config_;
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<Model>> idle_;
+    size_t n_leased_ = 0;
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,197 @@
+#include "embedder.h"
+#include "common.h"
+#include "error.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+std::shared_ptr<Embedder>
+Embedder::create(std::shared_ptr<ModelWeights> weights,
+                 const EmbedderConfig& config)
+{
+    if (config.n_batch < 1 || config.n_seq_max < 1) {
+        throw ModelError("n_batch and n_seq_max must be at least 1");
+    }
+
+    std::shared_ptr<Embedder> embedder(new Embedder());
+    embedder->weights_ = std::move(weights);
+    embedder->config_ = config;
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = config.pooling;
+    // Non-causal models attend over a whole sequence at once, so every
+    // batch has to fit one physical batch
+    ctx_params.n_ctx = config.n_batch;
+    ctx_params.n_batch = config.n_batch;
+    ctx_params.n_ubatch = config.n_batch;
+    ctx_params.n_seq_max = config.n_seq_max;
+    ctx_params.n_threads = config.n_threads;
+    ctx_params.n_threads_batch = config.n_threads_batch;
+    if (config.threadpool) {
+        ctx_params.n_threads = config.threadpool->n_threads();
+        ctx_params.n_threads_batch = config.threadpool->n_threads_batch();
+    }
+    ctx_params.kv_unified = true;
+
+    embedder->ctx_ =
+      llama_init_from_model(embedder->weights_->get_model(), ctx_params);
+    if (embedder->ctx_ == nullptr) {
+        throw ModelError("failed to create embedding context");
+    }
+    if (config.threadpool) {
+        llama_attach_threadpool(embedder->ctx_,
+                                config.threadpool->get(),
+                                config.threadpool->get_batch());
+    }
+
+    const enum llama_pooling_type pooling = llama_pooling_type(embedder->ctx_);
+    if (pooling == LLAMA_POOLING_TYPE_NONE ||
+        pooling == LLAMA_POOLING_TYPE_RANK) {
+        throw ModelError("model doesn't pool one embedding per text, set "
+                         "EmbedderConfig::pooling");
+    }
+
+    embedder->n_batch_ = static_cast<int>(llama_n_batch(embedder->ctx_));
+    embedder->n_seq_max_ = static_cast<int>(llama_n_seq_max(embedder->ctx_));
+    embedder->n_embd_ = static_cast<size_t>(
+      llama_model_n_embd(embedder->weights_->get_model()));
+    embedder->batch_ = llama_batch_init(embedder->n_batch_, 0, 1);
+    return embedder;
+}
+
+Embedder::~Embedder()
+{
+    if (batch_.token != nullptr) {
+        llama_batch_free(batch_);
+    }
+    if (ctx_ != nullptr) {
+        llama_free(ctx_);
+    }
+}
+
+std::vector<size_t>
+plan_embedding_batches(const std::vector<size_t>& n_tokens,
+                       size_t n_batch,
+                       size_t n_seq_max)
+{
+    std::vector<size_t> firsts;
+    size_t batch_tokens = 0;
+    size_t batch_seqs = 0;
+    for (size_t i = 0; i < n_tokens.size(); i++) {
+        if (batch_seqs == 0 || batch_seqs == n_seq_max ||
+            batch_tokens + n_tokens[i] > n_batch) {
+            firsts.push_back(i);
+            batch_tokens = 0;
+            batch_seqs = 0;
+        }
+        batch_tokens += n_tokens[i];
+        batch_seqs++;
+    }
+    return firsts;
+}
+
+void
+write_embedding(const float* embd, float* row, size_t n_embd, bool normalize)
+{
+    const int norm = normalize ? 2 : -1; // Euclidean or none
+    common_embd_normalize(embd, row, static_cast<int>(n_embd), norm);
+}
+
+Embeddings
+Embedder::embed(const std::vector<std::string>& texts)
+{
+    Embeddings out;
+    out.n_embd = n_embd_;
+    out.data.assign(texts.size() * n_embd_, 0.0F);
+
+    const llama_vocab* vocab = weights_->get_vocab();
+    std::vector<std::vector<llama_token>> tokens;
+    std::vector<size_t> n_tokens;
+    tokens.reserve(texts.size());
+    n_tokens.reserve(texts.size());
+    for (const auto& text : texts) {
+        auto text_tokens = common_tokenize(vocab, text, true, false);
+        if (text_tokens.size() > static_cast<size_t>(n_batch_)) {
+            text_tokens.resize(n_batch_);
+        }
+        n_tokens.push_back(text_tokens.size());
+        tokens.push_back(std::move(text_tokens));
+    }
+
+    const std::vector<size_t> firsts =
+      plan_embedding_batches(n_tokens, n_batch_, n_seq_max_);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    common_batch_clear(batch_);
+    for (size_t b = 0; b < firsts.size(); b++) {
+        const size_t first = firsts[b];
+        const size_t end = b + 1 < firsts.size() ? firsts[b + 1] : texts.size();
+        for (size_t i = first; i < end; i++) {
+            // An empty text still takes its sequence, so rows stay in order
+            const auto seq = static_cast<llama_seq_id>(i - first);
+            for (size_t pos = 0; pos < tokens[i].size(); pos++) {
+                common_batch_add(batch_,
+                                 tokens[i][pos],
+                                 static_cast<llama_pos>(pos),
+                                 { seq },
+                                 true);
+            }
+        }
+        flush(static_cast<int>(end - first), first, out);
+    }
+    return out;
+}
+
+std::vector<float>
+Embedder::embed_one(const std::string& text)
+{
+    return embed(std::vector<std::string>{ text }).data;
+}
+
+void
+Embedder::flush(int n_seq, size_t first, Embeddings& out)
+{
+    if (batch_.n_tokens > 0) {
+        // Every batch starts from an empty cache, the sequences are reused
+        llama_memory_clear(llama_get_memory(ctx_), true);
+
+        std::unique_lock<std::mutex> compute;
+        if (config_.threadpool) {
+            compute = config_.threadpool->acquire();
+        }
+        const llama_model* model = weights_->get_model();
+        const int32_t status =
+          llama_model_has_encoder(model) && !llama_model_has_decoder(model)
+            ? llama_encode(ctx_, batch_)
+            : llama_decode(ctx_, batch_);
+        if (status != 0) {
+            common_batch_clear(batch_);
+            throw ModelError("failed to decode embedding batch");
+        }
+    }
+
+    std::vector<bool> has_tokens(n_seq, false);
+    for (int32_t i = 0; i < batch_.n_tokens; i++) {
+        has_tokens[batch_.seq_id[i][0]] = true;
+    }
+
+    for (int seq = 0; seq < n_seq; seq++) {
+        if (!has_tokens[seq]) {
+            continue;
+        }
+        const float* embd = llama_get_embeddings_seq(ctx_, seq);
+        if (embd == nullptr) {
+            common_batch_clear(batch_);
+            throw ModelError("no embedding for sequence " +
+                             std::to_string(seq));
+        }
+        write_embedding(embd,
+                        out.data.data() + (first + seq) * n_embd_,
+                        n_embd_,
+                        config_.normalize);
+    }
+    common_batch_clear(batch_);
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "compute_threadpool.h"
+#include "llama.h"
+#include "model.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace agent_cpp {
+
+struct EmbedderConfig
+{
+    // Tokens decoded at once, shared by every text of a batch. Longer texts
+    // are truncated to it.
+    int n_batch = 8192;
+    // Texts packed into one batch, each in a sequence of its own
+    int n_seq_max = 64;
+    int n_threads =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    int n_threads_batch =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    // Shared workers to compute on, see ModelConfig::threadpool
+    std::shared_ptr<ComputeThreadpool> threadpool;
+    // How token embeddings are pooled into one vector per text, unspecified
+    // uses the model's own
+    enum llama_pooling_type pooling = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    // Scale every vector to unit length, so a dot product is the cosine
+    // similarity
+    bool normalize = true;
+};
+
+/// @brief One embedding per input text, in one contiguous buffer
+struct Embeddings
+{
+    size_t n_embd = 0;
+    // Row-major, row i is the embedding of text i
+    std::vector<float> data;
+
+    [[nodiscard]] size_t size() const
+    {
+        return n_embd == 0 ? 0 : data.size() / n_embd;
+    }
+    [[nodiscard]] const float* operator[](size_t i) const
+    {
+        return data.data() + i * n_embd;
+    }
+};
+
+/// @brief Group texts into the batches Embedder::embed decodes
+///
+/// A batch holds at most n_seq_max texts and n_batch tokens, texts keep
+/// their order and an empty text still takes a sequence.
+/// @param n_tokens Tokens of each text, none longer than n_batch
+/// @return Index of the first text of every batch
+std::vector<size_t>
+plan_embedding_batches(const std::vector<size_t>& n_tokens,
+                       size_t n_batch,
+                       size_t n_seq_max);
+
+/// @brief Copy a pooled embedding into row, scaled to unit length if
+/// normalize is set. A zero vector stays zero.
+void
+write_embedding(const float* embd, float* row, size_t n_embd, bool normalize);
+
+/// @brief Computes text embeddings in process with an embedding model
+///
+/// Owns a pooling context on the given weights. embed() packs as many texts
+/// as fit into each llama_batch, one sequence per text, so a few decodes
+/// embed a whole document set. Thread safe, calls take turns on the
+/// context, so retrieval tools can share one embedder.
+///
+/// Usage:
+///   auto weights = agent_cpp::ModelWeights::create("embedding.gguf");
+///   auto embedder = agent_cpp::Embedder::create(weights);
+///   std::vector<std::string> notes = { "first note", "second note" };
+///   auto vectors = embedder->embed(notes);
+///   // vectors[0] and vectors[1] are unit length rows of vectors.n_embd
+class Embedder
+{
+  public:
+    /// @throws agent_cpp::ModelError if the context can't be created or the
+    /// model doesn't pool its output into one vector per text
+    static std::shared_ptr<Embedder> create(
+      std::shared_ptr<ModelWeights> weights,
+      const EmbedderConfig& config = EmbedderConfig{});
+
+    ~Embedder();
+
+    Embedder(const Embedder&) = delete;
+    Embedder& operator=(const Embedder&) = delete;
+
+    /// @brief Embed every text, row i of the result belongs to texts[i]
+    /// Texts without any token get a zero vector
+    /// @throws agent_cpp::ModelError if decoding fails
+    Embeddings embed(const std::vector<std::string>& texts);
+
+    /// @brief Embed a single text
+    std::vector<float> embed_one(const std::string& text);
+
+    /// @brief Length of each embedding
+    [[nodiscard]] size_t n_embd() const { return n_embd_; }
+
+  private:
+    Embedder() = default;
+
+    // Decode the sequences in batch_ and write their embeddings to out,
+    // starting at row first
+    void flush(int n_seq, size_t first, Embeddings& out);
+
+    std::shared_ptr<ModelWeights> weights_;
+    EmbedderConfig config_;
+    llama_context* ctx_ = nullptr;
+    llama_batch batch_{};
+    int n_batch_ = 0;
+    int n_seq_max_ = 0;
+    size_t n_embd_ = 0;
+    std::mutex mutex_;
+};
+
+} // namespace agent_cpp
@@ -82,6 +82,29 @@ class MCPError : public Error
     }
 };
 
+/// @brief A turn was stopped through a CancellationToken
+/// Thrown when the token is cancelled or its deadline passes. The KV cache
+/// and messages stay consistent, so the session can be used again.
+class CancelledError : public Error
+{
+  public:
+    explicit CancelledError(const std::string& message)
+      : Error("Cancelled: " + message)
+    {
+    }
+};
+
+/// @brief Error reading or writing persistent agent memory
+/// Thrown when a memory log or vector index can't be opened or written.
+class MemoryError : public Error
+{
+  public:
+    explicit MemoryError(const std::string& message)
+      : Error("Memory error: " + message)
+    {
+    }
+};
+
 /// @brief Exception to intentionally skip tool execution
 /// This is not an error condition - it's a control flow mechanism.
 /// Throw from before_tool_execution callback to skip a tool.
@@ -0,0 +1,29 @@
+#pragma once
+
+namespace agent_cpp {
+
+/// @brief Where the time of one model call went
+///
+/// Filled by Model::generate and generate_from_tokens, see
+/// Model::last_stats() and Callback::on_generation_stats(). Times are in
+/// milliseconds. render_ms and tokenize_ms stay 0 for generate_from_tokens,
+/// which gets its prompt already tokenized.
+struct GenerationStats
+{
+    double render_ms = 0;   // Applying the chat template
+    double tokenize_ms = 0; // Tokenizing the rendered prompt
+    int prompt_tokens = 0;
+    // Leading prompt tokens already in the KV cache, a low value on a long
+    // conversation means the prompt prefix cache missed
+    int reused_tokens = 0;
+    int prefilled_tokens = 0; // Prompt tokens decoded by this call
+    double prefill_ms = 0;
+    int decoded_tokens = 0; // Tokens generated
+    double decode_ms = 0;   // From the first generated token to the last
+    // From the start of the call to the first generated token. For sessions
+    // of a BatchedModel this includes waiting for the scheduler, and
+    // prefill_ms is the same.
+    double ttft_ms = 0;
+};
+
+} // namespace agent_cpp
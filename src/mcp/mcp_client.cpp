@@ -1,8 +1,10 @@
 #include "mcp/mcp_client.h"
 #include "error.h"
 #include "mcp/mcp_tool.h"
+#include "mcp/sse_parser.h"
 
-#include <sstream>
+#include <algorithm>
+#include <cstdint>
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include "httplib.h"
@@ -27,6 +29,34 @@ parse_url(const std::string& url, std::string& host, std::string& path)
     }
 }
 
+// Move a string field out of a JSON object, large results aren't copied
+std::string
+take_string(json& object, const char* key)
+{
+    auto it = object.find(key);
+    if (it == object.end() || !it->is_string()) {
+        return {};
+    }
+    return std::move(it->get_ref<std::string&>());
+}
+
+// Session id and Authorization headers of a request
+void
+add_request_headers(httplib::Headers& headers,
+                    const std::string& session_id,
+                    const MCPAuthProvider& auth_provider)
+{
+    if (!session_id.empty()) {
+        headers.emplace("Mcp-Session-Id", session_id);
+    }
+    if (auth_provider) {
+        std::string authorization = auth_provider();
+        if (!authorization.empty()) {
+            headers.emplace("Authorization", std::move(authorization));
+        }
+    }
+}
+
 } // anonymous namespace
 
 std::shared_ptr<MCPClient>
@@ -37,58 +67,126 @@ MCPClient::create(const std::string& url, const MCPClientConfig& config)
 
 MCPClient::MCPClient(const std::string& url, const MCPClientConfig& config)
   : url_(url)
+  , config_(config)
 {
-    std::string host;
-    parse_url(url, host, path_);
-
-    http_client_ = std::make_unique<httplib::Client>(host);
-    http_client_->set_connection_timeout(config.connection_timeout_sec);
-    http_client_->set_read_timeout(config.read_timeout_sec);
-    http_client_->set_write_timeout(config.write_timeout_sec);
+    parse_url(url, host_, path_);
+    config_.max_connections = std::max<size_t>(1, config_.max_connections);
 }
 
 MCPClient::~MCPClient()
 {
+    // Queued calls still use the client
+    call_pool_.reset();
     close();
 }
 
-json
-MCPClient::parse_response(const std::string& response)
+MCPClient::Connection::Connection(MCPClient& owner,
+                                  std::unique_ptr<httplib::Client> client)
+  : owner_(owner)
+  , client_(std::move(client))
 {
-    std::istringstream stream(response);
-    std::string line;
-    std::string data;
+}
 
-    while (std::getline(stream, line)) {
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
-        }
+MCPClient::Connection::~Connection()
+{
+    owner_.release_connection(std::move(client_));
+}
 
-        if (line.find("data:") == 0) {
-            data = line.substr(5);
-            size_t start = data.find_first_not_of(" \t");
-            if (start != std::string::npos) {
-                data = data.substr(start);
-            }
-        }
+MCPClient::Connection
+MCPClient::acquire_connection()
+{
+    std::unique_lock<std::mutex> lock(pool_mutex_);
+    pool_cv_.wait(lock, [this] {
+        return !idle_connections_.empty() ||
+               n_connections_ < config_.max_connections;
+    });
+
+    if (!idle_connections_.empty()) {
+        auto client = std::move(idle_connections_.back());
+        idle_connections_.pop_back();
+        return Connection(*this, std::move(client));
+    }
+
+    n_connections_++;
+    lock.unlock();
+
+    auto client = std::make_unique<httplib::Client>(host_);
+    client->set_connection_timeout(config_.connection_timeout_sec);
+    client->set_read_timeout(config_.read_timeout_sec);
+    client->set_write_timeout(config_.write_timeout_sec);
+    client->set_keep_alive(true);
+    return Connection(*this, std::move(client));
+}
+
+void
+MCPClient::release_connection(std::unique_ptr<httplib::Client> client)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        idle_connections_.push_back(std::move(client));
     }
+    pool_cv_.notify_one();
+}
 
-    if (data.empty()) {
-        return json::object();
+std::string
+MCPClient::get_session_id() const
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    return session_id_;
+}
+
+void
+MCPClient::set_notification_handler(MCPNotificationHandler handler)
+{
+    std::lock_guard<std::mutex> lock(handler_mutex_);
+    notification_handler_ = std::move(handler);
+}
+
+bool
+MCPClient::handle_message(json& message,
+                          int id,
+                          const MCPProgressCallback& on_progress,
+                          json& response)
+{
+    if (!message.is_object()) {
+        return false;
     }
 
-    try {
-        return json::parse(data);
-    } catch (const json::parse_error& e) {
-        throw MCPError("Failed to parse SSE data: " + std::string(e.what()));
+    if (message.contains("id") && message["id"] == id &&
+        (message.contains("result") || message.contains("error"))) {
+        response = std::move(message);
+        return true;
+    }
+
+    const std::string method = message.value("method", "");
+    if (on_progress && method == "notifications/progress") {
+        const json& params = message.value("params", json::object());
+        if (params.value("progressToken", json()) == id) {
+            MCPProgress progress;
+            progress.progress = params.value("progress", 0.0);
+            progress.total = params.value("total", 0.0);
+            progress.message = params.value("message", "");
+            on_progress(progress);
+            return false;
+        }
+    }
+
+    MCPNotificationHandler handler;
+    {
+        std::lock_guard<std::mutex> lock(handler_mutex_);
+        handler = notification_handler_;
+    }
+    if (handler) {
+        handler(message);
     }
+    return false;
 }
 
 json
-MCPClient::send_request(const std::string& method, const json& params)
+MCPClient::send_request(const std::string& method,
+                        const json& params,
+                        const MCPProgressCallback& on_progress)
 {
-    std::lock_guard<std::mutex> lock(send_mutex_);
-
     int id = ++request_id_;
 
     json request = { { "jsonrpc", "2.0" }, { "id", id }, { "method", method } };
@@ -97,47 +195,102 @@ MCPClient::send_request(const std::string& method, const json& params)
         request["params"] = params;
     }
 
-    std::string request_body = request.dump();
+    if (on_progress) {
+        request["params"]["_meta"]["progressToken"] = id;
+    }
 
-    httplib::Headers headers = { { "Content-Type", "application/json" },
-                                 { "Accept",
-                                   "application/json, text/event-stream" } };
+    httplib::Request req;
+    req.method = "POST";
+    req.path = path_;
+    req.body = request.dump();
+    req.headers = { { "Content-Type", "application/json" },
+                    { "Accept", "application/json, text/event-stream" } };
 
-    if (!session_id_.empty()) {
-        headers.emplace("Mcp-Session-Id", session_id_);
-    }
+    add_request_headers(req.headers, get_session_id(), config_.auth_provider);
 
-    auto res =
-      http_client_->Post(path_, headers, request_body, "application/json");
+    int status = 0;
+    bool is_event_stream = false;
+    std::string body;
+    json response;
+    bool has_response = false;
+    std::string parse_error;
 
-    if (!res) {
-        throw MCPError("HTTP request failed: " +
-                       httplib::to_string(res.error()));
-    }
+    SSEParser parser([&](SSEEvent& event) {
+        if (event.data.empty()) {
+            return true;
+        }
+        json message;
+        try {
+            message = json::parse(event.data);
+        } catch (const json::parse_error& e) {
+            parse_error = "Failed to parse SSE data: " + std::string(e.what());
+            return false;
+        }
+        has_response = handle_message(message, id, on_progress, response);
+        // Stop reading as soon as the response arrived
+        return !has_response;
+    });
+
+    req.response_handler = [&](const httplib::Response& res) {
+        status = res.status;
+
+        auto session_it = res.headers.find("Mcp-Session-Id");
+        if (session_it != res.headers.end()) {
+            std::lock_guard<std::mutex> lock(session_mutex_);
+            session_id_ = session_it->second;
+        }
 
-    if (res->status != 200) {
-        throw MCPError("HTTP error: " + std::to_string(res->status) + " " +
-                       res->body);
+        auto ct_it = res.headers.find("Content-Type");
+        is_event_stream =
+          status == 200 && ct_it != res.headers.end() &&
+          ct_it->second.find("text/event-stream") != std::string::npos;
+        return true;
+    };
+
+    req.content_receiver =
+      [&](const char* data, size_t size, uint64_t, uint64_t) {
+          if (is_event_stream) {
+              return parser.feed(data, size);
+          }
+          body.append(data, size);
+          return true;
+      };
+
+    // Each request holds its own connection for the round trip, so requests
+    // from different threads are in flight at the same time
+    httplib::Result res = [&] {
+        auto connection = acquire_connection();
+        return connection->send(req);
+    }();
+
+    if (!parse_error.empty()) {
+        throw MCPError(parse_error);
     }
 
-    auto session_it = res->headers.find("Mcp-Session-Id");
-    if (session_it != res->headers.end()) {
-        session_id_ = session_it->second;
+    // Reading stops early once the response is in, which httplib reports as
+    // a canceled request
+    if (!res && !(has_response && res.error() == httplib::Error::Canceled)) {
+        throw MCPError("HTTP request failed: " +
+                       httplib::to_string(res.error()));
     }
 
-    std::string content_type;
-    auto ct_it = res->headers.find("Content-Type");
-    if (ct_it != res->headers.end()) {
-        content_type = ct_it->second;
+    if (status != 200) {
+        throw MCPError("HTTP error: " + std::to_string(status) + " " + body);
     }
 
-    json response;
-
-    if (content_type.find("text/event-stream") != std::string::npos) {
-        response = parse_response(res->body);
+    if (is_event_stream) {
+        if (!has_response) {
+            parser.finish();
+            if (!parse_error.empty()) {
+                throw MCPError(parse_error);
+            }
+        }
+        if (!has_response) {
+            return json();
+        }
     } else {
         try {
-            response = json::parse(res->body);
+            response = json::parse(body);
         } catch (const json::parse_error& e) {
             throw MCPError("Failed to parse response: " +
                            std::string(e.what()));
@@ -151,14 +304,12 @@ MCPClient::send_request(const std::string& method, const json& params)
         throw MCPError("JSON-RPC error " + std::to_string(code) + ": " + msg);
     }
 
-    return response["result"];
+    return std::move(response["result"]);
 }
 
 void
 MCPClient::send_notification(const std::string& method, const json& params)
 {
-    std::lock_guard<std::mutex> lock(send_mutex_);
-
     json notification = { { "jsonrpc", "2.0" }, { "method", method } };
 
     if (!params.empty()) {
@@ -171,11 +322,10 @@ MCPClient::send_notification(const std::string& method, const json& params)
                                  { "Accept",
                                    "application/json, text/event-stream" } };
 
-    if (!session_id_.empty()) {
-        headers.emplace("Mcp-Session-Id", session_id_);
-    }
+    add_request_headers(headers, get_session_id(), config_.auth_provider);
 
-    http_client_->Post(path_, headers, request_body, "application/json");
+    auto connection = acquire_connection();
+    connection->Post(path_, headers, request_body, "application/json");
 }
 
 bool
@@ -195,8 +345,15 @@ MCPClient::initialize(const std::string& client_name,
     try {
         json result = send_request("initialize", params);
 
-        if (result.contains("protocolVersion")) {
-            protocol_version_ = result["protocolVersion"].get<std::string>();
+        {
+            std::lock_guard<std::mutex> lock(session_mutex_);
+            if (result.contains("protocolVersion")) {
+                protocol_version_ =
+                  result["protocolVersion"].get<std::string>();
+            }
+            const json& info = result.value("serverInfo", json::object());
+            server_name_ = info.value("name", "");
+            server_version_ = info.value("version", "");
         }
 
         if (result.contains("capabilities")) {
@@ -220,9 +377,42 @@ void
 MCPClient::close()
 {
     initialized_ = false;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        tools_cached_ = false;
+        tool_cache_.clear();
+    }
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    session_id_.clear();
+}
+
+void
+MCPClient::invalidate_tools()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex_);
     tools_cached_ = false;
     tool_cache_.clear();
-    session_id_.clear();
+}
+
+std::string
+MCPClient::server_name() const
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    return server_name_;
+}
+
+std::string
+MCPClient::server_version() const
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    return server_version_;
+}
+
+std::string
+MCPClient::protocol_version() const
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    return protocol_version_;
 }
 
 std::vector<MCPToolDefinition>
@@ -236,8 +426,11 @@ MCPClient::list_tools()
         return {};
     }
 
-    if (tools_cached_) {
-        return tool_cache_;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (tools_cached_) {
+            return tool_cache_;
+        }
     }
 
     std::vector<MCPToolDefinition> all_tools;
@@ -276,6 +469,7 @@ MCPClient::list_tools()
 
     } while (!cursor.empty());
 
+    std::lock_guard<std::mutex> lock(cache_mutex_);
     tool_cache_ = all_tools;
     tools_cached_ = true;
 
@@ -283,7 +477,9 @@ MCPClient::list_tools()
 }
 
 MCPToolResult
-MCPClient::call_tool(const std::string& name, const json& arguments)
+MCPClient::call_tool(const std::string& name,
+                     const json& arguments,
+                     const MCPProgressCallback& on_progress)
 {
     if (!initialized_) {
         throw MCPError("MCP client not initialized");
@@ -291,23 +487,26 @@ MCPClient::call_tool(const std::string& name, const json& arguments)
 
     json params = { { "name", name }, { "arguments", arguments } };
 
-    json result = send_request("tools/call", params);
+    json result = send_request("tools/call", params, on_progress);
 
     MCPToolResult tool_result;
 
     if (result.contains("content") && result["content"].is_array()) {
-        for (const auto& item : result["content"]) {
+        auto& content = result["content"];
+        tool_result.content.reserve(content.size());
+        for (auto& item : content) {
             MCPContentItem content_item;
-            content_item.type = item.value("type", "");
-            content_item.text = item.value("text", "");
-            content_item.data = item.value("data", "");
-            content_item.mime_type = item.value("mimeType", "");
+            content_item.type = take_string(item, "type");
+            content_item.text = take_string(item, "text");
+            content_item.data = take_string(item, "data");
+            content_item.mime_type = take_string(item, "mimeType");
             tool_result.content.push_back(std::move(content_item));
         }
     }
 
     if (result.contains("structuredContent")) {
-        tool_result.structured_content = result["structuredContent"];
+        tool_result.structured_content =
+          std::move(result["structuredContent"]);
     }
 
     tool_result.is_error = result.value("isError", false);
@@ -315,6 +514,21 @@ MCPClient::call_tool(const std::string& name, const json& arguments)
     return tool_result;
 }
 
+std::future<MCPToolResult>
+MCPClient::call_tool_async(const std::string& name,
+                           const json& arguments,
+                           MCPProgressCallback on_progress)
+{
+    // More threads than connections would only wait for one
+    std::call_once(call_pool_once_, [this] {
+        call_pool_ = std::make_unique<ThreadPool>(config_.max_connections);
+    });
+    return call_pool_->submit(
+      [this, name, arguments, on_progress = std::move(on_progress)] {
+          return call_tool(name, arguments, on_progress);
+      });
+}
+
 std::vector<std::unique_ptr<Tool>>
 MCPClient::get_tools()
 {
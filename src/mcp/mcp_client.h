@@ -1,6 +1,10 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -8,6 +12,7 @@
 
 #include <nlohmann/json.hpp>
 
+#include "thread_pool.h"
 #include "tool.h"
 
 // Forward declaration
@@ -45,11 +50,37 @@ struct MCPToolResult
     bool is_error = false;
 };
 
+// A notifications/progress message for a request in flight
+struct MCPProgress
+{
+    double progress = 0.0;
+    double total = 0.0; // 0 when the server doesn't know the total
+    std::string message;
+};
+
+using MCPProgressCallback = std::function<void(const MCPProgress& progress)>;
+
+// Called with every JSON-RPC notification or request the server sends on a
+// response stream, except progress notifications routed to a
+// MCPProgressCallback. Invoked on the thread that made the request.
+using MCPNotificationHandler = std::function<void(const json& message)>;
+
+// Returns the value of the Authorization header sent with every request,
+// e.g. "Bearer <token>", or an empty string to send none. Called on the
+// request path, so it should return a token already at hand rather than
+// fetch one; see make_bearer_token_provider for OAuth.
+using MCPAuthProvider = std::function<std::string()>;
+
 struct MCPClientConfig
 {
     int connection_timeout_sec = 10;
     int read_timeout_sec = 30;
     int write_timeout_sec = 10;
+    // Keep-alive connections opened to the server. Bounds the number of
+    // requests in flight at once; further requests wait for a free one.
+    size_t max_connections = 4;
+    // Authenticates requests, none when unset
+    MCPAuthProvider auth_provider;
 };
 
 class MCPClient : public std::enable_shared_from_this<MCPClient>
@@ -69,39 +100,116 @@ class MCPClient : public std::enable_shared_from_this<MCPClient>
 
     void close();
 
-    bool is_initialized() const { return initialized_; }
+    bool is_initialized() const { return initialized_.load(); }
+
+    const std::string& url() const { return url_; }
 
     std::vector<MCPToolDefinition> list_tools();
 
+    // Drop the tools list_tools() cached, e.g. after the server sent
+    // notifications/tools/list_changed
+    void invalidate_tools();
+
+    // serverInfo the server sent in its initialize response
+    std::string server_name() const;
+    std::string server_version() const;
+    // Protocol version the server agreed to
+    std::string protocol_version() const;
+
+    // Safe to call from several threads, requests run concurrently up to
+    // MCPClientConfig::max_connections
+    // When on_progress is set a progress token is sent with the call and the
+    // server's progress notifications are forwarded while the tool runs
     MCPToolResult call_tool(const std::string& name,
-                            const json& arguments = json::object());
+                            const json& arguments = json::object(),
+                            const MCPProgressCallback& on_progress = nullptr);
+
+    // Run call_tool on one of max_connections threads of the client, more
+    // calls wait in a queue. Errors are rethrown from the returned future's
+    // get(). Destroying the client waits for the calls queued.
+    std::future<MCPToolResult> call_tool_async(
+      const std::string& name,
+      const json& arguments = json::object(),
+      MCPProgressCallback on_progress = nullptr);
+
+    // Receive server notifications, e.g. logging messages
+    void set_notification_handler(MCPNotificationHandler handler);
 
     std::vector<std::unique_ptr<Tool>> get_tools();
 
   private:
     MCPClient(const std::string& url, const MCPClientConfig& config);
 
+    // A pooled connection, returned to the pool when destroyed
+    class Connection
+    {
+      public:
+        Connection(MCPClient& owner, std::unique_ptr<httplib::Client> client);
+        ~Connection();
+
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        httplib::Client* operator->() const { return client_.get(); }
+
+      private:
+        MCPClient& owner_;
+        std::unique_ptr<httplib::Client> client_;
+    };
+
+    Connection acquire_connection();
+    void release_connection(std::unique_ptr<httplib::Client> client);
+
+    std::string get_session_id() const;
+
     std::string url_;
+    std::string host_;
     std::string path_;
-    std::unique_ptr<httplib::Client> http_client_;
+    MCPClientConfig config_;
+
+    // Guards idle_connections_ and n_connections_
+    std::mutex pool_mutex_;
+    std::condition_variable pool_cv_;
+    std::vector<std::unique_ptr<httplib::Client>> idle_connections_;
+    size_t n_connections_ = 0;
 
+    // Guards session_id_, protocol_version_ and the server info
+    mutable std::mutex session_mutex_;
     std::string session_id_;
     std::string protocol_version_;
-    bool initialized_ = false;
-    bool has_tools_ = false;
+    std::string server_name_;
+    std::string server_version_;
+    std::atomic<bool> initialized_{ false };
+    std::atomic<bool> has_tools_{ false };
     std::atomic<int> request_id_{ 0 };
-    std::mutex send_mutex_;
 
+    std::mutex handler_mutex_;
+    MCPNotificationHandler notification_handler_;
+
+    // Guards tool_cache_ and tools_cached_
+    std::mutex cache_mutex_;
     std::vector<MCPToolDefinition> tool_cache_;
     bool tools_cached_ = false;
 
+    // Runs call_tool_async calls, created on the first one
+    std::once_flag call_pool_once_;
+    std::unique_ptr<ThreadPool> call_pool_;
+
+    // Returns the result of the response. Messages the server streams before
+    // the response are dispatched as they arrive.
     json send_request(const std::string& method,
-                      const json& params = json::object());
+                      const json& params = json::object(),
+                      const MCPProgressCallback& on_progress = nullptr);
 
     void send_notification(const std::string& method,
                            const json& params = json::object());
 
-    json parse_response(const std::string& response);
+    // Handle one message of a response stream, returns true when it is the
+    // response to request id (moved into response)
+    bool handle_message(json& message,
+                        int id,
+                        const MCPProgressCallback& on_progress,
+                        json& response);
 };
 
 } // namespace agent_cpp
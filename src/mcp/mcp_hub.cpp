@@ -0,0 +1,456 @@
+#include "mcp/mcp_hub.h"
+#include "error.h"
+#include "mcp/mcp_tool.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <unordered_set>
+
+namespace agent_cpp {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr int kCatalogVersion = 1;
+
+json
+tool_to_json(const MCPToolDefinition& tool)
+{
+    json j = { { "name", tool.name },
+               { "title", tool.title },
+               { "description", tool.description } };
+    if (!tool.input_schema.is_null()) {
+        j["inputSchema"] = tool.input_schema;
+    }
+    if (!tool.output_schema.is_null()) {
+        j["outputSchema"] = tool.output_schema;
+    }
+    return j;
+}
+
+MCPToolDefinition
+tool_from_json(const json& j)
+{
+    MCPToolDefinition tool;
+    tool.name = j.value("name", "");
+    tool.title = j.value("title", "");
+    tool.description = j.value("description", "");
+    tool.input_schema = j.value("inputSchema", json());
+    tool.output_schema = j.value("outputSchema", json());
+    return tool;
+}
+
+} // anonymous namespace
+
+MCPToolCatalog::MCPToolCatalog(std::string path)
+  : path_(std::move(path))
+{
+    if (path_.empty()) {
+        return;
+    }
+    std::ifstream file(path_);
+    if (!file) {
+        return;
+    }
+    try {
+        json j = json::parse(file);
+        if (j.value("version", 0) == kCatalogVersion &&
+            j.contains("servers") && j["servers"].is_object()) {
+            servers_ = std::move(j["servers"]);
+        }
+    } catch (const json::exception&) {
+        // Rebuilt from the servers, like an empty catalog
+    }
+}
+
+std::optional<std::vector<MCPToolDefinition>>
+MCPToolCatalog::find(const std::string& url,
+                     const std::string& server_version,
+                     const std::string& protocol_version) const
+{
+    auto it = servers_.find(url);
+    if (it == servers_.end() || !it->is_object() ||
+        it->value("server_version", "") != server_version ||
+        it->value("protocol_version", "") != protocol_version ||
+        !it->contains("tools") || !(*it)["tools"].is_array()) {
+        return std::nullopt;
+    }
+
+    try {
+        std::vector<MCPToolDefinition> tools;
+        tools.reserve((*it)["tools"].size());
+        for (const auto& tool : (*it)["tools"]) {
+            tools.push_back(tool_from_json(tool));
+        }
+        return tools;
+    } catch (const json::exception&) {
+        return std::nullopt;
+    }
+}
+
+void
+MCPToolCatalog::put(const std::string& url,
+                    const std::string& server_version,
+                    const std::string& protocol_version,
+                    const std::vector<MCPToolDefinition>& tools)
+{
+    json entry = { { "server_version", server_version },
+                   { "protocol_version", protocol_version },
+                   { "tools", json::array() } };
+    for (const auto& tool : tools) {
+        entry["tools"].push_back(tool_to_json(tool));
+    }
+    servers_[url] = std::move(entry);
+}
+
+bool
+MCPToolCatalog::save() const
+{
+    if (path_.empty()) {
+        return true;
+    }
+
+    std::error_code ec;
+    const fs::path parent = fs::path(path_).parent_path();
+    if (!parent.empty()) {
+        fs::create_directories(parent, ec);
+    }
+
+    // Readers never see a partly written catalog
+    const std::string tmp_path = path_ + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << json{ { "version", kCatalogVersion }, { "servers", servers_ } }
+                  .dump();
+        if (!file) {
+            file.close();
+            fs::remove(tmp_path, ec);
+            return false;
+        }
+    }
+    fs::rename(tmp_path, path_, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+struct MCPHubServer
+{
+    MCPServerConfig config;
+    // Unique among the servers of the hub, see MCPServerConfig::name
+    std::string id;
+    std::shared_ptr<MCPClient> client;
+
+    // Guards tools and status
+    mutable std::mutex mutex;
+    std::vector<MCPToolDefinition> tools;
+    MCPServerStatus status;
+};
+
+namespace {
+
+// An MCPTool describing itself with the latest definition its server listed
+class MCPHubTool : public MCPTool
+{
+  public:
+    MCPHubTool(std::shared_ptr<MCPHubServer> server,
+               const MCPToolDefinition& definition,
+               std::string name)
+      : MCPTool(server->client, definition, std::move(name))
+      , server_(std::move(server))
+      , tool_name_(definition.name)
+    {
+    }
+
+    common_chat_tool get_definition() const override
+    {
+        {
+            std::lock_guard<std::mutex> lock(server_->mutex);
+            for (const auto& tool : server_->tools) {
+                if (tool.name == tool_name_) {
+                    return make_definition(tool);
+                }
+            }
+        }
+        // The server no longer lists it, calls report its error
+        return MCPTool::get_definition();
+    }
+
+  private:
+    std::shared_ptr<MCPHubServer> server_;
+    std::string tool_name_;
+};
+
+} // anonymous namespace
+
+MCPHub::MCPHub(MCPHubConfig config)
+  : config_(std::move(config))
+  , catalog_(config_.catalog_path)
+  , refresh_queue_(std::make_shared<RefreshQueue>())
+{
+    std::unordered_set<std::string> names;
+    for (const auto& server_config : config_.servers) {
+        // Unnamed servers have no prefix to keep apart
+        if (!server_config.name.empty() &&
+            !names.insert(server_config.name).second) {
+            throw MCPError("more than one server is named '" +
+                           server_config.name + "'");
+        }
+    }
+
+    for (size_t i = 0; i < config_.servers.size(); i++) {
+        const MCPServerConfig& server_config = config_.servers[i];
+        std::string id = server_config.name;
+        if (id.empty()) {
+            id = "#" + std::to_string(i);
+            while (!names.insert(id).second) {
+                id += "_";
+            }
+        }
+
+        auto server = std::make_shared<MCPHubServer>();
+        server->config = server_config;
+        server->id = id;
+        server->client =
+          MCPClient::create(server_config.url, server_config.client);
+        server->status.name = id;
+        server->status.url = server_config.url;
+
+        // Runs on the thread of whichever request the notification came
+        // with, the tools are listed again on the refresher
+        server->client->set_notification_handler(
+          [queue = refresh_queue_,
+           i,
+           id,
+           on_notification = config_.on_notification](const json& message) {
+              if (message.value("method", "") ==
+                  "notifications/tools/list_changed") {
+                  std::lock_guard<std::mutex> lock(queue->mutex);
+                  if (!queue->stopped &&
+                      std::find(queue->servers.begin(),
+                                queue->servers.end(),
+                                i) == queue->servers.end()) {
+                      queue->servers.push_back(i);
+                      queue->cv.notify_one();
+                  }
+                  return;
+              }
+              if (on_notification) {
+                  on_notification(id, message);
+              }
+          });
+        servers_.push_back(std::move(server));
+    }
+
+    refresher_ = std::thread([this] { refresh_loop(); });
+}
+
+MCPHub::~MCPHub()
+{
+    {
+        std::lock_guard<std::mutex> lock(refresh_queue_->mutex);
+        refresh_queue_->stopped = true;
+    }
+    refresh_queue_->cv.notify_all();
+    refresher_.join();
+}
+
+size_t
+MCPHub::connect()
+{
+    std::vector<std::future<void>> pending;
+    for (auto& server : servers_) {
+        {
+            std::lock_guard<std::mutex> lock(server->mutex);
+            if (server->status.connected) {
+                continue;
+            }
+        }
+        MCPHubServer* target = server.get();
+        pending.push_back(std::async(
+          std::launch::async, [this, target] { connect_server(*target); }));
+    }
+    for (auto& future : pending) {
+        future.get();
+    }
+    save_catalog();
+
+    size_t connected = 0;
+    for (const auto& server : servers_) {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        connected += server->status.connected ? 1 : 0;
+    }
+    return connected;
+}
+
+void
+MCPHub::connect_server(MCPHubServer& server)
+{
+    try {
+        MCPClient& client = *server.client;
+        client.initialize(config_.client_name, config_.client_version);
+        const std::string server_version = client.server_version();
+        const std::string protocol_version = client.protocol_version();
+
+        std::optional<std::vector<MCPToolDefinition>> tools;
+        {
+            std::lock_guard<std::mutex> lock(catalog_mutex_);
+            tools = catalog_.find(
+              server.config.url, server_version, protocol_version);
+        }
+        const bool from_catalog = tools.has_value();
+        if (!from_catalog) {
+            tools = client.list_tools();
+            std::lock_guard<std::mutex> lock(catalog_mutex_);
+            catalog_.put(
+              server.config.url, server_version, protocol_version, *tools);
+            catalog_dirty_ = true;
+        }
+
+        std::lock_guard<std::mutex> lock(server.mutex);
+        server.tools = std::move(*tools);
+        server.status.server_version = server_version;
+        server.status.connected = true;
+        server.status.from_catalog = from_catalog;
+        server.status.n_tools = server.tools.size();
+        server.status.error.clear();
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        server.status.error = e.what();
+    }
+}
+
+std::vector<std::unique_ptr<Tool>>
+MCPHub::get_tools()
+{
+    std::vector<std::unique_ptr<Tool>> tools;
+    for (const auto& server : servers_) {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if (!server->status.connected) {
+            continue;
+        }
+        const std::string& prefix = server->config.name;
+        for (const auto& tool : server->tools) {
+            std::string name = prefix.empty()
+                                 ? tool.name
+                                 : prefix + config_.separator + tool.name;
+            tools.push_back(
+              std::make_unique<MCPHubTool>(server, tool, std::move(name)));
+        }
+    }
+    return tools;
+}
+
+MCPHubServer*
+MCPHub::find_server(const std::string& server) const
+{
+    for (const auto& candidate : servers_) {
+        if (candidate->id == server) {
+            return candidate.get();
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<MCPClient>
+MCPHub::client(const std::string& server) const
+{
+    const MCPHubServer* found = find_server(server);
+    return found ? found->client : nullptr;
+}
+
+void
+MCPHub::refresh(const std::string& server)
+{
+    MCPHubServer* found = find_server(server);
+    bool connected = false;
+    if (found) {
+        std::lock_guard<std::mutex> lock(found->mutex);
+        connected = found->status.connected;
+    }
+    if (!connected) {
+        throw MCPError("server '" + server + "' is not connected");
+    }
+    refresh_server(*found);
+}
+
+void
+MCPHub::refresh_server(MCPHubServer& server)
+{
+    MCPClient& client = *server.client;
+    client.invalidate_tools();
+    std::vector<MCPToolDefinition> tools = client.list_tools();
+    {
+        std::lock_guard<std::mutex> lock(catalog_mutex_);
+        catalog_.put(server.config.url,
+                     client.server_version(),
+                     client.protocol_version(),
+                     tools);
+        catalog_dirty_ = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        server.tools = std::move(tools);
+        server.status.n_tools = server.tools.size();
+        server.status.from_catalog = false;
+    }
+    save_catalog();
+
+    if (config_.on_tools_changed) {
+        config_.on_tools_changed(server.id);
+    }
+}
+
+void
+MCPHub::refresh_loop()
+{
+    while (true) {
+        size_t index = 0;
+        {
+            std::unique_lock<std::mutex> lock(refresh_queue_->mutex);
+            refresh_queue_->cv.wait(lock, [this] {
+                return refresh_queue_->stopped ||
+                       !refresh_queue_->servers.empty();
+            });
+            if (refresh_queue_->stopped) {
+                return;
+            }
+            index = refresh_queue_->servers.front();
+            refresh_queue_->servers.pop_front();
+        }
+
+        try {
+            refresh_server(*servers_[index]);
+        } catch (const std::exception&) {
+            // The previous tools stay, the next change lists them again
+        }
+    }
+}
+
+void
+MCPHub::save_catalog()
+{
+    std::lock_guard<std::mutex> lock(catalog_mutex_);
+    if (catalog_dirty_ && catalog_.save()) {
+        catalog_dirty_ = false;
+    }
+}
+
+std::vector<MCPServerStatus>
+MCPHub::servers() const
+{
+    std::vector<MCPServerStatus> statuses;
+    statuses.reserve(servers_.size());
+    for (const auto& server : servers_) {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        statuses.push_back(server->status);
+    }
+    return statuses;
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "mcp/mcp_client.h"
+#include "tool.h"
+
+namespace agent_cpp {
+
+using json = nlohmann::json;
+
+/// @brief Tool definitions of MCP servers, kept in a JSON file
+///
+/// An entry is keyed by the server URL and only valid for the server and
+/// protocol version it was listed with, so a server that was upgraded is
+/// listed again. A missing or unreadable file is an empty catalog. Not
+/// thread safe.
+class MCPToolCatalog
+{
+  public:
+    /// @param path File the catalog is kept in, empty keeps it in memory
+    explicit MCPToolCatalog(std::string path = "");
+
+    /// @brief Tools of url, nullopt if they weren't stored for these versions
+    [[nodiscard]] std::optional<std::vector<MCPToolDefinition>> find(
+      const std::string& url,
+      const std::string& server_version,
+      const std::string& protocol_version) const;
+
+    void put(const std::string& url,
+             const std::string& server_version,
+             const std::string& protocol_version,
+             const std::vector<MCPToolDefinition>& tools);
+
+    /// @brief Write the catalog, replacing the file atomically
+    /// @return false if it couldn't be written
+    bool save() const;
+
+    [[nodiscard]] const std::string& path() const { return path_; }
+
+  private:
+    std::string path_;
+    json servers_ = json::object();
+};
+
+struct MCPServerConfig
+{
+    // Prefix of the server's tools, e.g. "github" for github__create_issue.
+    // Empty leaves the names as the server gives them; when tools of several
+    // servers then share a name, an agent uses the first one registered.
+    // The hub identifies an unnamed server by "#" and its index in
+    // MCPHubConfig::servers, e.g. "#2", in MCPServerStatus::name, client(),
+    // refresh() and the callbacks.
+    std::string name;
+    std::string url;
+    MCPClientConfig client;
+};
+
+struct MCPHubConfig
+{
+    std::vector<MCPServerConfig> servers;
+    // Where the tool catalog is kept across restarts, empty doesn't keep it
+    std::string catalog_path;
+    // Between the server name and the tool name
+    std::string separator = "__";
+    std::string client_name = "agent.cpp";
+    std::string client_version = "0.1.0";
+    // Called on a background thread after the tools of a server were listed
+    // again, e.g. to call Agent::invalidate_tool_definitions()
+    std::function<void(const std::string& server)> on_tools_changed;
+    // Every other notification a server sends
+    std::function<void(const std::string& server, const json& message)>
+      on_notification;
+};
+
+/// @brief What connecting to one server of an MCPHub did
+struct MCPServerStatus
+{
+    // Identifies the server to the hub, see MCPServerConfig::name
+    std::string name;
+    std::string url;
+    std::string server_version;
+    bool connected = false;
+    // Tools were taken from the catalog rather than listed
+    bool from_catalog = false;
+    size_t n_tools = 0;
+    // Why connecting failed
+    std::string error;
+};
+
+struct MCPHubServer; // Defined in mcp_hub.cpp
+
+/// @brief Tools of many MCP servers behind one object
+///
+/// connect() initializes every server concurrently, so startup takes about
+/// the slowest handshake rather than the sum of them. Tool lists come from
+/// the catalog when it holds them for the server's version, which saves
+/// paging through tools/list on every start; otherwise they are listed,
+/// again concurrently, and stored. A server that fails doesn't keep the
+/// others from connecting, see servers().
+///
+/// When a server sends notifications/tools/list_changed its tools are
+/// listed again on a background thread. Tools from get_tools() always
+/// describe themselves with the latest definitions, so calling
+/// Agent::invalidate_tool_definitions() from on_tools_changed is enough for
+/// changed tools; tools a server added only appear in a new get_tools().
+///
+/// Usage:
+///   agent_cpp::MCPHubConfig config;
+///   config.servers = { { "files", "http://localhost:8000/mcp" },
+///                      { "search", "http://localhost:8001/mcp" } };
+///   config.catalog_path = "mcp-catalog.json";
+///   agent_cpp::MCPHub hub(config);
+///   hub.connect();
+///   auto tools = hub.get_tools(); // files__read, search__query, ...
+class MCPHub
+{
+  public:
+    /// @throws agent_cpp::MCPError if two servers share a non-empty name
+    explicit MCPHub(MCPHubConfig config);
+    // Waits for a refresh in progress
+    ~MCPHub();
+
+    MCPHub(const MCPHub&) = delete;
+    MCPHub& operator=(const MCPHub&) = delete;
+
+    /// @brief Connect to the servers not connected yet, concurrently
+    /// @return Number of servers connected
+    size_t connect();
+
+    /// @brief Tools of every connected server, named server + separator +
+    /// tool
+    std::vector<std::unique_ptr<Tool>> get_tools();
+
+    /// @brief Client of server, nullptr if there is no such server
+    [[nodiscard]] std::shared_ptr<MCPClient> client(
+      const std::string& server) const;
+
+    /// @brief List the tools of server again and store them in the catalog
+    /// @throws agent_cpp::MCPError if server isn't connected or listing fails
+    void refresh(const std::string& server);
+
+    [[nodiscard]] std::vector<MCPServerStatus> servers() const;
+
+  private:
+    // Servers whose tools changed; shared with the notification handlers,
+    // which their clients may run after the hub is gone
+    struct RefreshQueue
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<size_t> servers;
+        bool stopped = false;
+    };
+
+    // Initialize server and take its tools from the catalog or list them
+    void connect_server(MCPHubServer& server);
+    // Server identified as server, nullptr if there is none
+    MCPHubServer* find_server(const std::string& server) const;
+    void refresh_server(MCPHubServer& server);
+    void refresh_loop();
+    void save_catalog();
+
+    MCPHubConfig config_;
+    std::vector<std::shared_ptr<MCPHubServer>> servers_;
+
+    // Guards catalog_ and catalog_dirty_
+    std::mutex catalog_mutex_;
+    MCPToolCatalog catalog_;
+    bool catalog_dirty_ = false;
+
+    std::shared_ptr<RefreshQueue> refresh_queue_;
+    std::thread refresher_;
+};
+
+} // namespace agent_cpp
@@ -1,24 +1,44 @@
 #include "mcp/mcp_tool.h"
 #include "mcp/mcp_client.h"
+#include "error.h"
 
 namespace agent_cpp {
 
 MCPTool::MCPTool(std::shared_ptr<MCPClient> client,
-                 MCPToolDefinition definition)
+                 MCPToolDefinition definition,
+                 std::string name)
   : client_(std::move(client))
   , definition_(std::move(definition))
+  , name_(name.empty() ? definition_.name : std::move(name))
 {
 }
 
 common_chat_tool
 MCPTool::get_definition() const
+{
+    // The client caches the list until the server reports a change, so this
+    // only lists the tools again after invalidate_tools()
+    try {
+        for (const auto& definition : client_->list_tools()) {
+            if (definition.name == definition_.name) {
+                return make_definition(definition);
+            }
+        }
+    } catch (const MCPError&) {
+        // Keep describing the tool as it was when the server is unreachable
+    }
+    return make_definition(definition_);
+}
+
+common_chat_tool
+MCPTool::make_definition(const MCPToolDefinition& definition) const
 {
     common_chat_tool tool;
-    tool.name = definition_.name;
-    tool.description = definition_.description;
+    tool.name = name_;
+    tool.description = definition.description;
 
-    if (!definition_.input_schema.is_null()) {
-        tool.parameters = definition_.input_schema.dump();
+    if (!definition.input_schema.is_null()) {
+        tool.parameters = definition.input_schema.dump();
     } else {
         tool.parameters = R"({"type": "object", "properties": {}})";
     }
@@ -26,6 +46,12 @@ MCPTool::get_definition() const
     return tool;
 }
 
+std::string
+MCPTool::cache_scope() const
+{
+    return client_ ? client_->url() : std::string();
+}
+
 std::string
 MCPTool::execute(const json& arguments)
 {
@@ -43,7 +69,7 @@ MCPTool::execute(const json& arguments)
         response["error"] =
           error_msg.empty() ? "Tool execution error" : error_msg;
     } else if (!result.structured_content.is_null()) {
-        response = result.structured_content;
+        response = std::move(result.structured_content);
     } else {
         std::string text_content;
         for (const auto& item : result.content) {
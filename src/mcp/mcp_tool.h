@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <string>
 
@@ -15,15 +16,40 @@ using json = nlohmann::json;
 class MCPTool : public Tool
 {
   public:
-    MCPTool(std::shared_ptr<MCPClient> client, MCPToolDefinition definition);
-
+    // name is the one the model sees, e.g. with a server prefix; empty uses
+    // the name the server gave the tool
+    MCPTool(std::shared_ptr<MCPClient> client,
+            MCPToolDefinition definition,
+            std::string name = "");
+
+    // Latest definition the client listed for the tool, so a registry
+    // invalidated after invalidate_tools() picks up a changed schema. Tools
+    // the server added or removed need a new MCPClient::get_tools().
     common_chat_tool get_definition() const override;
     std::string execute(const json& arguments) override;
-    std::string get_name() const override { return definition_.name; }
+    std::string get_name() const override { return name_; }
+
+    // Calls are independent requests on a client that supports concurrency
+    bool is_concurrency_safe() const override { return true; }
+
+    // Servers don't say whether a tool is deterministic, so caching is
+    // opted into per tool
+    std::chrono::milliseconds cache_ttl() const override { return cache_ttl_; }
+    void set_cache_ttl(std::chrono::milliseconds ttl) { cache_ttl_ = ttl; }
+
+    // Tools of different servers may share a name
+    std::string cache_scope() const override;
+
+  protected:
+    // Definition under the name the model sees
+    common_chat_tool make_definition(
+      const MCPToolDefinition& definition) const;
 
   private:
     std::shared_ptr<MCPClient> client_;
     MCPToolDefinition definition_;
+    std::string name_;
+    std::chrono::milliseconds cache_ttl_{ 0 };
 };
 
 }
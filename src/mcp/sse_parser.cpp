@@ -0,0 +1,130 @@
+#include "mcp/sse_parser.h"
+
+#include <cstring>
+#include <string_view>
+
+namespace agent_cpp {
+
+SSEParser::SSEParser(EventHandler handler)
+  : handler_(std::move(handler))
+{
+}
+
+bool
+SSEParser::feed(const char* data, size_t size)
+{
+    size_t pos = 0;
+
+    if (skip_newline_ && size > 0) {
+        skip_newline_ = false;
+        if (data[0] == '\n') {
+            pos = 1;
+        }
+    }
+
+    while (pos < size) {
+        const char* start = data + pos;
+        const size_t remaining = size - pos;
+
+        size_t len = 0;
+        while (len < remaining && start[len] != '\n' && start[len] != '\r') {
+            len++;
+        }
+
+        if (len == remaining) {
+            // Incomplete line, wait for the rest
+            line_.append(start, len);
+            break;
+        }
+
+        bool keep_going;
+        if (line_.empty()) {
+            // Parse straight from the chunk, no copy needed
+            keep_going = process_line(start, len);
+        } else {
+            line_.append(start, len);
+            keep_going = process_line(line_.data(), line_.size());
+            line_.clear();
+        }
+
+        pos += len + 1;
+        if (start[len] == '\r') {
+            if (pos < size) {
+                if (data[pos] == '\n') {
+                    pos++;
+                }
+            } else {
+                skip_newline_ = true;
+            }
+        }
+
+        if (!keep_going) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+SSEParser::finish()
+{
+    bool keep_going = true;
+    if (!line_.empty()) {
+        keep_going = process_line(line_.data(), line_.size());
+        line_.clear();
+    }
+    if (keep_going && has_data_) {
+        keep_going = dispatch();
+    }
+    return keep_going;
+}
+
+bool
+SSEParser::process_line(const char* line, size_t size)
+{
+    if (size == 0) {
+        return has_data_ ? dispatch() : true;
+    }
+
+    if (line[0] == ':') {
+        // Comment, often used as a keep-alive
+        return true;
+    }
+
+    const char* colon = static_cast<const char*>(std::memchr(line, ':', size));
+    const size_t field_size = colon ? static_cast<size_t>(colon - line) : size;
+    const char* value = colon ? colon + 1 : line + size;
+    size_t value_size = size - (value - line);
+    if (value_size > 0 && value[0] == ' ') {
+        value++;
+        value_size--;
+    }
+
+    const std::string_view field(line, field_size);
+    if (field == "data") {
+        if (has_data_) {
+            event_.data.push_back('\n');
+        }
+        event_.data.append(value, value_size);
+        has_data_ = true;
+    } else if (field == "event") {
+        event_.event.assign(value, value_size);
+    } else if (field == "id") {
+        event_.id.assign(value, value_size);
+    }
+    // Other fields (e.g. retry) don't matter for a single response stream
+
+    return true;
+}
+
+bool
+SSEParser::dispatch()
+{
+    bool keep_going = handler_(event_);
+    event_ = SSEEvent{};
+    has_data_ = false;
+    return keep_going;
+}
+
+} // namespace agent_cpp
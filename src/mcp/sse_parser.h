@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace agent_cpp {
+
+struct SSEEvent
+{
+    std::string event; // Event type, empty for the default "message"
+    std::string data;  // Data lines joined with '\n'
+    std::string id;
+};
+
+/// @brief Incremental parser for text/event-stream bodies
+///
+/// Bytes are fed as they arrive from the network and each event is
+/// dispatched as soon as its terminating blank line is seen. Only the
+/// current incomplete line and event are buffered.
+class SSEParser
+{
+  public:
+    /// @brief Called for every complete event
+    /// The handler may move out of the event. Returning false stops parsing,
+    /// feed() then returns false as well.
+    using EventHandler = std::function<bool(SSEEvent& event)>;
+
+    explicit SSEParser(EventHandler handler);
+
+    /// @brief Parse the next chunk of the stream
+    /// @return false if the handler asked to stop
+    bool feed(const char* data, size_t size);
+
+    /// @brief Dispatch an event left unterminated at the end of the stream
+    /// @return false if the handler asked to stop
+    bool finish();
+
+  private:
+    bool process_line(const char* line, size_t size);
+    bool dispatch();
+
+    EventHandler handler_;
+    std::string line_;
+    SSEEvent event_;
+    bool has_data_ = false;
+    // A '\r' ended the previous chunk, skip a '\n' starting the next one
+    bool skip_newline_ = false;
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,347 @@
+#include "memory/memory_store.h"
+#include "error.h"
+#include <algorithm>
+#include <filesystem>
+
+namespace agent_cpp {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t kMagic = 0x4d454d41; // "AMEM"
+constexpr uint32_t kPut = 1;
+constexpr uint32_t kErase = 2;
+// Keeps ids of compacted records from being handed out again
+constexpr uint32_t kReserveIds = 3;
+
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t id;
+    uint32_t key_size;
+    uint32_t text_size;
+    uint32_t checksum; // FNV-1a of the key and text
+    uint32_t reserved;
+};
+
+uint32_t
+fnv1a(const std::string& data, uint32_t hash = 2166136261U)
+{
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+uint64_t
+record_size(const RecordHeader& header)
+{
+    return sizeof(RecordHeader) + header.key_size + header.text_size;
+}
+
+// fseek takes a long, which is 32 bits on Windows and 32-bit builds
+int
+seek_to(std::FILE* file, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET);
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+}
+
+} // anonymous namespace
+
+MemoryStore::MemoryStore(std::string path)
+  : path_(std::move(path))
+{
+    const fs::path parent = fs::path(path_).parent_path();
+    if (!parent.empty()) {
+        std::error_code ec;
+        fs::create_directories(parent, ec);
+    }
+    open();
+}
+
+MemoryStore::~MemoryStore()
+{
+    if (file_ != nullptr) {
+        std::fclose(file_);
+    }
+}
+
+void
+MemoryStore::open()
+{
+    // Reads may seek anywhere, writes always go to the end
+    file_ = std::fopen(path_.c_str(), "a+b");
+    if (file_ == nullptr) {
+        throw MemoryError("unable to open '" + path_ + "'");
+    }
+    replay();
+}
+
+void
+MemoryStore::replay()
+{
+    by_key_.clear();
+    key_of_id_.clear();
+    next_id_ = 1;
+    live_bytes_ = 0;
+
+    std::fseek(file_, 0, SEEK_SET);
+    uint64_t offset = 0;
+    std::string key;
+    std::string text;
+    while (true) {
+        RecordHeader header{};
+        if (std::fread(&header, sizeof(header), 1, file_) != 1 ||
+            header.magic != kMagic || header.type < kPut ||
+            header.type > kReserveIds) {
+            break;
+        }
+        key.resize(header.key_size);
+        text.resize(header.text_size);
+        if ((header.key_size > 0 &&
+             std::fread(key.data(), header.key_size, 1, file_) != 1) ||
+            (header.text_size > 0 &&
+             std::fread(text.data(), header.text_size, 1, file_) != 1) ||
+            fnv1a(text, fnv1a(key)) != header.checksum) {
+            break;
+        }
+
+        auto it = header.type == kReserveIds ? by_key_.end()
+                                             : by_key_.find(key);
+        if (it != by_key_.end()) {
+            live_bytes_ -= sizeof(RecordHeader) + it->second.key_size +
+                           it->second.text_size;
+            key_of_id_.erase(it->second.id);
+            by_key_.erase(it);
+        }
+        if (header.type == kPut) {
+            by_key_[key] = { header.id, offset, header.key_size,
+                             header.text_size };
+            key_of_id_[header.id] = key;
+            live_bytes_ += record_size(header);
+        } else if (header.type == kReserveIds) {
+            // Needed until the next compaction, not reclaimable
+            live_bytes_ += record_size(header);
+        }
+        next_id_ = std::max(next_id_, header.id + 1);
+        offset += record_size(header);
+    }
+
+    // Whatever follows the last intact record was torn by a crash
+    std::error_code ec;
+    const uint64_t size = fs::file_size(path_, ec);
+    if (!ec && size > offset) {
+        truncate(offset);
+    }
+    file_size_ = offset;
+}
+
+void
+MemoryStore::truncate(uint64_t size)
+{
+    std::fclose(file_);
+    std::error_code ec;
+    fs::resize_file(path_, size, ec);
+    file_ = std::fopen(path_.c_str(), "a+b");
+    if (file_ == nullptr) {
+        throw MemoryError("unable to reopen '" + path_ + "'");
+    }
+}
+
+uint64_t
+MemoryStore::append(uint32_t type,
+                    uint64_t id,
+                    const std::string& key,
+                    const std::string& text)
+{
+    const RecordHeader header{ kMagic,
+                               type,
+                               id,
+                               static_cast<uint32_t>(key.size()),
+                               static_cast<uint32_t>(text.size()),
+                               fnv1a(text, fnv1a(key)),
+                               0 };
+
+    std::fseek(file_, 0, SEEK_END);
+    if (std::fwrite(&header, sizeof(header), 1, file_) != 1 ||
+        (!key.empty() && std::fwrite(key.data(), key.size(), 1, file_) != 1) ||
+        (!text.empty() &&
+         std::fwrite(text.data(), text.size(), 1, file_) != 1) ||
+        std::fflush(file_) != 0) {
+        // A partial record would shift the offsets of every later one
+        truncate(file_size_);
+        throw MemoryError("unable to append to '" + path_ + "'");
+    }
+
+    const uint64_t offset = file_size_;
+    file_size_ += record_size(header);
+    return offset;
+}
+
+uint64_t
+MemoryStore::put(const std::string& key, const std::string& text)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint64_t id = next_id_++;
+    const uint64_t offset = append(kPut, id, key, text);
+
+    auto it = by_key_.find(key);
+    if (it != by_key_.end()) {
+        live_bytes_ -= sizeof(RecordHeader) + it->second.key_size +
+                       it->second.text_size;
+        key_of_id_.erase(it->second.id);
+    }
+    by_key_[key] = { id,
+                     offset,
+                     static_cast<uint32_t>(key.size()),
+                     static_cast<uint32_t>(text.size()) };
+    key_of_id_[id] = key;
+    live_bytes_ += sizeof(RecordHeader) + key.size() + text.size();
+    return id;
+}
+
+MemoryRecord
+MemoryStore::read(const Location& location, const std::string& key) const
+{
+    MemoryRecord record;
+    record.id = location.id;
+    record.key = key;
+    record.text.resize(location.text_size);
+
+    const uint64_t text_offset =
+      location.offset + sizeof(RecordHeader) + location.key_size;
+    if (location.text_size > 0 &&
+        (seek_to(file_, text_offset) != 0 ||
+         std::fread(record.text.data(), location.text_size, 1, file_) != 1)) {
+        throw MemoryError("unable to read '" + path_ + "'");
+    }
+    return record;
+}
+
+std::optional<MemoryRecord>
+MemoryStore::get(const std::string& key) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_key_.find(key);
+    if (it == by_key_.end()) {
+        return std::nullopt;
+    }
+    return read(it->second, key);
+}
+
+std::optional<MemoryRecord>
+MemoryStore::get(uint64_t id) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = key_of_id_.find(id);
+    if (it == key_of_id_.end()) {
+        return std::nullopt;
+    }
+    return read(by_key_.at(it->second), it->second);
+}
+
+bool
+MemoryStore::contains(uint64_t id) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return key_of_id_.count(id) > 0;
+}
+
+bool
+MemoryStore::erase(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_key_.find(key);
+    if (it == by_key_.end()) {
+        return false;
+    }
+    append(kErase, it->second.id, key, "");
+    live_bytes_ -=
+      sizeof(RecordHeader) + it->second.key_size + it->second.text_size;
+    key_of_id_.erase(it->second.id);
+    by_key_.erase(it);
+    return true;
+}
+
+std::vector<std::string>
+MemoryStore::keys() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> keys;
+    keys.reserve(by_key_.size());
+    for (const auto& [key, location] : by_key_) {
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+size_t
+MemoryStore::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return by_key_.size();
+}
+
+uint64_t
+MemoryStore::dead_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return file_size_ - live_bytes_;
+}
+
+void
+MemoryStore::compact()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const std::string tmp_path = path_ + ".tmp";
+    std::FILE* out = std::fopen(tmp_path.c_str(), "wb");
+    if (out == nullptr) {
+        throw MemoryError("unable to create '" + tmp_path + "'");
+    }
+
+    // Ids stay unique, a vector index may still refer to the dropped ones
+    const RecordHeader reserve{
+        kMagic, kReserveIds, next_id_ - 1, 0, 0, fnv1a(""), 0
+    };
+    bool ok = std::fwrite(&reserve, sizeof(reserve), 1, out) == 1;
+    for (const auto& [key, location] : by_key_) {
+        const MemoryRecord record = read(location, key);
+        const RecordHeader header{ kMagic,
+                                   kPut,
+                                   record.id,
+                                   location.key_size,
+                                   location.text_size,
+                                   fnv1a(record.text, fnv1a(key)),
+                                   0 };
+        ok = ok && std::fwrite(&header, sizeof(header), 1, out) == 1;
+        ok = ok && (key.empty() ||
+                    std::fwrite(key.data(), key.size(), 1, out) == 1);
+        ok = ok && (record.text.empty() ||
+                    std::fwrite(
+                      record.text.data(), record.text.size(), 1, out) == 1);
+    }
+    ok = std::fclose(out) == 0 && ok;
+
+    std::error_code ec;
+    if (ok) {
+        fs::rename(tmp_path, path_, ec);
+    }
+    if (!ok || ec) {
+        fs::remove(tmp_path, ec);
+        throw MemoryError("unable to compact '" + path_ + "'");
+    }
+
+    std::fclose(file_);
+    file_ = nullptr;
+    open();
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief One remembered entry
+struct MemoryRecord
+{
+    // Assigned by the store, a new one for every write of a key
+    uint64_t id = 0;
+    std::string key;
+    std::string text;
+};
+
+/// @brief Append-only, log-structured key/value store for agent memory
+///
+/// Every write or erase appends one checksummed record to the log file, so
+/// a write costs its own size in I/O however large the store grows. Only
+/// the key index is kept in memory, texts are read from the log on demand.
+/// Opening replays the log; a record torn by a crash is cut off. Overwritten
+/// and erased records stay in the log until compact(). Thread safe.
+///
+/// Usage:
+///   agent_cpp::MemoryStore store("memory/records.log");
+///   store.put("user_name", "Ada");
+///   auto record = store.get("user_name");
+class MemoryStore
+{
+  public:
+    /// @throws agent_cpp::MemoryError if the log can't be opened
+    explicit MemoryStore(std::string path);
+    ~MemoryStore();
+
+    MemoryStore(const MemoryStore&) = delete;
+    MemoryStore& operator=(const MemoryStore&) = delete;
+
+    /// @brief Store text under key, replacing what it held
+    /// @return Id of the new record
+    /// @throws agent_cpp::MemoryError if the record can't be written
+    uint64_t put(const std::string& key, const std::string& text);
+
+    /// @brief Current record of key
+    [[nodiscard]] std::optional<MemoryRecord> get(const std::string& key) const;
+
+    /// @brief Record with id, nullopt if it was overwritten or erased since
+    [[nodiscard]] std::optional<MemoryRecord> get(uint64_t id) const;
+
+    /// @brief Whether id is a current record, without reading it
+    [[nodiscard]] bool contains(uint64_t id) const;
+
+    /// @brief Forget key
+    /// @return false if it wasn't stored
+    /// @throws agent_cpp::MemoryError if the record can't be written
+    bool erase(const std::string& key);
+
+    [[nodiscard]] std::vector<std::string> keys() const;
+
+    /// @brief Number of keys stored
+    [[nodiscard]] size_t size() const;
+
+    /// @brief Bytes of the log held by overwritten and erased records
+    [[nodiscard]] uint64_t dead_bytes() const;
+
+    /// @brief Rewrite the log with only the current records, keeping ids
+    /// @throws agent_cpp::MemoryError if the new log can't be written
+    void compact();
+
+  private:
+    struct Location
+    {
+        uint64_t id = 0;
+        uint64_t offset = 0; // Of the record header
+        uint32_t key_size = 0;
+        uint32_t text_size = 0;
+    };
+
+    void open();
+    void replay();
+    // Cut the log back to size bytes, e.g. after a torn or failed append
+    void truncate(uint64_t size);
+    // Append a record and return its offset, the caller holds mutex_
+    uint64_t append(uint32_t type,
+                    uint64_t id,
+                    const std::string& key,
+                    const std::string& text);
+    MemoryRecord read(const Location& location, const std::string& key) const;
+
+    std::string path_;
+    std::FILE* file_ = nullptr;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Location> by_key_;
+    std::unordered_map<uint64_t, std::string> key_of_id_; // Live ids only
+    uint64_t next_id_ = 1;
+    uint64_t file_size_ = 0;
+    uint64_t live_bytes_ = 0;
+};
+
+} // namespace agent_cpp
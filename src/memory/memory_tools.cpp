@@ -0,0 +1,187 @@
+#include "memory/memory_tools.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+namespace {
+
+json
+key_schema(const std::string& description)
+{
+    return { { "type", "object" },
+             { "properties",
+               { { "key",
+                   { { "type", "string" },
+                     { "description", description } } } } },
+             { "required", { "key" } } };
+}
+
+} // anonymous namespace
+
+WriteMemoryTool::WriteMemoryTool(std::shared_ptr<SemanticMemory> memory)
+  : memory_(std::move(memory))
+{
+}
+
+common_chat_tool
+WriteMemoryTool::get_definition() const
+{
+    json schema = {
+        { "type", "object" },
+        { "properties",
+          { { "key",
+              { { "type", "string" },
+                { "description",
+                  "A descriptive key for the memory (e.g., 'user_name', "
+                  "'favorite_color'). Writing an existing key replaces "
+                  "it." } } },
+            { "value",
+              { { "type", "string" },
+                { "description", "The information to store" } } } } },
+        { "required", { "key", "value" } }
+    };
+
+    return { "write_memory",
+             "Store information for future conversations, such as facts, "
+             "preferences or details the user shares.",
+             schema.dump() };
+}
+
+std::string
+WriteMemoryTool::execute(const json& arguments)
+{
+    const std::string key = arguments.at("key").get<std::string>();
+    const std::string value = arguments.at("value").get<std::string>();
+    memory_->remember(key, value);
+
+    json response;
+    response["success"] = true;
+    response["message"] = "Stored memory with key '" + key + "'";
+    return response.dump();
+}
+
+ReadMemoryTool::ReadMemoryTool(std::shared_ptr<SemanticMemory> memory)
+  : memory_(std::move(memory))
+{
+}
+
+common_chat_tool
+ReadMemoryTool::get_definition() const
+{
+    return { "read_memory",
+             "Retrieve the information stored under a known key. Use "
+             "search_memory when the exact key is not known.",
+             key_schema("The key of the memory to retrieve").dump() };
+}
+
+std::string
+ReadMemoryTool::execute(const json& arguments)
+{
+    const std::string key = arguments.at("key").get<std::string>();
+
+    json response;
+    if (auto record = memory_->read(key)) {
+        response["success"] = true;
+        response["key"] = key;
+        response["value"] = record->text;
+    } else {
+        response["success"] = false;
+        response["message"] = "No memory found with key '" + key + "'";
+    }
+    return response.dump();
+}
+
+SearchMemoryTool::SearchMemoryTool(std::shared_ptr<SemanticMemory> memory,
+                                   size_t max_results)
+  : memory_(std::move(memory))
+  , max_results_(max_results)
+{
+}
+
+common_chat_tool
+SearchMemoryTool::get_definition() const
+{
+    json schema = {
+        { "type", "object" },
+        { "properties",
+          { { "query",
+              { { "type", "string" },
+                { "description",
+                  "What to look for, in natural language (e.g., 'the "
+                  "user's food preferences')" } } },
+            { "limit",
+              { { "type", "integer" },
+                { "description", "Maximum number of memories to return" },
+                { "minimum", 1 },
+                { "maximum", max_results_ } } } } },
+        { "required", { "query" } }
+    };
+
+    return { "search_memory",
+             "Find stored memories related in meaning to a query, most "
+             "relevant first. Use this to recall what is known about a "
+             "topic without knowing the keys.",
+             schema.dump() };
+}
+
+std::string
+SearchMemoryTool::execute(const json& arguments)
+{
+    const std::string query = arguments.at("query").get<std::string>();
+    const size_t limit =
+      std::clamp<size_t>(arguments.value("limit", max_results_),
+                         1,
+                         std::max<size_t>(max_results_, 1));
+
+    json memories = json::array();
+    for (const auto& match : memory_->recall(query, limit)) {
+        memories.push_back({ { "key", match.record.key },
+                             { "value", match.record.text },
+                             { "score", match.score } });
+    }
+
+    json response;
+    response["success"] = true;
+    response["memories"] = memories;
+    return response.dump();
+}
+
+ForgetMemoryTool::ForgetMemoryTool(std::shared_ptr<SemanticMemory> memory)
+  : memory_(std::move(memory))
+{
+}
+
+common_chat_tool
+ForgetMemoryTool::get_definition() const
+{
+    return { "forget_memory",
+             "Delete the information stored under a key, e.g. when the user "
+             "asks for it to be forgotten or it is no longer true.",
+             key_schema("The key of the memory to delete").dump() };
+}
+
+std::string
+ForgetMemoryTool::execute(const json& arguments)
+{
+    const std::string key = arguments.at("key").get<std::string>();
+
+    json response;
+    response["success"] = memory_->forget(key);
+    if (!response["success"].get<bool>()) {
+        response["message"] = "No memory found with key '" + key + "'";
+    }
+    return response.dump();
+}
+
+std::vector<std::unique_ptr<Tool>>
+make_memory_tools(const std::shared_ptr<SemanticMemory>& memory)
+{
+    std::vector<std::unique_ptr<Tool>> tools;
+    tools.push_back(std::make_unique<WriteMemoryTool>(memory));
+    tools.push_back(std::make_unique<ReadMemoryTool>(memory));
+    tools.push_back(std::make_unique<SearchMemoryTool>(memory));
+    tools.push_back(std::make_unique<ForgetMemoryTool>(memory));
+    return tools;
+}
+
+} // namespace agent_cpp
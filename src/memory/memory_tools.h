@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "memory/semantic_memory.h"
+#include "tool.h"
+
+namespace agent_cpp {
+
+using json = nlohmann::json;
+
+// Stores a fact under a key: write_memory(key, value)
+class WriteMemoryTool : public Tool
+{
+  public:
+    explicit WriteMemoryTool(std::shared_ptr<SemanticMemory> memory);
+
+    common_chat_tool get_definition() const override;
+    std::string execute(const json& arguments) override;
+    std::string get_name() const override { return "write_memory"; }
+
+    // Memory is thread safe
+    bool is_concurrency_safe() const override { return true; }
+
+  private:
+    std::shared_ptr<SemanticMemory> memory_;
+};
+
+// Reads the fact stored under a key: read_memory(key)
+class ReadMemoryTool : public Tool
+{
+  public:
+    explicit ReadMemoryTool(std::shared_ptr<SemanticMemory> memory);
+
+    common_chat_tool get_definition() const override;
+    std::string execute(const json& arguments) override;
+    std::string get_name() const override { return "read_memory"; }
+
+    bool is_concurrency_safe() const override { return true; }
+
+  private:
+    std::shared_ptr<SemanticMemory> memory_;
+};
+
+// Finds the facts closest in meaning to a query: search_memory(query, limit)
+class SearchMemoryTool : public Tool
+{
+  public:
+    explicit SearchMemoryTool(std::shared_ptr<SemanticMemory> memory,
+                              size_t max_results = 5);
+
+    common_chat_tool get_definition() const override;
+    std::string execute(const json& arguments) override;
+    std::string get_name() const override { return "search_memory"; }
+
+    bool is_concurrency_safe() const override { return true; }
+
+  private:
+    std::shared_ptr<SemanticMemory> memory_;
+    size_t max_results_;
+};
+
+// Forgets the fact stored under a key: forget_memory(key)
+class ForgetMemoryTool : public Tool
+{
+  public:
+    explicit ForgetMemoryTool(std::shared_ptr<SemanticMemory> memory);
+
+    common_chat_tool get_definition() const override;
+    std::string execute(const json& arguments) override;
+    std::string get_name() const override { return "forget_memory"; }
+
+    bool is_concurrency_safe() const override { return true; }
+
+  private:
+    std::shared_ptr<SemanticMemory> memory_;
+};
+
+// All of the memory tools above, sharing one memory
+std::vector<std::unique_ptr<Tool>>
+make_memory_tools(const std::shared_ptr<SemanticMemory>& memory);
+
+} // namespace agent_cpp
@@ -0,0 +1,100 @@
+#include "memory/semantic_memory.h"
+#include <filesystem>
+
+namespace agent_cpp {
+
+namespace fs = std::filesystem;
+
+SemanticMemory::SemanticMemory(const std::string& directory,
+                               std::shared_ptr<Embedder> embedder)
+  : embedder_(std::move(embedder))
+  , store_((fs::path(directory) / "records.log").string())
+  , index_((fs::path(directory) / "vectors.idx").string(),
+           embedder_->n_embd())
+{
+}
+
+std::string
+SemanticMemory::embedding_text(const std::string& key, const std::string& text)
+{
+    return key + ": " + text;
+}
+
+uint64_t
+SemanticMemory::remember(const std::string& key, const std::string& text)
+{
+    // Embedded first, a failure then leaves no record without a vector
+    const std::vector<float> vector =
+      embedder_->embed_one(embedding_text(key, text));
+    const uint64_t id = store_.put(key, text);
+    index_.add(id, vector.data());
+    return id;
+}
+
+void
+SemanticMemory::remember(
+  const std::vector<std::pair<std::string, std::string>>& entries)
+{
+    std::vector<std::string> texts;
+    texts.reserve(entries.size());
+    for (const auto& [key, text] : entries) {
+        texts.push_back(embedding_text(key, text));
+    }
+
+    const Embeddings vectors = embedder_->embed(texts);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const uint64_t id = store_.put(entries[i].first, entries[i].second);
+        index_.add(id, vectors[i]);
+    }
+}
+
+std::optional<MemoryRecord>
+SemanticMemory::read(const std::string& key) const
+{
+    return store_.get(key);
+}
+
+std::vector<MemoryMatch>
+SemanticMemory::recall(const std::string& query, size_t k) const
+{
+    const std::vector<float> vector = embedder_->embed_one(query);
+
+    std::vector<MemoryMatch> matches;
+    const auto hits = index_.search(
+      vector.data(), k, [this](uint64_t id) { return store_.contains(id); });
+    matches.reserve(hits.size());
+    for (const auto& hit : hits) {
+        // May have been forgotten since the search
+        if (auto record = store_.get(hit.id)) {
+            matches.push_back({ std::move(*record), hit.score });
+        }
+    }
+    return matches;
+}
+
+bool
+SemanticMemory::forget(const std::string& key)
+{
+    return store_.erase(key);
+}
+
+std::vector<std::string>
+SemanticMemory::keys() const
+{
+    return store_.keys();
+}
+
+size_t
+SemanticMemory::size() const
+{
+    return store_.size();
+}
+
+void
+SemanticMemory::compact()
+{
+    store_.compact();
+    index_.compact([this](uint64_t id) { return store_.contains(id); });
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "embedder.h"
+#include "memory/memory_store.h"
+#include "memory/vector_index.h"
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief A recalled record and how close it is to the query
+struct MemoryMatch
+{
+    MemoryRecord record;
+    float score = 0.0F;
+};
+
+/// @brief Long-term agent memory recalled by meaning as well as by key
+///
+/// Records live in a MemoryStore (records.log) and their embeddings in a
+/// VectorIndex (vectors.idx), both in one directory. recall() embeds the
+/// query and returns the closest current records; overwritten and forgotten
+/// ones are skipped until compact() drops them from both files.
+///
+/// Usage:
+///   auto embedder = agent_cpp::Embedder::create(embedding_weights);
+///   auto memory =
+///     std::make_shared<agent_cpp::SemanticMemory>("memory", embedder);
+///   memory->remember("favorite_color", "The user's favorite color is teal");
+///   auto matches = memory->recall("what colors does the user like?", 3);
+class SemanticMemory
+{
+  public:
+    /// @throws agent_cpp::MemoryError if the files can't be opened
+    SemanticMemory(const std::string& directory,
+                   std::shared_ptr<Embedder> embedder);
+
+    /// @brief Store text under key and index its embedding
+    /// @return Id of the new record
+    uint64_t remember(const std::string& key, const std::string& text);
+
+    /// @brief Store several entries, embedding them in batches
+    void remember(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+
+    /// @brief Current record of key
+    [[nodiscard]] std::optional<MemoryRecord> read(
+      const std::string& key) const;
+
+    /// @brief The k records closest in meaning to query, closest first
+    [[nodiscard]] std::vector<MemoryMatch> recall(const std::string& query,
+                                                  size_t k) const;
+
+    /// @brief Forget key, its vector is skipped from now on
+    /// @return false if it wasn't stored
+    bool forget(const std::string& key);
+
+    [[nodiscard]] std::vector<std::string> keys() const;
+    [[nodiscard]] size_t size() const;
+
+    /// @brief Drop overwritten and forgotten entries from both files
+    void compact();
+
+  private:
+    // Text embedded for a record, the key gives short texts context
+    static std::string embedding_text(const std::string& key,
+                                      const std::string& text);
+
+    std::shared_ptr<Embedder> embedder_;
+    MemoryStore store_;
+    VectorIndex index_;
+};
+
+} // namespace agent_cpp
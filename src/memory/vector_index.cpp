@@ -0,0 +1,382 @@
+#include "memory/vector_index.h"
+#include "error.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <queue>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AGENT_CPP_DOT_AVX2
+#include <immintrin.h>
+#endif
+
+// vfmaq_f32 and vaddvq_f32 are AArch64 only, 32-bit ARM uses the scalar loop
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define AGENT_CPP_DOT_NEON
+#include <arm_neon.h>
+#endif
+
+namespace agent_cpp {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t kMagic = 0x58444941; // "AIDX"
+constexpr uint32_t kVersion = 1;
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t reserved;
+};
+
+float
+dot_scalar(const float* a, const float* b, size_t n)
+{
+    // Independent sums let the compiler vectorize and pipeline the loop
+    float sum[4] = { 0.0F, 0.0F, 0.0F, 0.0F };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum[0] += a[i] * b[i];
+        sum[1] += a[i + 1] * b[i + 1];
+        sum[2] += a[i + 2] * b[i + 2];
+        sum[3] += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; i++) {
+        sum[0] += a[i] * b[i];
+    }
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#ifdef AGENT_CPP_DOT_AVX2
+// Compiled for AVX2 regardless of the build flags, only called after the
+// CPU was checked for it
+__attribute__((target("avx2,fma"))) float
+dot_avx2(const float* a, const float* b, size_t n)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(
+          _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(
+          _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_fmadd_ps(
+          _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    const __m256 sum = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum),
+                             _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    float result = _mm_cvtss_f32(half);
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+#endif
+
+#ifdef AGENT_CPP_DOT_NEON
+float
+dot_neon(const float* a, const float* b, size_t n)
+{
+    float32x4_t sum0 = vdupq_n_f32(0.0F);
+    float32x4_t sum1 = vdupq_n_f32(0.0F);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float result = vaddvq_f32(vaddq_f32(sum0, sum1));
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+#endif
+
+using DotFunction = float (*)(const float*, const float*, size_t);
+
+DotFunction
+select_dot()
+{
+#ifdef AGENT_CPP_DOT_NEON
+    return dot_neon;
+#else
+#ifdef AGENT_CPP_DOT_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return dot_avx2;
+    }
+#endif
+    return dot_scalar;
+#endif
+}
+
+} // anonymous namespace
+
+float
+dot_product(const float* a, const float* b, size_t n)
+{
+    static const DotFunction dot = select_dot();
+    return dot(a, b, n);
+}
+
+VectorIndex::VectorIndex(std::string path, size_t dim)
+  : path_(std::move(path))
+  , dim_(dim)
+  , row_size_(sizeof(uint64_t) + dim * sizeof(float))
+{
+    if (dim_ == 0) {
+        throw MemoryError("vector index dim must be at least 1");
+    }
+    const fs::path parent = fs::path(path_).parent_path();
+    if (!parent.empty()) {
+        std::error_code ec;
+        fs::create_directories(parent, ec);
+    }
+    open();
+}
+
+VectorIndex::~VectorIndex()
+{
+    close();
+}
+
+void
+VectorIndex::open()
+{
+    std::error_code ec;
+    uint64_t size = fs::exists(path_, ec) ? fs::file_size(path_, ec) : 0;
+    if (ec) {
+        throw MemoryError("unable to stat '" + path_ + "'");
+    }
+
+    if (size < sizeof(Header)) {
+        // New index, or one torn before its header was complete
+        std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+        const Header header{ kMagic,
+                             kVersion,
+                             static_cast<uint32_t>(dim_),
+                             0 };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!file) {
+            throw MemoryError("unable to create '" + path_ + "'");
+        }
+        size = sizeof(Header);
+    }
+
+    Header header{};
+    {
+        std::ifstream file(path_, std::ios::binary);
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || header.magic != kMagic || header.version != kVersion) {
+            throw MemoryError("'" + path_ + "' is not a vector index");
+        }
+    }
+    if (header.dim != dim_) {
+        throw MemoryError("'" + path_ + "' holds vectors of " +
+                          std::to_string(header.dim) + " floats, not " +
+                          std::to_string(dim_));
+    }
+
+    // A row torn by a crash is cut off
+    n_mapped_ = static_cast<size_t>((size - sizeof(Header)) / row_size_);
+    const uint64_t valid_size = sizeof(Header) + n_mapped_ * row_size_;
+    if (valid_size < size) {
+        fs::resize_file(path_, valid_size, ec);
+        size = valid_size;
+    }
+
+    if (n_mapped_ > 0) {
+#ifndef _WIN32
+        const int fd = ::open(path_.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw MemoryError("unable to open '" + path_ + "'");
+        }
+        void* mapped = mmap(nullptr,
+                            static_cast<size_t>(size),
+                            PROT_READ,
+                            MAP_PRIVATE,
+                            fd,
+                            0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            throw MemoryError("unable to map '" + path_ + "'");
+        }
+        mapped_ = static_cast<const uint8_t*>(mapped);
+#else
+        std::ifstream file(path_, std::ios::binary);
+        buffer_.resize(static_cast<size_t>(size));
+        if (!file.read(reinterpret_cast<char*>(buffer_.data()),
+                       static_cast<std::streamsize>(size))) {
+            throw MemoryError("unable to read '" + path_ + "'");
+        }
+        mapped_ = buffer_.data();
+#endif
+        mapped_size_ = static_cast<size_t>(size);
+    }
+
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr) {
+        close();
+        throw MemoryError("unable to open '" + path_ + "' for writing");
+    }
+}
+
+void
+VectorIndex::close()
+{
+    if (file_ != nullptr) {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+#ifndef _WIN32
+    if (mapped_ != nullptr) {
+        munmap(const_cast<uint8_t*>(mapped_), mapped_size_);
+    }
+#endif
+    buffer_.clear();
+    mapped_ = nullptr;
+    mapped_size_ = 0;
+    n_mapped_ = 0;
+    appended_.clear();
+    n_appended_ = 0;
+}
+
+const uint8_t*
+VectorIndex::row(size_t i) const
+{
+    if (i < n_mapped_) {
+        return mapped_ + sizeof(Header) + i * row_size_;
+    }
+    return appended_.data() + (i - n_mapped_) * row_size_;
+}
+
+void
+VectorIndex::add(uint64_t id, const float* vector)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const size_t offset = appended_.size();
+    appended_.resize(offset + row_size_);
+    std::memcpy(appended_.data() + offset, &id, sizeof(id));
+    std::memcpy(
+      appended_.data() + offset + sizeof(id), vector, dim_ * sizeof(float));
+
+    if (std::fwrite(appended_.data() + offset, row_size_, 1, file_) != 1 ||
+        std::fflush(file_) != 0) {
+        appended_.resize(offset);
+        throw MemoryError("unable to append to '" + path_ + "'");
+    }
+    n_appended_++;
+}
+
+std::vector<VectorMatch>
+VectorIndex::search(const float* query,
+                    size_t k,
+                    const std::function<bool(uint64_t)>& accept) const
+{
+    auto worse = [](const VectorMatch& a, const VectorMatch& b) {
+        return a.score > b.score;
+    };
+    // Min-heap of the best k so far, its top is the one to beat
+    std::priority_queue<VectorMatch, std::vector<VectorMatch>, decltype(worse)>
+      best(worse);
+    if (k == 0) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t n_rows = n_mapped_ + n_appended_;
+    for (size_t i = 0; i < n_rows; i++) {
+        const uint8_t* data = row(i);
+        // Rows are only 4-byte aligned, the id is copied out
+        VectorMatch match;
+        std::memcpy(&match.id, data, sizeof(match.id));
+        match.score = dot_product(
+          query, reinterpret_cast<const float*>(data + sizeof(uint64_t)), dim_);
+
+        if (best.size() == k && match.score <= best.top().score) {
+            continue;
+        }
+        if (accept && !accept(match.id)) {
+            continue;
+        }
+        best.push(match);
+        if (best.size() > k) {
+            best.pop();
+        }
+    }
+
+    std::vector<VectorMatch> matches(best.size());
+    for (size_t i = matches.size(); i > 0; i--) {
+        matches[i - 1] = best.top();
+        best.pop();
+    }
+    return matches;
+}
+
+void
+VectorIndex::compact(const std::function<bool(uint64_t)>& keep)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const std::string tmp_path = path_ + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        const Header header{ kMagic,
+                             kVersion,
+                             static_cast<uint32_t>(dim_),
+                             0 };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t i = 0; i < n_mapped_ + n_appended_; i++) {
+            const uint8_t* data = row(i);
+            uint64_t id = 0;
+            std::memcpy(&id, data, sizeof(id));
+            if (keep(id)) {
+                file.write(reinterpret_cast<const char*>(data),
+                           static_cast<std::streamsize>(row_size_));
+            }
+        }
+        if (!file) {
+            file.close();
+            std::error_code ec;
+            fs::remove(tmp_path, ec);
+            throw MemoryError("unable to compact '" + path_ + "'");
+        }
+    }
+
+    close();
+    std::error_code ec;
+    fs::rename(tmp_path, path_, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+        open();
+        throw MemoryError("unable to replace '" + path_ + "'");
+    }
+    open();
+}
+
+size_t
+VectorIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return n_mapped_ + n_appended_;
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief Dot product of two vectors of n floats
+/// Uses AVX2/FMA or NEON where the CPU has them
+float
+dot_product(const float* a, const float* b, size_t n);
+
+/// @brief A search hit, higher scores are closer
+struct VectorMatch
+{
+    uint64_t id = 0;
+    float score = 0.0F;
+};
+
+/// @brief Flat, append-only index of vectors for exact top-k search
+///
+/// The file holds a small header and one row per vector: its id and dim
+/// floats. Rows already in the file are memory mapped rather than read, so
+/// opening an index of millions of vectors costs no copy; rows added since
+/// are appended to the file and kept in memory until the next open. search()
+/// scores every row with dot_product(), which ranks unit-length vectors by
+/// cosine similarity. Thread safe.
+///
+/// Usage:
+///   agent_cpp::VectorIndex index("memory/vectors.idx", embedder->n_embd());
+///   index.add(id, vector.data());
+///   auto hits = index.search(query.data(), 5);
+class VectorIndex
+{
+  public:
+    /// @throws agent_cpp::MemoryError if the file can't be opened or was
+    /// written with another dim
+    VectorIndex(std::string path, size_t dim);
+    ~VectorIndex();
+
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    /// @brief Append the dim floats at vector under id
+    /// @throws agent_cpp::MemoryError if the row can't be written
+    void add(uint64_t id, const float* vector);
+
+    /// @brief The k rows scoring highest against query, best first
+    /// @param accept If set, rows it returns false for are skipped, e.g. ids
+    /// of records that were overwritten
+    [[nodiscard]] std::vector<VectorMatch> search(
+      const float* query,
+      size_t k,
+      const std::function<bool(uint64_t)>& accept = nullptr) const;
+
+    /// @brief Rewrite the file with only the rows keep returns true for
+    /// @throws agent_cpp::MemoryError if the new file can't be written
+    void compact(const std::function<bool(uint64_t)>& keep);
+
+    /// @brief Number of rows, including ones search() may skip
+    [[nodiscard]] size_t size() const;
+
+    [[nodiscard]] size_t dim() const { return dim_; }
+
+  private:
+    void open();
+    void close();
+    // Row i of the mapped part, or of the appended part past it
+    const uint8_t* row(size_t i) const;
+
+    std::string path_;
+    size_t dim_ = 0;
+    size_t row_size_ = 0;
+    std::FILE* file_ = nullptr;
+    mutable std::mutex mutex_;
+
+    // Rows present when the file was opened
+    const uint8_t* mapped_ = nullptr;
+    size_t mapped_size_ = 0;
+    std::vector<uint8_t> buffer_; // Holds them where mmap isn't used
+    size_t n_mapped_ = 0;
+
+    // Rows added since, laid out the same way
+    std::vector<uint8_t> appended_;
+    size_t n_appended_ = 0;
+};
+
+} // namespace agent_cpp
@@ -1,22 +1,229 @@
 #include "model.h"
+#include "batched_model.h"
 #include "chat.h"
+#include "common.h"
 #include "error.h"
+#include "model_weights_registry.h"
+#include "state_snapshot.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 
 namespace agent_cpp {
 
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Bytes reserved for a response up front, enough for most replies and tool
+// calls without growing the buffer while streaming
+constexpr size_t kResponseReserve = 4096;
+
+// Writes snapshots in the background, one at a time so checkpoints of many
+// sessions don't compete for the disk. Drains pending writes at exit.
+ThreadPool&
+snapshot_writer()
+{
+    static ThreadPool pool(1);
+    return pool;
+}
+
+double
+elapsed_ms(Clock::time_point start, Clock::time_point end = Clock::now())
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Mirrors how llama.cpp's server turns chat params into a grammar sampler
+llama_sampler*
+init_grammar_sampler(const llama_vocab* vocab, const common_chat_params& params)
+{
+    if (!params.grammar_lazy) {
+        return llama_sampler_init_grammar(
+          vocab, params.grammar.c_str(), "root");
+    }
+
+    std::vector<std::string> patterns_anywhere;
+    std::vector<std::string> patterns;
+    std::vector<llama_token> trigger_tokens;
+
+    for (const auto& trigger : params.grammar_triggers) {
+        switch (trigger.type) {
+            case COMMON_GRAMMAR_TRIGGER_TYPE_WORD: {
+                // A word that is a single preserved token triggers on the
+                // token itself
+                if (std::find(params.preserved_tokens.begin(),
+                              params.preserved_tokens.end(),
+                              trigger.value) != params.preserved_tokens.end()) {
+                    auto ids =
+                      common_tokenize(vocab, trigger.value, false, true);
+                    if (ids.size() == 1) {
+                        trigger_tokens.push_back(ids[0]);
+                        break;
+                    }
+                }
+                patterns_anywhere.push_back(regex_escape(trigger.value));
+                break;
+            }
+            case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN:
+                patterns_anywhere.push_back(trigger.value);
+                break;
+            case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN_FULL: {
+                const auto& pattern = trigger.value;
+                std::string anchored = "^$";
+                if (!pattern.empty()) {
+                    anchored = (pattern.front() != '^' ? "^" : "") + pattern +
+                               (pattern.back() != '$' ? "$" : "");
+                }
+                patterns.push_back(anchored);
+                break;
+            }
+            case COMMON_GRAMMAR_TRIGGER_TYPE_TOKEN:
+                trigger_tokens.push_back(trigger.token);
+                break;
+        }
+    }
+
+    if (!patterns_anywhere.empty()) {
+        const std::string anywhere = string_join(patterns_anywhere, "|");
+        patterns.push_back("^[\\s\\S]*?(" + anywhere + ")[\\s\\S]*");
+    }
+
+    std::vector<const char*> pattern_ptrs;
+    pattern_ptrs.reserve(patterns.size());
+    for (const auto& pattern : patterns) {
+        pattern_ptrs.push_back(pattern.c_str());
+    }
+
+    return llama_sampler_init_grammar_lazy_patterns(vocab,
+                                                    params.grammar.c_str(),
+                                                    "root",
+                                                    pattern_ptrs.data(),
+                                                    pattern_ptrs.size(),
+                                                    trigger_tokens.data(),
+                                                    trigger_tokens.size());
+}
+
+llama_sampler*
+init_sampler_chain(const ModelConfig& config, float temp, uint32_t seed)
+{
+    llama_sampler* chain =
+      llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(config.top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(config.top_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(config.min_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(temp));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+    return chain;
+}
+
+// Log-probability of token under the logits of a vocabulary of n_vocab
+double
+token_logprob(const float* logits, int n_vocab, llama_token token)
+{
+    const float max_logit = *std::max_element(logits, logits + n_vocab);
+    double sum = 0;
+    for (int i = 0; i < n_vocab; i++) {
+        sum += std::exp(static_cast<double>(logits[i] - max_logit));
+    }
+    return static_cast<double>(logits[token] - max_logit) - std::log(sum);
+}
+
+} // anonymous namespace
+
+int
+plan_context_shift(int n_past,
+                   int n_tokens,
+                   int n_ctx,
+                   int n_keep,
+                   int n_discard)
+{
+    const int n_needed = n_past + n_tokens - n_ctx;
+    if (n_needed <= 0) {
+        return 0;
+    }
+    const int n_left = n_past - n_keep;
+    const int n_chunk = n_discard > 0 ? n_discard : n_left / 2;
+    const int n_shift = std::max(n_chunk, n_needed);
+    return n_shift > n_left ? -1 : n_shift;
+}
+
+bool
+map_shifted_prompt(const std::vector<llama_token>& prompt,
+                   const std::vector<llama_token>& cached,
+                   size_t n_keep,
+                   const std::vector<llama_token>& discarded,
+                   std::vector<llama_token>& mapped)
+{
+    if (discarded.empty() || cached.size() < n_keep ||
+        prompt.size() < n_keep + discarded.size() ||
+        !std::equal(cached.begin(), cached.begin() + n_keep, prompt.begin()) ||
+        !std::equal(
+          discarded.begin(), discarded.end(), prompt.begin() + n_keep)) {
+        return false;
+    }
+
+    mapped.reserve(prompt.size() - discarded.size());
+    mapped.assign(prompt.begin(), prompt.begin() + n_keep);
+    mapped.insert(
+      mapped.end(), prompt.begin() + n_keep + discarded.size(), prompt.end());
+    return true;
+}
+
 std::shared_ptr<ModelWeights>
-ModelWeights::create(const std::string& model_path)
+ModelWeights::create(const std::string& model_path,
+                     const ModelWeightsConfig& config)
 {
     std::shared_ptr<ModelWeights> weights(new ModelWeights());
 
     ggml_backend_load_all();
 
     llama_model_params model_params = llama_model_default_params();
+    if (config.n_gpu_layers >= 0) {
+        model_params.n_gpu_layers = config.n_gpu_layers;
+    }
+    model_params.split_mode = config.split_mode;
+    model_params.main_gpu = config.main_gpu;
+    model_params.use_mmap = config.use_mmap;
+    model_params.use_mlock = config.use_mlock;
+
+    // llama.cpp reads one entry per possible device
+    std::vector<float> tensor_split;
+    if (!config.tensor_split.empty()) {
+        if (config.tensor_split.size() > llama_max_devices()) {
+            throw ModelError("tensor_split has more entries than the " +
+                             std::to_string(llama_max_devices()) +
+                             " supported devices");
+        }
+        tensor_split = config.tensor_split;
+        tensor_split.resize(llama_max_devices(), 0.0F);
+        model_params.tensor_split = tensor_split.data();
+    }
+
+    bool aborted = false;
+    struct Progress
+    {
+        const std::function<bool(float)>* callback;
+        bool* aborted;
+    } progress{ &config.on_progress, &aborted };
+    if (config.on_progress) {
+        model_params.progress_callback = [](float value, void* user_data) {
+            auto* progress = static_cast<Progress*>(user_data);
+            const bool keep_going = (*progress->callback)(value);
+            *progress->aborted = !keep_going;
+            return keep_going;
+        };
+        model_params.progress_callback_user_data = &progress;
+    }
+
     weights->model_ =
       llama_model_load_from_file(model_path.c_str(), model_params);
     if (weights->model_ == nullptr) {
+        if (aborted) {
+            throw ModelError("loading '" + model_path + "' was aborted");
+        }
         throw ModelError("unable to load model from '" + model_path + "'");
     }
 
@@ -41,7 +248,7 @@ ModelWeights::~ModelWeights()
 std::shared_ptr<Model>
 Model::create(const std::string& model_path, const ModelConfig& model_config)
 {
-    auto weights = ModelWeights::create(model_path);
+    auto weights = ModelWeightsRegistry::global().get(model_path);
     return create_with_weights(std::move(weights), model_config);
 }
 
@@ -55,15 +262,54 @@ Model::create_with_weights(std::shared_ptr<ModelWeights> weights,
     return model;
 }
 
+std::shared_ptr<Model>
+Model::fork() const
+{
+    std::shared_ptr<Model> branch;
+    if (scheduler_) {
+        branch = scheduler_->create_session(*this, config_);
+    } else {
+        branch = create_with_weights(weights_, config_);
+        if (!branch->copy_state_from(*this)) {
+            throw ModelError("failed to copy the KV cache into the fork");
+        }
+    }
+
+    // The branch continues the same conversation, so it can keep rendering
+    // incrementally and shifting the same span
+    branch->prompt_builder_ = prompt_builder_;
+    branch->n_keep_ = n_keep_;
+    branch->shift_keep_ = shift_keep_;
+    branch->discarded_tokens_ = discarded_tokens_;
+    return branch;
+}
+
 Model::~Model()
 {
+    release();
+    // weights_ is automatically released when ref count drops to zero
+}
+
+void
+Model::release()
+{
+    drafter_.reset();
+    if (grammar_ != nullptr) {
+        llama_sampler_free(grammar_);
+        grammar_ = nullptr;
+    }
     if (sampler_ != nullptr) {
         llama_sampler_free(sampler_);
+        sampler_ = nullptr;
     }
-    if (ctx_ != nullptr) {
+    if (scheduler_) {
+        // The context belongs to the scheduler, only give back our sequence
+        scheduler_->release_session(seq_id_);
+        scheduler_.reset();
+    } else if (ctx_ != nullptr) {
         llama_free(ctx_);
     }
-    // weights_ is automatically released when ref count drops to zero
+    ctx_ = nullptr;
 }
 
 Model::Model(Model&& other) noexcept
@@ -73,22 +319,37 @@ Model::Model(Model&& other) noexcept
   , processed_tokens_(std::move(other.processed_tokens_))
   , n_past_(other.n_past_)
   , config_(other.config_)
+  , n_keep_(other.n_keep_)
+  , shift_keep_(other.shift_keep_)
+  , discarded_tokens_(std::move(other.discarded_tokens_))
+  , prompt_builder_(std::move(other.prompt_builder_))
+  , drafter_(std::move(other.drafter_))
+  , grammar_(other.grammar_)
+  , stops_(std::move(other.stops_))
+  , stop_requested_(other.stop_requested_)
+  , cancel_(std::move(other.cancel_))
+  , candidates_(std::move(other.candidates_))
+  , piece_(std::move(other.piece_))
+  , stats_(other.stats_)
+  , generation_start_(other.generation_start_)
+  , first_token_at_(other.first_token_at_)
+  , scheduler_(std::move(other.scheduler_))
+  , seq_id_(other.seq_id_)
 {
     other.ctx_ = nullptr;
     other.sampler_ = nullptr;
+    other.grammar_ = nullptr;
     other.n_past_ = 0;
+    if (scheduler_) {
+        scheduler_->rebind_session(*this);
+    }
 }
 
 Model&
 Model::operator=(Model&& other) noexcept
 {
     if (this != &other) {
-        if (sampler_ != nullptr) {
-            llama_sampler_free(sampler_);
-        }
-        if (ctx_ != nullptr) {
-            llama_free(ctx_);
-        }
+        release();
 
         weights_ = std::move(other.weights_);
         ctx_ = other.ctx_;
@@ -96,10 +357,30 @@ Model::operator=(Model&& other) noexcept
         processed_tokens_ = std::move(other.processed_tokens_);
         n_past_ = other.n_past_;
         config_ = other.config_;
+        n_keep_ = other.n_keep_;
+        shift_keep_ = other.shift_keep_;
+        discarded_tokens_ = std::move(other.discarded_tokens_);
+        prompt_builder_ = std::move(other.prompt_builder_);
+        drafter_ = std::move(other.drafter_);
+        grammar_ = other.grammar_;
+        stops_ = std::move(other.stops_);
+        stop_requested_ = other.stop_requested_;
+        cancel_ = std::move(other.cancel_);
+        candidates_ = std::move(other.candidates_);
+        piece_ = std::move(other.piece_);
+        stats_ = other.stats_;
+        generation_start_ = other.generation_start_;
+        first_token_at_ = other.first_token_at_;
+        scheduler_ = std::move(other.scheduler_);
+        seq_id_ = other.seq_id_;
 
         other.ctx_ = nullptr;
         other.sampler_ = nullptr;
+        other.grammar_ = nullptr;
         other.n_past_ = 0;
+        if (scheduler_) {
+            scheduler_->rebind_session(*this);
+        }
     }
     return *this;
 }
@@ -108,31 +389,60 @@ void
 Model::initialize_context(const ModelConfig& model_config)
 {
     config_ = model_config;
+    prompt_builder_.set_enabled(model_config.incremental_prompt);
 
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = model_config.n_ctx;
     ctx_params.n_batch = model_config.n_batch;
     ctx_params.n_threads = model_config.n_threads;
     ctx_params.n_threads_batch = model_config.n_threads_batch;
+    if (model_config.threadpool) {
+        ctx_params.n_threads = model_config.threadpool->n_threads();
+        ctx_params.n_threads_batch = model_config.threadpool->n_threads_batch();
+    }
+    if (model_config.n_ubatch > 0) {
+        ctx_params.n_ubatch = model_config.n_ubatch;
+    }
     ctx_params.type_k = model_config.cache_type_k;
     ctx_params.type_v = model_config.cache_type_v;
+    ctx_params.flash_attn_type = model_config.flash_attn;
+    ctx_params.offload_kqv = model_config.offload_kqv;
+    if (model_config.n_seq_max > 1) {
+        ctx_params.n_seq_max = static_cast<uint32_t>(model_config.n_seq_max);
+        ctx_params.kv_unified = true;
+    }
 
     ctx_ = llama_init_from_model(weights_->get_model(), ctx_params);
     if (ctx_ == nullptr) {
         throw ModelError("failed to create llama context");
     }
+    if (model_config.threadpool) {
+        llama_attach_threadpool(ctx_,
+                                model_config.threadpool->get(),
+                                model_config.threadpool->get_batch());
+    }
 
-    sampler_ = llama_sampler_chain_init(llama_sampler_chain_default_params());
-    llama_sampler_chain_add(sampler_,
-                            llama_sampler_init_top_k(model_config.top_k));
-    llama_sampler_chain_add(sampler_,
-                            llama_sampler_init_top_p(model_config.top_p, 1));
-    llama_sampler_chain_add(sampler_,
-                            llama_sampler_init_min_p(model_config.min_p, 1));
-    llama_sampler_chain_add(sampler_,
-                            llama_sampler_init_temp(model_config.temp));
-    llama_sampler_chain_add(sampler_,
-                            llama_sampler_init_dist(model_config.seed));
+    initialize_sampler(model_config);
+
+    if (model_config.speculative.enabled()) {
+        drafter_ = std::make_unique<Drafter>(model_config.speculative,
+                                             weights_->get_vocab(),
+                                             llama_n_ctx(ctx_),
+                                             llama_n_batch(ctx_),
+                                             model_config.n_threads,
+                                             model_config.n_threads_batch,
+                                             model_config.threadpool);
+    }
+}
+
+void
+Model::initialize_sampler(const ModelConfig& model_config)
+{
+    sampler_ =
+      init_sampler_chain(model_config, model_config.temp, model_config.seed);
+
+    stops_ = model_config.stop_sequences;
+    n_keep_ = model_config.n_keep;
 }
 
 std::vector<llama_token>
@@ -163,46 +473,607 @@ Model::tokenize(const std::string& prompt) const
 common_chat_msg
 Model::generate(const std::vector<common_chat_msg>& messages,
                 const std::vector<common_chat_tool>& tools,
-                const ResponseCallback& callback)
+                const ResponseCallback& callback,
+                const GenerationEventCallback& on_event,
+                const CancellationToken& cancel)
 {
-    common_chat_templates_inputs inputs;
-    inputs.messages = messages;
-    inputs.tools = tools;
-    inputs.tool_choice = COMMON_CHAT_TOOL_CHOICE_AUTO;
-    inputs.add_generation_prompt = true;
-    inputs.enable_thinking = false;
-
-    auto params =
-      common_chat_templates_apply(weights_->get_templates(), inputs);
-
-    // Tokenize the prompt
-    std::vector<llama_token> prompt_tokens = tokenize(params.prompt);
+    // Tokens already in the KV cache decide BOS handling, see tokenize()
+    const auto build_start = Clock::now();
+    std::vector<llama_token> prompt_tokens;
+    auto params = prompt_builder_.build(weights_->get_templates(),
+                                        weights_->get_vocab(),
+                                        messages,
+                                        tools,
+                                        processed_tokens_.empty(),
+                                        prompt_tokens);
+    const double build_ms = elapsed_ms(build_start);
     if (prompt_tokens.empty()) {
         throw ModelError("failed to tokenize prompt");
     }
 
-    std::string response = generate_from_tokens(prompt_tokens, callback);
-
     common_chat_syntax syntax;
     // Use explicitly configured format, or fall back to auto-detected format
     syntax.format = config_.chat_format.value_or(params.format);
     syntax.parse_tool_calls = true;
 
+    std::optional<ChatStreamParser> stream_parser;
+    std::vector<GenerationEvent> events;
+    auto dispatch = [&]() {
+        for (const auto& event : events) {
+            if (!on_event(event)) {
+                stop_requested_ = true;
+                break;
+            }
+        }
+        events.clear();
+    };
+
+    ResponseCallback stream_callback = callback;
+    if (on_event) {
+        stream_parser.emplace(syntax);
+        stream_callback = [&](std::string_view chunk) {
+            if (callback) {
+                callback(chunk);
+            }
+            if (!stop_requested_) {
+                stream_parser->push(chunk, events);
+                dispatch();
+            }
+        };
+    }
+
+    begin_constraints(params);
+    cancel_ = cancel;
+    std::string response;
+    try {
+        response = generate_from_tokens(prompt_tokens, stream_callback);
+    } catch (...) {
+        end_constraints();
+        throw;
+    }
+    const bool stopped_early = stop_requested_;
+    end_constraints();
+
+    stats_.tokenize_ms = prompt_builder_.last_tokenize_ms();
+    stats_.render_ms = build_ms - stats_.tokenize_ms;
+    if (stats_.decoded_tokens > 0) {
+        stats_.ttft_ms += build_ms;
+    }
+
     auto parsed_msg = common_chat_parse(response, false, syntax);
     parsed_msg.role = "assistant";
 
+    if (stream_parser && !stopped_early) {
+        stream_parser->finish(parsed_msg, events);
+        dispatch();
+    }
+
     return parsed_msg;
 }
 
+std::vector<Candidate>
+Model::generate_candidates(const std::vector<common_chat_msg>& messages,
+                           const std::vector<common_chat_tool>& tools,
+                           const CandidateConfig& config,
+                           const CancellationToken& cancel)
+{
+    if (scheduler_) {
+        throw ModelError("generate_candidates is not supported for sessions "
+                         "of a BatchedModel");
+    }
+    const int n = config.n;
+    if (n < 1 || n > static_cast<int>(llama_n_seq_max(ctx_))) {
+        throw ModelError("generate_candidates with " + std::to_string(n) +
+                         " candidates needs ModelConfig::n_seq_max of at "
+                         "least " +
+                         std::to_string(std::max(n, 1)));
+    }
+
+    const auto build_start = Clock::now();
+    std::vector<llama_token> prompt_tokens;
+    auto params = prompt_builder_.build(weights_->get_templates(),
+                                        weights_->get_vocab(),
+                                        messages,
+                                        tools,
+                                        processed_tokens_.empty(),
+                                        prompt_tokens);
+    const double build_ms = elapsed_ms(build_start);
+    if (prompt_tokens.empty()) {
+        throw ModelError("failed to tokenize prompt");
+    }
+
+    common_chat_syntax syntax;
+    syntax.format = config_.chat_format.value_or(params.format);
+    syntax.parse_tool_calls = true;
+
+    stats_ = GenerationStats{};
+    stats_.prompt_tokens = static_cast<int>(prompt_tokens.size());
+    generation_start_ = Clock::now();
+
+    llama_memory_t mem = llama_get_memory(ctx_);
+
+    struct Sequence
+    {
+        llama_sampler* chain = nullptr;
+        llama_sampler* grammar = nullptr;
+        StopMatcher response;
+        llama_token last = 0;
+        int n_tokens = 0;
+        double logprob = 0;
+        bool done = false;
+    };
+    std::vector<Sequence> sequences(n);
+    llama_batch batch = llama_batch_init(n, 0, 1);
+
+    // Only sequence 0 holds anything afterwards: the prompt
+    auto release_sequences = [&]() {
+        for (int i = 0; i < n; i++) {
+            if (i > 0) {
+                llama_memory_seq_rm(mem, i, -1, -1);
+            }
+            if (sequences[i].chain != nullptr) {
+                llama_sampler_free(sequences[i].chain);
+            }
+            if (sequences[i].grammar != nullptr) {
+                llama_sampler_free(sequences[i].grammar);
+            }
+        }
+        llama_memory_seq_rm(mem, seq_id_, n_past_, -1);
+        llama_batch_free(batch);
+        end_constraints();
+    };
+
+    std::vector<Candidate> candidates(n);
+    begin_constraints(params);
+    cancel_ = cancel;
+    try {
+        prefill(prompt_tokens, true);
+        const llama_pos n_prompt = n_past_;
+
+        const float temp = config.temp.value_or(config_.temp);
+        for (int i = 0; i < n; i++) {
+            const uint32_t seed = config.seed == LLAMA_DEFAULT_SEED
+                                    ? LLAMA_DEFAULT_SEED
+                                    : config.seed + static_cast<uint32_t>(i);
+            sequences[i].chain = init_sampler_chain(config_, temp, seed);
+            if (grammar_ != nullptr) {
+                sequences[i].grammar = llama_sampler_clone(grammar_);
+            }
+            sequences[i].response = StopMatcher(stops_);
+            if (i > 0) {
+                // Shares the prompt's cells, nothing is copied
+                llama_memory_seq_rm(mem, i, -1, -1);
+                llama_memory_seq_cp(mem, seq_id_, i, -1, -1);
+            }
+        }
+
+        const llama_vocab* vocab = weights_->get_vocab();
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        auto accept = [&](Sequence& sequence, int32_t idx) {
+            const llama_token token =
+              sample(sequence.chain, sequence.grammar, idx);
+            if (config.logprobs) {
+                sequence.logprob += token_logprob(
+                  llama_get_logits_ith(ctx_, idx), n_vocab, token);
+            }
+            if (llama_vocab_is_eog(vocab, token)) {
+                sequence.done = true;
+                return;
+            }
+            record_token();
+            sequence.n_tokens++;
+            token_to_piece(token, piece_);
+            sequence.response.push(piece_);
+            // The token completing a stop sequence is not decoded
+            sequence.done = sequence.response.stopped() ||
+                            (config.max_tokens > 0 &&
+                             sequence.n_tokens >= config.max_tokens);
+            sequence.last = token;
+        };
+
+        // Every candidate starts from the logits of the prompt
+        for (auto& sequence : sequences) {
+            accept(sequence, -1);
+        }
+
+        const int n_ctx = static_cast<int>(llama_n_ctx(ctx_));
+        int n_cells = n_past_;
+        std::vector<int> in_batch;
+        while (true) {
+            common_batch_clear(batch);
+            in_batch.clear();
+            for (int i = 0; i < n; i++) {
+                if (!sequences[i].done) {
+                    common_batch_add(batch,
+                                     sequences[i].last,
+                                     n_prompt + sequences[i].n_tokens - 1,
+                                     { i },
+                                     true);
+                    in_batch.push_back(i);
+                }
+            }
+            if (in_batch.empty()) {
+                break;
+            }
+
+            cancel_.throw_if_cancelled();
+            // The sequences share the cache, each of them fills cells
+            if (n_cells + static_cast<int>(in_batch.size()) > n_ctx) {
+                throw ModelError("context size exceeded during generation");
+            }
+            if (decode(batch) != 0) {
+                throw ModelError("failed to decode token");
+            }
+            n_cells += static_cast<int>(in_batch.size());
+
+            for (size_t j = 0; j < in_batch.size(); j++) {
+                accept(sequences[in_batch[j]], static_cast<int32_t>(j));
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            sequences[i].response.flush();
+            candidates[i].text = sequences[i].response.take_text();
+            candidates[i].n_tokens = sequences[i].n_tokens;
+            candidates[i].logprob = sequences[i].logprob;
+        }
+    } catch (...) {
+        release_sequences();
+        throw;
+    }
+    release_sequences();
+
+    if (stats_.decoded_tokens > 0) {
+        stats_.decode_ms = elapsed_ms(first_token_at_);
+        stats_.ttft_ms += build_ms;
+    }
+    stats_.tokenize_ms = prompt_builder_.last_tokenize_ms();
+    stats_.render_ms = build_ms - stats_.tokenize_ms;
+
+    for (auto& candidate : candidates) {
+        candidate.message = common_chat_parse(candidate.text, false, syntax);
+        candidate.message.role = "assistant";
+    }
+    return candidates;
+}
+
+void
+Model::begin_constraints(const common_chat_params& params)
+{
+    stop_requested_ = false;
+    stops_ = config_.stop_sequences;
+    stops_.insert(stops_.end(),
+                  params.additional_stops.begin(),
+                  params.additional_stops.end());
+
+    if (config_.use_grammar && !params.grammar.empty()) {
+        grammar_ = init_grammar_sampler(weights_->get_vocab(), params);
+        if (grammar_ == nullptr) {
+            throw ModelError("failed to initialize grammar sampler");
+        }
+    }
+}
+
+void
+Model::end_constraints()
+{
+    stop_requested_ = false;
+    cancel_ = CancellationToken();
+    if (grammar_ != nullptr) {
+        llama_sampler_free(grammar_);
+        grammar_ = nullptr;
+    }
+    stops_ = config_.stop_sequences;
+}
+
+int32_t
+Model::decode(const llama_batch& batch)
+{
+    std::unique_lock<std::mutex> compute;
+    if (config_.threadpool) {
+        compute = config_.threadpool->acquire();
+    }
+    return llama_decode(ctx_, batch);
+}
+
+llama_token
+Model::sample(int32_t idx)
+{
+    return sample(sampler_, grammar_, idx);
+}
+
+llama_token
+Model::sample(llama_sampler* chain, llama_sampler* grammar, int32_t idx)
+{
+    if (grammar == nullptr) {
+        return llama_sampler_sample(chain, ctx_, idx);
+    }
+
+    const float* logits = llama_get_logits_ith(ctx_, idx);
+    const int n_vocab = llama_vocab_n_tokens(weights_->get_vocab());
+    auto fill_candidates = [&]() {
+        candidates_.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; id++) {
+            candidates_[id] = llama_token_data{ id, logits[id], 0.0F };
+        }
+        return llama_token_data_array{
+            candidates_.data(), candidates_.size(), -1, false
+        };
+    };
+
+    llama_token_data_array cur_p = fill_candidates();
+    llama_sampler_apply(chain, &cur_p);
+    llama_token token = cur_p.data[cur_p.selected].id;
+
+    // Checking the one sampled token is much cheaper than applying the
+    // grammar to the whole vocabulary, and usually passes
+    llama_token_data single{ token, 1.0F, 0.0F };
+    llama_token_data_array single_p{ &single, 1, -1, false };
+    llama_sampler_apply(grammar, &single_p);
+
+    if (std::isinf(single.logit)) {
+        cur_p = fill_candidates();
+        llama_sampler_apply(grammar, &cur_p);
+        llama_sampler_apply(chain, &cur_p);
+        token = cur_p.data[cur_p.selected].id;
+    }
+
+    llama_sampler_accept(grammar, token);
+    llama_sampler_accept(chain, token);
+    return token;
+}
+
+std::string
+Model::token_to_piece(llama_token token) const
+{
+    std::string piece;
+    token_to_piece(token, piece);
+    return piece;
+}
+
+void
+Model::token_to_piece(llama_token token, std::string& piece) const
+{
+    // Reuses the capacity of piece, so a buffer kept across tokens stops
+    // allocating once it fits the longest piece
+    piece.resize(std::max<size_t>(piece.capacity(), 16));
+    int n = llama_token_to_piece(
+      weights_->get_vocab(), token, piece.data(), piece.size(), 0, true);
+    if (n < 0) {
+        piece.resize(static_cast<size_t>(-n));
+        n = llama_token_to_piece(
+          weights_->get_vocab(), token, piece.data(), piece.size(), 0, true);
+    }
+    if (n < 0) {
+        throw ModelError("failed to convert token to piece");
+    }
+    piece.resize(static_cast<size_t>(n));
+}
+
 std::string
 Model::generate_from_tokens(const std::vector<llama_token>& all_tokens,
                             const ResponseCallback& callback)
+{
+    stats_ = GenerationStats{};
+    stats_.prompt_tokens = static_cast<int>(all_tokens.size());
+    generation_start_ = Clock::now();
+
+    std::string text;
+    if (scheduler_) {
+        text = scheduler_->generate(*this, all_tokens, callback);
+    } else {
+        prefill(all_tokens, true);
+        text = drafter_ ? generate_speculative(callback)
+                        : generate_sequential(callback);
+    }
+
+    if (stats_.decoded_tokens > 0) {
+        stats_.decode_ms = elapsed_ms(first_token_at_);
+    }
+    return text;
+}
+
+void
+Model::record_token()
+{
+    if (stats_.decoded_tokens++ == 0) {
+        first_token_at_ = Clock::now();
+        stats_.ttft_ms = elapsed_ms(generation_start_, first_token_at_);
+        if (scheduler_) {
+            stats_.prefill_ms = stats_.ttft_ms;
+        }
+    }
+}
+
+std::string
+Model::generate_sequential(const ResponseCallback& callback)
+{
+    const llama_vocab* vocab = weights_->get_vocab();
+    StopMatcher response(stops_, config_.stream_chunk_tokens);
+    response.reserve(kResponseReserve);
+
+    llama_token new_token_id{};
+    while (true) {
+        new_token_id = sample(-1);
+
+        if (llama_vocab_is_eog(vocab, new_token_id)) {
+            break;
+        }
+        record_token();
+
+        token_to_piece(new_token_id, piece_);
+        std::string_view piece = response.push(piece_);
+
+        if (callback && !piece.empty()) {
+            callback(piece);
+        }
+
+        // The token completing the stop sequence is not decoded
+        if (response.stopped() || stop_requested_) {
+            return response.take_text();
+        }
+
+        cancel_.throw_if_cancelled();
+        reserve_context(1, "context size exceeded during generation");
+
+        llama_batch batch = llama_batch_get_one(&new_token_id, 1);
+        if (decode(batch) != 0) {
+            throw ModelError("failed to decode token");
+        }
+
+        n_past_++;
+        processed_tokens_.push_back(new_token_id);
+    }
+
+    std::string_view rest = response.flush();
+    if (callback && !rest.empty()) {
+        callback(rest);
+    }
+    return response.take_text();
+}
+
+std::string
+Model::generate_speculative(const ResponseCallback& callback)
 {
     const llama_vocab* vocab = weights_->get_vocab();
-    std::string response{};
+    StopMatcher response(stops_, config_.stream_chunk_tokens);
+    response.reserve(kResponseReserve);
     const int n_ctx = llama_n_ctx(ctx_);
+    const int n_draft = config_.speculative.n_draft;
+    llama_memory_t mem = llama_get_memory(ctx_);
+
+    llama_batch batch = llama_batch_init(n_draft + 1, 0, 1);
+    struct BatchGuard
+    {
+        llama_batch& batch;
+        ~BatchGuard() { llama_batch_free(batch); }
+    } batch_guard{ batch };
+
+    // Returns false once a stop sequence was generated
+    auto emit = [&](llama_token token) {
+        record_token();
+        token_to_piece(token, piece_);
+        std::string_view piece = response.push(piece_);
+        if (callback && !piece.empty()) {
+            callback(piece);
+        }
+        return !response.stopped() && !stop_requested_;
+    };
+
+    llama_token token = sample(-1);
+    while (!llama_vocab_is_eog(vocab, token)) {
+        if (!emit(token)) {
+            return response.take_text();
+        }
+
+        cancel_.throw_if_cancelled();
+        reserve_context(1, "context size exceeded during generation");
+
+        // Decode the sampled token together with the drafts that follow it
+        const int n_max = std::min(n_draft, n_ctx - n_past_ - 1);
+        const auto draft = drafter_->draft(processed_tokens_, token, n_max);
+
+        common_batch_clear(batch);
+        common_batch_add(batch, token, n_past_, { seq_id_ }, true);
+        for (size_t i = 0; i < draft.size(); i++) {
+            common_batch_add(
+              batch, draft[i], n_past_ + 1 + i, { seq_id_ }, true);
+        }
+        if (decode(batch) != 0) {
+            throw ModelError("failed to decode token");
+        }
+
+        n_past_++;
+        processed_tokens_.push_back(token);
+
+        // Sample after each position as if decoding one token at a time,
+        // accepting drafts for as long as they match. Output is unchanged.
+        size_t n_accepted = 0;
+        bool stopped = false;
+        llama_token next = sample(0);
+        while (n_accepted < draft.size() && next == draft[n_accepted] &&
+               !llama_vocab_is_eog(vocab, next)) {
+            if (!emit(next)) {
+                stopped = true;
+                break;
+            }
+            n_accepted++;
+            n_past_++;
+            processed_tokens_.push_back(next);
+            next = sample(static_cast<int32_t>(n_accepted));
+        }
+
+        // Drop the cells of rejected drafts so the cache matches
+        // processed_tokens_ again
+        if (n_accepted < draft.size()) {
+            llama_memory_seq_rm(mem, seq_id_, n_past_, -1);
+        }
+
+        if (stopped) {
+            return response.take_text();
+        }
+
+        token = next;
+    }
+
+    std::string_view rest = response.flush();
+    if (callback && !rest.empty()) {
+        callback(rest);
+    }
+    return response.take_text();
+}
+
+void
+Model::prefill_partial(const std::vector<common_chat_msg>& messages,
+                       const std::vector<common_chat_tool>& tools)
+{
+    const bool add_special = processed_tokens_.empty();
+    const auto tokens = prompt_builder_.build_partial(weights_->get_templates(),
+                                                      weights_->get_vocab(),
+                                                      messages,
+                                                      tools,
+                                                      add_special);
+    // Only worth a decode once it goes beyond what is cached
+    if (tokens.size() <= processed_tokens_.size() &&
+        std::equal(tokens.begin(), tokens.end(), processed_tokens_.begin())) {
+        return;
+    }
+    if (!tokens.empty()) {
+        prefill(tokens);
+    }
+}
+
+void
+Model::prefill(const std::vector<llama_token>& prompt_tokens)
+{
+    prefill(prompt_tokens, false);
+}
+
+void
+Model::prefill(const std::vector<llama_token>& prompt_tokens, bool sample_next)
+{
+    const auto start = Clock::now();
+    if (scheduler_) {
+        scheduler_->generate(*this, prompt_tokens, nullptr, true);
+        stats_.prefill_ms = elapsed_ms(start);
+        return;
+    }
+
     const int n_batch = llama_n_batch(ctx_);
 
+    // After a context shift the cache lacks a span of the conversation, drop
+    // it from the prompt too so the rest still matches
+    std::vector<llama_token> mapped;
+    const bool shifted = map_shifted_prompt(prompt_tokens,
+                                            processed_tokens_,
+                                            static_cast<size_t>(shift_keep_),
+                                            discarded_tokens_,
+                                            mapped);
+    if (!shifted) {
+        discarded_tokens_.clear();
+    }
+    const auto& all_tokens = shifted ? mapped : prompt_tokens;
+
     // Find common prefix length between processed tokens and new tokens
     size_t common_prefix = 0;
     while (common_prefix < processed_tokens_.size() &&
@@ -211,6 +1082,14 @@ Model::generate_from_tokens(const std::vector<llama_token>& all_tokens,
         common_prefix++;
     }
 
+    // Sampling needs the logits of the last prompt token. When the whole
+    // prompt is cached, those of the last decode may belong to another
+    // branch or a restored cache, so it is decoded again.
+    if (sample_next && common_prefix == all_tokens.size() &&
+        common_prefix > 0) {
+        common_prefix--;
+    }
+
     // If tokens diverged, clear KV cache from divergence point onwards
     if (common_prefix < processed_tokens_.size()) {
         llama_memory_t mem = llama_get_memory(ctx_);
@@ -219,13 +1098,17 @@ Model::generate_from_tokens(const std::vector<llama_token>& all_tokens,
         n_past_ = common_prefix;
     }
 
+    stats_.reused_tokens = static_cast<int>(common_prefix);
+    stats_.prefilled_tokens =
+      static_cast<int>(all_tokens.size() - common_prefix);
+
     size_t i = common_prefix;
     while (i < all_tokens.size()) {
         size_t batch_size = std::min(all_tokens.size() - i, (size_t)n_batch);
 
-        if (n_past_ + (int)batch_size > n_ctx) {
-            throw ModelError("context size exceeded");
-        }
+        cancel_.throw_if_cancelled();
+
+        reserve_context(static_cast<int>(batch_size), "context size exceeded");
 
         std::vector<llama_token> batch_tokens(
           all_tokens.begin() + i, all_tokens.begin() + i + batch_size);
@@ -233,7 +1116,7 @@ Model::generate_from_tokens(const std::vector<llama_token>& all_tokens,
         llama_batch batch =
           llama_batch_get_one(batch_tokens.data(), batch_tokens.size());
 
-        if (llama_decode(ctx_, batch) != 0) {
+        if (decode(batch) != 0) {
             throw ModelError("failed to decode batch");
         }
 
@@ -242,47 +1125,135 @@ Model::generate_from_tokens(const std::vector<llama_token>& all_tokens,
           processed_tokens_.end(), batch_tokens.begin(), batch_tokens.end());
         i += batch_size;
     }
+    stats_.prefill_ms = elapsed_ms(start);
+}
 
-    llama_token new_token_id{};
-    while (true) {
-        new_token_id = llama_sampler_sample(sampler_, ctx_, -1);
+void
+Model::reserve_context(int n_tokens, const char* error)
+{
+    const int n_ctx = llama_n_ctx(ctx_);
+    if (n_past_ + n_tokens <= n_ctx) {
+        return;
+    }
 
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
-        }
+    // Shifting cells a BatchedModel session shares with others would move
+    // them for every session, so sessions keep failing instead
+    if (config_.context_overflow != ContextOverflow::Shift || scheduler_) {
+        throw ModelError(error);
+    }
 
-        char buf[256];
-        int n =
-          llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-            throw ModelError("failed to convert token to piece");
-        }
-        std::string piece(buf, n);
+    llama_memory_t mem = llama_get_memory(ctx_);
+    if (!llama_memory_can_shift(mem)) {
+        throw ModelError(std::string(error) +
+                         " (the model's cache cannot be shifted)");
+    }
 
-        if (callback) {
-            callback(piece);
-        }
-        response += piece;
+    // Later shifts discard right after the span earlier ones discarded
+    const int n_keep =
+      discarded_tokens_.empty() ? std::clamp(n_keep_, 0, n_past_) : shift_keep_;
+    const int n_discard =
+      plan_context_shift(n_past_, n_tokens, n_ctx, n_keep, config_.n_discard);
+    if (n_discard < 0) {
+        throw ModelError(error);
+    }
 
-        if (n_past_ + 1 > n_ctx) {
-            throw ModelError("context size exceeded during generation");
-        }
+    llama_memory_seq_rm(mem, seq_id_, n_keep, n_keep + n_discard);
+    llama_memory_seq_add(mem, seq_id_, n_keep + n_discard, n_past_, -n_discard);
 
-        llama_batch batch = llama_batch_get_one(&new_token_id, 1);
-        if (llama_decode(ctx_, batch) != 0) {
-            throw ModelError("failed to decode token");
+    const auto first = processed_tokens_.begin() + n_keep;
+    discarded_tokens_.insert(
+      discarded_tokens_.end(), first, first + n_discard);
+    processed_tokens_.erase(first, first + n_discard);
+    n_past_ -= n_discard;
+    shift_keep_ = n_keep;
+}
+
+void
+Model::reset(size_t n_tokens)
+{
+    auto lock = lock_context();
+
+    // Positions before the discarded span are the only ones left unchanged
+    const size_t n_intact = discarded_tokens_.empty()
+                              ? processed_tokens_.size()
+                              : static_cast<size_t>(shift_keep_);
+    n_tokens = std::min(n_tokens, n_intact);
+
+    llama_memory_t mem = llama_get_memory(ctx_);
+    if (n_tokens == 0 && !scheduler_) {
+        llama_memory_clear(mem, true);
+    } else {
+        llama_memory_seq_rm(
+          mem, seq_id_, static_cast<llama_pos>(n_tokens), -1);
+    }
+    processed_tokens_.resize(n_tokens);
+    n_past_ = static_cast<int>(n_tokens);
+    discarded_tokens_.clear();
+    shift_keep_ = 0;
+    n_keep_ = config_.n_keep;
+
+    prompt_builder_.reset();
+    llama_sampler_reset(sampler_);
+    stats_ = GenerationStats{};
+}
+
+bool
+Model::copy_state_from(const Model& source)
+{
+    if (&source == this) {
+        return true;
+    }
+    if (weights_->get_model() != source.weights_->get_model()) {
+        return false;
+    }
+
+    // Sessions of one scheduler live in the same context: tag the source's
+    // cells with our sequence instead of copying them
+    if (scheduler_ && scheduler_ == source.scheduler_) {
+        scheduler_->copy_session(source, *this);
+        return true;
+    }
+
+    std::vector<uint8_t> state;
+    std::vector<llama_token> tokens;
+    {
+        auto lock = source.lock_context();
+        const size_t size =
+          llama_state_seq_get_size(source.ctx_, source.seq_id_);
+        state.resize(size);
+        if (llama_state_seq_get_data(
+              source.ctx_, state.data(), size, source.seq_id_) != size) {
+            return false;
         }
+        tokens = source.processed_tokens_;
+    }
 
-        n_past_++;
-        processed_tokens_.push_back(new_token_id);
+    auto lock = lock_context();
+    llama_memory_seq_rm(llama_get_memory(ctx_), seq_id_, -1, -1);
+    if (llama_state_seq_set_data(ctx_, state.data(), state.size(), seq_id_) ==
+        0) {
+        set_cache_state({});
+        return false;
     }
+    set_cache_state(tokens);
+    return true;
+}
 
-    return response;
+std::unique_lock<std::mutex>
+Model::lock_context() const
+{
+    if (scheduler_) {
+        return std::unique_lock<std::mutex>(scheduler_->ctx_mutex_);
+    }
+    return {};
 }
 
 bool
 Model::save_cache(const std::string& cache_path)
 {
+    if (scheduler_) {
+        return scheduler_->save_session(*this, cache_path);
+    }
     return llama_state_save_file(ctx_,
                                  cache_path.c_str(),
                                  processed_tokens_.data(),
@@ -292,6 +1263,10 @@ Model::save_cache(const std::string& cache_path)
 std::vector<llama_token>
 Model::load_cache(const std::string& cache_path)
 {
+    if (scheduler_) {
+        return scheduler_->load_session(*this, cache_path);
+    }
+
     // Start with a reasonable capacity, will be resized based on actual count
     std::vector<llama_token> tokens(llama_n_ctx(ctx_));
     size_t n_token_count_out = 0;
@@ -309,4 +1284,47 @@ Model::load_cache(const std::string& cache_path)
     return tokens;
 }
 
+std::future<bool>
+Model::save_snapshot(const std::string& path)
+{
+    auto snapshot = std::make_shared<SequenceSnapshot>();
+    {
+        auto lock = lock_context();
+        const size_t size = llama_state_seq_get_size(ctx_, seq_id_);
+        snapshot->state.resize(size);
+        if (size == 0 ||
+            llama_state_seq_get_data(
+              ctx_, snapshot->state.data(), size, seq_id_) != size) {
+            std::promise<bool> failed;
+            failed.set_value(false);
+            return failed.get_future();
+        }
+        snapshot->tokens = processed_tokens_;
+    }
+
+    return snapshot_writer().submit(
+      [snapshot, path] { return snapshot->write(path); });
+}
+
+std::vector<llama_token>
+Model::load_snapshot(const std::string& path)
+{
+    MappedSnapshot snapshot;
+    if (!snapshot.open(path)) {
+        return {};
+    }
+    auto tokens = snapshot.tokens();
+
+    auto lock = lock_context();
+    llama_memory_seq_rm(llama_get_memory(ctx_), seq_id_, -1, -1);
+    if (llama_state_seq_set_data(
+          ctx_, snapshot.state(), snapshot.state_size(), seq_id_) == 0) {
+        set_cache_state({});
+        return {};
+    }
+
+    set_cache_state(tokens);
+    return tokens;
+}
+
 } // namespace agent_cpp
@@ -1,18 +1,38 @@
 #pragma once
 
+#include "cancellation.h"
 #include "chat.h"
+#include "chat_stream.h"
+#include "compute_threadpool.h"
+#include "generation_stats.h"
 #include "llama.h"
+#include "prompt_builder.h"
+#include "response_callback.h"
+#include "speculative.h"
+#include "stop_matcher.h"
 #include <algorithm>
+#include <chrono>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace agent_cpp {
 
-// Callback for streaming response chunks
-using ResponseCallback = std::function<void(const std::string& chunk)>;
+// What happens when the KV cache of a model runs out of space
+enum class ContextOverflow
+{
+    // Throw ModelError("context size exceeded")
+    Error,
+    // Discard the oldest tokens after the first n_keep and shift the rest
+    // down, like llama.cpp's context shift. Earlier text is forgotten
+    // instead of the session failing.
+    Shift
+};
 
 // Model configuration with sensible defaults
 struct ModelConfig
@@ -31,12 +51,122 @@ struct ModelConfig
       static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
     int n_threads_batch =
       static_cast<int>(std::max(1u, std::thread::hardware_concurrency() - 1));
+    // Workers to compute on instead of threads of the context's own. When
+    // set, n_threads and n_threads_batch are the pool's.
+    std::shared_ptr<ComputeThreadpool> threadpool;
+    // Physical batch size, n_batch is split into chunks of at most n_ubatch
+    // tokens. -1 keeps llama.cpp's default.
+    int n_ubatch = -1;
     ggml_type cache_type_k = GGML_TYPE_F16;
     ggml_type cache_type_v = GGML_TYPE_F16;
+    // Flash attention, by default enabled where the backend supports it.
+    // Needed for a quantized V cache.
+    llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
+    // Keep the KV cache and attention on the GPU with the offloaded layers
+    bool offload_kqv = true;
+    // Render and tokenize only newly appended messages when the chat template
+    // allows it. See PromptBuilder.
+    bool incremental_prompt = true;
+    // Constrain sampling with the grammar the chat template provides for tool
+    // calls, so their arguments always parse. Lazy grammars only apply once a
+    // trigger (e.g. "<tool_call>") has been generated.
+    bool use_grammar = true;
+    // Strings that end generation, on top of the template's additional stops.
+    // The stop string itself is not part of the response.
+    std::vector<std::string> stop_sequences;
+    // Tokens collected before a ResponseCallback call, 1 streams every token.
+    // Chunks always end on a UTF-8 character boundary either way.
+    int stream_chunk_tokens = 1;
+    ContextOverflow context_overflow = ContextOverflow::Error;
+    // Tokens at the start of the cache a shift never discards. 0 lets an
+    // Agent keep its system prompt and tool definitions, see set_n_keep().
+    int n_keep = 0;
+    // Tokens discarded per shift, 0 discards half of those after n_keep
+    int n_discard = 0;
+    // Speculative decoding, off by default. Not used by sessions of a
+    // BatchedModel, which already batch decode steps across sessions.
+    SpeculativeConfig speculative;
+    // Sequences the context holds, generate_candidates() needs one per
+    // candidate. Above 1 the KV cache is unified, so one sequence can still
+    // fill all of n_ctx.
+    int n_seq_max = 1;
+};
+
+// Tokens a context shift discards so that n_tokens more fit in n_ctx cells
+// holding n_past, keeping the first n_keep. n_discard is
+// ModelConfig::n_discard. 0 if they fit already, -1 if discarding every
+// token after n_keep isn't enough.
+int
+plan_context_shift(int n_past,
+                   int n_tokens,
+                   int n_ctx,
+                   int n_keep,
+                   int n_discard);
+
+// Drop from prompt the span a context shift discarded after the first n_keep
+// tokens of cached, so the rest lines up with the shifted cache. Returns
+// false if prompt doesn't continue the shifted conversation.
+bool
+map_shifted_prompt(const std::vector<llama_token>& prompt,
+                   const std::vector<llama_token>& cached,
+                   size_t n_keep,
+                   const std::vector<llama_token>& discarded,
+                   std::vector<llama_token>& mapped);
+
+// Options of Model::generate_candidates
+struct CandidateConfig
+{
+    // Number of candidates, at most ModelConfig::n_seq_max
+    int n = 4;
+    // Candidate i samples with seed + i, so they differ even at the same
+    // temperature. LLAMA_DEFAULT_SEED picks random seeds.
+    uint32_t seed = LLAMA_DEFAULT_SEED;
+    // Sampling parameters, nullopt uses those of the ModelConfig. Candidates
+    // only differ when temp > 0.
+    std::optional<float> temp;
+    // Tokens each candidate may generate, 0 until it ends
+    int max_tokens = 0;
+    // Sum the log-probabilities of the generated tokens
+    bool logprobs = false;
+};
+
+// One response of Model::generate_candidates
+struct Candidate
+{
+    common_chat_msg message; // Parsed, role set to "assistant"
+    std::string text;        // As generated
+    int n_tokens = 0;
+    // Log-probability of the generated tokens under the model, before
+    // sampling filters. Only set with CandidateConfig::logprobs.
+    double logprob = 0;
 };
 
-// Forward declaration
+// Where and how model weights are loaded, see ModelWeights::create
+struct ModelWeightsConfig
+{
+    // Layers stored in VRAM, -1 keeps llama.cpp's default (all layers on
+    // builds with a GPU backend) and 0 keeps the model on the CPU
+    int n_gpu_layers = -1;
+    // How the model is spread over several GPUs: by layer, by tensor rows or
+    // not at all (only main_gpu is used)
+    llama_split_mode split_mode = LLAMA_SPLIT_MODE_LAYER;
+    // GPU used for the whole model with LLAMA_SPLIT_MODE_NONE, and for
+    // intermediate results and the KV cache with LLAMA_SPLIT_MODE_ROW
+    int main_gpu = 0;
+    // Fraction of the model placed on each GPU, e.g. { 3, 1 }. Empty splits
+    // it in proportion to the free memory of each device.
+    std::vector<float> tensor_split;
+    // Map the file instead of reading it, pages are loaded on first use
+    bool use_mmap = true;
+    // Lock the weights in RAM so they are never paged out
+    bool use_mlock = false;
+    // Called with the load progress from 0 to 1, return false to abort
+    std::function<bool(float)> on_progress;
+};
+
+// Forward declarations
 class Model;
+class BatchedModel;
 
 /// @brief Immutable model weights that can be shared across multiple Model
 /// instances.
@@ -52,9 +182,12 @@ class ModelWeights
   public:
     /// @brief Load model weights from a GGUF file
     /// @param model_path Path to the GGUF model file
+    /// @param config Optional GPU placement and memory options
     /// @return Shared pointer to the loaded weights
-    /// @throws agent_cpp::ModelError if loading fails
-    static std::shared_ptr<ModelWeights> create(const std::string& model_path);
+    /// @throws agent_cpp::ModelError if loading fails or is aborted
+    static std::shared_ptr<ModelWeights> create(
+      const std::string& model_path,
+      const ModelWeightsConfig& config = ModelWeightsConfig{});
 
     ~ModelWeights();
 
@@ -90,12 +223,17 @@ class ModelWeights
 // Each Model instance has its own context (KV cache) but can share weights
 class Model
 {
+    friend class BatchedModel;
+
   public:
     /// @brief Initialize the model from a GGUF file
     /// @param model_path Path to the GGUF model file
     /// @param model_config Optional configuration
     /// @return Shared pointer to the initialized Model
     /// @throws agent_cpp::ModelError if model loading or initialization fails
+    ///
+    /// The weights come from ModelWeightsRegistry::global(), so models
+    /// created from the same file share them.
     static std::shared_ptr<Model> create(
       const std::string& model_path,
       const ModelConfig& model_config = ModelConfig{});
@@ -112,7 +250,21 @@ class Model
       std::shared_ptr<ModelWeights> weights,
       const ModelConfig& model_config = ModelConfig{});
 
+    /// @brief Branch off the conversation held in this model's KV cache
+    /// @return New model with the same configuration and cache
+    /// @throws agent_cpp::ModelError if no sequence is free or the state
+    /// can't be copied
+    ///
+    /// Sessions of a BatchedModel fork into a new sequence of the shared
+    /// context that references this one's KV cells (llama_memory_seq_cp), so
+    /// a branch only pays for the tokens it adds. Other models fork into a
+    /// context of their own holding a copy of the state. Dropping the branch
+    /// releases it without touching this model. Must not be called while
+    /// this model is generating.
+    std::shared_ptr<Model> fork() const;
+
     // Destructor - Frees sampler and context (weights are ref-counted)
+    // Sessions of a BatchedModel release their sequence instead
     ~Model();
 
     // Delete copy operations to prevent double-free
@@ -125,10 +277,32 @@ class Model
 
     // Generate text from chat messages and tools
     // Applies chat templates, tokenizes, and generates response
+    // When messages extend the previous call, only the new messages are
+    // rendered and tokenized
     // Returns parsed message with role set to "assistant"
+    // on_event receives the response as structured events while it streams
+    // and can stop generation early, e.g. once a tool call is complete
+    // Throws CancelledError once cancel is cancelled or its deadline passes,
+    // checked between decode steps. The KV cache keeps what was decoded.
     common_chat_msg generate(const std::vector<common_chat_msg>& messages,
                              const std::vector<common_chat_tool>& tools,
-                             const ResponseCallback& callback = nullptr);
+                             const ResponseCallback& callback = nullptr,
+                             const GenerationEventCallback& on_event = nullptr,
+                             const CancellationToken& cancel = {});
+
+    // Generate several responses to the same messages at once
+    // The prompt is prefilled once and its KV cache shared by one sequence
+    // per candidate (llama_memory_seq_cp); the candidates then decode in
+    // one batch per step, each with its own sampler and seed. Costs about
+    // one prefill plus a batched decode instead of config.n generations.
+    // The KV cache keeps the prompt afterwards, not the candidates.
+    // Throws ModelError if config.n exceeds ModelConfig::n_seq_max or the
+    // model is a session of a BatchedModel, CancelledError like generate()
+    std::vector<Candidate> generate_candidates(
+      const std::vector<common_chat_msg>& messages,
+      const std::vector<common_chat_tool>& tools,
+      const CandidateConfig& config = CandidateConfig{},
+      const CancellationToken& cancel = {});
 
     // Generate text from pre-tokenized input, only processing new tokens
     // Uses KV cache efficiently by tracking previously processed tokens
@@ -136,6 +310,48 @@ class Model
       const std::vector<llama_token>& all_tokens,
       const ResponseCallback& callback = nullptr);
 
+    // Process tokens into the KV cache without generating anything
+    // Only tokens after the common prefix with the cache are decoded
+    void prefill(const std::vector<llama_token>& all_tokens);
+
+    // Prefill the start of the next prompt while its last message is still
+    // being written, e.g. a tool response streaming in: everything up to
+    // where that message's content ends so far. The next generate() call
+    // then only decodes what came after. Must not be called while this
+    // model is generating
+    void prefill_partial(const std::vector<common_chat_msg>& messages,
+                         const std::vector<common_chat_tool>& tools);
+
+    // Replace this model's KV cache with a copy of another model's cache
+    // Sessions of the same BatchedModel share the source's cells instead of
+    // duplicating them. Otherwise the sequence state is cloned, which skips
+    // the prefill but not the memory. Returns false if the models don't share
+    // weights or the state could not be restored.
+    bool copy_state_from(const Model& source);
+
+    // Forget the conversation so the model can start a new one
+    // The first n_tokens of the KV cache are kept, e.g. a shared system
+    // prompt; after a context shift at most the tokens before the discarded
+    // span. Also resets the sampler, n_keep and the stats.
+    // Must not be called while this model is generating
+    void reset(size_t n_tokens = 0);
+
+    // Stats of the last generate() or generate_from_tokens() call
+    [[nodiscard]] const GenerationStats& last_stats() const { return stats_; }
+
+    // Set the number of leading tokens a context shift keeps
+    // Overrides ModelConfig::n_keep
+    void set_n_keep(int n_keep) { n_keep_ = n_keep; }
+    [[nodiscard]] int get_n_keep() const { return n_keep_; }
+
+    // Get the tokens currently held in the KV cache
+    // After a context shift these lack the discarded span
+    // Must not be called while this model is generating
+    [[nodiscard]] const std::vector<llama_token>& get_cached_tokens() const
+    {
+        return processed_tokens_;
+    }
+
     // Tokenize a prompt string into tokens
     // Returns empty vector on failure
     std::vector<llama_token> tokenize(const std::string& prompt) const;
@@ -153,8 +369,12 @@ class Model
     }
 
     // Get the context for KV cache management
+    // For sessions of a BatchedModel this is the shared context
     [[nodiscard]] llama_context* get_context() const { return ctx_; }
 
+    // Get the sequence this model's KV cache lives in
+    [[nodiscard]] llama_seq_id get_seq_id() const { return seq_id_; }
+
     // Get the shared weights (for creating additional Model instances)
     [[nodiscard]] std::shared_ptr<ModelWeights> get_weights() const
     {
@@ -170,16 +390,74 @@ class Model
     // The loaded state will be applied to the context
     std::vector<llama_token> load_cache(const std::string& cache_path);
 
+    // Snapshot the KV cache of this model's sequence and write it to a file
+    // in the background. The state is copied out before this returns, so
+    // generation can go on while it is written.
+    // The future is true once the file is in place, false on failure
+    std::future<bool> save_snapshot(const std::string& path);
+
+    // Load a snapshot written by save_snapshot into this model's sequence
+    // The file is memory mapped and handed to llama.cpp without a copy
+    // Returns the tokens that were cached, or empty vector on failure
+    std::vector<llama_token> load_snapshot(const std::string& path);
+
   private:
     // Set the internal cache state (used when loading from prompt cache)
     void set_cache_state(const std::vector<llama_token>& tokens)
     {
         processed_tokens_ = tokens;
         n_past_ = static_cast<int>(tokens.size());
+        discarded_tokens_.clear();
     }
     Model() = default;
 
+    // prefill(), with sample_next the last prompt token is decoded even when
+    // it is cached, so the logits to sample from are the prompt's
+    void prefill(const std::vector<llama_token>& prompt_tokens,
+                 bool sample_next);
+
     void initialize_context(const ModelConfig& model_config);
+    void initialize_sampler(const ModelConfig& model_config);
+    void release();
+
+    // Lock the context against the scheduler for sessions of a BatchedModel
+    // Returns an empty lock for models that own their context
+    std::unique_lock<std::mutex> lock_context() const;
+
+    // Convert a sampled token to its text piece
+    std::string token_to_piece(llama_token token) const;
+    // Same, writing into piece to reuse its buffer
+    void token_to_piece(llama_token token, std::string& piece) const;
+
+    // Sampling loop of generate_from_tokens decoding one token at a time,
+    // called once the prompt is prefilled
+    std::string generate_sequential(const ResponseCallback& callback);
+
+    // Sampling loop of generate_from_tokens verifying drafted tokens in
+    // batches, called once the prompt is prefilled
+    std::string generate_speculative(const ResponseCallback& callback);
+
+    // Make room for n_tokens more tokens, shifting the cache if the overflow
+    // policy allows it. Throws ModelError(error) otherwise.
+    void reserve_context(int n_tokens, const char* error);
+
+    // llama_decode, taking turns with other contexts on a shared threadpool
+    int32_t decode(const llama_batch& batch);
+
+    // Sample from the logits at idx of the last batch, applying the grammar
+    // of the current generation if any
+    llama_token sample(int32_t idx);
+    // Same with the given sampler chain and grammar, which may be nullptr
+    llama_token sample(llama_sampler* chain,
+                       llama_sampler* grammar,
+                       int32_t idx);
+
+    // Count a generated token in stats_, the first one sets ttft_ms
+    void record_token();
+
+    // Set up the grammar and stop sequences of one generate() call
+    void begin_constraints(const common_chat_params& params);
+    void end_constraints();
 
     std::shared_ptr<ModelWeights> weights_;
     llama_context* ctx_ = nullptr;
@@ -187,6 +465,32 @@ class Model
     std::vector<llama_token> processed_tokens_; // Track tokens in KV cache
     int n_past_ = 0;                            // Track position in KV cache
     ModelConfig config_;
+
+    // Context shift state: tokens discarded right after the first
+    // shift_keep_ tokens, in order. The conversation the cache stands for is
+    // processed_tokens_ with these inserted at shift_keep_.
+    int n_keep_ = 0;
+    int shift_keep_ = 0;
+    std::vector<llama_token> discarded_tokens_;
+    PromptBuilder prompt_builder_;
+    std::unique_ptr<Drafter> drafter_; // Set when speculative decoding is on
+
+    // Constraints of the generation in progress
+    llama_sampler* grammar_ = nullptr;
+    std::vector<std::string> stops_;
+    bool stop_requested_ = false; // Set by a GenerationEventCallback
+    CancellationToken cancel_;
+    std::vector<llama_token_data> candidates_; // Reused by sample()
+    std::string piece_;                        // Reused by token_to_piece()
+
+    GenerationStats stats_;
+    std::chrono::steady_clock::time_point generation_start_;
+    std::chrono::steady_clock::time_point first_token_at_;
+
+    // Set when this model is a session of a BatchedModel. The context is
+    // then owned by the scheduler and this model only owns seq_id_.
+    std::shared_ptr<BatchedModel> scheduler_;
+    llama_seq_id seq_id_ = 0;
 };
 
 } // namespace agent_cpp
@@ -0,0 +1,205 @@
+#include "model_weights_registry.h"
+#include <algorithm>
+#include <filesystem>
+
+namespace agent_cpp {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Options that change what gets loaded, on_progress doesn't
+std::string
+make_key(const std::string& model_path, const ModelWeightsConfig& config)
+{
+    std::error_code ec;
+    fs::path path = fs::absolute(model_path, ec);
+    if (ec) {
+        path = model_path;
+    }
+
+    std::string key = path.lexically_normal().string();
+    key += '|' + std::to_string(config.n_gpu_layers);
+    key += '|' + std::to_string(static_cast<int>(config.split_mode));
+    key += '|' + std::to_string(config.main_gpu);
+    key += '|' + std::to_string(static_cast<int>(config.use_mmap));
+    key += '|' + std::to_string(static_cast<int>(config.use_mlock));
+    for (float split : config.tensor_split) {
+        key += '|' + std::to_string(split);
+    }
+    return key;
+}
+
+} // anonymous namespace
+
+ModelWeightsRegistry::ModelWeightsRegistry(ModelWeightsRegistryConfig config)
+  : state_(std::make_shared<State>())
+{
+    state_->config = config;
+}
+
+ModelWeightsRegistry&
+ModelWeightsRegistry::global()
+{
+    static ModelWeightsRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<ModelWeights>
+ModelWeightsRegistry::get(const std::string& model_path,
+                          const ModelWeightsConfig& config)
+{
+    const std::string key = make_key(model_path, config);
+
+    std::promise<std::shared_ptr<ModelWeights>> promise;
+    std::shared_future<std::shared_ptr<ModelWeights>> future;
+    std::vector<std::shared_ptr<ModelWeights>> evicted;
+    bool load = false;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        auto it = state_->entries.find(key);
+        if (it != state_->entries.end()) {
+            it->second.users++;
+            it->second.last_used = ++state_->clock;
+            future = it->second.weights;
+        } else {
+            Entry entry;
+            entry.weights = promise.get_future().share();
+            std::error_code ec;
+            const auto file_size = fs::file_size(model_path, ec);
+            entry.bytes = ec ? 0 : static_cast<uint64_t>(file_size);
+            entry.users = 1;
+            entry.last_used = ++state_->clock;
+            future = entry.weights;
+
+            evicted = state_->evict(entry.bytes);
+            state_->entries.emplace(key, std::move(entry));
+            load = true;
+        }
+    }
+    // Freed outside the lock, unloading can take a while
+    evicted.clear();
+
+    if (load) {
+        try {
+            auto weights = ModelWeights::create(model_path, config);
+            {
+                std::lock_guard<std::mutex> lock(state_->mutex);
+                // Entries being loaded are never evicted
+                Entry& entry = state_->entries.at(key);
+                entry.loaded = true;
+                entry.bytes = llama_model_size(weights->get_model());
+            }
+            promise.set_value(std::move(weights));
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(state_->mutex);
+                state_->entries.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    return acquire(future.get(), key);
+}
+
+std::shared_ptr<ModelWeights>
+ModelWeightsRegistry::acquire(const std::shared_ptr<ModelWeights>& weights,
+                              const std::string& key)
+{
+    // The deleter holds the weights, so they outlive an eviction until the
+    // last copy of the returned pointer is gone
+    std::weak_ptr<State> state = state_;
+    return std::shared_ptr<ModelWeights>(
+      weights.get(), [state, key, weights](ModelWeights*) {
+          if (auto locked = state.lock()) {
+              locked->release(key);
+          }
+      });
+}
+
+void
+ModelWeightsRegistry::set_max_bytes(uint64_t max_bytes)
+{
+    std::vector<std::shared_ptr<ModelWeights>> evicted;
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->config.max_bytes = max_bytes;
+    evicted = state_->evict(0);
+}
+
+void
+ModelWeightsRegistry::unload_unused()
+{
+    std::vector<std::shared_ptr<ModelWeights>> evicted;
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    const uint64_t max_bytes = state_->config.max_bytes;
+    state_->config.max_bytes = 0;
+    evicted = state_->evict(0);
+    state_->config.max_bytes = max_bytes;
+}
+
+size_t
+ModelWeightsRegistry::size() const
+{
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->entries.size();
+}
+
+uint64_t
+ModelWeightsRegistry::resident_bytes() const
+{
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    uint64_t total = 0;
+    for (const auto& [key, entry] : state_->entries) {
+        if (entry.loaded) {
+            total += entry.bytes;
+        }
+    }
+    return total;
+}
+
+std::vector<std::shared_ptr<ModelWeights>>
+ModelWeightsRegistry::State::evict(uint64_t incoming)
+{
+    uint64_t total = incoming;
+    std::vector<std::map<std::string, Entry>::iterator> unused;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        total += it->second.bytes;
+        if (it->second.loaded && it->second.users == 0) {
+            unused.push_back(it);
+        }
+    }
+    std::sort(unused.begin(), unused.end(), [](const auto& a, const auto& b) {
+        return a->second.last_used < b->second.last_used;
+    });
+
+    std::vector<std::shared_ptr<ModelWeights>> evicted;
+    for (auto it : unused) {
+        if (config.max_bytes > 0 && total <= config.max_bytes) {
+            break;
+        }
+        total -= it->second.bytes;
+        evicted.push_back(it->second.weights.get());
+        entries.erase(it);
+    }
+    return evicted;
+}
+
+void
+ModelWeightsRegistry::State::release(const std::string& key)
+{
+    std::vector<std::shared_ptr<ModelWeights>> evicted;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return;
+    }
+    if (it->second.users > 0) {
+        it->second.users--;
+    }
+    it->second.last_used = ++clock;
+    evicted = evict(0);
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "model.h"
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace agent_cpp {
+
+struct ModelWeightsRegistryConfig
+{
+    // Total size of the loaded weights. Weights no model uses are unloaded,
+    // least recently used first, to stay within it; weights in use are never
+    // unloaded. 0 unloads them as soon as their last user is gone.
+    uint64_t max_bytes = 0;
+};
+
+/// @brief Loads each model file once and shares it between everyone using it
+///
+/// Weights are keyed by path and load options. get() loads them on first
+/// use; concurrent calls for weights still loading wait for that load
+/// instead of starting their own. Weights stay loaded while any returned
+/// pointer is alive, and afterwards as long as they fit in max_bytes, so a
+/// host serving several models keeps the recently used ones warm. The size
+/// counted is llama_model_size(), whether the tensors live in RAM or VRAM.
+///
+/// Model::create() loads through global(), so models created from the same
+/// path share their weights.
+///
+/// Usage:
+///   auto& registry = agent_cpp::ModelWeightsRegistry::global();
+///   registry.set_max_bytes(24ULL << 30);
+///   auto model = agent_cpp::Model::create_with_weights(
+///     registry.get("model.gguf"));
+class ModelWeightsRegistry
+{
+  public:
+    explicit ModelWeightsRegistry(ModelWeightsRegistryConfig config = {});
+
+    ModelWeightsRegistry(const ModelWeightsRegistry&) = delete;
+    ModelWeightsRegistry& operator=(const ModelWeightsRegistry&) = delete;
+
+    /// @brief Registry shared by the whole process
+    static ModelWeightsRegistry& global();
+
+    /// @brief Weights of model_path loaded with config, loading them if needed
+    /// Before loading, unused weights are unloaded until the file fits in
+    /// max_bytes. The load happens anyway if it still doesn't fit.
+    /// config.on_progress is only called by the call that loads.
+    /// @throws agent_cpp::ModelError if loading fails, in every waiting call
+    std::shared_ptr<ModelWeights> get(
+      const std::string& model_path,
+      const ModelWeightsConfig& config = ModelWeightsConfig{});
+
+    /// @brief Change the budget, unloading unused weights beyond it
+    void set_max_bytes(uint64_t max_bytes);
+
+    /// @brief Unload every weights no model uses
+    void unload_unused();
+
+    /// @brief Number of weights loaded or loading
+    [[nodiscard]] size_t size() const;
+
+    /// @brief Total size of the loaded weights in bytes
+    [[nodiscard]] uint64_t resident_bytes() const;
+
+  private:
+    struct Entry
+    {
+        std::shared_future<std::shared_ptr<ModelWeights>> weights;
+        bool loaded = false;
+        // Size once loaded, estimated from the file size while loading
+        uint64_t bytes = 0;
+        // Pointers returned by get() that are still alive
+        size_t users = 0;
+        uint64_t last_used = 0;
+    };
+
+    // Shared with the deleters of returned pointers, which may outlive the
+    // registry
+    struct State
+    {
+        ModelWeightsRegistryConfig config;
+        mutable std::mutex mutex;
+        std::map<std::string, Entry> entries;
+        uint64_t clock = 0;
+
+        // Unload unused weights, least recently used first, until
+        // incoming more bytes fit. Returns them to be freed after unlocking.
+        std::vector<std::shared_ptr<ModelWeights>> evict(uint64_t incoming);
+        void release(const std::string& key);
+    };
+
+    std::shared_ptr<ModelWeights> acquire(
+      const std::shared_ptr<ModelWeights>& weights,
+      const std::string& key);
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace agent_cpp
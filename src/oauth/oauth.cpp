@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <atomic>
 #include <condition_variable>
+#include <future>
 #include <iomanip>
 #include <memory>
 #include <mutex>
@@ -25,6 +26,9 @@ using json = nlohmann::json;
 
 namespace {
 
+// Wait before retrying a failed background refresh
+constexpr std::chrono::seconds kRefreshRetry(30);
+
 std::string
 url_encode(const std::string& value)
 {
@@ -250,11 +254,29 @@ class OAuthClientImpl : public OAuthClient
     OAuthClientImpl(const OAuthConfig& config,
                     const TokenStorageConfig& storage_config)
       : config_(config)
-      , storage_(create_file_token_storage(storage_config.storage_dir))
+      , storage_(create_cached_token_storage(
+          create_file_token_storage(storage_config.storage_dir)))
+    {
+        if (config_.background_refresh) {
+            refresher_ = std::thread([this] { refresh_loop(); });
+        }
+    }
 
+    ~OAuthClientImpl() override
     {
+        {
+            std::lock_guard<std::mutex> lock(cached_token_mutex_);
+            stopping_ = true;
+        }
+        refresh_cv_.notify_all();
+        if (refresher_.joinable()) {
+            refresher_.join();
+        }
     }
 
+    OAuthClientImpl(const OAuthClientImpl&) = delete;
+    OAuthClientImpl& operator=(const OAuthClientImpl&) = delete;
+
     std::optional<OAuthToken> get_token(
       const AuthUrlCallback& auth_url_callback,
       const StatusCallback& status_callback,
@@ -275,7 +297,7 @@ class OAuthClientImpl : public OAuthClient
         if (cached && !cached->is_expired()) {
             {
                 std::lock_guard<std::mutex> lock(cached_token_mutex_);
-                cached_token_ = cached;
+                cache_token(*cached);
             }
             if (status_callback) {
                 status_callback("Using cached token");
@@ -302,12 +324,130 @@ class OAuthClientImpl : public OAuthClient
         return storage_->load(config_.provider_name);
     }
 
+    // Concurrent callers share one request to the token endpoint, and a
+    // token that was refreshed meanwhile isn't refreshed again, which would
+    // fail with servers that rotate refresh tokens
     std::optional<OAuthToken> refresh_token(const OAuthToken& token) override
     {
         if (token.refresh_token.empty()) {
             return std::nullopt;
         }
 
+        std::promise<std::optional<OAuthToken>> promise;
+        std::shared_future<std::optional<OAuthToken>> result;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lock(refresh_mutex_);
+            {
+                std::lock_guard<std::mutex> cached_lock(cached_token_mutex_);
+                if (cached_token_ &&
+                    cached_token_->access_token != token.access_token &&
+                    !cached_token_->is_expired()) {
+                    return cached_token_;
+                }
+            }
+            if (refresh_in_flight_.valid()) {
+                result = refresh_in_flight_;
+            } else {
+                result = promise.get_future().share();
+                refresh_in_flight_ = result;
+                leader = true;
+            }
+        }
+
+        if (leader) {
+            try {
+                promise.set_value(request_refresh(token));
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+            std::lock_guard<std::mutex> lock(refresh_mutex_);
+            refresh_in_flight_ = {};
+        }
+        return result.get();
+    }
+
+    void clear_tokens() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(cached_token_mutex_);
+            cached_token_.reset();
+        }
+        storage_->remove(config_.provider_name);
+    }
+
+    [[nodiscard]] bool has_valid_token() const override
+    {
+        std::lock_guard<std::mutex> lock(cached_token_mutex_);
+        auto token = storage_->load(config_.provider_name);
+        return token && !token->is_expired();
+    }
+
+    std::optional<OAuthToken> current_token() override
+    {
+        std::lock_guard<std::mutex> lock(cached_token_mutex_);
+        if (!cached_token_) {
+            auto stored = storage_->load(config_.provider_name);
+            if (!stored) {
+                return std::nullopt;
+            }
+            cache_token(*stored);
+        }
+        if (cached_token_->is_expired(std::chrono::seconds(0))) {
+            return std::nullopt;
+        }
+        return cached_token_;
+    }
+
+  private:
+    // Keep token in memory and schedule its refresh, the caller holds
+    // cached_token_mutex_
+    void cache_token(const OAuthToken& token)
+    {
+        using Duration = std::chrono::system_clock::duration;
+        cached_token_ = token;
+        const Duration left =
+          token.expires_at - std::chrono::system_clock::now();
+        const Duration ahead = std::clamp<Duration>(
+          left / 2, Duration::zero(), config_.refresh_ahead);
+        refresh_at_ = token.expires_at - ahead;
+        refresh_cv_.notify_all();
+    }
+
+    void refresh_loop()
+    {
+        std::unique_lock<std::mutex> lock(cached_token_mutex_);
+        while (!stopping_) {
+            if (!cached_token_ || !cached_token_->can_refresh()) {
+                refresh_cv_.wait(lock);
+                continue;
+            }
+            if (std::chrono::system_clock::now() < refresh_at_) {
+                refresh_cv_.wait_until(lock, refresh_at_);
+                continue;
+            }
+
+            const OAuthToken token = *cached_token_;
+            lock.unlock();
+            bool refreshed = false;
+            try {
+                refreshed = refresh_token(token).has_value();
+            } catch (const std::exception&) {
+                // Retried below, callers keep using the current token
+            }
+            lock.lock();
+
+            // A rejected refresh token clears the cache, and there is
+            // nothing to refresh until a new token is obtained
+            if (!refreshed && cached_token_ &&
+                cached_token_->access_token == token.access_token) {
+                refresh_at_ = std::chrono::system_clock::now() + kRefreshRetry;
+            }
+        }
+    }
+
+    std::optional<OAuthToken> request_refresh(const OAuthToken& token)
+    {
         try {
             std::ostringstream body;
             body << "grant_type=refresh_token";
@@ -329,7 +469,10 @@ class OAuthClientImpl : public OAuthClient
                 // is revoked/expired
                 {
                     std::lock_guard<std::mutex> lock(cached_token_mutex_);
-                    cached_token_.reset();
+                    if (cached_token_ &&
+                        cached_token_->refresh_token == token.refresh_token) {
+                        cached_token_.reset();
+                    }
                 }
                 return std::nullopt;
             }
@@ -344,7 +487,7 @@ class OAuthClientImpl : public OAuthClient
                 storage_->save(config_.provider_name, *new_token);
                 {
                     std::lock_guard<std::mutex> lock(cached_token_mutex_);
-                    cached_token_ = new_token;
+                    cache_token(*new_token);
                 }
             }
             return new_token;
@@ -356,23 +499,6 @@ class OAuthClientImpl : public OAuthClient
         }
     }
 
-    void clear_tokens() override
-    {
-        {
-            std::lock_guard<std::mutex> lock(cached_token_mutex_);
-            cached_token_.reset();
-        }
-        storage_->remove(config_.provider_name);
-    }
-
-    [[nodiscard]] bool has_valid_token() const override
-    {
-        std::lock_guard<std::mutex> lock(cached_token_mutex_);
-        auto token = storage_->load(config_.provider_name);
-        return token && !token->is_expired();
-    }
-
-  private:
     std::optional<OAuthToken> perform_auth_flow(
       const AuthUrlCallback& auth_url_callback,
       const StatusCallback& status_callback,
@@ -565,7 +691,7 @@ class OAuthClientImpl : public OAuthClient
             storage_->save(config_.provider_name, *token);
             {
                 std::lock_guard<std::mutex> lock(cached_token_mutex_);
-                cached_token_ = token;
+                cache_token(*token);
             }
         }
         return token;
@@ -595,10 +721,29 @@ class OAuthClientImpl : public OAuthClient
 
     OAuthConfig config_;
     std::unique_ptr<TokenStorage> storage_;
-    mutable std::optional<OAuthToken> cached_token_;
+    // Guards cached_token_, refresh_at_ and stopping_
     mutable std::mutex cached_token_mutex_;
+    std::optional<OAuthToken> cached_token_;
+    std::chrono::system_clock::time_point refresh_at_;
+    bool stopping_ = false;
+    std::condition_variable refresh_cv_;
+    std::thread refresher_;
+
+    // Guards refresh_in_flight_, taken before cached_token_mutex_
+    std::mutex refresh_mutex_;
+    std::shared_future<std::optional<OAuthToken>> refresh_in_flight_;
 };
 
+std::optional<OAuthToken>
+OAuthClient::current_token()
+{
+    auto token = get_cached_token();
+    if (!token || token->is_expired(std::chrono::seconds(0))) {
+        return std::nullopt;
+    }
+    return token;
+}
+
 std::unique_ptr<OAuthClient>
 create_oauth_client(const OAuthConfig& config,
                     const TokenStorageConfig& storage_config)
@@ -606,4 +751,16 @@ create_oauth_client(const OAuthConfig& config,
     return std::make_unique<OAuthClientImpl>(config, storage_config);
 }
 
+std::function<std::string()>
+make_bearer_token_provider(std::shared_ptr<OAuthClient> client)
+{
+    return [client = std::move(client)]() -> std::string {
+        auto token = client->current_token();
+        if (!token) {
+            return {};
+        }
+        return "Bearer " + token->access_token;
+    };
+}
+
 } // namespace agent_cpp
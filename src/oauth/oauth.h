@@ -35,6 +35,14 @@ struct OAuthConfig
     std::string scope;
 
     std::string provider_name = "default";
+
+    // Refresh the token on a background thread before it expires, so
+    // callers of current_token() never wait for the token endpoint. Off by
+    // default, as it keeps a thread per client.
+    bool background_refresh = false;
+    // How long before expires_at to refresh, at most half the lifetime the
+    // token had left when it was obtained
+    std::chrono::seconds refresh_ahead = std::chrono::seconds(300);
 };
 
 struct TokenStorageConfig
@@ -73,6 +81,18 @@ class OAuthClient
     virtual void clear_tokens() = 0;
 
     [[nodiscard]] virtual bool has_valid_token() const = 0;
+
+    // The token at hand, without any network round trip: the one held in
+    // memory, or the stored one the first time. nullopt if there is none or
+    // it expired; with background_refresh one that can be refreshed is
+    // refreshed in the background. The default returns get_cached_token()
+    // while it is valid.
+    virtual std::optional<OAuthToken> current_token();
 };
 
+// Authorization header values of client's current token, "Bearer <token>",
+// for MCPClientConfig::auth_provider. Empty while there is no valid token.
+std::function<std::string()>
+make_bearer_token_provider(std::shared_ptr<OAuthClient> client);
+
 } // namespace agent_cpp
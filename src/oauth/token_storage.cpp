@@ -4,6 +4,8 @@
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <unordered_map>
 
 #ifdef _WIN32
 #include <shlobj.h>
@@ -189,10 +191,73 @@ class FileTokenStorage : public TokenStorage
     std::string storage_dir_;
 };
 
+class CachedTokenStorage : public TokenStorage
+{
+  public:
+    explicit CachedTokenStorage(std::unique_ptr<TokenStorage> storage)
+      : storage_(std::move(storage))
+    {
+    }
+
+    void save(const std::string& provider_name,
+              const OAuthToken& token) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Whatever is stored after a failed save is unknown
+        cache_.erase(provider_name);
+        storage_->save(provider_name, token);
+        cache_[provider_name] = token;
+    }
+
+    std::optional<OAuthToken> load(
+      const std::string& provider_name) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cache_.find(provider_name);
+        if (it != cache_.end()) {
+            return it->second;
+        }
+        auto token = storage_->load(provider_name);
+        if (token) {
+            cache_.emplace(provider_name, *token);
+        }
+        return token;
+    }
+
+    void remove(const std::string& provider_name) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.erase(provider_name);
+        storage_->remove(provider_name);
+    }
+
+    bool exists(const std::string& provider_name) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (cache_.count(provider_name) > 0) {
+                return true;
+            }
+        }
+        return storage_->exists(provider_name);
+    }
+
+  private:
+    std::unique_ptr<TokenStorage> storage_;
+    mutable std::mutex mutex_;
+    mutable std::unordered_map<std::string, OAuthToken> cache_;
+};
+
 std::unique_ptr<TokenStorage>
 create_file_token_storage(const std::string& storage_dir)
 {
     return std::make_unique<FileTokenStorage>(storage_dir);
 }
 
+std::unique_ptr<TokenStorage>
+create_cached_token_storage(std::unique_ptr<TokenStorage> storage)
+{
+    return std::make_unique<CachedTokenStorage>(std::move(storage));
+}
+
 } // namespace agent_cpp
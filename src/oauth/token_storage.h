@@ -1,6 +1,8 @@
 #pragma once
 
 #include "oauth/oauth.h"
+#include <memory>
+#include <optional>
 #include <string>
 
 namespace agent_cpp {
@@ -24,4 +26,11 @@ class TokenStorage
 std::unique_ptr<TokenStorage>
 create_file_token_storage(const std::string& storage_dir = "");
 
+/// Keeps the tokens of storage in memory, so only the first load of a
+/// provider that finds one reads it. Misses aren't cached, a token another
+/// process saves meanwhile is still found. save and remove write through
+/// and update the cache. Thread safe.
+std::unique_ptr<TokenStorage>
+create_cached_token_storage(std::unique_ptr<TokenStorage> storage);
+
 } // namespace agent_cpp
@@ -0,0 +1,315 @@
+#include "prompt_builder.h"
+#include <algorithm>
+#include <chrono>
+
+namespace agent_cpp {
+
+namespace {
+
+common_chat_params
+render(const common_chat_templates* templates,
+       const std::vector<common_chat_msg>& messages,
+       const std::vector<common_chat_tool>& tools,
+       bool add_generation_prompt)
+{
+    common_chat_templates_inputs inputs;
+    inputs.messages = messages;
+    inputs.tools = tools;
+    inputs.tool_choice = COMMON_CHAT_TOOL_CHOICE_AUTO;
+    inputs.add_generation_prompt = add_generation_prompt;
+    inputs.enable_thinking = false;
+
+    return common_chat_templates_apply(templates, inputs);
+}
+
+// Returns empty vector on failure
+std::vector<llama_token>
+tokenize(const llama_vocab* vocab,
+         const std::string& text,
+         bool add_special,
+         double& elapsed_ms)
+{
+    using Clock = std::chrono::steady_clock;
+    struct Timer
+    {
+        double& elapsed_ms;
+        Clock::time_point start = Clock::now();
+        ~Timer()
+        {
+            elapsed_ms +=
+              std::chrono::duration<double, std::milli>(Clock::now() - start)
+                .count();
+        }
+    } timer{ elapsed_ms };
+
+    const int n_tokens = -llama_tokenize(
+      vocab, text.c_str(), text.size(), nullptr, 0, add_special, true);
+    std::vector<llama_token> tokens(n_tokens);
+    if (llama_tokenize(vocab,
+                       text.c_str(),
+                       text.size(),
+                       tokens.data(),
+                       tokens.size(),
+                       add_special,
+                       true) < 0) {
+        return {};
+    }
+    return tokens;
+}
+
+bool
+starts_with(const std::string& text, const std::string& prefix)
+{
+    return text.size() >= prefix.size() &&
+           text.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool
+same_tools(const std::vector<common_chat_tool>& a,
+           const std::vector<common_chat_tool>& b)
+{
+    return std::equal(a.begin(),
+                      a.end(),
+                      b.begin(),
+                      b.end(),
+                      [](const common_chat_tool& x, const common_chat_tool& y) {
+                          return x.name == y.name &&
+                                 x.description == y.description &&
+                                 x.parameters == y.parameters;
+                      });
+}
+
+// Length of the common prefix of a and b
+size_t
+common_prefix(const std::string& a, const std::string& b)
+{
+    const size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Trailing tokens of a partial prompt left out of build_partial(), the
+// token at the cut may merge with the text that follows it
+constexpr size_t kUnstableTokens = 2;
+
+// Templates often render assistant messages differently when they carry tool
+// calls, so those are verified separately
+std::string
+message_kind(const common_chat_msg& msg)
+{
+    return msg.tool_calls.empty() ? msg.role : msg.role + "+tool_calls";
+}
+
+} // anonymous namespace
+
+void
+PromptBuilder::reset()
+{
+    messages_.clear();
+    tools_.clear();
+    text_.clear();
+    tokens_.clear();
+}
+
+bool
+PromptBuilder::can_extend(const std::vector<common_chat_msg>& messages,
+                          const std::vector<common_chat_tool>& tools) const
+{
+    if (messages_.empty() || messages.size() <= messages_.size()) {
+        return false;
+    }
+    if (!same_tools(tools, tools_)) {
+        return false;
+    }
+    return std::equal(messages_.begin(), messages_.end(), messages.begin());
+}
+
+common_chat_params
+PromptBuilder::build(const common_chat_templates* templates,
+                     const llama_vocab* vocab,
+                     const std::vector<common_chat_msg>& messages,
+                     const std::vector<common_chat_tool>& tools,
+                     bool add_special,
+                     std::vector<llama_token>& tokens)
+{
+    tokens.clear();
+    tokenize_ms_ = 0;
+
+    if (enabled_ && can_extend(messages, tools)) {
+        common_chat_params params;
+        try {
+            if (build_incremental(
+                  templates, vocab, messages, tools, params, tokens)) {
+                return params;
+            }
+        } catch (const std::exception&) {
+            // Some templates reject the anchored conversation (e.g. strict
+            // role alternation), a full render handles those
+        }
+        tokens.clear();
+    }
+
+    reset();
+    auto params = render(templates, messages, tools, true);
+
+    if (enabled_) {
+        auto stable = render(templates, messages, tools, false);
+        if (starts_with(params.prompt, stable.prompt)) {
+            auto stable_tokens =
+              tokenize(vocab, stable.prompt, add_special, tokenize_ms_);
+            auto generation_tokens =
+              tokenize(vocab,
+                       params.prompt.substr(stable.prompt.size()),
+                       false,
+                       tokenize_ms_);
+
+            if (!stable_tokens.empty()) {
+                messages_ = messages;
+                tools_ = tools;
+                text_ = std::move(stable.prompt);
+                tokens_ = std::move(stable_tokens);
+
+                tokens = tokens_;
+                tokens.insert(tokens.end(),
+                              generation_tokens.begin(),
+                              generation_tokens.end());
+                return params;
+            }
+        }
+    }
+
+    tokens = tokenize(vocab, params.prompt, add_special, tokenize_ms_);
+    return params;
+}
+
+bool
+PromptBuilder::build_incremental(const common_chat_templates* templates,
+                                 const llama_vocab* vocab,
+                                 const std::vector<common_chat_msg>& messages,
+                                 const std::vector<common_chat_tool>& tools,
+                                 common_chat_params& params,
+                                 std::vector<llama_token>& tokens)
+{
+    const auto first_new =
+      messages.begin() + static_cast<std::ptrdiff_t>(messages_.size());
+
+    std::vector<common_chat_msg> anchored;
+    anchored.reserve(1 + messages.size() - messages_.size());
+    anchored.push_back(messages_.back());
+    anchored.insert(anchored.end(), first_new, messages.end());
+
+    const auto head = render(templates, { messages_.back() }, tools, false);
+    const auto body = render(templates, anchored, tools, false);
+    params = render(templates, anchored, tools, true);
+
+    // Appending messages must not change how the anchor itself renders
+    if (!starts_with(body.prompt, head.prompt) ||
+        !starts_with(params.prompt, body.prompt)) {
+        return false;
+    }
+
+    const std::string delta = body.prompt.substr(head.prompt.size());
+    const std::string generation_prompt =
+      params.prompt.substr(body.prompt.size());
+
+    std::vector<std::string> new_kinds;
+    for (auto it = first_new; it != messages.end(); ++it) {
+        std::string kind = message_kind(*it);
+        if (verified_kinds_.count(kind) == 0) {
+            new_kinds.push_back(std::move(kind));
+        }
+    }
+
+    if (!new_kinds.empty()) {
+        const auto reference = render(templates, messages, tools, false);
+        if (reference.prompt.size() != text_.size() + delta.size() ||
+            !starts_with(reference.prompt, text_) ||
+            reference.prompt.compare(text_.size(), delta.size(), delta) != 0) {
+            // The template is position dependent, stop trying to split it
+            enabled_ = false;
+            return false;
+        }
+        verified_kinds_.insert(new_kinds.begin(), new_kinds.end());
+    }
+
+    auto delta_tokens = tokenize(vocab, delta, false, tokenize_ms_);
+    auto generation_tokens =
+      tokenize(vocab, generation_prompt, false, tokenize_ms_);
+    if ((delta_tokens.empty() && !delta.empty()) ||
+        (generation_tokens.empty() && !generation_prompt.empty())) {
+        return false;
+    }
+
+    messages_.insert(messages_.end(), first_new, messages.end());
+    text_ += delta;
+    tokens_.insert(tokens_.end(), delta_tokens.begin(), delta_tokens.end());
+
+    tokens = tokens_;
+    tokens.insert(
+      tokens.end(), generation_tokens.begin(), generation_tokens.end());
+
+    // The full prompt text is never materialized on this path
+    params.prompt.clear();
+    return true;
+}
+
+std::vector<llama_token>
+PromptBuilder::build_partial(const common_chat_templates* templates,
+                             const llama_vocab* vocab,
+                             const std::vector<common_chat_msg>& messages,
+                             const std::vector<common_chat_tool>& tools,
+                             bool add_special) const
+{
+    if (messages.empty()) {
+        return {};
+    }
+
+    // Whatever the content goes on with renders the same up to where the
+    // two variants differ
+    auto stable_text = [&](const std::vector<common_chat_msg>& conversation) {
+        auto a = conversation;
+        auto b = conversation;
+        a.back().content += "A";
+        b.back().content += "B";
+        const auto rendered_a = render(templates, a, tools, false).prompt;
+        const auto rendered_b = render(templates, b, tools, false).prompt;
+        return rendered_a.substr(0, common_prefix(rendered_a, rendered_b));
+    };
+
+    double tokenize_ms = 0;
+    std::vector<llama_token> tokens;
+    try {
+        if (enabled_ && can_extend(messages, tools)) {
+            // Same split as build_incremental()
+            std::vector<common_chat_msg> anchored;
+            anchored.push_back(messages_.back());
+            anchored.insert(anchored.end(),
+                            messages.begin() +
+                              static_cast<std::ptrdiff_t>(messages_.size()),
+                            messages.end());
+            const auto head =
+              render(templates, { messages_.back() }, tools, false).prompt;
+            const std::string text = stable_text(anchored);
+            if (starts_with(text, head)) {
+                tokens = tokens_;
+                auto delta = tokenize(
+                  vocab, text.substr(head.size()), false, tokenize_ms);
+                tokens.insert(tokens.end(), delta.begin(), delta.end());
+            }
+        }
+        if (tokens.empty()) {
+            tokens =
+              tokenize(vocab, stable_text(messages), add_special, tokenize_ms);
+        }
+    } catch (const std::exception&) {
+        return {};
+    }
+
+    tokens.resize(tokens.size() - std::min(tokens.size(), kUnstableTokens));
+    return tokens;
+}
+
+} // namespace agent_cpp
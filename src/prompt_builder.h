@@ -0,0 +1,87 @@
+#pragma once
+
+#include "chat.h"
+#include "llama.h"
+#include <set>
+#include <string>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief Renders and tokenizes chat prompts incrementally.
+///
+/// Keeps the rendered text and tokens of the last conversation it saw
+/// (without the generation prompt). When the next conversation extends it,
+/// only the appended messages are rendered, using the last cached message as
+/// an anchor so the template sees a valid conversation, and only the new text
+/// is tokenized.
+///
+/// The split is only trusted when rendering the anchor alone is a prefix of
+/// rendering the anchor followed by the new messages. The first time a kind of
+/// message is appended incrementally the result is also compared against a
+/// full render, and incremental rendering is disabled for good if they differ.
+class PromptBuilder
+{
+  public:
+    /// @brief Render messages with the generation prompt appended
+    /// @param templates Chat templates of the model
+    /// @param vocab Vocabulary used for tokenization
+    /// @param messages Conversation to render
+    /// @param tools Tool definitions passed to the template
+    /// @param add_special Whether a full render is tokenized with special
+    /// tokens (BOS) added
+    /// @param tokens Receives the tokens of the rendered prompt
+    /// @return Template output. prompt is left empty when the render was
+    /// incremental, use tokens instead.
+    common_chat_params build(const common_chat_templates* templates,
+                             const llama_vocab* vocab,
+                             const std::vector<common_chat_msg>& messages,
+                             const std::vector<common_chat_tool>& tools,
+                             bool add_special,
+                             std::vector<llama_token>& tokens);
+
+    /// @brief Tokens of the prompt for messages that stay the same however
+    /// the content of the last message goes on, e.g. a tool response still
+    /// streaming in. Tokenized the way build() would, so they match the
+    /// start of its result; the last few are left out because they may
+    /// still merge with what follows. Doesn't change the cached prefix.
+    /// @return Empty if the template rejects messages
+    std::vector<llama_token> build_partial(
+      const common_chat_templates* templates,
+      const llama_vocab* vocab,
+      const std::vector<common_chat_msg>& messages,
+      const std::vector<common_chat_tool>& tools,
+      bool add_special) const;
+
+    /// @brief Milliseconds the last build() spent tokenizing, the rest of
+    /// it went to rendering
+    [[nodiscard]] double last_tokenize_ms() const { return tokenize_ms_; }
+
+    /// @brief Forget the cached prefix
+    void reset();
+
+    /// @brief Enable or disable incremental rendering
+    void set_enabled(bool enabled) { enabled_ = enabled; }
+
+  private:
+    bool can_extend(const std::vector<common_chat_msg>& messages,
+                    const std::vector<common_chat_tool>& tools) const;
+
+    bool build_incremental(const common_chat_templates* templates,
+                           const llama_vocab* vocab,
+                           const std::vector<common_chat_msg>& messages,
+                           const std::vector<common_chat_tool>& tools,
+                           common_chat_params& params,
+                           std::vector<llama_token>& tokens);
+
+    bool enabled_ = true;
+    std::vector<common_chat_msg> messages_;
+    std::vector<common_chat_tool> tools_;
+    std::string text_;
+    std::vector<llama_token> tokens_;
+    // Kinds of appended messages already checked against a full render
+    std::set<std::string> verified_kinds_;
+    double tokenize_ms_ = 0;
+};
+
+} // namespace agent_cpp
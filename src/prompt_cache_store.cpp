@@ -0,0 +1,430 @@
+#include "prompt_cache_store.h"
+#include "error.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#else
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+namespace agent_cpp {
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace {
+
+// FNV-1a, stable across platforms and runs
+uint64_t
+fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Identifies the weights a state was saved with
+std::string
+model_id(const Model& model)
+{
+    const llama_model* weights = model.get_weights()->get_model();
+    char desc[256];
+    llama_model_desc(weights, desc, sizeof(desc));
+
+    char id[384];
+    snprintf(id,
+             sizeof(id),
+             "%s|%" PRIu64 "|%" PRIu64 "|%d",
+             desc,
+             llama_model_size(weights),
+             llama_model_n_params(weights),
+             llama_vocab_n_tokens(model.get_vocab()));
+    return id;
+}
+
+std::string
+entry_key(const std::string& model_id, const std::vector<llama_token>& tokens)
+{
+    uint64_t hash = fnv1a(model_id.data(), model_id.size());
+    hash = fnv1a(tokens.data(), tokens.size() * sizeof(llama_token), hash);
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016" PRIx64, hash);
+    return key;
+}
+
+size_t
+common_prefix_length(const std::vector<llama_token>& a,
+                     const std::vector<llama_token>& b)
+{
+    const size_t n = std::min(a.size(), b.size());
+    return static_cast<size_t>(
+      std::mismatch(a.begin(), a.begin() + n, b.begin()).first - a.begin());
+}
+
+// Exclusive lock on a file, held across processes. Without a lock file,
+// e.g. in a read-only directory, the store goes on unlocked.
+class FileLock
+{
+  public:
+    explicit FileLock(const std::string& path)
+    {
+#ifdef _WIN32
+        fd_ = _open(path.c_str(), _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE);
+        // _LK_LOCK gives up after about ten seconds
+        while (fd_ >= 0 && _locking(fd_, _LK_LOCK, 1) != 0 &&
+               errno == EDEADLOCK) {
+        }
+#else
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        while (fd_ >= 0 && flock(fd_, LOCK_EX) != 0 && errno == EINTR) {
+        }
+#endif
+    }
+
+    ~FileLock()
+    {
+        // Closing releases the lock
+#ifdef _WIN32
+        if (fd_ >= 0) {
+            _close(fd_);
+        }
+#else
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+#endif
+    }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+  private:
+    int fd_ = -1;
+};
+
+} // anonymous namespace
+
+PromptCacheIndex
+PromptCacheIndex::read(const std::string& path)
+{
+    PromptCacheIndex index;
+    std::ifstream file(path);
+    if (!file) {
+        return index;
+    }
+
+    try {
+        const json j = json::parse(file);
+        index.clock_ = j.value("clock", uint64_t{ 0 });
+        for (const auto& item : j.at("entries")) {
+            Entry entry;
+            entry.key = item.at("key").get<std::string>();
+            entry.model_id = item.at("model").get<std::string>();
+            entry.tokens = item.at("tokens").get<std::vector<llama_token>>();
+            entry.bytes = item.value("bytes", uint64_t{ 0 });
+            entry.last_used = item.value("last_used", uint64_t{ 0 });
+            index.entries_.push_back(std::move(entry));
+        }
+    } catch (const json::exception&) {
+        // A corrupt index only costs the cache, start over
+        return PromptCacheIndex{};
+    }
+    return index;
+}
+
+bool
+PromptCacheIndex::write(const std::string& path) const
+{
+    json entries = json::array();
+    for (const auto& entry : entries_) {
+        entries.push_back({ { "key", entry.key },
+                            { "model", entry.model_id },
+                            { "tokens", entry.tokens },
+                            { "bytes", entry.bytes },
+                            { "last_used", entry.last_used } });
+    }
+    const json index = { { "clock", clock_ }, { "entries", entries } };
+
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << index.dump();
+        if (!file) {
+            file.close();
+            std::error_code ec;
+            fs::remove(tmp_path, ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+const PromptCacheIndex::Entry*
+PromptCacheIndex::find(const std::string& model_id,
+                       const std::vector<llama_token>& tokens,
+                       size_t& n_match) const
+{
+    const Entry* best = nullptr;
+    n_match = 0;
+    for (const auto& entry : entries_) {
+        if (entry.model_id != model_id) {
+            continue;
+        }
+        const size_t n = common_prefix_length(entry.tokens, tokens);
+        if (n > n_match || (best != nullptr && n == n_match && n > 0 &&
+                            entry.tokens.size() < best->tokens.size())) {
+            best = &entry;
+            n_match = n;
+        }
+    }
+    return best;
+}
+
+void
+PromptCacheIndex::put(Entry entry)
+{
+    entry.last_used = ++clock_;
+    auto it =
+      std::find_if(entries_.begin(), entries_.end(), [&entry](const Entry& e) {
+          return e.key == entry.key;
+      });
+    if (it != entries_.end()) {
+        *it = std::move(entry);
+    } else {
+        entries_.push_back(std::move(entry));
+    }
+}
+
+bool
+PromptCacheIndex::touch(const std::string& key)
+{
+    for (auto& entry : entries_) {
+        if (entry.key == key) {
+            entry.last_used = ++clock_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+PromptCacheIndex::merge(const PromptCacheIndex& other)
+{
+    clock_ = std::max(clock_, other.clock_);
+    for (const auto& theirs : other.entries_) {
+        auto it = std::find_if(
+          entries_.begin(), entries_.end(), [&theirs](const Entry& e) {
+              return e.key == theirs.key;
+          });
+        if (it == entries_.end()) {
+            entries_.push_back(theirs);
+        } else if (theirs.last_used > it->last_used) {
+            *it = theirs;
+        }
+    }
+}
+
+void
+PromptCacheIndex::retain(const std::function<bool(const Entry&)>& keep)
+{
+    entries_.erase(std::remove_if(entries_.begin(),
+                                  entries_.end(),
+                                  [&keep](const Entry& e) { return !keep(e); }),
+                   entries_.end());
+}
+
+std::vector<PromptCacheIndex::Entry>
+PromptCacheIndex::evict(uint64_t max_bytes)
+{
+    std::sort(entries_.begin(),
+              entries_.end(),
+              [](const Entry& a, const Entry& b) {
+                  return a.last_used > b.last_used;
+              });
+
+    uint64_t total = 0;
+    size_t n_keep = 0;
+    for (; n_keep < entries_.size(); n_keep++) {
+        // The newest entry is always kept, even if it alone is too large
+        if (n_keep > 0 && total + entries_[n_keep].bytes > max_bytes) {
+            break;
+        }
+        total += entries_[n_keep].bytes;
+    }
+
+    std::vector<Entry> evicted(
+      std::make_move_iterator(entries_.begin() + n_keep),
+      std::make_move_iterator(entries_.end()));
+    entries_.resize(n_keep);
+    return evicted;
+}
+
+uint64_t
+PromptCacheIndex::total_bytes() const
+{
+    uint64_t total = 0;
+    for (const auto& entry : entries_) {
+        total += entry.bytes;
+    }
+    return total;
+}
+
+PromptCacheStore::PromptCacheStore(PromptCacheStoreConfig config)
+  : config_(std::move(config))
+{
+    std::error_code ec;
+    fs::create_directories(config_.directory, ec);
+    if (ec) {
+        throw Error("unable to create prompt cache directory '" +
+                    config_.directory + "': " + ec.message());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FileLock file_lock(path_of("index.lock"));
+    sync_index();
+}
+
+std::string
+PromptCacheStore::path_of(const std::string& name) const
+{
+    return (fs::path(config_.directory) / name).string();
+}
+
+std::string
+PromptCacheStore::index_path() const
+{
+    return path_of("index.json");
+}
+
+void
+PromptCacheStore::sync_index()
+{
+    index_.merge(PromptCacheIndex::read(index_path()));
+    // Entries another store evicted are gone with their state file
+    index_.retain([this](const PromptCacheIndex::Entry& entry) {
+        std::error_code ec;
+        return fs::exists(path_of(entry.key + ".bin"), ec);
+    });
+}
+
+void
+PromptCacheStore::commit_index()
+{
+    for (const auto& entry : index_.evict(config_.max_bytes)) {
+        std::error_code ec;
+        fs::remove(path_of(entry.key + ".bin"), ec);
+    }
+    index_.write(index_path());
+}
+
+bool
+PromptCacheStore::save(Model& model)
+{
+    const auto& tokens = model.get_cached_tokens();
+    if (tokens.empty()) {
+        return false;
+    }
+
+    PromptCacheIndex::Entry entry;
+    entry.model_id = model_id(model);
+    entry.key = entry_key(entry.model_id, tokens);
+    entry.tokens = tokens;
+
+    // Written aside first so a crash never leaves a truncated entry
+    const std::string path = path_of(entry.key + ".bin");
+    const std::string tmp_path = path + ".tmp";
+    if (!model.save_cache(tmp_path)) {
+        std::error_code ec;
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    entry.bytes = fs::file_size(path, ec);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FileLock file_lock(path_of("index.lock"));
+    sync_index();
+    index_.put(std::move(entry));
+    commit_index();
+    return true;
+}
+
+size_t
+PromptCacheStore::load(Model& model,
+                       const std::vector<llama_token>& prompt_tokens)
+{
+    const std::string id = model_id(model);
+
+    std::string key;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        FileLock file_lock(path_of("index.lock"));
+        sync_index();
+        size_t n_match = 0;
+        const auto* best = index_.find(id, prompt_tokens, n_match);
+        if (best == nullptr) {
+            return 0;
+        }
+        key = best->key;
+    }
+
+    // Another store may evict the entry meanwhile, loading then fails
+    const auto loaded = model.load_cache(path_of(key + ".bin"));
+    const size_t n_reused = common_prefix_length(loaded, prompt_tokens);
+    if (n_reused == 0) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FileLock file_lock(path_of("index.lock"));
+    sync_index();
+    if (index_.touch(key)) {
+        commit_index();
+    }
+    return n_reused;
+}
+
+size_t
+PromptCacheStore::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.entries().size();
+}
+
+uint64_t
+PromptCacheStore::total_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.total_bytes();
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "llama.h"
+#include "model.h"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace agent_cpp {
+
+struct PromptCacheStoreConfig
+{
+    // Directory holding the state files and their index
+    std::string directory;
+    // Total size of the state files, least recently used entries are
+    // evicted beyond it
+    uint64_t max_bytes = 4ULL << 30;
+};
+
+/// @brief Entries of a PromptCacheStore, as kept in its index.json
+///
+/// Orders entries by a logical clock that advances on every use, so stores
+/// sharing a directory agree on which entry was used least recently once
+/// their indexes are merged. Not thread safe.
+class PromptCacheIndex
+{
+  public:
+    struct Entry
+    {
+        std::string key; // Names the state file
+        std::string model_id;
+        std::vector<llama_token> tokens;
+        uint64_t bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    /// @brief Read an index file, empty if it is missing or corrupt
+    static PromptCacheIndex read(const std::string& path);
+
+    /// @brief Write the index, replacing the file atomically
+    /// @return false if it couldn't be written
+    bool write(const std::string& path) const;
+
+    /// @brief Entry of model_id sharing the longest prefix with tokens
+    /// @param n_match Set to the length of that prefix
+    /// @return nullptr if no entry shares a token. On a tie the entry with
+    /// fewer tokens wins, its state is cheaper to load.
+    const Entry* find(const std::string& model_id,
+                      const std::vector<llama_token>& tokens,
+                      size_t& n_match) const;
+
+    /// @brief Add entry as the most recently used, replacing one with the
+    /// same key
+    void put(Entry entry);
+
+    /// @brief Mark the entry with key as the most recently used
+    /// @return false if there is no such entry
+    bool touch(const std::string& key);
+
+    /// @brief Take in the entries of other, e.g. the index another store
+    /// wrote. An entry both hold keeps its most recent use.
+    void merge(const PromptCacheIndex& other);
+
+    /// @brief Keep only the entries keep returns true for
+    void retain(const std::function<bool(const Entry&)>& keep);
+
+    /// @brief Remove least recently used entries until the rest fit
+    /// max_bytes. The most recently used one is always kept.
+    /// @return The removed entries
+    std::vector<Entry> evict(uint64_t max_bytes);
+
+    [[nodiscard]] const std::vector<Entry>& entries() const
+    {
+        return entries_;
+    }
+
+    [[nodiscard]] uint64_t total_bytes() const;
+
+  private:
+    std::vector<Entry> entries_;
+    uint64_t clock_ = 0;
+};
+
+/// @brief Directory of KV cache snapshots keyed by model and token prefix
+///
+/// Each entry is the saved state of a model whose cache held a given token
+/// sequence, named after a hash of the model and the tokens. Loading picks
+/// the entry sharing the longest prefix with the prompt about to be
+/// decoded, so agents with slightly different instructions or tools still
+/// start from the part they have in common, and a changed prompt can never
+/// be served a stale state. The index lives in index.json in the directory.
+///
+/// Several stores, also in other processes, may share a directory. Each
+/// takes index.lock before it reads or writes the index and merges what
+/// the others wrote, so no store drops another's entries or evicts by a
+/// stale view of which were used last.
+///
+/// Usage:
+///   agent_cpp::PromptCacheStore store({ "prompt-cache" });
+///   auto prompt = agent.build_prompt_tokens();
+///   if (store.load(*model, prompt) < prompt.size()) {
+///       model->prefill(prompt);
+///       store.save(*model);
+///   }
+class PromptCacheStore
+{
+  public:
+    /// @throws agent_cpp::Error if the directory can't be created
+    explicit PromptCacheStore(PromptCacheStoreConfig config);
+
+    /// @brief Save the model's current cache, replacing an entry with the
+    /// same tokens
+    /// @return false if the state could not be written
+    bool save(Model& model);
+
+    /// @brief Load the entry sharing the longest prefix with prompt_tokens
+    /// @return Number of leading prompt tokens now in the model's cache, 0 if
+    /// no entry matched. Prefill prompt_tokens to decode the rest.
+    size_t load(Model& model, const std::vector<llama_token>& prompt_tokens);
+
+    /// @brief Number of entries
+    [[nodiscard]] size_t size() const;
+
+    /// @brief Total size of the state files in bytes
+    [[nodiscard]] uint64_t total_bytes() const;
+
+  private:
+    // Path of the file called name in the directory
+    std::string path_of(const std::string& name) const;
+    std::string index_path() const;
+    // Merge index.json into index_, dropping entries whose state file is
+    // gone. The caller holds mutex_ and the directory's lock.
+    void sync_index();
+    // Evict beyond max_bytes and write index.json, same locks held
+    void commit_index();
+
+    PromptCacheStoreConfig config_;
+    mutable std::mutex mutex_;
+    PromptCacheIndex index_;
+};
+
+} // namespace agent_cpp
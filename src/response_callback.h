@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace agent_cpp {
+
+/// @brief Callback for streaming response chunks
+///
+/// Chunks are views into the model's buffers, valid for the duration of the
+/// call, and always end on a UTF-8 character boundary. Callables taking a
+/// std::string_view get the view as is. Callables taking a
+/// const std::string& are still accepted; they get a copy in a string that
+/// is reused between chunks.
+class ResponseCallback
+{
+  public:
+    ResponseCallback() = default;
+    ResponseCallback(std::nullptr_t) {}
+
+    template<
+      typename F,
+      std::enable_if_t<!std::is_same_v<std::decay_t<F>, ResponseCallback> &&
+                         std::is_invocable_v<F&, std::string_view>,
+                       int> = 0>
+    ResponseCallback(F callback)
+      : callback_(std::move(callback))
+    {
+    }
+
+    template<
+      typename F,
+      std::enable_if_t<!std::is_same_v<std::decay_t<F>, ResponseCallback> &&
+                         !std::is_invocable_v<F&, std::string_view> &&
+                         std::is_invocable_v<F&, const std::string&>,
+                       int> = 0>
+    ResponseCallback(F callback)
+      : callback_([callback = std::move(callback),
+                   chunk = std::string()](std::string_view piece) mutable {
+          chunk.assign(piece.data(), piece.size());
+          callback(chunk);
+      })
+    {
+    }
+
+    void operator()(std::string_view chunk) const { callback_(chunk); }
+
+    explicit operator bool() const { return static_cast<bool>(callback_); }
+
+  private:
+    std::function<void(std::string_view)> callback_;
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,209 @@
+#include "speculative.h"
+#include "error.h"
+#include "model.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+std::vector<llama_token>
+ngram_lookup_draft(const std::vector<llama_token>& context,
+                   llama_token last,
+                   int ngram_min,
+                   int ngram_max,
+                   int n_draft)
+{
+    // The sequence searched is context followed by last
+    const size_t n_seq = context.size() + 1;
+    auto at = [&](size_t i) {
+        return i < context.size() ? context[i] : last;
+    };
+
+    for (int n = ngram_max; n >= std::max(1, ngram_min); n--) {
+        const auto n_gram = static_cast<size_t>(n);
+        if (n_seq < n_gram + 1) {
+            continue;
+        }
+        const size_t pattern = n_seq - n_gram;
+
+        // Latest earlier occurrence wins, it is the most likely to repeat
+        for (size_t start = pattern; start-- > 0;) {
+            size_t k = 0;
+            while (k < n_gram && at(start + k) == at(pattern + k)) {
+                k++;
+            }
+            if (k < n_gram) {
+                continue;
+            }
+
+            std::vector<llama_token> draft;
+            for (size_t i = start + n_gram;
+                 i < n_seq && draft.size() < static_cast<size_t>(n_draft);
+                 i++) {
+                draft.push_back(at(i));
+            }
+            return draft;
+        }
+    }
+
+    return {};
+}
+
+Drafter::Drafter(const SpeculativeConfig& config,
+                 const llama_vocab* target_vocab,
+                 int n_ctx,
+                 int n_batch,
+                 int n_threads,
+                 int n_threads_batch,
+                 std::shared_ptr<ComputeThreadpool> threadpool)
+  : config_(config)
+  , threadpool_(std::move(threadpool))
+{
+    if (!config_.draft_weights) {
+        return;
+    }
+
+    const llama_vocab* draft_vocab = config_.draft_weights->get_vocab();
+    if (llama_vocab_n_tokens(draft_vocab) !=
+        llama_vocab_n_tokens(target_vocab)) {
+        throw ModelError("draft model vocabulary doesn't match the model");
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config_.draft_n_ctx > 0 ? config_.draft_n_ctx : n_ctx;
+    ctx_params.n_batch = n_batch;
+    ctx_params.n_threads = n_threads;
+    ctx_params.n_threads_batch = n_threads_batch;
+    if (threadpool_) {
+        ctx_params.n_threads = threadpool_->n_threads();
+        ctx_params.n_threads_batch = threadpool_->n_threads_batch();
+    }
+
+    ctx_ =
+      llama_init_from_model(config_.draft_weights->get_model(), ctx_params);
+    if (ctx_ == nullptr) {
+        throw ModelError("failed to create draft model context");
+    }
+    if (threadpool_) {
+        llama_attach_threadpool(
+          ctx_, threadpool_->get(), threadpool_->get_batch());
+    }
+    n_batch_ = static_cast<int>(llama_n_batch(ctx_));
+
+    // Drafts only need the most likely continuation
+    sampler_ = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(sampler_, llama_sampler_init_greedy());
+}
+
+Drafter::~Drafter()
+{
+    if (sampler_ != nullptr) {
+        llama_sampler_free(sampler_);
+    }
+    if (ctx_ != nullptr) {
+        llama_free(ctx_);
+    }
+}
+
+std::vector<llama_token>
+Drafter::draft(const std::vector<llama_token>& context,
+               llama_token last,
+               int n_max)
+{
+    n_max = std::min(n_max, config_.n_draft);
+    if (n_max <= 0) {
+        return {};
+    }
+
+    if (config_.ngram_lookup) {
+        auto tokens = ngram_lookup_draft(
+          context, last, config_.ngram_min, config_.ngram_max, n_max);
+        if (!tokens.empty()) {
+            return tokens;
+        }
+    }
+
+    if (ctx_ != nullptr) {
+        return draft_with_model(context, last, n_max);
+    }
+    return {};
+}
+
+bool
+Drafter::decode(const llama_token* tokens, size_t n_tokens)
+{
+    size_t i = 0;
+    while (i < n_tokens) {
+        const size_t n = std::min(n_tokens - i, static_cast<size_t>(n_batch_));
+        llama_batch batch =
+          llama_batch_get_one(const_cast<llama_token*>(tokens + i), n);
+        int ret = 0;
+        {
+            std::unique_lock<std::mutex> compute;
+            if (threadpool_) {
+                compute = threadpool_->acquire();
+            }
+            ret = llama_decode(ctx_, batch);
+        }
+        if (ret != 0) {
+            return false;
+        }
+        processed_tokens_.insert(
+          processed_tokens_.end(), tokens + i, tokens + i + n);
+        i += n;
+    }
+    return true;
+}
+
+std::vector<llama_token>
+Drafter::draft_with_model(const std::vector<llama_token>& context,
+                          llama_token last,
+                          int n_max)
+{
+    const size_t n_history = context.size() + 1;
+    const auto n_ctx = static_cast<size_t>(llama_n_ctx(ctx_));
+    if (n_history + n_max > n_ctx) {
+        return {};
+    }
+
+    // Follow the target's cache. Rejected drafts from the previous step are
+    // dropped here as well.
+    size_t common_prefix = 0;
+    while (common_prefix < processed_tokens_.size() &&
+           common_prefix < context.size() &&
+           processed_tokens_[common_prefix] == context[common_prefix]) {
+        common_prefix++;
+    }
+    if (common_prefix < processed_tokens_.size()) {
+        llama_memory_seq_rm(llama_get_memory(ctx_), 0, common_prefix, -1);
+        processed_tokens_.resize(common_prefix);
+    }
+
+    std::vector<llama_token> pending(context.begin() + common_prefix,
+                                     context.end());
+    pending.push_back(last);
+    if (!decode(pending.data(), pending.size())) {
+        // Start over next time
+        llama_memory_clear(llama_get_memory(ctx_), true);
+        processed_tokens_.clear();
+        return {};
+    }
+
+    const llama_vocab* vocab = config_.draft_weights->get_vocab();
+    std::vector<llama_token> tokens;
+    tokens.reserve(n_max);
+    while (static_cast<int>(tokens.size()) < n_max) {
+        llama_token token = llama_sampler_sample(sampler_, ctx_, -1);
+        tokens.push_back(token);
+        if (llama_vocab_is_eog(vocab, token) ||
+            static_cast<int>(tokens.size()) == n_max) {
+            break;
+        }
+        if (!decode(&token, 1)) {
+            break;
+        }
+    }
+
+    return tokens;
+}
+
+} // namespace agent_cpp
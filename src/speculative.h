@@ -0,0 +1,97 @@
+#pragma once
+
+#include "llama.h"
+#include <memory>
+#include <vector>
+
+namespace agent_cpp {
+
+class ComputeThreadpool;
+class ModelWeights;
+
+// Speculative decoding: cheap guesses of the next tokens are verified by the
+// model in a single batch. The output is the same as without it, only the
+// number of llama_decode calls changes.
+struct SpeculativeConfig
+{
+    // Small model sharing the vocabulary of the target, proposes tokens
+    std::shared_ptr<ModelWeights> draft_weights;
+    // Propose the tokens that followed the latest n-gram earlier in the
+    // context. Costs no extra model and works well on tool call JSON, which
+    // repeats earlier text heavily. Tried before the draft model.
+    bool ngram_lookup = false;
+    int ngram_min = 2;
+    int ngram_max = 4;
+    // Maximum number of tokens proposed per step
+    int n_draft = 8;
+    // Context size of the draft model, 0 uses the target's
+    int draft_n_ctx = 0;
+
+    [[nodiscard]] bool enabled() const
+    {
+        return (draft_weights || ngram_lookup) && n_draft > 0;
+    }
+};
+
+/// @brief Find the tokens that followed the latest n-gram earlier on
+/// @param context Tokens in the KV cache
+/// @param last Sampled token that follows context
+/// @param ngram_min Shortest n-gram to match
+/// @param ngram_max Longest n-gram to match, longer matches are tried first
+/// @param n_draft Maximum number of tokens to return
+/// @return Proposed continuation, empty if no n-gram matched
+std::vector<llama_token>
+ngram_lookup_draft(const std::vector<llama_token>& context,
+                   llama_token last,
+                   int ngram_min,
+                   int ngram_max,
+                   int n_draft);
+
+/// @brief Proposes draft tokens for speculative decoding
+///
+/// Owned by a Model that owns its context. The draft model, if any, keeps
+/// its own context and follows the target's cached tokens, re-decoding only
+/// after the point where they diverge. Given the target's threadpool, the
+/// draft context computes on it too instead of starting its own threads.
+class Drafter
+{
+  public:
+    /// @throws agent_cpp::ModelError if the draft model's context can't be
+    /// created or its vocabulary doesn't match the target
+    Drafter(const SpeculativeConfig& config,
+            const llama_vocab* target_vocab,
+            int n_ctx,
+            int n_batch,
+            int n_threads,
+            int n_threads_batch,
+            std::shared_ptr<ComputeThreadpool> threadpool = nullptr);
+
+    ~Drafter();
+
+    Drafter(const Drafter&) = delete;
+    Drafter& operator=(const Drafter&) = delete;
+
+    /// @brief Propose tokens following context + last
+    /// @param n_max Maximum number of tokens, capped by n_draft
+    std::vector<llama_token> draft(const std::vector<llama_token>& context,
+                                   llama_token last,
+                                   int n_max);
+
+  private:
+    std::vector<llama_token> draft_with_model(
+      const std::vector<llama_token>& context,
+      llama_token last,
+      int n_max);
+
+    // Decode tokens into the draft context, returns false on failure
+    bool decode(const llama_token* tokens, size_t n_tokens);
+
+    SpeculativeConfig config_;
+    std::shared_ptr<ComputeThreadpool> threadpool_;
+    llama_context* ctx_ = nullptr;
+    llama_sampler* sampler_ = nullptr;
+    int n_batch_ = 0;
+    std::vector<llama_token> processed_tokens_; // Tokens in the draft cache
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,164 @@
+#include "state_snapshot.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace agent_cpp {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x53534741; // "AGSS"
+constexpr uint32_t kVersion = 1;
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags; // Reserved, 0
+    uint32_t n_tokens;
+    uint64_t state_size;
+};
+
+} // anonymous namespace
+
+bool
+SequenceSnapshot::write(const std::string& path) const
+{
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+
+        const Header header{ kMagic,
+                             kVersion,
+                             0,
+                             static_cast<uint32_t>(tokens.size()),
+                             static_cast<uint64_t>(state.size()) };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(tokens.data()),
+                   static_cast<std::streamsize>(tokens.size() *
+                                                sizeof(llama_token)));
+        file.write(reinterpret_cast<const char*>(state.data()),
+                   static_cast<std::streamsize>(state.size()));
+        if (!file) {
+            file.close();
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+    close();
+}
+
+bool
+MappedSnapshot::open(const std::string& path)
+{
+    close();
+
+#ifndef _WIN32
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(
+      nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    data_ = static_cast<const uint8_t*>(mapped);
+    size_ = static_cast<size_t>(st.st_size);
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    buffer_.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(buffer_.data()),
+                   static_cast<std::streamsize>(buffer_.size()))) {
+        buffer_.clear();
+        return false;
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+
+    Header header{};
+    if (size_ < sizeof(header)) {
+        close();
+        return false;
+    }
+    std::memcpy(&header, data_, sizeof(header));
+
+    const size_t tokens_size =
+      static_cast<size_t>(header.n_tokens) * sizeof(llama_token);
+    if (header.magic != kMagic || header.version != kVersion ||
+        header.flags != 0 ||
+        size_ - sizeof(header) < tokens_size ||
+        size_ - sizeof(header) - tokens_size != header.state_size) {
+        close();
+        return false;
+    }
+
+    tokens_ = reinterpret_cast<const llama_token*>(data_ + sizeof(header));
+    n_tokens_ = header.n_tokens;
+    state_ = data_ + sizeof(header) + tokens_size;
+    state_size_ = static_cast<size_t>(header.state_size);
+    return true;
+}
+
+std::vector<llama_token>
+MappedSnapshot::tokens() const
+{
+    std::vector<llama_token> tokens(n_tokens_);
+    if (n_tokens_ > 0) {
+        std::memcpy(tokens.data(), tokens_, n_tokens_ * sizeof(llama_token));
+    }
+    return tokens;
+}
+
+void
+MappedSnapshot::close()
+{
+#ifndef _WIN32
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#endif
+    buffer_.clear();
+    data_ = nullptr;
+    size_ = 0;
+    tokens_ = nullptr;
+    n_tokens_ = 0;
+    state_ = nullptr;
+    state_size_ = 0;
+}
+
+} // namespace agent_cpp
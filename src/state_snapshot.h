@@ -0,0 +1,56 @@
+#pragma once
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief KV cache state of one sequence, copied out of a context
+///
+/// Written to disk as a small header, the tokens and the raw
+/// llama_state_seq_get_data() bytes, so loading can hand a mapped file
+/// straight to llama_state_seq_set_data() without copying it.
+struct SequenceSnapshot
+{
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
+
+    /// @brief Write to path, through a temporary file renamed into place
+    /// @return false if the file could not be written
+    bool write(const std::string& path) const;
+};
+
+/// @brief Read-only view of a snapshot file, memory mapped where supported
+class MappedSnapshot
+{
+  public:
+    /// @brief Map the file at path
+    /// @return false if it can't be read or isn't a snapshot
+    bool open(const std::string& path);
+
+    ~MappedSnapshot();
+
+    MappedSnapshot() = default;
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    [[nodiscard]] std::vector<llama_token> tokens() const;
+    [[nodiscard]] const uint8_t* state() const { return state_; }
+    [[nodiscard]] size_t state_size() const { return state_size_; }
+
+  private:
+    void close();
+
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<uint8_t> buffer_; // Holds the file where mmap isn't used
+    const llama_token* tokens_ = nullptr;
+    size_t n_tokens_ = 0;
+    const uint8_t* state_ = nullptr;
+    size_t state_size_ = 0;
+};
+
+} // namespace agent_cpp
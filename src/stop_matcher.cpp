@@ -0,0 +1,114 @@
+#include "stop_matcher.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+namespace {
+
+// Bytes at the end of text[begin, end) that start a UTF-8 character whose
+// remaining bytes are still to come
+size_t
+incomplete_utf8_length(const std::string& text, size_t begin, size_t end)
+{
+    for (size_t n = 1; n <= 4 && n <= end - begin; n++) {
+        const auto byte = static_cast<unsigned char>(text[end - n]);
+        if ((byte & 0xC0) == 0x80) {
+            continue; // Continuation byte, the lead byte is further back
+        }
+
+        size_t length = 1;
+        if ((byte & 0xE0) == 0xC0) {
+            length = 2;
+        } else if ((byte & 0xF0) == 0xE0) {
+            length = 3;
+        } else if ((byte & 0xF8) == 0xF0) {
+            length = 4;
+        }
+        return length > n ? n : 0;
+    }
+    return 0;
+}
+
+} // anonymous namespace
+
+StopMatcher::StopMatcher(const std::vector<std::string>& stops,
+                         size_t chunk_pieces)
+  : chunk_pieces_(std::max<size_t>(1, chunk_pieces))
+{
+    for (const auto& stop : stops) {
+        if (!stop.empty() &&
+            std::find(stops_.begin(), stops_.end(), stop) == stops_.end()) {
+            stops_.push_back(stop);
+            max_stop_length_ = std::max(max_stop_length_, stop.size());
+        }
+    }
+}
+
+std::string_view
+StopMatcher::push(std::string_view piece)
+{
+    if (stopped_) {
+        return {};
+    }
+
+    text_.append(piece.data(), piece.size());
+
+    if (!stops_.empty()) {
+        // Held back text never contains a whole stop sequence, so matches
+        // start at or after emitted_
+        size_t stop_pos = std::string::npos;
+        for (const auto& stop : stops_) {
+            stop_pos = std::min(stop_pos, text_.find(stop, emitted_));
+        }
+
+        if (stop_pos != std::string::npos) {
+            stopped_ = true;
+            text_.resize(stop_pos);
+            return flush();
+        }
+    }
+
+    if (++pending_pieces_ < chunk_pieces_) {
+        return {};
+    }
+
+    size_t end = text_.size() - partial_match_length();
+    end -= incomplete_utf8_length(text_, emitted_, end);
+    return release(end);
+}
+
+std::string_view
+StopMatcher::flush()
+{
+    return release(text_.size());
+}
+
+std::string_view
+StopMatcher::release(size_t end)
+{
+    const size_t begin = emitted_;
+    emitted_ = end;
+    pending_pieces_ = 0;
+    return std::string_view(text_).substr(begin, end - begin);
+}
+
+size_t
+StopMatcher::partial_match_length() const
+{
+    if (max_stop_length_ == 0) {
+        return 0;
+    }
+    const size_t n_max =
+      std::min(max_stop_length_ - 1, text_.size() - emitted_);
+    for (size_t n = n_max; n > 0; n--) {
+        const size_t start = text_.size() - n;
+        for (const auto& stop : stops_) {
+            if (stop.size() > n && text_.compare(start, n, stop, 0, n) == 0) {
+                return n;
+            }
+        }
+    }
+    return 0;
+}
+
+} // namespace agent_cpp
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief Accumulates generated text and detects stop sequences
+///
+/// Text that could be the start of a stop sequence is held back from
+/// streaming until the following pieces show whether it is, so a callback
+/// never sees part of a stop sequence. The same goes for the leading bytes
+/// of a UTF-8 character split across tokens.
+///
+/// Released text is a view into the accumulated text, valid until the next
+/// call that modifies it.
+class StopMatcher
+{
+  public:
+    StopMatcher() = default;
+
+    /// @param stops Strings that end generation
+    /// @param chunk_pieces Pieces to collect before releasing text, to call
+    /// a streaming callback less often
+    explicit StopMatcher(const std::vector<std::string>& stops,
+                         size_t chunk_pieces = 1);
+
+    /// @brief Reserve room for the generated text
+    void reserve(size_t size) { text_.reserve(size); }
+
+    /// @brief Append a generated piece
+    /// @return Text that can be streamed now
+    std::string_view push(std::string_view piece);
+
+    /// @brief Release the text held back, at the end of generation
+    std::string_view flush();
+
+    /// @brief Whether a stop sequence was generated
+    [[nodiscard]] bool stopped() const { return stopped_; }
+
+    /// @brief Take the generated text, without the stop sequence
+    std::string take_text() { return std::move(text_); }
+
+  private:
+    // Length of the longest suffix of text_ after emitted_ that starts a stop
+    // sequence
+    size_t partial_match_length() const;
+
+    // Release text_ up to end
+    std::string_view release(size_t end);
+
+    std::vector<std::string> stops_;
+    size_t max_stop_length_ = 0;
+    size_t chunk_pieces_ = 1;
+    size_t pending_pieces_ = 0;
+    std::string text_;
+    size_t emitted_ = 0;
+    bool stopped_ = false;
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief Fixed-size pool of worker threads running tasks in FIFO order
+///
+/// Used to run tool calls concurrently. A pool can be shared between agents
+/// through std::shared_ptr. A task that waits for tasks it submitted to its
+/// own pool deadlocks once every worker does so; check is_worker() and run
+/// such work inline instead.
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(size_t n_threads)
+    {
+        n_threads = std::max<size_t>(1, n_threads);
+        workers_.reserve(n_threads);
+        for (size_t i = 0; i < n_threads; i++) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    // Runs the tasks still queued, then joins the workers
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    /// @brief Queue a task
+    /// @return Future holding the task's result or exception
+    template<typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& task)
+    {
+        using Result = std::invoke_result_t<F>;
+        auto packaged =
+          std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        auto future = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace([packaged] { (*packaged)(); });
+        }
+        cv_.notify_one();
+        return future;
+    }
+
+    /// @brief Number of worker threads
+    [[nodiscard]] size_t size() const { return workers_.size(); }
+
+    /// @brief Whether the calling thread is one of this pool's workers
+    [[nodiscard]] bool is_worker() const { return current_ == this; }
+
+  private:
+    void work()
+    {
+        current_ = this;
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    // Pool whose worker the thread is, nullptr on other threads
+    inline static thread_local const ThreadPool* current_ = nullptr;
+};
+
+} // namespace agent_cpp
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <nlohmann/json.hpp>
@@ -24,8 +27,44 @@ class Tool
     // Execute the tool with given arguments
     virtual std::string execute(const json& arguments) = 0;
 
+    // Execute, passing output to on_output while it is produced
+    // The chunks, in order, are the start of the returned output. Tools
+    // that produce output gradually, e.g. a command printing as it runs,
+    // override this so the agent can prefill it before the call returns.
+    // By default runs execute() and passes nothing.
+    virtual std::string execute_streaming(
+      const json& arguments,
+      const std::function<void(std::string_view)>& on_output)
+    {
+        (void)on_output;
+        return execute(arguments);
+    }
+
     // Get the tool's name
     virtual std::string get_name() const = 0;
+
+    // Whether execute() may run at the same time as other tool calls
+    // Only consulted when the agent runs tool calls concurrently. Tools that
+    // are not safe run alone, after the calls before them have finished.
+    virtual bool is_concurrency_safe() const { return false; }
+
+    // How long an output may be reused for the same arguments, 0 never
+    // Only for deterministic tools without side effects, and only consulted
+    // when the agent is given a ToolResultCache.
+    virtual std::chrono::milliseconds cache_ttl() const
+    {
+        return std::chrono::milliseconds(0);
+    }
+
+    // Who the tool belongs to, e.g. the URL of its MCP server. Cached
+    // outputs are only reused within a scope, so tools that share a name
+    // but not their behaviour must return different ones when agents share
+    // a ToolResultCache.
+    virtual std::string cache_scope() const { return {}; }
+
+    // Tokens an output may take in the conversation, 0 uses the limit of
+    // AgentConfig::tool_output. Only consulted when that sets a budget.
+    virtual int max_output_tokens() const { return 0; }
 };
 
 } // namespace agent_cpp
@@ -0,0 +1,293 @@
+#include "tool_output_governor.h"
+#include <algorithm>
+
+namespace agent_cpp {
+
+namespace {
+
+constexpr size_t kBytesPerToken = 4;
+
+// Move offset back to the start of the UTF-8 character it falls in
+size_t
+char_start(const std::string& text, size_t offset)
+{
+    while (offset > 0 && offset < text.size() &&
+           (static_cast<unsigned char>(text[offset]) & 0xC0) == 0x80) {
+        offset--;
+    }
+    return offset;
+}
+
+// Offset in text where token i starts
+size_t
+token_start(const std::vector<size_t>& ends, size_t i)
+{
+    return i == 0 ? 0 : ends[i - 1];
+}
+
+// Token ends at four bytes per token, used without a vocab
+std::vector<size_t>
+estimate_ends(const std::string& text)
+{
+    std::vector<size_t> ends;
+    for (size_t end = kBytesPerToken; end < text.size();
+         end += kBytesPerToken) {
+        ends.push_back(end);
+    }
+    if (!text.empty()) {
+        ends.push_back(text.size());
+    }
+    return ends;
+}
+
+} // anonymous namespace
+
+ToolOutputGovernor::ToolOutputGovernor(ToolOutputGovernorConfig config,
+                                       const llama_vocab* vocab)
+  : config_(config)
+  , vocab_(vocab)
+{
+    config_.head_fraction = std::clamp(config_.head_fraction, 0.0F, 1.0F);
+    config_.max_stored = std::max<size_t>(config_.max_stored, 1);
+}
+
+int
+ToolOutputGovernor::page_tokens() const
+{
+    const int tokens =
+      config_.page_tokens > 0 ? config_.page_tokens : config_.max_tokens;
+    return std::max(tokens, 1);
+}
+
+std::vector<size_t>
+ToolOutputGovernor::token_ends(const std::string& text) const
+{
+    if (vocab_ == nullptr) {
+        return estimate_ends(text);
+    }
+
+    const int n_tokens = -llama_tokenize(
+      vocab_, text.c_str(), text.size(), nullptr, 0, false, false);
+    std::vector<llama_token> tokens(std::max(n_tokens, 0));
+    if (llama_tokenize(vocab_,
+                       text.c_str(),
+                       text.size(),
+                       tokens.data(),
+                       tokens.size(),
+                       false,
+                       false) < 0) {
+        return estimate_ends(text);
+    }
+
+    // Pieces mostly add up to the text, offsets are clamped where they don't
+    std::vector<size_t> ends;
+    ends.reserve(tokens.size());
+    std::string piece(64, '\0');
+    size_t end = 0;
+    for (llama_token token : tokens) {
+        int n = llama_token_to_piece(
+          vocab_, token, piece.data(), piece.size(), 0, false);
+        if (n < 0) {
+            piece.resize(static_cast<size_t>(-n));
+            n = llama_token_to_piece(
+              vocab_, token, piece.data(), piece.size(), 0, false);
+        }
+        end = std::min(end + static_cast<size_t>(std::max(n, 0)), text.size());
+        ends.push_back(end);
+    }
+    if (!ends.empty()) {
+        ends.back() = text.size();
+    }
+    return ends;
+}
+
+int
+ToolOutputGovernor::count_tokens(const std::string& text) const
+{
+    if (vocab_ == nullptr) {
+        return static_cast<int>((text.size() + kBytesPerToken - 1) /
+                                kBytesPerToken);
+    }
+    return -llama_tokenize(
+      vocab_, text.c_str(), text.size(), nullptr, 0, false, false);
+}
+
+int
+ToolOutputGovernor::budget_of(const std::string& tool_name,
+                              int max_tokens) const
+{
+    // Pages of read_tool_output are the stored outputs themselves
+    if (tool_name == kReadTool) {
+        return 0;
+    }
+    return max_tokens > 0 ? max_tokens : config_.max_tokens;
+}
+
+size_t
+ToolOutputGovernor::head_tokens(int budget) const
+{
+    return static_cast<size_t>(static_cast<float>(budget) *
+                               config_.head_fraction);
+}
+
+std::string
+ToolOutputGovernor::head(const std::string& tool_name,
+                         const std::string& output,
+                         int max_tokens) const
+{
+    const int budget = budget_of(tool_name, max_tokens);
+    if (budget <= 0 || output.size() <= static_cast<size_t>(budget)) {
+        return output;
+    }
+    const std::vector<size_t> ends = token_ends(output);
+    if (ends.size() <= static_cast<size_t>(budget)) {
+        return output;
+    }
+    return output.substr(
+      0, char_start(output, token_start(ends, head_tokens(budget))));
+}
+
+std::string
+ToolOutputGovernor::govern(const std::string& tool_name,
+                           std::string output,
+                           int max_tokens)
+{
+    const int budget = budget_of(tool_name, max_tokens);
+    // A token covers at least one byte, short outputs need no tokenizing
+    if (budget <= 0 || output.size() <= static_cast<size_t>(budget)) {
+        return output;
+    }
+    const std::vector<size_t> ends = token_ends(output);
+    const size_t n_tokens = ends.size();
+    if (n_tokens <= static_cast<size_t>(budget)) {
+        return output;
+    }
+
+    const size_t head_tokens = this->head_tokens(budget);
+    const size_t tail_tokens = static_cast<size_t>(budget) - head_tokens;
+    const size_t head_end =
+      char_start(output, token_start(ends, head_tokens));
+    const size_t tail_start =
+      char_start(output, token_start(ends, n_tokens - tail_tokens));
+    const size_t page = static_cast<size_t>(page_tokens());
+    const size_t n_pages = (n_tokens + page - 1) / page;
+
+    std::string id;
+    std::string governed = output.substr(0, head_end);
+    const std::string tail = output.substr(tail_start);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        id = "output-" + std::to_string(next_id_++);
+        outputs_[id] = std::move(output);
+        order_.push_back(id);
+        while (order_.size() > config_.max_stored) {
+            outputs_.erase(order_.front());
+            order_.pop_front();
+        }
+    }
+
+    governed += "\n\n[... " +
+                std::to_string(n_tokens - head_tokens - tail_tokens) +
+                " of " + std::to_string(n_tokens) +
+                " tokens omitted. The full output of " + tool_name +
+                " is stored as \"" + id + "\" in " + std::to_string(n_pages) +
+                " pages, call " + kReadTool + " with {\"id\": \"" + id +
+                "\", \"page\": 1} to read it ...]\n\n";
+    governed += tail;
+    return governed;
+}
+
+std::optional<std::string>
+ToolOutputGovernor::read(const std::string& id, int page, int* n_pages) const
+{
+    std::string output;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = outputs_.find(id);
+        if (it == outputs_.end()) {
+            return std::nullopt;
+        }
+        output = it->second;
+    }
+
+    const std::vector<size_t> ends = token_ends(output);
+    const size_t per_page = static_cast<size_t>(page_tokens());
+    const size_t pages = std::max<size_t>((ends.size() + per_page - 1) /
+                                            per_page,
+                                          1);
+    if (n_pages != nullptr) {
+        *n_pages = static_cast<int>(pages);
+    }
+    if (page < 1 || static_cast<size_t>(page) > pages) {
+        return std::nullopt;
+    }
+
+    const size_t first = (static_cast<size_t>(page) - 1) * per_page;
+    const size_t last = std::min(first + per_page, ends.size());
+    const size_t start = char_start(output, token_start(ends, first));
+    const size_t end = last == ends.size()
+                         ? output.size()
+                         : char_start(output, token_start(ends, last));
+    return output.substr(start, end - start);
+}
+
+size_t
+ToolOutputGovernor::stored() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return outputs_.size();
+}
+
+ReadToolOutputTool::ReadToolOutputTool(
+  std::shared_ptr<ToolOutputGovernor> governor)
+  : governor_(std::move(governor))
+{
+}
+
+common_chat_tool
+ReadToolOutputTool::get_definition() const
+{
+    json schema = {
+        { "type", "object" },
+        { "properties",
+          { { "id",
+              { { "type", "string" },
+                { "description",
+                  "Id of the stored output, as given where it was "
+                  "shortened" } } },
+            { "page",
+              { { "type", "integer" },
+                { "description", "Page to read, starting at 1" },
+                { "minimum", 1 } } } } },
+        { "required", { "id" } }
+    };
+
+    return { ToolOutputGovernor::kReadTool,
+             "Read a page of a tool output that was too long to show in "
+             "full.",
+             schema.dump() };
+}
+
+std::string
+ReadToolOutputTool::execute(const json& arguments)
+{
+    const std::string id = arguments.at("id").get<std::string>();
+    const int page = arguments.value("page", 1);
+
+    json response;
+    int n_pages = 0;
+    if (auto content = governor_->read(id, page, &n_pages)) {
+        response["id"] = id;
+        response["page"] = page;
+        response["pages"] = n_pages;
+        response["content"] = std::move(*content);
+    } else if (n_pages > 0) {
+        response["error"] = "'" + id + "' has pages 1 to " +
+                            std::to_string(n_pages);
+    } else {
+        response["error"] = "no stored output '" + id + "'";
+    }
+    return response.dump();
+}
+
+} // namespace agent_cpp
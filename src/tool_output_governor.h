@@ -0,0 +1,120 @@
+#pragma once
+
+#include "llama.h"
+#include "tool.h"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace agent_cpp {
+
+struct ToolOutputGovernorConfig
+{
+    // Tokens one tool output may take in the conversation, unless the tool
+    // sets its own max_output_tokens(). 0 leaves outputs whole.
+    int max_tokens = 0;
+    // Share of the budget kept from the start of a long output, the rest is
+    // kept from its end, where errors and summaries tend to be
+    float head_fraction = 0.6F;
+    // Full outputs kept for paging, the oldest is dropped first
+    size_t max_stored = 32;
+    // Tokens per page of read_tool_output. 0 uses max_tokens.
+    int page_tokens = 0;
+};
+
+/// @brief Keeps large tool outputs from flooding the context
+///
+/// Every output the agent appends passes through govern(). One within its
+/// budget is returned as is. A longer one is cut to its head and tail, with
+/// a note in between saying how much was left out, and kept whole in a
+/// small store. The read_tool_output tool the agent registers alongside
+/// returns it page by page, so the model can still read all of it when it
+/// needs to, while each turn prefills at most the budget.
+///
+/// Sizes are measured with the model's tokenizer; without a vocab they are
+/// estimated at four bytes per token.
+class ToolOutputGovernor
+{
+  public:
+    /// @brief Name of the paging tool
+    static constexpr const char* kReadTool = "read_tool_output";
+
+    explicit ToolOutputGovernor(ToolOutputGovernorConfig config,
+                                const llama_vocab* vocab = nullptr);
+
+    /// @brief Output to put in the conversation in place of output
+    /// @param max_tokens Budget of this output, 0 uses the configured one
+    std::string govern(const std::string& tool_name,
+                       std::string output,
+                       int max_tokens = 0);
+
+    /// @brief Start of what govern() returns for output, without storing
+    /// anything: all of it within the budget, else the head it keeps. Text
+    /// appended to a shortened output doesn't change its head, so a prompt
+    /// can be prefilled with it while the tool is still running.
+    [[nodiscard]] std::string head(const std::string& tool_name,
+                                   const std::string& output,
+                                   int max_tokens = 0) const;
+
+    /// @brief Page of a stored output, counted from 1
+    /// @return nullopt if id isn't stored (any more) or page is out of range
+    [[nodiscard]] std::optional<std::string> read(const std::string& id,
+                                                  int page,
+                                                  int* n_pages = nullptr) const;
+
+    /// @brief Size of text in tokens
+    [[nodiscard]] int count_tokens(const std::string& text) const;
+
+    /// @brief Number of outputs stored for paging
+    [[nodiscard]] size_t stored() const;
+
+    [[nodiscard]] const ToolOutputGovernorConfig& config() const
+    {
+        return config_;
+    }
+
+  private:
+    // End offset in text of each of its tokens
+    std::vector<size_t> token_ends(const std::string& text) const;
+    int page_tokens() const;
+    // Tokens output of tool_name may take, 0 if it isn't limited
+    int budget_of(const std::string& tool_name, int max_tokens) const;
+    // Tokens kept from the start of an output over budget
+    size_t head_tokens(int budget) const;
+
+    ToolOutputGovernorConfig config_;
+    const llama_vocab* vocab_ = nullptr;
+
+    mutable std::mutex mutex_;
+    size_t next_id_ = 1;
+    std::list<std::string> order_; // Stored ids, oldest first
+    std::unordered_map<std::string, std::string> outputs_;
+};
+
+/// @brief Pages through outputs a ToolOutputGovernor shortened:
+/// read_tool_output(id, page)
+class ReadToolOutputTool : public Tool
+{
+  public:
+    explicit ReadToolOutputTool(std::shared_ptr<ToolOutputGovernor> governor);
+
+    common_chat_tool get_definition() const override;
+    std::string execute(const json& arguments) override;
+    std::string get_name() const override
+    {
+        return ToolOutputGovernor::kReadTool;
+    }
+
+    // Only reads the governor's store
+    bool is_concurrency_safe() const override { return true; }
+
+  private:
+    std::shared_ptr<ToolOutputGovernor> governor_;
+};
+
+} // namespace agent_cpp
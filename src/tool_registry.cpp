@@ -0,0 +1,54 @@
+#include "tool_registry.h"
+
+namespace agent_cpp {
+
+ToolRegistry::ToolRegistry(std::vector<std::unique_ptr<Tool>> tools)
+{
+    tools_.reserve(tools.size());
+    by_name_.reserve(tools.size());
+    for (auto& tool : tools) {
+        add(std::move(tool));
+    }
+}
+
+void
+ToolRegistry::add(std::unique_ptr<Tool> tool)
+{
+    if (!tool) {
+        return;
+    }
+    by_name_.emplace(tool->get_name(), tool.get());
+    tools_.push_back(std::move(tool));
+    invalidate();
+}
+
+Tool*
+ToolRegistry::find(const std::string& name) const
+{
+    auto it = by_name_.find(name);
+    return it == by_name_.end() ? nullptr : it->second;
+}
+
+ToolRegistry::Definitions
+ToolRegistry::definitions() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!definitions_) {
+        auto definitions = std::make_shared<std::vector<common_chat_tool>>();
+        definitions->reserve(tools_.size());
+        for (const auto& tool : tools_) {
+            definitions->push_back(tool->get_definition());
+        }
+        definitions_ = std::move(definitions);
+    }
+    return definitions_;
+}
+
+void
+ToolRegistry::invalidate()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    definitions_.reset();
+}
+
+} // namespace agent_cpp
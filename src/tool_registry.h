@@ -0,0 +1,57 @@
+#pragma once
+
+#include "chat.h"
+#include "tool.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace agent_cpp {
+
+/// @brief An agent's tools, indexed by name with their definitions cached
+///
+/// Definitions are built once and shared as an immutable snapshot, so a
+/// turn never re-serializes tool schemas. When a tool's definition changes,
+/// e.g. after an MCP tools/list_changed notification, call invalidate() and
+/// the next turn rebuilds them; a turn already running keeps its snapshot.
+/// Only the definitions of registered tools are rebuilt: tools a server
+/// added or removed need a new registry, e.g. from MCPClient::get_tools().
+class ToolRegistry
+{
+  public:
+    using Definitions = std::shared_ptr<const std::vector<common_chat_tool>>;
+
+    ToolRegistry() = default;
+    explicit ToolRegistry(std::vector<std::unique_ptr<Tool>> tools);
+
+    ToolRegistry(const ToolRegistry&) = delete;
+    ToolRegistry& operator=(const ToolRegistry&) = delete;
+
+    /// @brief Register a tool after the ones already registered
+    /// Not safe while a turn is running
+    void add(std::unique_ptr<Tool> tool);
+
+    /// @brief Tool registered under name, nullptr if there is none
+    /// When several share a name the first one registered is returned
+    [[nodiscard]] Tool* find(const std::string& name) const;
+
+    /// @brief Definitions of every tool, in registration order
+    [[nodiscard]] Definitions definitions() const;
+
+    /// @brief Rebuild the definitions on their next use
+    /// Safe to call from any thread
+    void invalidate();
+
+    [[nodiscard]] size_t size() const { return tools_.size(); }
+    [[nodiscard]] bool empty() const { return tools_.empty(); }
+
+  private:
+    std::vector<std::unique_ptr<Tool>> tools_;
+    std::unordered_map<std::string, Tool*> by_name_;
+    mutable std::mutex mutex_;
+    mutable Definitions definitions_; // nullptr until built
+};
+
+} // namespace agent_cpp
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <nlohmann/json.hpp>
+
+namespace agent_cpp {
+
+/// @brief Bounded LRU cache of tool outputs keyed by tool scope, name and
+/// arguments
+///
+/// The scope, Tool::cache_scope(), keeps apart tools of the same name from
+/// different owners, e.g. two MCP servers. Arguments are keyed by their JSON
+/// dump. Object keys are kept sorted, so the same arguments match whatever
+/// order the model wrote them in. Entries expire after the TTL they were
+/// stored with. Thread safe, so one cache can be shared by agents through
+/// std::shared_ptr.
+class ToolResultCache
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit ToolResultCache(size_t max_entries = 1024)
+      : max_entries_(max_entries)
+    {
+    }
+
+    /// @brief Look up the output of an earlier call that hasn't expired
+    std::optional<std::string> get(const std::string& tool_name,
+                                   const nlohmann::json& arguments,
+                                   const std::string& scope = "")
+    {
+        const std::string key = make_key(scope, tool_name, arguments);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return std::nullopt;
+        }
+        if (Clock::now() >= it->second->expires) {
+            entries_.erase(it->second);
+            index_.erase(it);
+            return std::nullopt;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->output;
+    }
+
+    /// @brief Store the output of a call for ttl
+    void put(const std::string& tool_name,
+             const nlohmann::json& arguments,
+             std::string output,
+             std::chrono::milliseconds ttl,
+             const std::string& scope = "")
+    {
+        if (max_entries_ == 0 || ttl.count() <= 0) {
+            return;
+        }
+        std::string key = make_key(scope, tool_name, arguments);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+
+        entries_.push_front({ key, std::move(output), Clock::now() + ttl });
+        index_.emplace(std::move(key), entries_.begin());
+
+        while (entries_.size() > max_entries_) {
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+    /// @brief Drop every entry
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        index_.clear();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+  private:
+    struct Entry
+    {
+        std::string key;
+        std::string output;
+        Clock::time_point expires;
+    };
+
+    static std::string make_key(const std::string& scope,
+                                const std::string& tool_name,
+                                const nlohmann::json& arguments)
+    {
+        std::string key = scope;
+        key += '\0';
+        key += tool_name;
+        key += '\0';
+        key += arguments.dump();
+        return key;
+    }
+
+    size_t max_entries_;
+    mutable std::mutex mutex_;
+    std::list<Entry> entries_; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
+
+} // namespace agent_cpp
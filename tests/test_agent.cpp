@@ -0,0 +1,309 @@
+#include "context_compaction.h"
+#include "model.h"
+#include "prompt_builder.h"
+#include "prompt_cache_store.h"
+#include "test_utils.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using agent_cpp::CompactionPlan;
+using agent_cpp::CompactionReport;
+using agent_cpp::ContextCompactionCallback;
+using agent_cpp::ContextCompactionConfig;
+using agent_cpp::Model;
+using agent_cpp::ModelConfig;
+using agent_cpp::ModelWeights;
+using agent_cpp::PromptBuilder;
+using agent_cpp::PromptCacheIndex;
+using agent_cpp::PromptCacheStore;
+
+namespace {
+
+std::string
+temp_dir(const std::string& name)
+{
+    const auto path = std::filesystem::temp_directory_path() / name;
+    std::filesystem::remove_all(path);
+    return path.string();
+}
+
+PromptCacheIndex::Entry
+cache_entry(const std::string& key,
+            const std::string& model_id,
+            std::vector<llama_token> tokens,
+            uint64_t bytes = 1)
+{
+    PromptCacheIndex::Entry entry;
+    entry.key = key;
+    entry.model_id = model_id;
+    entry.tokens = std::move(tokens);
+    entry.bytes = bytes;
+    return entry;
+}
+
+// Weights of the GGUF file named by AGENT_CPP_TEST_MODEL, loaded once.
+// Without one the tests that decode are skipped.
+std::shared_ptr<ModelWeights>
+test_weights()
+{
+    const char* path = std::getenv("AGENT_CPP_TEST_MODEL");
+    if (path == nullptr || *path == '\0') {
+        std::cout << "(skipped, AGENT_CPP_TEST_MODEL isn't set) ";
+        return nullptr;
+    }
+    static const std::shared_ptr<ModelWeights> weights =
+      ModelWeights::create(path);
+    return weights;
+}
+
+// Test lookup picks the entry of the model sharing the longest prefix
+TEST(test_prompt_cache_index_longest_prefix)
+{
+    PromptCacheIndex index;
+    index.put(cache_entry("short", "m", { 1, 2, 3 }));
+    index.put(cache_entry("long", "m", { 1, 2, 3, 4, 5 }));
+    index.put(cache_entry("other", "m", { 1, 9 }));
+    index.put(cache_entry("other_model", "n", { 1, 2, 3, 4, 5, 6 }));
+
+    size_t n_match = 0;
+    const auto* entry = index.find("m", { 1, 2, 3, 4, 7 }, n_match);
+    ASSERT_TRUE(entry != nullptr);
+    ASSERT_EQ(entry->key, "long");
+    ASSERT_EQ(n_match, 4);
+
+    // On a tie the smaller state wins
+    entry = index.find("m", { 1, 2, 3 }, n_match);
+    ASSERT_TRUE(entry != nullptr);
+    ASSERT_EQ(entry->key, "short");
+    ASSERT_EQ(n_match, 3);
+
+    ASSERT_TRUE(index.find("m", { 7, 1, 2 }, n_match) == nullptr);
+    ASSERT_EQ(n_match, 0);
+    ASSERT_TRUE(index.find("unknown", { 1, 2, 3 }, n_match) == nullptr);
+}
+
+// Test eviction drops the least recently used entries beyond the budget
+TEST(test_prompt_cache_index_evicts_lru)
+{
+    PromptCacheIndex index;
+    index.put(cache_entry("a", "m", { 1 }, 40));
+    index.put(cache_entry("b", "m", { 2 }, 40));
+    index.put(cache_entry("c", "m", { 3 }, 40));
+    ASSERT_TRUE(index.touch("a"));
+    ASSERT_FALSE(index.touch("missing"));
+    ASSERT_EQ(index.total_bytes(), 120);
+
+    auto evicted = index.evict(100);
+    ASSERT_EQ(evicted.size(), 1);
+    ASSERT_EQ(evicted[0].key, "b");
+    ASSERT_EQ(index.entries().size(), 2);
+    ASSERT_EQ(index.total_bytes(), 80);
+
+    // The most recently used entry stays even when it alone is too large
+    evicted = index.evict(10);
+    ASSERT_EQ(evicted.size(), 1);
+    ASSERT_EQ(evicted[0].key, "c");
+    ASSERT_EQ(index.entries().size(), 1);
+    ASSERT_EQ(index.entries()[0].key, "a");
+}
+
+// Test indexes of two stores merge, keeping the latest use of each entry
+TEST(test_prompt_cache_index_merge)
+{
+    PromptCacheIndex ours;
+    ours.put(cache_entry("shared", "m", { 1 }, 10));
+    ours.put(cache_entry("ours", "m", { 2 }, 10));
+
+    PromptCacheIndex theirs;
+    theirs.put(cache_entry("theirs", "m", { 3 }, 10));
+    theirs.put(cache_entry("shared", "m", { 1 }, 10));
+    theirs.put(cache_entry("later", "m", { 4 }, 10));
+    ASSERT_TRUE(theirs.touch("shared"));
+
+    ours.merge(theirs);
+    ASSERT_EQ(ours.entries().size(), 4);
+
+    // Their use of shared is the latest of all
+    auto evicted = ours.evict(10);
+    ASSERT_EQ(evicted.size(), 3);
+    ASSERT_EQ(ours.entries()[0].key, "shared");
+
+    // The clock moved past theirs, so a new entry is the newest
+    ours.put(cache_entry("newest", "m", { 5 }, 10));
+    evicted = ours.evict(10);
+    ASSERT_EQ(evicted.size(), 1);
+    ASSERT_EQ(evicted[0].key, "shared");
+}
+
+// Test the index survives a round trip through its file
+TEST(test_prompt_cache_index_file)
+{
+    const std::string dir = temp_dir("agent_cpp_prompt_cache_index");
+    std::filesystem::create_directories(dir);
+    const std::string path = dir + "/index.json";
+
+    PromptCacheIndex index;
+    index.put(cache_entry("a", "m", { 1, 2, 3 }, 7));
+    ASSERT_TRUE(index.write(path));
+
+    const auto read = PromptCacheIndex::read(path);
+    ASSERT_EQ(read.entries().size(), 1);
+    ASSERT_EQ(read.entries()[0].key, "a");
+    ASSERT_EQ(read.entries()[0].model_id, "m");
+    ASSERT_EQ(read.entries()[0].tokens, std::vector<llama_token>({ 1, 2, 3 }));
+    ASSERT_EQ(read.entries()[0].bytes, 7);
+
+    {
+        std::ofstream file(path, std::ios::trunc);
+        file << "not json";
+    }
+    ASSERT_TRUE(PromptCacheIndex::read(path).entries().empty());
+    ASSERT_TRUE(
+      PromptCacheIndex::read(dir + "/missing.json").entries().empty());
+    std::filesystem::remove_all(dir);
+}
+
+// Test a store sees the entries another store left in its directory
+TEST(test_prompt_cache_store_shared_directory)
+{
+    const std::string dir = temp_dir("agent_cpp_prompt_cache_store");
+    std::filesystem::create_directories(dir);
+
+    PromptCacheIndex index;
+    index.put(cache_entry("kept", "m", { 1 }, 3));
+    index.put(cache_entry("gone", "m", { 2 }, 4));
+    ASSERT_TRUE(index.write(dir + "/index.json"));
+    {
+        std::ofstream file(dir + "/kept.bin");
+        file << "abc";
+    }
+
+    // Entries whose state file was evicted are dropped
+    PromptCacheStore store({ dir });
+    ASSERT_EQ(store.size(), 1);
+    ASSERT_EQ(store.total_bytes(), 3);
+    std::filesystem::remove_all(dir);
+}
+
+// Conversation of n_turns exchanges after a system prompt and a task
+std::vector<common_chat_msg>
+test_conversation(int n_turns)
+{
+    std::vector<common_chat_msg> messages(2);
+    messages[0].role = "system";
+    messages[0].content = "You are a careful assistant.";
+    messages[1].role = "user";
+    messages[1].content = "Help me plan a trip through the mountains.";
+    for (int i = 0; i < n_turns; i++) {
+        common_chat_msg user;
+        user.role = "user";
+        user.content = "What should I pack for day " + std::to_string(i) +
+                       " of the trip, and where should I stay that night?";
+        messages.push_back(user);
+        common_chat_msg assistant;
+        assistant.role = "assistant";
+        assistant.content = "On day " + std::to_string(i) +
+                            " pack water, a map and warm layers, and stay "
+                            "in the hut at the end of the trail.";
+        messages.push_back(assistant);
+    }
+    return messages;
+}
+
+// Test compaction removes the span that keeps the cached prefix valid
+TEST(test_context_compaction_keeps_cached_prefix)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    ModelConfig model_config;
+    model_config.n_ctx = 4096;
+    auto model = Model::create_with_weights(weights, model_config);
+    const auto messages = test_conversation(12);
+    model->prefill_partial(messages, {});
+    ASSERT_FALSE(model->get_cached_tokens().empty());
+
+    const int total = ContextCompactionCallback(model).count_tokens(messages);
+    ContextCompactionConfig config;
+    config.max_tokens = total - 1;
+    config.target_tokens = total * 2 / 3;
+    config.keep_first = 2;
+    config.keep_last = 2;
+    std::optional<CompactionReport> report;
+    config.on_compaction = [&](const CompactionReport& r) { report = r; };
+    ContextCompactionCallback compaction(model, config);
+
+    const auto plans = compaction.plan(messages);
+    ASSERT_FALSE(plans.empty());
+    const CompactionPlan& best = plans.front();
+    for (const auto& plan : plans) {
+        ASSERT_TRUE(best.prefill_tokens <= plan.prefill_tokens);
+        ASSERT_TRUE(plan.first >= config.keep_first);
+        ASSERT_TRUE(plan.first + plan.count <=
+                    messages.size() - config.keep_last);
+    }
+    // Removing later turns leaves more of the cache valid
+    ASSERT_TRUE(best.first > config.keep_first);
+    ASSERT_TRUE(best.reused_tokens > 0);
+
+    auto compacted = messages;
+    ASSERT_TRUE(compaction.compact(compacted));
+    ASSERT_TRUE(report.has_value());
+    ASSERT_EQ(report->applied.first, best.first);
+    ASSERT_EQ(compacted.size(), messages.size() - best.count);
+    ASSERT_TRUE(report->applied.tokens_after < total);
+    for (size_t i = 0; i < best.first; i++) {
+        ASSERT_EQ(compacted[i].content, messages[i].content);
+    }
+
+    // The prompt of the compacted conversation starts with the reused tokens
+    PromptBuilder full;
+    full.set_enabled(false);
+    std::vector<llama_token> tokens;
+    full.build(
+      model->get_templates(), model->get_vocab(), compacted, {}, true, tokens);
+    const auto& cached = model->get_cached_tokens();
+    const auto n_reused =
+      static_cast<std::ptrdiff_t>(report->applied.reused_tokens);
+    ASSERT_TRUE(n_reused <= static_cast<std::ptrdiff_t>(tokens.size()));
+    ASSERT_TRUE(
+      std::equal(tokens.begin(), tokens.begin() + n_reused, cached.begin()));
+
+    // Without minimize_prefill the oldest turns go
+    config.minimize_prefill = false;
+    ContextCompactionCallback oldest(model, config);
+    const auto oldest_plans = oldest.plan(messages);
+    ASSERT_FALSE(oldest_plans.empty());
+    ASSERT_EQ(oldest_plans.front().first, config.keep_first);
+}
+
+}
+
+int
+main()
+{
+    std::cout << "\n=== Running Agent Unit Tests ===\n" << std::endl;
+
+    try {
+        RUN_TEST(test_prompt_cache_index_longest_prefix);
+        RUN_TEST(test_prompt_cache_index_evicts_lru);
+        RUN_TEST(test_prompt_cache_index_merge);
+        RUN_TEST(test_prompt_cache_index_file);
+        RUN_TEST(test_prompt_cache_store_shared_directory);
+        RUN_TEST(test_context_compaction_keeps_cached_prefix);
+
+        std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "\n✗ TEST FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+}
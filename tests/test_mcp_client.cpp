@@ -1,13 +1,24 @@
+#include "error.h"
 #include "mcp/mcp_client.h"
+#include "mcp/mcp_hub.h"
 #include "mcp/mcp_tool.h"
+#include "mcp/sse_parser.h"
 #include "test_utils.h"
+#include <filesystem>
+#include <vector>
 
 using agent_cpp::json;
 using agent_cpp::MCPClient;
+using agent_cpp::MCPClientConfig;
 using agent_cpp::MCPContentItem;
+using agent_cpp::MCPHub;
+using agent_cpp::MCPHubConfig;
 using agent_cpp::MCPTool;
+using agent_cpp::MCPToolCatalog;
 using agent_cpp::MCPToolDefinition;
 using agent_cpp::MCPToolResult;
+using agent_cpp::SSEEvent;
+using agent_cpp::SSEParser;
 
 namespace {
 
@@ -89,6 +100,79 @@ TEST(test_mcp_client_https_url)
     ASSERT_FALSE(client->is_initialized());
 }
 
+// Test call_tool_async reports errors through the future
+TEST(test_mcp_client_call_tool_async_not_initialized)
+{
+    MCPClientConfig config;
+    config.max_connections = 2;
+    auto client = MCPClient::create("http://localhost:8080/mcp", config);
+
+    auto future = client->call_tool_async("echo");
+
+    bool caught = false;
+    try {
+        future.get();
+    } catch (const agent_cpp::MCPError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+}
+
+// Test SSE events split across arbitrary chunk boundaries
+TEST(test_sse_parser_chunked)
+{
+    std::vector<SSEEvent> events;
+    SSEParser parser([&events](SSEEvent& event) {
+        events.push_back(std::move(event));
+        return true;
+    });
+
+    const std::string stream = ": keep-alive\r\n"
+                               "event: message\r\n"
+                               "id: 1\r\n"
+                               "data: {\"a\":\r\n"
+                               "data: 1}\r\n"
+                               "\r\n"
+                               "data:second\n\n";
+
+    // Feed one byte at a time, including between '\r' and '\n'
+    for (char c : stream) {
+        ASSERT_TRUE(parser.feed(&c, 1));
+    }
+    ASSERT_TRUE(parser.finish());
+
+    ASSERT_EQ(events.size(), 2);
+    ASSERT_EQ(events[0].event, "message");
+    ASSERT_EQ(events[0].id, "1");
+    ASSERT_EQ(events[0].data, "{\"a\":\n1}");
+    ASSERT_EQ(events[1].data, "second");
+}
+
+// Test the handler can stop parsing and unterminated events are flushed
+TEST(test_sse_parser_stop_and_finish)
+{
+    int n_events = 0;
+    SSEParser parser([&n_events](SSEEvent&) {
+        n_events++;
+        return n_events < 2;
+    });
+
+    const std::string stream = "data: 1\n\ndata: 2\n\ndata: 3\n\n";
+    ASSERT_FALSE(parser.feed(stream.data(), stream.size()));
+    ASSERT_EQ(n_events, 2);
+
+    int n_tail = 0;
+    SSEParser tail([&n_tail](SSEEvent& event) {
+        n_tail++;
+        return event.data == "last";
+    });
+    const std::string unterminated = "data: last";
+    ASSERT_TRUE(tail.feed(unterminated.data(), unterminated.size()));
+    ASSERT_EQ(n_tail, 0);
+    ASSERT_TRUE(tail.finish());
+    ASSERT_EQ(n_tail, 1);
+}
+
 // Test protocol version constant
 TEST(test_mcp_protocol_version)
 {
@@ -115,6 +199,7 @@ TEST(test_mcp_tool_get_definition)
     MCPTool tool(client, def);
 
     ASSERT_EQ(tool.get_name(), "calculator");
+    ASSERT_TRUE(tool.is_concurrency_safe());
 
     auto chat_tool = tool.get_definition();
     ASSERT_EQ(chat_tool.name, "calculator");
@@ -146,6 +231,103 @@ TEST(test_mcp_tool_empty_schema)
     ASSERT_EQ(params["type"].get<std::string>(), "object");
 }
 
+// Test the tool catalog round trip and its version keys
+TEST(test_mcp_tool_catalog)
+{
+    const std::string path =
+      (std::filesystem::temp_directory_path() / "agent-cpp-mcp-catalog.json")
+        .string();
+    std::filesystem::remove(path);
+
+    MCPToolDefinition def;
+    def.name = "read";
+    def.description = "Read a file";
+    def.input_schema = json({ { "type", "object" } });
+    {
+        MCPToolCatalog catalog(path);
+        ASSERT_FALSE(catalog.find("http://a/mcp", "1.0", "2025-11-25"));
+        catalog.put("http://a/mcp", "1.0", "2025-11-25", { def });
+        ASSERT_TRUE(catalog.save());
+    }
+
+    MCPToolCatalog catalog(path);
+    auto tools = catalog.find("http://a/mcp", "1.0", "2025-11-25");
+    ASSERT_TRUE(tools.has_value());
+    ASSERT_EQ(tools->size(), 1);
+    ASSERT_EQ((*tools)[0].name, "read");
+    ASSERT_EQ((*tools)[0].description, "Read a file");
+    ASSERT_EQ((*tools)[0].input_schema["type"].get<std::string>(), "object");
+    ASSERT_TRUE((*tools)[0].output_schema.is_null());
+
+    // An upgraded server is listed again
+    ASSERT_FALSE(catalog.find("http://a/mcp", "1.1", "2025-11-25"));
+    ASSERT_FALSE(catalog.find("http://b/mcp", "1.0", "2025-11-25"));
+
+    std::filesystem::remove(path);
+}
+
+// Test a tool exposed under another name still calls the server's one
+TEST(test_mcp_tool_exposed_name)
+{
+    auto client = MCPClient::create("http://localhost:8080/mcp");
+    MCPToolDefinition def;
+    def.name = "query";
+
+    MCPTool tool(client, def, "search__query");
+    ASSERT_EQ(tool.get_name(), "search__query");
+    ASSERT_EQ(tool.get_definition().name, "search__query");
+
+    MCPTool plain(client, def);
+    ASSERT_EQ(plain.get_name(), "query");
+}
+
+// Test servers of a hub need distinct names
+TEST(test_mcp_hub_duplicate_names)
+{
+    MCPHubConfig config;
+    config.servers = { { "files", "http://localhost:8000/mcp" },
+                       { "files", "http://localhost:8001/mcp" } };
+
+    bool caught = false;
+    try {
+        MCPHub hub(config);
+    } catch (const agent_cpp::MCPError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+
+    // Servers without a prefix may be several, each with its own name
+    config.servers = { { "", "http://localhost:8000/mcp" },
+                       { "#0", "http://localhost:8001/mcp" },
+                       { "", "http://localhost:8002/mcp" } };
+    MCPHub hub(config);
+    auto servers = hub.servers();
+    ASSERT_EQ(servers.size(), 3);
+    ASSERT_EQ(servers[0].name, "#0_");
+    ASSERT_EQ(servers[1].name, "#0");
+    ASSERT_EQ(servers[2].name, "#2");
+    ASSERT_EQ(hub.client("#0_")->url(), "http://localhost:8000/mcp");
+    ASSERT_EQ(hub.client("#2")->url(), "http://localhost:8002/mcp");
+    ASSERT_TRUE(hub.client("") == nullptr);
+}
+
+// Test a server that can't be reached is reported, not thrown
+TEST(test_mcp_hub_unreachable_server)
+{
+    MCPHubConfig config;
+    config.servers = { { "down", "http://127.0.0.1:1/mcp" } };
+    config.servers[0].client.connection_timeout_sec = 1;
+    MCPHub hub(config);
+
+    ASSERT_EQ(hub.connect(), 0);
+    auto servers = hub.servers();
+    ASSERT_EQ(servers.size(), 1);
+    ASSERT_FALSE(servers[0].connected);
+    ASSERT_FALSE(servers[0].error.empty());
+    ASSERT_TRUE(hub.get_tools().empty());
+    ASSERT_TRUE(hub.client("down") != nullptr);
+    ASSERT_TRUE(hub.client("up") == nullptr);
+}
 }
 
 int
@@ -160,9 +342,16 @@ main()
         RUN_TEST(test_mcp_client_creation);
         RUN_TEST(test_mcp_client_http_url);
         RUN_TEST(test_mcp_client_https_url);
+        RUN_TEST(test_mcp_client_call_tool_async_not_initialized);
+        RUN_TEST(test_sse_parser_chunked);
+        RUN_TEST(test_sse_parser_stop_and_finish);
         RUN_TEST(test_mcp_protocol_version);
         RUN_TEST(test_mcp_tool_get_definition);
         RUN_TEST(test_mcp_tool_empty_schema);
+        RUN_TEST(test_mcp_tool_catalog);
+        RUN_TEST(test_mcp_tool_exposed_name);
+        RUN_TEST(test_mcp_hub_duplicate_names);
+        RUN_TEST(test_mcp_hub_unreachable_server);
 
         std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
         return 0;
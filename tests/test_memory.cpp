@@ -0,0 +1,211 @@
+#include "error.h"
+#include "memory/memory_store.h"
+#include "memory/vector_index.h"
+#include "test_utils.h"
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using agent_cpp::dot_product;
+using agent_cpp::MemoryError;
+using agent_cpp::MemoryStore;
+using agent_cpp::VectorIndex;
+
+namespace {
+
+std::string
+temp_path(const std::string& name)
+{
+    const auto path = std::filesystem::temp_directory_path() / name;
+    std::filesystem::remove(path);
+    return path.string();
+}
+
+// Test the SIMD dot product matches the plain loop, tails included
+TEST(test_dot_product_matches_scalar)
+{
+    for (size_t n : { 0, 1, 3, 8, 15, 16, 17, 100, 384 }) {
+        std::vector<float> a(n);
+        std::vector<float> b(n);
+        float expected = 0.0F;
+        for (size_t i = 0; i < n; i++) {
+            a[i] = static_cast<float>(i % 7) * 0.25F - 0.5F;
+            b[i] = static_cast<float>(i % 5) * 0.5F - 1.0F;
+            expected += a[i] * b[i];
+        }
+        const float diff = dot_product(a.data(), b.data(), n) - expected;
+        ASSERT_TRUE(diff < 1e-3F && diff > -1e-3F);
+    }
+}
+
+// Test records survive reopening, overwrites and erases included
+TEST(test_memory_store_reopen)
+{
+    const std::string path = temp_path("agent_cpp_memory_store.log");
+    uint64_t color_id = 0;
+    {
+        MemoryStore store(path);
+        store.put("name", "Ada");
+        store.put("color", "red");
+        color_id = store.put("color", "blue");
+        store.put("pet", "cat");
+        ASSERT_TRUE(store.erase("pet"));
+        ASSERT_FALSE(store.erase("pet"));
+        ASSERT_TRUE(store.dead_bytes() > 0);
+    }
+
+    MemoryStore store(path);
+    ASSERT_EQ(store.size(), 2);
+    ASSERT_EQ(store.get("name")->text, "Ada");
+    ASSERT_EQ(store.get("color")->text, "blue");
+    ASSERT_EQ(store.get(color_id)->key, "color");
+    ASSERT_TRUE(store.contains(color_id));
+    ASSERT_FALSE(store.get("pet").has_value());
+
+    // New ids never repeat earlier ones
+    ASSERT_TRUE(store.put("pet", "dog") > color_id);
+    std::remove(path.c_str());
+}
+
+// Test compaction drops dead records but keeps ids unique
+TEST(test_memory_store_compact)
+{
+    const std::string path = temp_path("agent_cpp_memory_compact.log");
+    {
+        MemoryStore store(path);
+        store.put("a", "1");
+        const uint64_t id = store.put("a", "2");
+        const uint64_t last = store.put("b", "3");
+        store.erase("b");
+
+        store.compact();
+        ASSERT_EQ(store.dead_bytes(), 0);
+        ASSERT_EQ(store.size(), 1);
+        ASSERT_EQ(store.get("a")->id, id);
+        ASSERT_FALSE(store.contains(last));
+    }
+
+    MemoryStore store(path);
+    ASSERT_EQ(store.get("a")->text, "2");
+    ASSERT_TRUE(store.put("c", "4") > 3);
+    std::remove(path.c_str());
+}
+
+// Test a record torn by a crash is dropped and the log stays usable
+TEST(test_memory_store_torn_tail)
+{
+    const std::string path = temp_path("agent_cpp_memory_torn.log");
+    {
+        MemoryStore store(path);
+        store.put("kept", "intact");
+        store.put("torn", "this record is cut short");
+    }
+    std::filesystem::resize_file(path,
+                                 std::filesystem::file_size(path) - 5);
+
+    MemoryStore store(path);
+    ASSERT_EQ(store.size(), 1);
+    ASSERT_EQ(store.get("kept")->text, "intact");
+    store.put("after", "crash");
+
+    MemoryStore reopened(path);
+    ASSERT_EQ(reopened.get("after")->text, "crash");
+    std::remove(path.c_str());
+}
+
+// Test search ranks best first, across mapped and appended rows
+TEST(test_vector_index_search)
+{
+    const std::string path = temp_path("agent_cpp_vectors.idx");
+    const std::vector<float> x = { 1.0F, 0.0F, 0.0F };
+    const std::vector<float> y = { 0.0F, 1.0F, 0.0F };
+    const std::vector<float> xy = { 0.7F, 0.7F, 0.0F };
+    {
+        VectorIndex index(path, 3);
+        index.add(1, x.data());
+        index.add(2, y.data());
+    }
+
+    // Rows 1 and 2 are now mapped, row 3 is appended
+    VectorIndex index(path, 3);
+    index.add(3, xy.data());
+    ASSERT_EQ(index.size(), 3);
+
+    auto matches = index.search(x.data(), 2);
+    ASSERT_EQ(matches.size(), 2);
+    ASSERT_EQ(matches[0].id, 1);
+    ASSERT_EQ(matches[1].id, 3);
+
+    matches =
+      index.search(x.data(), 5, [](uint64_t id) { return id != 1; });
+    ASSERT_EQ(matches.size(), 2);
+    ASSERT_EQ(matches[0].id, 3);
+    ASSERT_EQ(matches[1].id, 2);
+
+    ASSERT_TRUE(index.search(x.data(), 0).empty());
+    std::remove(path.c_str());
+}
+
+// Test compaction keeps only the requested rows
+TEST(test_vector_index_compact)
+{
+    const std::string path = temp_path("agent_cpp_vectors_compact.idx");
+    VectorIndex index(path, 2);
+    for (uint64_t id = 1; id <= 4; id++) {
+        const std::vector<float> v = { static_cast<float>(id), 1.0F };
+        index.add(id, v.data());
+    }
+
+    index.compact([](uint64_t id) { return id % 2 == 0; });
+    ASSERT_EQ(index.size(), 2);
+
+    const std::vector<float> query = { 1.0F, 0.0F };
+    auto matches = index.search(query.data(), 4);
+    ASSERT_EQ(matches.size(), 2);
+    ASSERT_EQ(matches[0].id, 4);
+    ASSERT_EQ(matches[1].id, 2);
+    std::remove(path.c_str());
+}
+
+// Test an index can't be reopened with another dim
+TEST(test_vector_index_dim_mismatch)
+{
+    const std::string path = temp_path("agent_cpp_vectors_dim.idx");
+    {
+        VectorIndex index(path, 4);
+    }
+
+    bool threw = false;
+    try {
+        VectorIndex index(path, 8);
+    } catch (const MemoryError&) {
+        threw = true;
+    }
+    ASSERT_TRUE(threw);
+    std::remove(path.c_str());
+}
+
+}
+
+int
+main()
+{
+    std::cout << "\n=== Running Memory Unit Tests ===\n" << std::endl;
+
+    try {
+        RUN_TEST(test_dot_product_matches_scalar);
+        RUN_TEST(test_memory_store_reopen);
+        RUN_TEST(test_memory_store_compact);
+        RUN_TEST(test_memory_store_torn_tail);
+        RUN_TEST(test_vector_index_search);
+        RUN_TEST(test_vector_index_compact);
+        RUN_TEST(test_vector_index_dim_mismatch);
+
+        std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "\n✗ TEST FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,924 @@
+#include "batched_model.h"
+#include "chat_stream.h"
+#include "compute_threadpool.h"
+#include "context_pool.h"
+#include "embedder.h"
+#include "error.h"
+#include "model.h"
+#include "model_weights_registry.h"
+#include "prompt_builder.h"
+#include "response_callback.h"
+#include "speculative.h"
+#include "state_snapshot.h"
+#include "stop_matcher.h"
+#include "test_utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using agent_cpp::BatchedModel;
+using agent_cpp::BatchedModelConfig;
+using agent_cpp::CandidateConfig;
+using agent_cpp::ChatStreamParser;
+using agent_cpp::ComputeThreadpool;
+using agent_cpp::ComputeThreadpoolConfig;
+using agent_cpp::ContextPool;
+using agent_cpp::ContextPoolConfig;
+using agent_cpp::GenerationEvent;
+using agent_cpp::GenerationEventType;
+using agent_cpp::MappedSnapshot;
+using agent_cpp::Model;
+using agent_cpp::ModelConfig;
+using agent_cpp::ModelError;
+using agent_cpp::ModelWeights;
+using agent_cpp::map_shifted_prompt;
+using agent_cpp::ModelWeightsConfig;
+using agent_cpp::ModelWeightsRegistry;
+using agent_cpp::ngram_lookup_draft;
+using agent_cpp::plan_context_shift;
+using agent_cpp::plan_embedding_batches;
+using agent_cpp::PromptBuilder;
+using agent_cpp::ResponseCallback;
+using agent_cpp::SequenceSnapshot;
+using agent_cpp::StopMatcher;
+using agent_cpp::write_embedding;
+
+namespace {
+
+// GGUF file the tests that decode run on, named by AGENT_CPP_TEST_MODEL.
+// Any small model does; without one the tests are skipped.
+std::string
+test_model_path()
+{
+    const char* path = std::getenv("AGENT_CPP_TEST_MODEL");
+    if (path == nullptr || *path == '\0') {
+        std::cout << "(skipped, AGENT_CPP_TEST_MODEL isn't set) ";
+        return {};
+    }
+    return path;
+}
+
+// Weights of test_model_path(), loaded once
+std::shared_ptr<ModelWeights>
+test_weights()
+{
+    const std::string path = test_model_path();
+    if (path.empty()) {
+        return nullptr;
+    }
+    static const std::shared_ptr<ModelWeights> weights =
+      ModelWeights::create(path);
+    return weights;
+}
+
+// A prompt of exactly n_tokens tokens
+std::vector<llama_token>
+test_prompt(const Model& model, const std::string& text, size_t n_tokens)
+{
+    std::vector<llama_token> tokens;
+    while (tokens.size() < n_tokens) {
+        const auto more = model.tokenize(text);
+        ASSERT_FALSE(more.empty());
+        tokens.insert(tokens.end(), more.begin(), more.end());
+    }
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+// Thrown by a response callback to end a generation after enough tokens
+struct EnoughTokens
+{};
+
+// Test the tokens after the latest earlier n-gram are proposed
+TEST(test_ngram_lookup_draft_latest_match)
+{
+    // 1 2 3 ... 1 2 5 6 ... 1 | last = 2
+    std::vector<llama_token> context = { 1, 2, 3, 4, 1, 2, 5, 6, 1 };
+
+    auto draft = ngram_lookup_draft(context, 2, 2, 2, 3);
+    ASSERT_EQ(draft.size(), 3);
+    ASSERT_EQ(draft[0], 5);
+    ASSERT_EQ(draft[1], 6);
+    ASSERT_EQ(draft[2], 1);
+}
+
+// Test longer n-grams take precedence over more recent shorter ones
+TEST(test_ngram_lookup_draft_prefers_longer_ngrams)
+{
+    std::vector<llama_token> context = { 7, 1, 2, 3, 8, 1, 2, 4, 7, 1 };
+
+    auto draft = ngram_lookup_draft(context, 2, 2, 3, 1);
+    ASSERT_EQ(draft.size(), 1);
+    ASSERT_EQ(draft[0], 3);
+}
+
+// Test no draft without a match and n_draft caps the result
+TEST(test_ngram_lookup_draft_limits)
+{
+    std::vector<llama_token> context = { 1, 2, 3, 4 };
+    ASSERT_TRUE(ngram_lookup_draft(context, 5, 2, 4, 8).empty());
+    ASSERT_TRUE(ngram_lookup_draft({}, 5, 2, 4, 8).empty());
+
+    std::vector<llama_token> repeated = { 1, 2, 3, 4, 5, 6, 1 };
+    auto draft = ngram_lookup_draft(repeated, 2, 2, 4, 2);
+    ASSERT_EQ(draft.size(), 2);
+    ASSERT_EQ(draft[0], 3);
+    ASSERT_EQ(draft[1], 4);
+}
+
+// Test speculative decoding is off unless a drafting method is configured
+TEST(test_speculative_config_enabled)
+{
+    agent_cpp::SpeculativeConfig config;
+    ASSERT_FALSE(config.enabled());
+
+    config.ngram_lookup = true;
+    ASSERT_TRUE(config.enabled());
+
+    config.n_draft = 0;
+    ASSERT_FALSE(config.enabled());
+}
+
+// Test text is streamed unchanged without stop sequences
+TEST(test_stop_matcher_no_stops)
+{
+    StopMatcher matcher;
+    ASSERT_EQ(matcher.push("Hello"), "Hello");
+    ASSERT_EQ(matcher.push(" world"), " world");
+    ASSERT_FALSE(matcher.stopped());
+    ASSERT_EQ(matcher.flush(), "");
+    ASSERT_EQ(matcher.take_text(), "Hello world");
+}
+
+// Test a stop sequence split across pieces is held back and cut off
+TEST(test_stop_matcher_split_stop)
+{
+    StopMatcher matcher({ "</s>" });
+    ASSERT_EQ(matcher.push("Done<"), "Done");
+    ASSERT_EQ(matcher.push("/"), "");
+    ASSERT_FALSE(matcher.stopped());
+    ASSERT_EQ(matcher.push("s> trailing"), "");
+    ASSERT_TRUE(matcher.stopped());
+    ASSERT_EQ(matcher.push("more"), "");
+    ASSERT_EQ(matcher.take_text(), "Done");
+}
+
+// Test held back text is released when it turns out not to be a stop
+TEST(test_stop_matcher_false_alarm)
+{
+    StopMatcher matcher({ "STOP", "<|end|>" });
+    ASSERT_EQ(matcher.push("a <|"), "a ");
+    ASSERT_EQ(matcher.push("x"), "<|x");
+    ASSERT_EQ(matcher.push(" ST"), " ");
+    ASSERT_EQ(matcher.flush(), "ST");
+    ASSERT_FALSE(matcher.stopped());
+    ASSERT_EQ(matcher.take_text(), "a <|x ST");
+}
+
+// Test the earliest of several stop sequences wins
+TEST(test_stop_matcher_earliest_stop)
+{
+    StopMatcher matcher({ "END", "\n\n" });
+    ASSERT_EQ(matcher.push("one\n\ntwo END"), "one");
+    ASSERT_TRUE(matcher.stopped());
+    ASSERT_EQ(matcher.take_text(), "one");
+}
+
+// Test a UTF-8 character split across pieces is held back until complete
+TEST(test_stop_matcher_utf8_boundary)
+{
+    StopMatcher matcher;
+    // "é" is 0xC3 0xA9, "€" is 0xE2 0x82 0xAC
+    ASSERT_EQ(matcher.push("caf\xC3"), "caf");
+    ASSERT_EQ(matcher.push("\xA9 \xE2\x82"), "\xC3\xA9 ");
+    ASSERT_EQ(matcher.push("\xAC"), "\xE2\x82\xAC");
+    ASSERT_EQ(matcher.push("\xF0\x9F"), "");
+    ASSERT_EQ(matcher.flush(), "\xF0\x9F");
+}
+
+// Test pieces are collected into chunks when asked to
+TEST(test_stop_matcher_chunk_pieces)
+{
+    StopMatcher matcher({ "END" }, 3);
+    ASSERT_EQ(matcher.push("a"), "");
+    ASSERT_EQ(matcher.push("b"), "");
+    ASSERT_EQ(matcher.push("c"), "abc");
+    ASSERT_EQ(matcher.push("d"), "");
+    ASSERT_EQ(matcher.push("EN"), "");
+    ASSERT_EQ(matcher.push("D"), "d");
+    ASSERT_TRUE(matcher.stopped());
+    ASSERT_EQ(matcher.take_text(), "abcd");
+}
+
+// Test both string_view and std::string callables are accepted
+TEST(test_response_callback_signatures)
+{
+    std::string received;
+    ResponseCallback view_callback = [&](std::string_view chunk) {
+        received.append(chunk.data(), chunk.size());
+    };
+    ResponseCallback string_callback = [&](const std::string& chunk) {
+        received += chunk;
+    };
+    ResponseCallback empty = nullptr;
+
+    ASSERT_TRUE(view_callback);
+    ASSERT_TRUE(string_callback);
+    ASSERT_FALSE(empty);
+
+    view_callback("ab");
+    string_callback(std::string_view("cdef").substr(0, 2));
+    ASSERT_EQ(received, "abcd");
+}
+
+// Test a snapshot reads back through the mapped file
+TEST(test_sequence_snapshot_round_trip)
+{
+    const std::string path =
+      (std::filesystem::temp_directory_path() / "agent_cpp_snapshot.bin")
+        .string();
+
+    SequenceSnapshot snapshot;
+    snapshot.tokens = { 1, 2, 3, 42 };
+    snapshot.state = { 0xde, 0xad, 0xbe, 0xef, 0x00 };
+    ASSERT_TRUE(snapshot.write(path));
+
+    MappedSnapshot mapped;
+    ASSERT_TRUE(mapped.open(path));
+    ASSERT_EQ(mapped.tokens(), snapshot.tokens);
+    ASSERT_EQ(mapped.state_size(), snapshot.state.size());
+    ASSERT_EQ(std::vector<uint8_t>(mapped.state(),
+                                   mapped.state() + mapped.state_size()),
+              snapshot.state);
+
+    std::remove(path.c_str());
+    ASSERT_FALSE(mapped.open(path));
+}
+
+// Test files that aren't snapshots are rejected
+TEST(test_sequence_snapshot_rejects_other_files)
+{
+    const std::string path =
+      (std::filesystem::temp_directory_path() / "agent_cpp_not_snapshot.bin")
+        .string();
+    {
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        std::fputs("not a snapshot, just some text", file);
+        std::fclose(file);
+    }
+
+    MappedSnapshot mapped;
+    ASSERT_FALSE(mapped.open(path));
+    std::remove(path.c_str());
+}
+
+// Test plain text streams as content deltas
+TEST(test_chat_stream_parser_content)
+{
+    common_chat_syntax syntax;
+    syntax.format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+    ChatStreamParser parser(syntax);
+
+    std::vector<GenerationEvent> events;
+    parser.push("Hello", events);
+    parser.push(" world", events);
+
+    ASSERT_EQ(events.size(), 2);
+    ASSERT_TRUE(events[0].type == GenerationEventType::ContentDelta);
+    ASSERT_EQ(events[0].text, "Hello");
+    ASSERT_EQ(events[1].text, " world");
+
+    events.clear();
+    common_chat_msg final_msg;
+    final_msg.content = "Hello world";
+    parser.finish(final_msg, events);
+    ASSERT_TRUE(events.empty());
+}
+
+// Test tool calls of the final message are reported complete once
+TEST(test_chat_stream_parser_finish_completes_tool_calls)
+{
+    common_chat_syntax syntax;
+    syntax.format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+    ChatStreamParser parser(syntax);
+
+    common_chat_msg final_msg;
+    common_chat_tool_call tool_call;
+    tool_call.name = "search";
+    tool_call.arguments = R"({"query": "llama"})";
+    final_msg.tool_calls.push_back(tool_call);
+
+    std::vector<GenerationEvent> events;
+    parser.finish(final_msg, events);
+    ASSERT_EQ(events.size(), 1);
+    ASSERT_TRUE(events[0].type ==
+                GenerationEventType::ToolCallArgumentsComplete);
+    ASSERT_EQ(events[0].tool_name, "search");
+    ASSERT_EQ(events[0].text, tool_call.arguments);
+
+    events.clear();
+    parser.finish(final_msg, events);
+    ASSERT_TRUE(events.empty());
+}
+
+// Test texts are split into batches by token and sequence limits
+TEST(test_plan_embedding_batches)
+{
+    ASSERT_TRUE(plan_embedding_batches({}, 8, 4).empty());
+
+    // 3 + 4 fit into 8 tokens, 5 starts a new batch
+    auto firsts = plan_embedding_batches({ 3, 4, 5, 2 }, 8, 4);
+    ASSERT_EQ(firsts.size(), 2);
+    ASSERT_EQ(firsts[0], 0);
+    ASSERT_EQ(firsts[1], 2);
+
+    // A full batch takes exactly n_batch tokens
+    firsts = plan_embedding_batches({ 4, 4, 8 }, 8, 4);
+    ASSERT_EQ(firsts.size(), 2);
+    ASSERT_EQ(firsts[1], 2);
+
+    // n_seq_max splits even when tokens are left, empty texts count
+    firsts = plan_embedding_batches({ 1, 0, 1, 0, 1 }, 8, 2);
+    ASSERT_EQ(firsts.size(), 3);
+    ASSERT_EQ(firsts[0], 0);
+    ASSERT_EQ(firsts[1], 2);
+    ASSERT_EQ(firsts[2], 4);
+}
+
+// Test embeddings are scaled to unit length only when asked to
+TEST(test_write_embedding_normalizes)
+{
+    const float embd[] = { 3.0F, 0.0F, -4.0F };
+    float row[3] = {};
+
+    write_embedding(embd, row, 3, true);
+    ASSERT_TRUE(std::fabs(row[0] - 0.6F) < 1e-6F);
+    ASSERT_TRUE(std::fabs(row[1]) < 1e-6F);
+    ASSERT_TRUE(std::fabs(row[2] + 0.8F) < 1e-6F);
+
+    write_embedding(embd, row, 3, false);
+    ASSERT_EQ(row[0], 3.0F);
+    ASSERT_EQ(row[2], -4.0F);
+
+    const float zero[] = { 0.0F, 0.0F, 0.0F };
+    write_embedding(zero, row, 3, true);
+    ASSERT_EQ(row[0], 0.0F);
+    ASSERT_EQ(row[1], 0.0F);
+    ASSERT_EQ(row[2], 0.0F);
+}
+
+// Test a shift discards enough after n_keep, and never the kept tokens
+TEST(test_plan_context_shift)
+{
+    // Room left, nothing to discard
+    ASSERT_EQ(plan_context_shift(90, 10, 100, 20, 0), 0);
+
+    // Half of the 80 tokens after n_keep, more than the 1 needed
+    ASSERT_EQ(plan_context_shift(100, 1, 100, 20, 0), 40);
+    // A fixed chunk, or what is needed when that is more
+    ASSERT_EQ(plan_context_shift(100, 1, 100, 20, 8), 8);
+    ASSERT_EQ(plan_context_shift(100, 50, 100, 20, 8), 50);
+
+    // Everything after n_keep isn't enough
+    ASSERT_EQ(plan_context_shift(100, 81, 100, 20, 0), -1);
+    ASSERT_EQ(plan_context_shift(100, 1, 100, 100, 0), -1);
+}
+
+// Test a prompt continuing a shifted conversation skips the discarded span
+TEST(test_map_shifted_prompt)
+{
+    // Cache of 1 2 | 5 6 after 3 4 were discarded
+    const std::vector<llama_token> cached = { 1, 2, 5, 6 };
+    const std::vector<llama_token> discarded = { 3, 4 };
+    std::vector<llama_token> mapped;
+
+    ASSERT_TRUE(map_shifted_prompt(
+      { 1, 2, 3, 4, 5, 6, 7 }, cached, 2, discarded, mapped));
+    ASSERT_EQ(mapped, std::vector<llama_token>({ 1, 2, 5, 6, 7 }));
+
+    // Only the discarded span is dropped, the tail may differ from the cache
+    ASSERT_TRUE(
+      map_shifted_prompt({ 1, 2, 3, 4, 9 }, cached, 2, discarded, mapped));
+    ASSERT_EQ(mapped, std::vector<llama_token>({ 1, 2, 9 }));
+
+    // Diverging in the kept or discarded tokens, or too short
+    ASSERT_FALSE(
+      map_shifted_prompt({ 1, 9, 3, 4, 5 }, cached, 2, discarded, mapped));
+    ASSERT_FALSE(
+      map_shifted_prompt({ 1, 2, 3, 9, 5 }, cached, 2, discarded, mapped));
+    ASSERT_FALSE(map_shifted_prompt({ 1, 2, 3 }, cached, 2, discarded, mapped));
+    // Nothing was discarded
+    ASSERT_FALSE(map_shifted_prompt({ 1, 2, 5 }, cached, 2, {}, mapped));
+}
+
+// Test sessions generating at the same time all make progress
+TEST(test_batched_model_concurrent_sessions)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    BatchedModelConfig config;
+    config.n_ctx = 1024;
+    config.n_batch = 64; // Prompts are prefilled in several chunks
+    auto batched = BatchedModel::create(weights, config);
+
+    std::vector<std::shared_ptr<Model>> sessions;
+    std::vector<std::vector<llama_token>> prompts;
+    for (int i = 0; i < 3; i++) {
+        sessions.push_back(batched->create_session());
+        prompts.push_back(test_prompt(
+          *sessions.back(), "Session " + std::to_string(i) + " says", 100));
+    }
+    ASSERT_EQ(batched->n_active_sessions(), 3);
+
+    constexpr int kTokens = 8;
+    std::vector<int> n_chunks(sessions.size(), 0);
+    std::vector<int> failed(sessions.size(), 0); // Not vector<bool>, racy
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        threads.emplace_back([&, i] {
+            try {
+                sessions[i]->generate_from_tokens(
+                  prompts[i], [&n_chunks, i](std::string_view) {
+                      if (++n_chunks[i] == kTokens) {
+                          throw EnoughTokens{};
+                      }
+                  });
+            } catch (const EnoughTokens&) {
+            } catch (const std::exception&) {
+                failed[i] = 1;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        ASSERT_EQ(failed[i], 0);
+        ASSERT_TRUE(n_chunks[i] <= kTokens);
+        const auto& cached = sessions[i]->get_cached_tokens();
+        ASSERT_TRUE(cached.size() >= prompts[i].size());
+        ASSERT_TRUE(
+          std::equal(prompts[i].begin(), prompts[i].end(), cached.begin()));
+    }
+
+    sessions.clear();
+    ASSERT_EQ(batched->n_active_sessions(), 0);
+}
+
+// Test a full cache drops the cache of an idle session rather than failing
+// the request that needs the cells
+TEST(test_batched_model_preempts_idle_session)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    BatchedModelConfig config;
+    config.n_ctx = 256;
+    config.n_seq_max = 2;
+    auto batched = BatchedModel::create(weights, config);
+
+    auto idle = batched->create_session();
+    auto busy = batched->create_session();
+    const auto idle_prompt = test_prompt(*idle, "An idle session", 160);
+    const auto busy_prompt = test_prompt(*busy, "A busy session", 160);
+
+    idle->prefill(idle_prompt);
+    ASSERT_EQ(idle->get_cached_tokens(), idle_prompt);
+
+    // Both don't fit into the cache at once
+    busy->prefill(busy_prompt);
+    ASSERT_EQ(busy->get_cached_tokens(), busy_prompt);
+    ASSERT_TRUE(idle->get_cached_tokens().empty());
+
+    // The idle session prefills again on its next request
+    idle->prefill(idle_prompt);
+    ASSERT_EQ(idle->get_cached_tokens(), idle_prompt);
+    ASSERT_TRUE(busy->get_cached_tokens().empty());
+}
+
+// Test a prompt rendered incrementally matches rendering it in full
+TEST(test_prompt_builder_matches_full_render)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    const common_chat_templates* templates = weights->get_templates();
+    const llama_vocab* vocab = weights->get_vocab();
+
+    std::vector<common_chat_msg> messages(2);
+    messages[0].role = "system";
+    messages[0].content = "You answer in one sentence.";
+    messages[1].role = "user";
+    messages[1].content = "What is a prompt cache?";
+
+    PromptBuilder incremental;
+    std::vector<llama_token> tokens;
+    incremental.build(templates, vocab, messages, {}, true, tokens);
+
+    for (int turn = 0; turn < 3; turn++) {
+        common_chat_msg assistant;
+        assistant.role = "assistant";
+        assistant.content = "Answer " + std::to_string(turn) + ".";
+        messages.push_back(assistant);
+        common_chat_msg user;
+        user.role = "user";
+        user.content = "Follow-up question " + std::to_string(turn) + "?";
+        messages.push_back(user);
+
+        incremental.build(templates, vocab, messages, {}, true, tokens);
+
+        PromptBuilder full;
+        full.set_enabled(false);
+        std::vector<llama_token> expected;
+        const auto params =
+          full.build(templates, vocab, messages, {}, true, expected);
+        ASSERT_FALSE(params.prompt.empty());
+        ASSERT_EQ(tokens, expected);
+    }
+}
+
+// Test a fork starts from the cache and diverges without touching it
+TEST(test_model_fork)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    ModelConfig config;
+    config.n_ctx = 512;
+    auto model = Model::create_with_weights(weights, config);
+    const auto prompt = test_prompt(*model, "A conversation to branch", 60);
+    model->prefill(prompt);
+
+    auto branch = model->fork();
+    ASSERT_EQ(branch->get_cached_tokens(), prompt);
+
+    auto extended = prompt;
+    const auto more = test_prompt(*branch, " and only the branch", 20);
+    extended.insert(extended.end(), more.begin(), more.end());
+    branch->prefill(extended);
+    ASSERT_EQ(branch->get_cached_tokens(), extended);
+    ASSERT_EQ(model->get_cached_tokens(), prompt);
+
+    // Greedy sampling continues the prompt the same way from either cache
+    constexpr int kTokens = 8;
+    auto continuation = [&](Model& from) {
+        std::string text;
+        int n_chunks = 0;
+        try {
+            from.generate_from_tokens(prompt, [&](std::string_view chunk) {
+                text += chunk;
+                if (++n_chunks == kTokens) {
+                    throw EnoughTokens{};
+                }
+            });
+        } catch (const EnoughTokens&) {
+        }
+        return text;
+    };
+    ASSERT_EQ(continuation(*branch), continuation(*model));
+}
+
+// Test sessions of a BatchedModel fork into a sequence of their own
+TEST(test_batched_model_fork)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    BatchedModelConfig config;
+    config.n_ctx = 512;
+    auto batched = BatchedModel::create(weights, config);
+
+    auto session = batched->create_session();
+    const auto prompt = test_prompt(*session, "A shared prefix", 60);
+    session->prefill(prompt);
+
+    {
+        auto branch = session->fork();
+        ASSERT_EQ(batched->n_active_sessions(), 2);
+        ASSERT_EQ(branch->get_cached_tokens(), prompt);
+
+        auto extended = prompt;
+        const auto more = test_prompt(*branch, " diverges", 20);
+        extended.insert(extended.end(), more.begin(), more.end());
+        branch->prefill(extended);
+        ASSERT_EQ(branch->get_cached_tokens(), extended);
+        ASSERT_EQ(session->get_cached_tokens(), prompt);
+    }
+
+    // Dropping the branch releases its sequence, not the prefix
+    ASSERT_EQ(batched->n_active_sessions(), 1);
+    ASSERT_EQ(session->get_cached_tokens(), prompt);
+}
+
+// Test a tensor_split for more devices than exist is rejected before loading
+TEST(test_model_weights_rejects_tensor_split)
+{
+    ModelWeightsConfig config;
+    config.tensor_split.assign(llama_max_devices() + 1, 1.0F);
+
+    std::string error;
+    try {
+        ModelWeights::create("missing.gguf", config);
+    } catch (const ModelError& e) {
+        error = e.what();
+    }
+    ASSERT_TRUE(error.find("tensor_split") != std::string::npos);
+}
+
+// Test a progress callback returning false aborts the load
+TEST(test_model_weights_load_aborted)
+{
+    const std::string path = test_model_path();
+    if (path.empty()) {
+        return;
+    }
+    ModelWeightsConfig config;
+    config.on_progress = [](float) { return false; };
+
+    std::string error;
+    try {
+        ModelWeights::create(path, config);
+    } catch (const ModelError& e) {
+        error = e.what();
+    }
+    ASSERT_TRUE(error.find("aborted") != std::string::npos);
+}
+
+// Test concurrent gets of one model share a single load
+TEST(test_model_weights_registry_single_flight)
+{
+    const std::string path = test_model_path();
+    if (path.empty()) {
+        return;
+    }
+    ModelWeightsRegistry registry;
+
+    std::vector<std::shared_ptr<ModelWeights>> weights(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < weights.size(); i++) {
+        threads.emplace_back([&, i] { weights[i] = registry.get(path); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& w : weights) {
+        ASSERT_TRUE(w != nullptr);
+        ASSERT_EQ(w.get(), weights.front().get());
+    }
+    ASSERT_EQ(registry.size(), 1);
+    ASSERT_TRUE(registry.resident_bytes() > 0);
+
+    // max_bytes 0 unloads them with their last user
+    weights.pop_back();
+    ASSERT_EQ(registry.size(), 1);
+    weights.clear();
+    ASSERT_EQ(registry.size(), 0);
+    ASSERT_EQ(registry.resident_bytes(), 0);
+}
+
+// Test a failed load reaches the caller and leaves nothing behind
+TEST(test_model_weights_registry_load_failure)
+{
+    ModelWeightsRegistry registry;
+
+    bool caught = false;
+    try {
+        registry.get("missing.gguf");
+    } catch (const ModelError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+    ASSERT_EQ(registry.size(), 0);
+}
+
+// Test unused weights are unloaded least recently used first to fit the
+// budget, and weights in use never are
+TEST(test_model_weights_registry_budget)
+{
+    const std::string path = test_model_path();
+    if (path.empty()) {
+        return;
+    }
+    // The same file loaded another way counts as other weights
+    ModelWeightsConfig copy;
+    copy.use_mmap = false;
+
+    ModelWeightsRegistry registry;
+    registry.set_max_bytes(UINT64_MAX);
+    registry.get(path);
+    const uint64_t bytes = registry.resident_bytes();
+    ASSERT_TRUE(bytes > 0);
+    ASSERT_EQ(registry.size(), 1);
+
+    // Room for one of them
+    registry.set_max_bytes(bytes * 3 / 2);
+    ASSERT_EQ(registry.size(), 1);
+
+    auto second = registry.get(path, copy);
+    ASSERT_EQ(registry.size(), 1);
+    ASSERT_EQ(registry.resident_bytes(), bytes);
+
+    // Over budget while both are in use, until one is released
+    auto first = registry.get(path);
+    ASSERT_EQ(registry.size(), 2);
+    first.reset();
+    ASSERT_EQ(registry.size(), 1);
+
+    second.reset();
+    ASSERT_EQ(registry.size(), 1);
+    registry.unload_unused();
+    ASSERT_EQ(registry.size(), 0);
+}
+
+// Test leased contexts come back reset to the prefix and are reused
+TEST(test_context_pool_lease_and_return)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    ContextPoolConfig config;
+    config.model.n_ctx = 512;
+    config.n_initial = 1;
+    config.max_idle = 1;
+    auto tokenizer = Model::create_with_weights(weights, config.model);
+    config.prefix = test_prompt(*tokenizer, "A shared system prompt", 30);
+    auto pool = ContextPool::create(weights, config);
+    ASSERT_EQ(pool->idle(), 1);
+    ASSERT_EQ(pool->leased(), 0);
+
+    auto first = pool->lease();
+    const Model* reused = first.get();
+    ASSERT_EQ(first->get_cached_tokens(), config.prefix);
+    ASSERT_EQ(pool->idle(), 0);
+    ASSERT_EQ(pool->leased(), 1);
+
+    auto conversation = config.prefix;
+    const auto more = test_prompt(*first, " and a conversation", 20);
+    conversation.insert(conversation.end(), more.begin(), more.end());
+    first->prefill(conversation);
+
+    // None is idle, so this one is created
+    auto second = pool->lease();
+    ASSERT_TRUE(second.get() != reused);
+    ASSERT_EQ(second->get_cached_tokens(), config.prefix);
+    ASSERT_EQ(pool->leased(), 2);
+
+    first.reset();
+    ASSERT_EQ(pool->idle(), 1);
+    ASSERT_EQ(pool->leased(), 1);
+
+    // Beyond max_idle it is freed
+    second.reset();
+    ASSERT_EQ(pool->idle(), 1);
+    ASSERT_EQ(pool->leased(), 0);
+
+    auto third = pool->lease();
+    ASSERT_EQ(third.get(), reused);
+    ASSERT_EQ(third->get_cached_tokens(), config.prefix);
+
+    // A model may outlive its pool
+    pool.reset();
+    third.reset();
+}
+
+// Test split divides the CPUs evenly, one thread per CPU
+TEST(test_compute_threadpool_split)
+{
+    ComputeThreadpoolConfig config;
+    config.cpus = { 0, 1, 2 };
+    auto pools = ComputeThreadpool::split(config, 2);
+    ASSERT_EQ(pools.size(), 2);
+    ASSERT_EQ(pools[0]->n_threads(), 1);
+    ASSERT_EQ(pools[1]->n_threads(), 2);
+    ASSERT_EQ(pools[1]->n_threads_batch(), 2);
+    ASSERT_TRUE(pools[0]->get() != pools[1]->get());
+
+    // More parts than CPUs share them
+    config.cpus = { 0 };
+    pools = ComputeThreadpool::split(config, 2);
+    ASSERT_EQ(pools.size(), 2);
+    ASSERT_EQ(pools[0]->n_threads(), 1);
+    ASSERT_EQ(pools[1]->n_threads(), 1);
+
+    bool caught = false;
+    try {
+        ComputeThreadpool::split(config, 0);
+    } catch (const ModelError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+}
+
+// Test candidates are generated per sequence and seeded reproducibly
+TEST(test_generate_candidates)
+{
+    auto weights = test_weights();
+    if (!weights) {
+        return;
+    }
+    ModelConfig config;
+    config.n_ctx = 1024;
+    config.n_seq_max = 3;
+    auto model = Model::create_with_weights(weights, config);
+
+    std::vector<common_chat_msg> messages(1);
+    messages[0].role = "user";
+    messages[0].content = "Name a colour.";
+
+    CandidateConfig candidates;
+    candidates.n = 3;
+    candidates.seed = 42;
+    candidates.temp = 1.0F;
+    candidates.max_tokens = 8;
+    candidates.logprobs = true;
+    const auto first = model->generate_candidates(messages, {}, candidates);
+    ASSERT_EQ(first.size(), 3);
+    for (const auto& candidate : first) {
+        ASSERT_TRUE(candidate.n_tokens <= candidates.max_tokens);
+        ASSERT_EQ(candidate.message.role, "assistant");
+        ASSERT_TRUE(candidate.logprob <= 0);
+    }
+
+    // Only the prompt stays cached, so the same seed samples the same again
+    const auto prompt = model->get_cached_tokens();
+    const auto second = model->generate_candidates(messages, {}, candidates);
+    ASSERT_EQ(model->get_cached_tokens(), prompt);
+    ASSERT_EQ(second.size(), first.size());
+    for (size_t i = 0; i < first.size(); i++) {
+        ASSERT_EQ(second[i].text, first[i].text);
+    }
+
+    candidates.n = config.n_seq_max + 1;
+    bool caught = false;
+    try {
+        model->generate_candidates(messages, {}, candidates);
+    } catch (const ModelError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+}
+
+}
+
+int
+main()
+{
+    std::cout << "\n=== Running Model Unit Tests ===\n" << std::endl;
+
+    try {
+        RUN_TEST(test_ngram_lookup_draft_latest_match);
+        RUN_TEST(test_ngram_lookup_draft_prefers_longer_ngrams);
+        RUN_TEST(test_ngram_lookup_draft_limits);
+        RUN_TEST(test_speculative_config_enabled);
+        RUN_TEST(test_stop_matcher_no_stops);
+        RUN_TEST(test_stop_matcher_split_stop);
+        RUN_TEST(test_stop_matcher_false_alarm);
+        RUN_TEST(test_stop_matcher_earliest_stop);
+        RUN_TEST(test_stop_matcher_utf8_boundary);
+        RUN_TEST(test_stop_matcher_chunk_pieces);
+        RUN_TEST(test_response_callback_signatures);
+        RUN_TEST(test_sequence_snapshot_round_trip);
+        RUN_TEST(test_sequence_snapshot_rejects_other_files);
+        RUN_TEST(test_chat_stream_parser_content);
+        RUN_TEST(test_chat_stream_parser_finish_completes_tool_calls);
+        RUN_TEST(test_plan_embedding_batches);
+        RUN_TEST(test_write_embedding_normalizes);
+        RUN_TEST(test_plan_context_shift);
+        RUN_TEST(test_map_shifted_prompt);
+        RUN_TEST(test_batched_model_concurrent_sessions);
+        RUN_TEST(test_batched_model_preempts_idle_session);
+        RUN_TEST(test_prompt_builder_matches_full_render);
+        RUN_TEST(test_model_fork);
+        RUN_TEST(test_batched_model_fork);
+        RUN_TEST(test_model_weights_rejects_tensor_split);
+        RUN_TEST(test_model_weights_load_aborted);
+        RUN_TEST(test_model_weights_registry_single_flight);
+        RUN_TEST(test_model_weights_registry_load_failure);
+        RUN_TEST(test_model_weights_registry_budget);
+        RUN_TEST(test_context_pool_lease_and_return);
+        RUN_TEST(test_compute_threadpool_split);
+        RUN_TEST(test_generate_candidates);
+
+        std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "\n✗ TEST FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,193 @@
+#include "oauth/oauth.h"
+#include "oauth/token_storage.h"
+#include "test_utils.h"
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#include "httplib.h"
+
+using agent_cpp::OAuthConfig;
+using agent_cpp::OAuthToken;
+using agent_cpp::TokenStorage;
+using agent_cpp::TokenStorageConfig;
+
+namespace {
+
+// In-memory storage counting the loads that reach it
+class CountingTokenStorage : public TokenStorage
+{
+  public:
+    void save(const std::string& provider_name,
+              const OAuthToken& token) override
+    {
+        tokens[provider_name] = token;
+    }
+
+    std::optional<OAuthToken> load(
+      const std::string& provider_name) const override
+    {
+        ++n_loads;
+        auto it = tokens.find(provider_name);
+        if (it == tokens.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void remove(const std::string& provider_name) override
+    {
+        tokens.erase(provider_name);
+    }
+
+    bool exists(const std::string& provider_name) override
+    {
+        return tokens.count(provider_name) > 0;
+    }
+
+    std::map<std::string, OAuthToken> tokens;
+    mutable int n_loads = 0;
+};
+
+OAuthToken
+make_token(const std::string& access_token,
+           std::chrono::seconds expires_in = std::chrono::seconds(3600))
+{
+    OAuthToken token;
+    token.access_token = access_token;
+    token.refresh_token = "refresh-" + access_token;
+    token.token_type = "Bearer";
+    token.expires_at = std::chrono::system_clock::now() + expires_in;
+    return token;
+}
+
+// Test hits are served from memory and misses are looked up again
+TEST(test_cached_token_storage_hit_and_miss)
+{
+    auto counting = std::make_unique<CountingTokenStorage>();
+    auto* inner = counting.get();
+    auto storage = agent_cpp::create_cached_token_storage(std::move(counting));
+
+    ASSERT_FALSE(storage->load("p").has_value());
+    ASSERT_FALSE(storage->exists("p"));
+    ASSERT_EQ(inner->n_loads, 1);
+
+    // Saved behind the cache's back, e.g. by another process
+    inner->tokens["p"] = make_token("a");
+    auto token = storage->load("p");
+    ASSERT_TRUE(token.has_value());
+    ASSERT_EQ(token->access_token, "a");
+    ASSERT_EQ(inner->n_loads, 2);
+
+    token = storage->load("p");
+    ASSERT_TRUE(token.has_value());
+    ASSERT_EQ(token->access_token, "a");
+    ASSERT_TRUE(storage->exists("p"));
+    ASSERT_EQ(inner->n_loads, 2);
+}
+
+// Test save and remove write through and update the cache
+TEST(test_cached_token_storage_invalidate)
+{
+    auto counting = std::make_unique<CountingTokenStorage>();
+    auto* inner = counting.get();
+    auto storage = agent_cpp::create_cached_token_storage(std::move(counting));
+
+    storage->save("p", make_token("a"));
+    ASSERT_EQ(inner->tokens.at("p").access_token, "a");
+    ASSERT_EQ(storage->load("p")->access_token, "a");
+    ASSERT_EQ(inner->n_loads, 0);
+
+    storage->save("p", make_token("b"));
+    ASSERT_EQ(storage->load("p")->access_token, "b");
+    ASSERT_EQ(inner->n_loads, 0);
+
+    storage->remove("p");
+    ASSERT_TRUE(inner->tokens.empty());
+    ASSERT_FALSE(storage->load("p").has_value());
+    ASSERT_EQ(inner->n_loads, 1);
+}
+
+// Test concurrent refreshes of one token share a single request
+TEST(test_oauth_refresh_single_flight)
+{
+    const auto dir =
+      std::filesystem::temp_directory_path() / "agent_cpp_oauth_tokens";
+    std::filesystem::remove_all(dir);
+
+    // Stub token endpoint, slow enough for the callers to overlap
+    std::atomic<int> n_requests{ 0 };
+    httplib::Server server;
+    server.Post("/token",
+                [&](const httplib::Request&, httplib::Response& res) {
+                    const int n = ++n_requests;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                    res.set_content("{\"access_token\": \"new-" +
+                                      std::to_string(n) +
+                                      "\", \"refresh_token\": \"r\", "
+                                      "\"expires_in\": 3600}",
+                                    "application/json");
+                });
+    const int port = server.bind_to_any_port("127.0.0.1");
+    std::thread listener([&] { server.listen_after_bind(); });
+    server.wait_until_ready();
+
+    OAuthConfig config;
+    config.client_id = "test";
+    config.token_url = "http://127.0.0.1:" + std::to_string(port) + "/token";
+    TokenStorageConfig storage_config;
+    storage_config.storage_dir = dir.string();
+    auto client = agent_cpp::create_oauth_client(config, storage_config);
+
+    const OAuthToken expired = make_token("old", std::chrono::seconds(-1));
+    std::vector<std::string> results(8);
+    std::vector<std::thread> callers;
+    for (size_t i = 0; i < results.size(); ++i) {
+        callers.emplace_back([&, i] {
+            auto token = client->refresh_token(expired);
+            results[i] = token ? token->access_token : "";
+        });
+    }
+    for (auto& caller : callers) {
+        caller.join();
+    }
+
+    ASSERT_EQ(n_requests.load(), 1);
+    for (const auto& result : results) {
+        ASSERT_EQ(result, "new-1");
+    }
+
+    // The token was refreshed already, so it isn't refreshed again
+    ASSERT_EQ(client->refresh_token(expired)->access_token, "new-1");
+    ASSERT_EQ(n_requests.load(), 1);
+    ASSERT_EQ(client->current_token()->access_token, "new-1");
+
+    server.stop();
+    listener.join();
+    std::filesystem::remove_all(dir);
+}
+
+}
+
+int
+main()
+{
+    std::cout << "\n=== Running OAuth Unit Tests ===\n" << std::endl;
+
+    try {
+        RUN_TEST(test_cached_token_storage_hit_and_miss);
+        RUN_TEST(test_cached_token_storage_invalidate);
+        RUN_TEST(test_oauth_refresh_single_flight);
+
+        std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "\n✗ TEST FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,5 +1,15 @@
+#include "cancellation.h"
 #include "test_utils.h"
+#include "thread_pool.h"
 #include "tool.h"
+#include "tool_output_governor.h"
+#include "tool_registry.h"
+#include "tool_result_cache.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
 
 using agent_cpp::json;
 
@@ -57,6 +67,248 @@ TEST(test_tool_polymorphism)
     ASSERT_EQ(tools[0]->get_name(), "test_tool");
 }
 
+TEST(test_tool_concurrency_safe_default)
+{
+    TestTool tool;
+    ASSERT_FALSE(tool.is_concurrency_safe());
+    ASSERT_EQ(tool.cache_ttl().count(), 0);
+    ASSERT_EQ(tool.max_output_tokens(), 0);
+}
+
+// Test tools that don't stream return their output without passing chunks
+TEST(test_tool_execute_streaming_default)
+{
+    TestTool tool;
+    json args = { { "input", "test" } };
+    size_t chunks = 0;
+    std::string output = tool.execute_streaming(
+      args, [&chunks](std::string_view) { chunks++; });
+    ASSERT_EQ(output, tool.execute(args));
+    ASSERT_EQ(chunks, 0);
+}
+
+TEST(test_thread_pool_runs_tasks)
+{
+    agent_cpp::ThreadPool pool(4);
+    ASSERT_EQ(pool.size(), 4);
+
+    std::atomic<int> counter{ 0 };
+    std::vector<std::future<int>> futures;
+    for (int i = 0; i < 16; i++) {
+        futures.push_back(pool.submit([&counter, i] {
+            counter++;
+            return i * 2;
+        }));
+    }
+
+    for (int i = 0; i < 16; i++) {
+        ASSERT_EQ(futures[i].get(), i * 2);
+    }
+    ASSERT_EQ(counter.load(), 16);
+}
+
+TEST(test_thread_pool_propagates_exceptions)
+{
+    agent_cpp::ThreadPool pool(1);
+    auto future =
+      pool.submit([]() -> int { throw std::runtime_error("tool failed"); });
+
+    bool caught = false;
+    try {
+        future.get();
+    } catch (const std::runtime_error& e) {
+        caught = std::string(e.what()) == "tool failed";
+    }
+    ASSERT_TRUE(caught);
+}
+
+TEST(test_thread_pool_is_worker)
+{
+    agent_cpp::ThreadPool pool(2);
+    agent_cpp::ThreadPool other(1);
+    ASSERT_FALSE(pool.is_worker());
+
+    ASSERT_TRUE(pool.submit([&pool] { return pool.is_worker(); }).get());
+    ASSERT_FALSE(pool.submit([&other] { return other.is_worker(); }).get());
+}
+
+TEST(test_cancellation_token)
+{
+    agent_cpp::CancellationToken never;
+    never.cancel();
+    ASSERT_FALSE(never.is_cancelled());
+
+    auto token = agent_cpp::CancellationToken::create();
+    auto copy = token;
+    auto child = token.with_deadline(
+      agent_cpp::CancellationToken::Clock::now() + std::chrono::hours(1));
+    ASSERT_FALSE(child.is_cancelled());
+
+    copy.cancel();
+    ASSERT_TRUE(token.is_cancelled());
+    ASSERT_TRUE(child.is_cancelled());
+
+    bool caught = false;
+    try {
+        child.throw_if_cancelled();
+    } catch (const agent_cpp::CancelledError&) {
+        caught = true;
+    }
+    ASSERT_TRUE(caught);
+}
+
+TEST(test_cancellation_token_deadline)
+{
+    auto token =
+      agent_cpp::CancellationToken::with_timeout(std::chrono::milliseconds(0));
+    ASSERT_TRUE(token.is_cancelled());
+
+    // A child's deadline doesn't cancel its parent
+    auto parent = agent_cpp::CancellationToken::create();
+    auto child =
+      parent.with_deadline(agent_cpp::CancellationToken::Clock::now());
+    ASSERT_TRUE(child.is_cancelled());
+    ASSERT_FALSE(parent.is_cancelled());
+}
+
+TEST(test_tool_result_cache_hits)
+{
+    agent_cpp::ToolResultCache cache;
+    const auto ttl = std::chrono::minutes(1);
+    cache.put("weather",
+              json::parse(R"({"city": "Paris", "unit": "C"})"),
+              "sunny",
+              ttl);
+
+    // Argument order doesn't matter, values and tool name do
+    auto hit =
+      cache.get("weather", json::parse(R"({"unit": "C", "city": "Paris"})"));
+    ASSERT_TRUE(hit.has_value());
+    ASSERT_EQ(*hit, "sunny");
+    ASSERT_FALSE(
+      cache.get("weather", json::parse(R"({"city": "Rome", "unit": "C"})")));
+    ASSERT_FALSE(
+      cache.get("forecast", json::parse(R"({"city": "Paris", "unit": "C"})")));
+
+    // Expired entries are dropped, a zero ttl stores nothing
+    cache.put("clock", json::object(), "noon", std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_FALSE(cache.get("clock", json::object()));
+    cache.put("clock", json::object(), "noon", std::chrono::milliseconds(0));
+    ASSERT_EQ(cache.size(), 1);
+
+    // Same-named tools of different owners don't share outputs
+    cache.put("search",
+              json::object(),
+              "docs",
+              std::chrono::minutes(1),
+              "http://docs/mcp");
+    ASSERT_FALSE(cache.get("search", json::object(), "http://web/mcp"));
+    ASSERT_FALSE(cache.get("search", json::object()));
+    ASSERT_EQ(*cache.get("search", json::object(), "http://docs/mcp"),
+              "docs");
+}
+
+TEST(test_tool_result_cache_evicts_lru)
+{
+    agent_cpp::ToolResultCache cache(2);
+    const auto ttl = std::chrono::minutes(1);
+    cache.put("a", json::object(), "1", ttl);
+    cache.put("b", json::object(), "2", ttl);
+    ASSERT_TRUE(cache.get("a", json::object()));
+
+    cache.put("c", json::object(), "3", ttl);
+    ASSERT_EQ(cache.size(), 2);
+    ASSERT_TRUE(cache.get("a", json::object()));
+    ASSERT_FALSE(cache.get("b", json::object()));
+    ASSERT_TRUE(cache.get("c", json::object()));
+}
+
+TEST(test_tool_registry)
+{
+    std::vector<std::unique_ptr<agent_cpp::Tool>> tools;
+    tools.push_back(std::make_unique<TestTool>());
+    agent_cpp::ToolRegistry registry(std::move(tools));
+
+    ASSERT_EQ(registry.size(), 1);
+    ASSERT_TRUE(registry.find("test_tool") != nullptr);
+    ASSERT_TRUE(registry.find("missing") == nullptr);
+
+    // Definitions are built once and shared until invalidated
+    auto definitions = registry.definitions();
+    ASSERT_EQ(definitions->size(), 1);
+    ASSERT_EQ((*definitions)[0].name, "test_tool");
+    ASSERT_TRUE(registry.definitions() == definitions);
+
+    registry.invalidate();
+    auto rebuilt = registry.definitions();
+    ASSERT_TRUE(rebuilt != definitions);
+    ASSERT_EQ(definitions->size(), 1);
+    ASSERT_EQ(rebuilt->size(), 1);
+}
+
+// Test long outputs keep their head and tail and page back in full
+TEST(test_tool_output_governor)
+{
+    agent_cpp::ToolOutputGovernorConfig config;
+    config.max_tokens = 10; // 40 bytes without a vocab
+    config.head_fraction = 0.5F;
+    auto governor = std::make_shared<agent_cpp::ToolOutputGovernor>(config);
+
+    ASSERT_EQ(governor->govern("shell", "short"), "short");
+    ASSERT_EQ(governor->stored(), 0);
+
+    std::string output;
+    for (int i = 0; i < 100; i++) {
+        output += static_cast<char>('a' + i % 26);
+    }
+    const std::string governed = governor->govern("shell", output);
+    ASSERT_EQ(governed.substr(0, 20), output.substr(0, 20));
+    ASSERT_EQ(governed.substr(governed.size() - 20), output.substr(80));
+    ASSERT_TRUE(governed.find("output-1") != std::string::npos);
+    ASSERT_EQ(governor->stored(), 1);
+
+    agent_cpp::ReadToolOutputTool reader(governor);
+    std::string paged;
+    for (int page = 1; page <= 3; page++) {
+        const json args = { { "id", "output-1" }, { "page", page } };
+        json result = json::parse(reader.execute(args));
+        ASSERT_EQ(result["pages"], 3);
+        paged += result["content"].get<std::string>();
+    }
+    ASSERT_EQ(paged, output);
+
+    json missing = json::parse(reader.execute({ { "id", "output-9" } }));
+    ASSERT_TRUE(missing.contains("error"));
+    // A tool's own budget overrides the configured one
+    ASSERT_EQ(governor->govern("shell", output, 1000), output);
+}
+
+TEST(test_tool_output_governor_head)
+{
+    agent_cpp::ToolOutputGovernorConfig config;
+    config.max_tokens = 10; // 40 bytes without a vocab
+    config.head_fraction = 0.5F;
+    agent_cpp::ToolOutputGovernor governor(config);
+
+    std::string output(30, 'a');
+    ASSERT_EQ(governor.head("shell", output), output);
+
+    // Over budget only the head is kept, however much follows
+    output += std::string(30, 'b');
+    const std::string head = governor.head("shell", output);
+    ASSERT_EQ(head, std::string(20, 'a'));
+    ASSERT_EQ(governor.govern("shell", output).substr(0, head.size()), head);
+    output += std::string(100, 'c');
+    ASSERT_EQ(governor.head("shell", output), head);
+    ASSERT_EQ(governor.stored(), 1);
+
+    // The tool's own budget, and pages that are never shortened
+    ASSERT_EQ(governor.head("shell", output, 1000), output);
+    ASSERT_EQ(governor.head(agent_cpp::ToolOutputGovernor::kReadTool, output),
+              output);
+}
+
 int
 main()
 {
@@ -65,6 +317,18 @@ main()
     try {
         RUN_TEST(test_tool_interface);
         RUN_TEST(test_tool_polymorphism);
+        RUN_TEST(test_tool_concurrency_safe_default);
+        RUN_TEST(test_tool_execute_streaming_default);
+        RUN_TEST(test_thread_pool_runs_tasks);
+        RUN_TEST(test_thread_pool_propagates_exceptions);
+        RUN_TEST(test_thread_pool_is_worker);
+        RUN_TEST(test_cancellation_token);
+        RUN_TEST(test_cancellation_token_deadline);
+        RUN_TEST(test_tool_result_cache_hits);
+        RUN_TEST(test_tool_result_cache_evicts_lru);
+        RUN_TEST(test_tool_registry);
+        RUN_TEST(test_tool_output_governor);
+        RUN_TEST(test_tool_output_governor_head);
 
         std::cout << "\n=== All tests passed! ✓ ===\n" << std::endl;
         return 0;